@@ -0,0 +1,716 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "cluster.h"
+#include "common.h"
+#include "keys.h"
+
+// the proxy:
+// clients connect to the proxy, which forwards each request over one of a few
+// persistent connections to the server owning the key's slot. A client always
+// uses the same connection to a server, so its requests run in the order it
+// sent them. A server replies in order on each connection, so every upstream
+// connection keeps a FIFO of the requests it's waiting for, and every client
+// keeps a FIFO of its replies in request order. The output is written once
+// per event loop iteration, so the requests from many clients go upstream in a
+// single write.
+//
+// the upstream connections are shared, so the commands that keep state in the
+// connection (blocking pops, pub/sub, tracking, transactions) are rejected.
+
+static void msg(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+static void die(const char *msg)
+{
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    abort();
+}
+
+static void fd_set_nb(int fd)
+{
+    errno = 0;
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (errno)
+    {
+        die("fcntl error");
+        return;
+    }
+
+    flags |= O_NONBLOCK;
+
+    errno = 0;
+    (void)fcntl(fd, F_SETFL, flags);
+    if (errno)
+    {
+        die("fcntl error");
+    }
+}
+
+const size_t k_max_msg = 4096;
+
+// stop reading from a client that has this many replies outstanding
+const size_t k_max_pending = 1024;
+// stop reading from a client that doesn't read its replies
+const size_t k_max_wbuf = 1 << 20;
+
+// the error codes of the server
+enum
+{
+    ERR_UNKNOWN = 1,
+    ERR_CROSSSLOT = 12,
+};
+
+enum
+{
+    CONN_CLIENT = 0,
+    CONN_UPSTREAM = 1,
+};
+
+struct Conn;
+
+// a forwarded request
+struct Pending
+{
+    // NULL if the client is gone
+    Conn *client = NULL;
+    bool done = false;
+    std::string reply;
+};
+
+struct Conn
+{
+    int fd = -1;
+    uint32_t kind = CONN_CLIENT;
+    bool closed = false;
+    // queued for the flush at the end of the loop iteration
+    bool dirty = false;
+    // read buffer
+    size_t rbuf_size = 0;
+    uint8_t rbuf[4 + k_max_msg];
+    // write buffer
+    std::string wbuf;
+    size_t wbuf_sent = 0;
+    // a client: its replies in request order, owned once done
+    // an upstream: the requests it's waiting for, owned until done
+    std::deque<Pending *> pending;
+    // an upstream: the index into g_data.servers
+    size_t server = 0;
+    // a client: its connection in each pool
+    size_t pool_idx = 0;
+};
+
+struct Server
+{
+    std::string host;
+    uint16_t port = 0;
+    // persistent connections, NULL if not connected
+    std::vector<Conn *> pool;
+};
+
+static struct
+{
+    std::vector<Conn *> fd2conn;
+    std::vector<Server> servers;
+    // slot -> index into servers
+    std::vector<uint32_t> owner;
+    std::vector<Conn *> dirty;
+    // spreads the clients over the pools
+    size_t next_pool = 0;
+} g_data;
+
+static void conn_put(Conn *conn)
+{
+    if (g_data.fd2conn.size() <= (size_t)conn->fd)
+    {
+        g_data.fd2conn.resize(conn->fd + 1);
+    }
+    g_data.fd2conn[conn->fd] = conn;
+}
+
+// the output is flushed at the end of the loop iteration
+static void conn_send(Conn *conn, const void *data, size_t size)
+{
+    conn->wbuf.append((const char *)data, size);
+    if (!conn->dirty)
+    {
+        conn->dirty = true;
+        g_data.dirty.push_back(conn);
+    }
+}
+
+static void out_err(std::string &out, int32_t code, const std::string &msg)
+{
+    uint32_t len = 1 + 4 + 4 + (uint32_t)msg.size();
+    out.append((char *)&len, 4);
+    out.push_back(SER_ERR);
+    out.append((char *)&code, 4);
+    len = (uint32_t)msg.size();
+    out.append((char *)&len, 4);
+    out.append(msg);
+}
+
+// move the completed replies of a client into its output, in order
+static void client_drain(Conn *client)
+{
+    while (!client->pending.empty() && client->pending.front()->done)
+    {
+        Pending *p = client->pending.front();
+        client->pending.pop_front();
+        if (!client->closed)
+        {
+            conn_send(client, p->reply.data(), p->reply.size());
+        }
+        delete p;
+    }
+}
+
+static void pending_done(Pending *p)
+{
+    p->done = true;
+    if (p->client)
+    {
+        client_drain(p->client);
+    }
+    else
+    {
+        delete p; // the client is gone
+    }
+}
+
+static int upstream_connect(Server &server)
+{
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.port);
+    if (1 != inet_pton(AF_INET, server.host.c_str(), &addr.sin_addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    fd_set_nb(fd);
+    int val = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    if (rv < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// the connection of the client in the pool, reconnecting if needed
+static Conn *upstream_get(size_t idx, Conn *client)
+{
+    Server &server = g_data.servers[idx];
+    size_t i = client->pool_idx % server.pool.size();
+    if (!server.pool[i])
+    {
+        int fd = upstream_connect(server);
+        if (fd < 0)
+        {
+            return NULL;
+        }
+        Conn *conn = new Conn();
+        conn->fd = fd;
+        conn->kind = CONN_UPSTREAM;
+        conn->server = idx;
+        conn_put(conn);
+        server.pool[i] = conn;
+    }
+    return server.pool[i];
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    uint32_t v = 0;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// split a request, stops at the first malformed argument
+static void parse_args(const uint8_t *req, uint32_t len, std::vector<std::string> &args)
+{
+    if (len < 4)
+    {
+        return;
+    }
+    uint32_t nstr = read_u32(&req[0]);
+    size_t pos = 4;
+    for (uint32_t i = 0; i < nstr && pos + 4 <= len; i++)
+    {
+        uint32_t alen = read_u32(&req[pos]);
+        if (pos + 4 + (size_t)alen > len)
+        {
+            return;
+        }
+        args.push_back(std::string((const char *)&req[pos + 4], alen));
+        pos += 4 + alen;
+    }
+}
+
+// the command keeps state in the connection, which other clients share
+static bool cmd_stateful(const std::vector<std::string> &args)
+{
+    static const char *k_stateful[] = {
+        "blpop", "brpop", "subscribe", "psubscribe", "unsubscribe", "punsubscribe",
+        "multi", "exec", "discard", "watch", "unwatch", "asking",
+    };
+    for (const char *name : k_stateful)
+    {
+        if (cmd_is(args[0], name))
+        {
+            return true;
+        }
+    }
+    if (cmd_is(args[0], "client") && args.size() >= 2 && cmd_is(args[1], "tracking"))
+    {
+        return true;
+    }
+    if (cmd_is(args[0], "xread"))
+    {
+        // xread [count N] [block MS] streams ...
+        for (size_t i = 1; i < args.size() && !cmd_is(args[i], "streams"); i++)
+        {
+            if (cmd_is(args[i], "block"))
+            {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// the server owning the keys of the request, the first one without keys.
+// false if the keys are on different servers.
+static bool route(const std::vector<std::string> &args, size_t &idx)
+{
+    idx = 0;
+    std::vector<size_t> keys;
+    cmd_route_keys(args, keys);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        const std::string &key = args[keys[i]];
+        size_t owner = g_data.owner[key_hash_slot(key.data(), key.size())];
+        if (i > 0 && owner != idx)
+        {
+            return false;
+        }
+        idx = owner;
+    }
+    return true;
+}
+
+// forward a request as is
+static void client_request(Conn *client, const uint8_t *frame, uint32_t len)
+{
+    Pending *p = new Pending();
+    p->client = client;
+    client->pending.push_back(p);
+
+    std::vector<std::string> args;
+    parse_args(frame + 4, len, args);
+    if (!args.empty() && cmd_stateful(args))
+    {
+        out_err(p->reply, ERR_UNKNOWN, "proxy: " + args[0] + " is not supported");
+        return pending_done(p);
+    }
+    size_t idx = 0;
+    if (!args.empty() && !route(args, idx))
+    {
+        out_err(p->reply, ERR_CROSSSLOT, "proxy: the keys are on different servers");
+        return pending_done(p);
+    }
+    Conn *up = upstream_get(idx, client);
+    if (!up)
+    {
+        out_err(p->reply, ERR_UNKNOWN, "proxy: cannot connect to the server");
+        return pending_done(p);
+    }
+    up->pending.push_back(p);
+    conn_send(up, frame, 4 + len);
+}
+
+static void upstream_reply(Conn *up, const uint8_t *frame, uint32_t len)
+{
+    if (up->pending.empty())
+    {
+        msg("unexpected reply");
+        up->closed = true;
+        return;
+    }
+    Pending *p = up->pending.front();
+    up->pending.pop_front();
+    p->reply.assign((const char *)frame, 4 + len);
+    pending_done(p);
+}
+
+static bool client_readable(Conn *conn)
+{
+    return conn->pending.size() < k_max_pending && conn->wbuf.size() < k_max_wbuf;
+}
+
+static void conn_read(Conn *conn)
+{
+    while (!conn->closed)
+    {
+        if (conn->kind == CONN_CLIENT && !client_readable(conn))
+        {
+            return;
+        }
+        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+        ssize_t rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (rv <= 0)
+        {
+            conn->closed = true;
+            return;
+        }
+        conn->rbuf_size += (size_t)rv;
+
+        // process complete messages
+        size_t pos = 0;
+        while (conn->rbuf_size - pos >= 4)
+        {
+            uint32_t len = read_u32(&conn->rbuf[pos]);
+            if (len > k_max_msg)
+            {
+                msg("too long");
+                conn->closed = true;
+                return;
+            }
+            if (4 + len > conn->rbuf_size - pos)
+            {
+                break;
+            }
+            if (conn->kind == CONN_CLIENT)
+            {
+                client_request(conn, &conn->rbuf[pos], len);
+            }
+            else
+            {
+                upstream_reply(conn, &conn->rbuf[pos], len);
+            }
+            pos += 4 + len;
+        }
+        conn->rbuf_size -= pos;
+        memmove(conn->rbuf, &conn->rbuf[pos], conn->rbuf_size);
+    }
+}
+
+static void conn_write(Conn *conn)
+{
+    while (!conn->closed && conn->wbuf_sent < conn->wbuf.size())
+    {
+        size_t remain = conn->wbuf.size() - conn->wbuf_sent;
+        ssize_t rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (rv < 0)
+        {
+            conn->closed = true;
+            return;
+        }
+        conn->wbuf_sent += (size_t)rv;
+    }
+    conn->wbuf.clear();
+    conn->wbuf_sent = 0;
+}
+
+static void conn_done(Conn *conn)
+{
+    if (conn->kind == CONN_CLIENT)
+    {
+        // the replies still in flight are discarded by the upstreams
+        for (Pending *p : conn->pending)
+        {
+            if (p->done)
+            {
+                delete p;
+            }
+            else
+            {
+                p->client = NULL;
+            }
+        }
+    }
+    else
+    {
+        // fail the requests in flight, the pool reconnects on demand
+        std::vector<Conn *> &pool = g_data.servers[conn->server].pool;
+        for (Conn *&slot : pool)
+        {
+            if (slot == conn)
+            {
+                slot = NULL;
+            }
+        }
+        for (Pending *p : conn->pending)
+        {
+            out_err(p->reply, ERR_UNKNOWN, "proxy: lost the server connection");
+            pending_done(p);
+        }
+    }
+    g_data.fd2conn[conn->fd] = NULL;
+    (void)close(conn->fd);
+    delete conn;
+}
+
+static void accept_new_conn(int fd)
+{
+    while (true)
+    {
+        int connfd = accept(fd, NULL, NULL);
+        if (connfd < 0)
+        {
+            return;
+        }
+        fd_set_nb(connfd);
+        Conn *conn = new Conn();
+        conn->fd = connfd;
+        conn->pool_idx = g_data.next_pool++;
+        conn_put(conn);
+    }
+}
+
+// each line is `first-last host:port`, the same as the server's cluster config
+static void load_cluster(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        die("open cluster config");
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        unsigned first = 0, last = 0;
+        char host[200] = {};
+        unsigned port = 0;
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+        {
+            continue;
+        }
+        if (4 != sscanf(line, "%u-%u %199[^:]:%u", &first, &last, host, &port)
+            || first > last || last >= k_cluster_slots)
+        {
+            die("bad cluster config");
+        }
+        size_t idx = 0;
+        while (idx < g_data.servers.size()
+               && (g_data.servers[idx].host != host || g_data.servers[idx].port != port))
+        {
+            idx++;
+        }
+        if (idx == g_data.servers.size())
+        {
+            g_data.servers.push_back(Server{host, (uint16_t)port, {}});
+        }
+        for (uint32_t slot = first; slot <= last; slot++)
+        {
+            g_data.owner[slot] = (uint32_t)idx;
+        }
+    }
+    fclose(fp);
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: proxy [--port N] [--pool N] (--cluster FILE | HOST:PORT...)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 1234;
+    size_t pool_size = 4;
+    g_data.owner.assign(k_cluster_slots, 0);
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--port") && i + 1 < argc)
+        {
+            port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--pool") && i + 1 < argc)
+        {
+            pool_size = (size_t)atoi(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--cluster") && i + 1 < argc)
+        {
+            load_cluster(argv[++i]);
+        }
+        else if (argv[i][0] != '-' && strchr(argv[i], ':'))
+        {
+            const char *colon = strchr(argv[i], ':');
+            std::string host(argv[i], colon - argv[i]);
+            g_data.servers.push_back(Server{host, (uint16_t)atoi(colon + 1), {}});
+        }
+        else
+        {
+            usage();
+        }
+    }
+    if (g_data.servers.empty() || pool_size == 0)
+    {
+        usage();
+    }
+    for (Server &server : g_data.servers)
+    {
+        server.pool.resize(pool_size);
+    }
+    if (g_data.servers.size() > 1 && g_data.owner[k_cluster_slots - 1] == 0)
+    {
+        // no cluster config, split the slots evenly
+        size_t n = g_data.servers.size();
+        for (uint32_t slot = 0; slot < k_cluster_slots; slot++)
+        {
+            g_data.owner[slot] = (uint32_t)(slot * n / k_cluster_slots);
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+
+    // bind
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs(port);
+    addr.sin_addr.s_addr = ntohl(0);
+    int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
+    if (rv)
+    {
+        die("bind()");
+    }
+
+    rv = listen(fd, SOMAXCONN);
+    if (rv)
+    {
+        die("listen()");
+    }
+
+    fd_set_nb(fd);
+
+    // the event loop
+    std::vector<struct pollfd> poll_args;
+    while (true)
+    {
+        poll_args.clear();
+        struct pollfd pfd = {fd, POLLIN, 0};
+        poll_args.push_back(pfd);
+
+        for (Conn *conn : g_data.fd2conn)
+        {
+            if (!conn)
+            {
+                continue;
+            }
+            struct pollfd pfd = {};
+            pfd.fd = conn->fd;
+            if (conn->kind == CONN_UPSTREAM || client_readable(conn))
+            {
+                pfd.events |= POLLIN;
+            }
+            if (!conn->wbuf.empty())
+            {
+                pfd.events |= POLLOUT;
+            }
+            pfd.events = pfd.events | POLLERR;
+            poll_args.push_back(pfd);
+        }
+
+        // poll for active fds
+        int rv = poll(poll_args.data(), (nfds_t)poll_args.size(), -1);
+        if (rv < 0 && errno != EINTR)
+        {
+            die("poll");
+        }
+
+        // process active connections
+        for (size_t i = 1; i < poll_args.size(); ++i)
+        {
+            short revents = poll_args[i].revents;
+            Conn *conn = g_data.fd2conn[poll_args[i].fd];
+            if (!revents || !conn)
+            {
+                continue;
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                conn_read(conn);
+            }
+            if (revents & POLLOUT)
+            {
+                conn_write(conn);
+            }
+        }
+
+        // coalesced writes: one write per connection per iteration
+        for (size_t i = 0; i < g_data.dirty.size(); i++)
+        {
+            Conn *conn = g_data.dirty[i];
+            conn->dirty = false;
+            conn_write(conn);
+        }
+        g_data.dirty.clear();
+
+        // close the connections that are done
+        for (Conn *conn : g_data.fd2conn)
+        {
+            if (conn && conn->closed)
+            {
+                conn_done(conn);
+            }
+        }
+
+        // accept new connections
+        if (poll_args[0].revents)
+        {
+            accept_new_conn(fd);
+        }
+    }
+
+    return 0;
+}
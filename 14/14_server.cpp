@@ -8,19 +8,45 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
 #include <time.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <netinet/ip.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
 #include <vector>
 #include <string>
 
 #include "hashtable.h"
 #include "zset.h"
+#include "cluster.h"
+#include "keys.h"
 #include "common.h"
 #include "list.h"
 #include "heap.h"
 #include "thread_pool.h"
+#include "slab.h"
+#include "hash.h"
+#include "qlist.h"
+#include "set.h"
+#include "stream.h"
+#include "geo.h"
+#include "vset.h"
+#include "bloom.h"
+#include "sketch.h"
+#include "tseries.h"
+#include "pubsub.h"
+#include "script.h"
+#include "hll.h"
+#include "bitops.h"
 
 static void msg(const char *msg)
 {
@@ -61,6 +87,34 @@ static uint64_t get_monotonic_usec()
     return uint64_t(tv.tv_sec) * 1000000 + tv.tv_nsec / 1000;
 }
 
+// wall-clock time, only used for things that must survive a restart
+static uint64_t get_realtime_msec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_REALTIME, &tv);
+    return uint64_t(tv.tv_sec) * 1000 + tv.tv_nsec / 1000000;
+}
+
+static int32_t write_all(int fd, const char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = write(fd, buf, n);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return -1; // error
+        }
+        assert((size_t)rv <= n);
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return 0;
+}
+
 const size_t k_max_msg = 4096;
 
 enum
@@ -68,8 +122,21 @@ enum
     STATE_REQ = 0,
     STATE_RES = 1,
     STATE_END = 2, // mark the connection for deletion
+    STATE_WAIT = 3, // parked until some background work is done
+};
+
+enum
+{
+    REPL_NONE = 0,
+    // a replica as seen from its primary
+    REPL_WAIT_SNAPSHOT_START = 1,
+    REPL_WAIT_SNAPSHOT_END = 2,
+    REPL_SEND_SNAPSHOT = 3,
+    REPL_ONLINE = 4,
 };
 
+struct Blocked;
+
 struct Conn
 {
     int fd = -1;
@@ -77,13 +144,157 @@ struct Conn
     // read buffer
     size_t rbuf_size = 0;
     uint8_t rbuf[4 + k_max_msg];
-    // write buffer
-    size_t wbuf_size = 0;
+    // write buffer, it can hold more than one message
+    std::string wbuf;
     size_t wbuf_sent = 0;
-    uint8_t wbuf[4 + k_max_msg];
     uint64_t idle_start = 0;
     // timer
     DList idle_list;
+    // for a replica connected to this server
+    uint32_t repl_state = REPL_NONE;
+    uint64_t repl_offset = 0;
+    int repl_snap_fd = -1;
+    size_t repl_snap_left = 0;
+    // the command stream produced while the snapshot is in flight
+    std::string repl_pending;
+    // cluster mode: the next command may use an importing slot
+    bool asking = false;
+    // the migration link from another server, which writes into importing slots
+    bool import_link = false;
+    // parked by BLPOP/BRPOP
+    Blocked *blocked = NULL;
+    // pub/sub: the subscriptions, and the messages to send after wbuf, which
+    // are shared with the other subscribers
+    std::vector<std::string> channels;
+    std::vector<std::string> patterns;
+    std::deque<PubMsg *> pubq;
+    // the bytes of the first message already sent, and the unsent bytes
+    size_t pubq_sent = 0;
+    size_t pubq_bytes = 0;
+    // CLIENT ID
+    uint64_t id = 0;
+    // CLIENT TRACKING: the invalidations go to the `redirect` connection
+    bool tracking = false;
+    bool tracking_bcast = false;
+    uint64_t tracking_redirect = 0;
+    std::vector<std::string> tracking_prefixes;
+    // MULTI: the commands queued for EXEC, which doesn't let them block
+    bool multi = false;
+    bool multi_failed = false;
+    bool executing = false;
+    std::vector<std::vector<std::string>> multi_queue;
+    // WATCH: the keys and the versions of their entries
+    std::vector<std::pair<std::string, uint64_t>> watched;
+    bool watch_dirty = false;
+};
+
+// the append-only log of mutations
+struct AOF
+{
+    int fd = -1;
+    std::string path;
+    // records produced by the current event loop iteration
+    std::string buf;
+    // records that arrived while a rewrite is in progress
+    std::string rewrite_buf;
+    // the rewrite child process
+    pid_t child = -1;
+    // the file size, and the size right after the last rewrite
+    size_t size = 0;
+    size_t base_size = 0;
+    // for the once-per-second fsync
+    bool unsynced = false;
+    uint64_t last_fsync_us = 0;
+};
+
+// a stream of propagated commands being applied. the writes of a transaction
+// come between MULTI and EXEC records, they are held back and applied together
+struct Replay
+{
+    bool in_txn = false;
+    std::vector<std::vector<std::string>> txn;
+};
+
+struct SnapWriter;
+
+// the point-in-time snapshot file
+struct Snapshot
+{
+    std::string path = "dump.snap";
+    pid_t child = -1;
+    // the fork-less mode walks the key space from the event loop
+    bool incremental = false;
+    SnapWriter *writer = NULL;
+    // entries stamped with the current epoch are already in the snapshot
+    uint32_t epoch = 0;
+    // entries that existed when the snapshot started, and those written so far
+    size_t nkeys = 0;
+    size_t nwritten = 0;
+    // the scan position: ht2, then ht1
+    uint32_t cursor_tab = 0;
+    size_t cursor_pos = 0;
+    // set by the thread pool after the file is synced and renamed
+    std::atomic<int> commit_status{0};
+    bool committing = false;
+};
+
+enum
+{
+    // the link to the primary as seen from a replica
+    LINK_NONE = 0,
+    LINK_CONNECT = 1,
+    LINK_HANDSHAKE = 2,
+    LINK_TRANSFER = 3,
+    LINK_CONNECTED = 4,
+};
+
+struct Repl
+{
+    // as a primary, the command stream is identified by (replid, offset)
+    std::string replid;
+    uint64_t offset = 0;
+    // the stream produced by the current event loop iteration
+    std::string batch;
+    // the circular backlog, allocated with the first replica
+    size_t backlog_size = 1 << 20;
+    std::string backlog;
+    size_t backlog_idx = 0;
+    size_t backlog_histlen = 0;
+    std::vector<Conn *> replicas;
+    uint64_t last_send_us = 0;
+    size_t stat_full_syncs = 0;
+    size_t stat_partial_syncs = 0;
+    // as a replica
+    std::string primary_host;
+    uint16_t primary_port = 0;
+    uint32_t link_state = LINK_NONE;
+    Conn *link = NULL;
+    uint64_t link_retry_us = 0;
+    std::string primary_replid;
+    uint64_t primary_offset = 0;
+    int transfer_fd = -1;
+    uint64_t transfer_left = 0;
+    // executing the command stream from the primary
+    bool applying = false;
+    Replay replay;
+    // the bytes of a transaction not applied yet, not counted in primary_offset
+    uint64_t txn_bytes = 0;
+};
+
+// cluster mode: each server owns some of the slots and redirects the rest
+struct Cluster
+{
+    bool enabled = false;
+    // host:port of this server
+    std::string myself;
+    std::vector<std::string> nodes;
+    // slot -> index into nodes, -1 if no one serves it
+    std::vector<int32_t> owner;
+    // slot -> the source node if it's being moved here, otherwise -1
+    std::vector<int32_t> importing;
+    // the keys of each slot, for enumeration
+    std::vector<uint32_t> slot_count;
+    std::vector<DList> slot_keys;
 };
 
 // the data structure for the key space
@@ -98,8 +309,88 @@ static struct
     std::vector<HeapItem> heap;
     // the thread pool
     ThreadPool tp;
+    // persistence
+    AOF aof;
+    Snapshot snap;
+    Repl repl;
+    Cluster cluster;
 } g_data;
 
+// client side caching: the server remembers what the tracking clients read
+// and tells them when it changes, as pub/sub messages on k_invalidate_channel
+// to the connections they redirect to.
+static struct
+{
+    // the connections by CLIENT ID
+    std::map<uint64_t, Conn *> clients;
+    uint64_t next_id = 1;
+    // the keys read by the tracking clients, and the ids of the readers. a
+    // key is forgotten once it is invalidated, or to stay under max_keys.
+    std::map<std::string, std::vector<uint64_t>> keys;
+    size_t max_keys = 1 << 20;
+    uint64_t nevicted = 0;
+    // BCAST mode: the prefixes and their clients, all keys for ""
+    std::map<std::string, std::vector<uint64_t>> prefixes;
+} g_tracking;
+
+static const char k_invalidate_channel[] = "__redis__:invalidate";
+
+// EVAL: the compiled scripts by the SHA-1 of their source
+static struct
+{
+    std::map<std::string, Script *> cache;
+    // the instructions a run may take
+    uint64_t budget = 10 * 1000 * 1000;
+    uint64_t nkilled = 0;
+    // the ASKING of the EVAL being run, for the keys of its commands
+    bool asking = false;
+    // the MULTI record of the EVAL being run is propagated
+    bool txn = false;
+} g_scripts;
+
+// WATCH: the entries are stamped from a clock on every write, but only while
+// some connection watches keys
+static struct
+{
+    uint64_t clock = 0;
+    // the connections with watched keys
+    size_t nwatching = 0;
+} g_watch;
+
+// work done by the thread pool is handed back to the event loop
+static struct
+{
+    int fd = -1;
+    pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+    std::vector<Work> queue;
+} g_posted;
+
+// called from any thread, f(arg) runs on the event loop
+static void loop_post(void (*f)(void *), void *arg)
+{
+    pthread_mutex_lock(&g_posted.mu);
+    g_posted.queue.push_back(Work{f, arg});
+    pthread_mutex_unlock(&g_posted.mu);
+    uint64_t one = 1;
+    ssize_t rv = write(g_posted.fd, &one, 8);
+    (void)rv;
+}
+
+static void process_posted()
+{
+    uint64_t cnt = 0;
+    ssize_t rv = read(g_posted.fd, &cnt, 8);
+    (void)rv;
+    std::vector<Work> works;
+    pthread_mutex_lock(&g_posted.mu);
+    works.swap(g_posted.queue);
+    pthread_mutex_unlock(&g_posted.mu);
+    for (Work &w : works)
+    {
+        w.f(w.arg);
+    }
+}
+
 static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
 {
     if (fd2conn.size() <= (size_t)conn->fd)
@@ -109,6 +400,19 @@ static void conn_put(std::vector<Conn *> &fd2conn, struct Conn *conn)
     fd2conn[conn->fd] = conn;
 }
 
+static Conn *conn_new(int fd)
+{
+    Conn *conn = new Conn();
+    conn->fd = fd;
+    conn->id = g_tracking.next_id++;
+    g_tracking.clients[conn->id] = conn;
+    conn->state = STATE_REQ;
+    conn->idle_start = get_monotonic_usec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    conn_put(g_data.fd2conn, conn);
+    return conn;
+}
+
 static int32_t accept_new_conn(int fd)
 {
     struct sockaddr_in client_addr = {};
@@ -116,25 +420,15 @@ static int32_t accept_new_conn(int fd)
     int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
     if (connfd < 0)
     {
-        msg("accept() error");
+        if (errno != EAGAIN)
+        {
+            msg("accept() error");
+        }
         return -1;
     }
 
     fd_set_nb(connfd);
-    struct Conn *conn = (struct Conn *)malloc(sizeof(struct Conn));
-    if (!conn)
-    {
-        close(connfd);
-        return -1;
-    }
-    conn->fd = connfd;
-    conn->state = STATE_REQ;
-    conn->rbuf_size = 0;
-    conn->wbuf_size = 0;
-    conn->wbuf_sent = 0;
-    conn->idle_start = get_monotonic_usec();
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-    conn_put(g_data.fd2conn, conn);
+    (void)conn_new(connfd);
     return 0;
 }
 
@@ -184,6 +478,15 @@ enum
 {
     T_STR = 0,
     T_ZSET = 1,
+    T_HASH = 2,
+    T_LIST = 3,
+    T_SET = 4,
+    T_STREAM = 5,
+    T_VSET = 6,
+    T_BLOOM = 7,
+    T_CMS = 8,
+    T_TOPK = 9,
+    T_TS = 10,
 };
 
 // the structure for the key
@@ -193,11 +496,195 @@ struct Entry
     std::string key;
     std::string val;
     uint32_t type = 0;
-    ZSet *zset = NULL;
+    // the last snapshot that has captured this entry
+    uint32_t snap_epoch = 0;
+    // the value of the other types, the member is picked by `type`.
+    // NULL for a string or a spilled entry.
+    union
+    {
+        void *ptr = NULL;
+        ZSet *zset;
+        Hash *hash;
+        QList *list;
+        Set *set;
+        Stream *stream;
+        VSet *vset;
+        Bloom *bloom;
+        CMS *cms;
+        TopK *topk;
+        TSeries *series;
+    };
+    // the keys of the same slot in cluster mode
+    DList slot_node;
+    // being moved to another server
+    bool migrating = false;
+    // tiered storage: the value is in the tier file if tier_len > 0
+    uint32_t tier_len = 0;
+    uint64_t tier_off = 0;
+    uint64_t atime_us = 0;
+    DList tier_node;
     // for TTLs
     size_t heap_idx = -1;
+    // the last write while keys were watched
+    uint64_t version = 0;
+};
+
+static void entry_before_write(Entry *ent);
+static void entry_before_update(Entry *ent);
+static void tracking_invalidate(const std::string &key);
+
+// tiered storage:
+// large values that haven't been accessed for a while are appended to the tier
+// file in the snapshot entry format, leaving a stub entry with the offset. A
+// request for a spilled key parks the connection while a worker reads the value
+// back, and other clients keep being served. The file is compacted in the
+// background once it's mostly garbage.
+const size_t k_tier_spill_budget = 1 << 20;
+const size_t k_tier_compact_min = 1 << 20;
+
+// a value being read back
+struct TierLoad
+{
+    std::string key;
+    int fd = -1;
+    uint64_t off = 0;
+    uint32_t len = 0;
+    uint64_t gen = 0;
+    Entry *cold = NULL;
+    std::vector<Conn *> waiters;
+};
+
+// the live records are copied into a new file
+struct TierCompact
+{
+    int old_fd = -1;
+    int new_fd = -1;
+    std::string path;
+    // the live records, sorted by the old offsets
+    std::vector<std::pair<uint64_t, uint32_t>> recs;
+    std::vector<uint64_t> new_offs;
+    uint64_t end = 0;
+    bool err = false;
+};
+
+struct Tier
+{
+    bool enabled = false;
+    std::string path;
+    int fd = -1;
+    uint64_t size = 0;
+    uint64_t live = 0;
+    // bumped when the records are moved by compaction
+    uint64_t gen = 0;
+    size_t min_size = 1024;
+    uint64_t cold_us = 60 * 1000 * 1000;
+    // resident candidates ordered by the access time, and the spilled entries
+    DList lru;
+    DList spilled;
+    size_t nspilled = 0;
+    std::vector<TierLoad *> loads;
+    TierCompact *compact = NULL;
+    bool compact_done = false;
+    uint64_t compact_start = 0;
+    // stats
+    size_t nfaults = 0;
+    size_t ncompactions = 0;
+};
+
+static Tier g_tier;
+
+// active defrag:
+// once the slab classes hold much more memory than the live objects need, the
+// key space is walked a bucket at a time under a time budget, and the entries
+// and the nodes of zsets, hashes and lists on sparse pages are moved to denser
+// ones so the sparse pages drain and get unmapped.
+const uint64_t k_defrag_step_us = 1000;
+// the pause between steps, this caps the CPU time at about 25%
+const uint64_t k_defrag_interval_us = 3000;
+const uint64_t k_defrag_check_us = 1000 * 1000;
+
+struct Defrag
+{
+    // start a cycle above this slab_frag_ratio, 0 disables
+    double threshold = 1.4;
+    size_t min_bytes = 16 << 20;
+    bool running = false;
+    uint64_t next_us = 0;
+    // the scan position: ht2, then ht1
+    uint32_t cursor_tab = 0;
+    size_t cursor_pos = 0;
+    // the zsets, hashes and lists found by the scan, each is walked before the
+    // scan goes on
+    std::vector<std::string> containers;
+    uint32_t ctab = 0;
+    size_t cpos = 0;
+    // a list or a stream: the next node to move, and the value it belongs to.
+    // cleared when the value is written, then the walk doesn't resume.
+    void *cvalue = NULL;
+    void *cnode = NULL;
+    // stats
+    size_t ncycles = 0;
+    size_t nmoved = 0;
+    size_t nmoved_start = 0;
+    double ratio_before = 0;
+    double ratio_after = 0;
+};
+
+static Defrag g_defrag;
+
+// the value is about to change or go away
+static void defrag_forget(Entry *ent)
+{
+    if (ent->ptr && ent->ptr == g_defrag.cvalue)
+    {
+        g_defrag.cvalue = NULL;
+        g_defrag.cnode = NULL;
+    }
+}
+
+// a connection parked by BLPOP/BRPOP until one of its keys gets an item, or
+// by XREAD until one of its streams gets an entry after the given ID
+struct Blocked
+{
+    Conn *conn = NULL;
+    std::vector<std::string> keys;
+    bool left = true;
+    // XREAD
+    bool stream = false;
+    std::vector<StreamID> ids;
+    size_t count = 0;
+    // the timeout in g_blocking.heap, -1 for none
+    size_t heap_idx = -1;
 };
 
+static struct
+{
+    // the clients waiting on each key, in arrival order
+    std::map<std::string, std::deque<Blocked *>> waiters;
+    // the keys pushed to while someone waits on them
+    std::vector<std::string> ready;
+    // timeouts
+    std::vector<HeapItem> heap;
+} g_blocking;
+
+static struct
+{
+    // the subscribers of each channel, and of each pattern
+    std::map<std::string, std::vector<Conn *>> channels;
+    PatNode patterns;
+    // a subscriber whose unsent messages pass this is disconnected
+    size_t max_output = 32 << 20;
+    uint64_t ndisconnected = 0;
+} g_pubsub;
+
+static Entry *tier_read(Entry *ent);
+static void tier_load_sync(Entry *ent);
+static void tier_touch(Entry *ent);
+static bool cmd_is_valueless(const std::string &word);
+static void conn_resume(Conn *conn);
+static void propagate(std::vector<std::string> &cmd);
+static bool propagating();
+
 static bool entry_eq(HNode *lhs, HNode *rhs)
 {
     struct Entry *le = container_of(lhs, struct Entry, node);
@@ -211,6 +698,14 @@ enum
     ERR_2BIG = 2,
     ERR_TYPE = 3,
     ERR_ARG = 4,
+    ERR_READONLY = 5,
+    ERR_MOVED = 6,
+    ERR_CLUSTERDOWN = 7,
+    ERR_ASK = 8,
+    ERR_TRYAGAIN = 9,
+    ERR_SCRIPT = 10,
+    ERR_NOSCRIPT = 11,
+    ERR_CROSSSLOT = 12,
 };
 
 static void out_nil(std::string &out)
@@ -264,6 +759,74 @@ static void out_update_arr(std::string &out, uint32_t n)
     memcpy(&out[1], &n, 4);
 }
 
+static bool str2dbl(const std::string &s, double &out)
+{
+    char *endp = NULL;
+    out = strtod(s.c_str(), &endp);
+    return endp == s.c_str() + s.size() && !isnan(out);
+}
+
+static bool str2int(const std::string &s, int64_t &out)
+{
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
+}
+
+// stricter than str2int(), for the values stored as integers: no leading
+// space or '+', and no overflow
+static bool str2int_strict(const std::string &s, int64_t &out)
+{
+    if (s.empty() || !(s[0] == '-' || (s[0] >= '0' && s[0] <= '9')))
+    {
+        return false;
+    }
+    errno = 0;
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return errno == 0 && endp == s.c_str() + s.size();
+}
+
+static void db_insert(Entry *ent)
+{
+    hm_insert(&g_data.db, &ent->node);
+    Cluster &cl = g_data.cluster;
+    if (cl.enabled)
+    {
+        uint32_t slot = key_hash_slot(ent->key.data(), ent->key.size());
+        dlist_insert_before(&cl.slot_keys[slot], &ent->slot_node);
+        cl.slot_count[slot]++;
+    }
+}
+
+static Entry *db_lookup(const std::string &key)
+{
+    Entry probe;
+    probe.key = key;
+    probe.node.hcode = str_hash((uint8_t *)key.data(), key.size());
+    HNode *node = hm_lookup(&g_data.db, &probe.node, &entry_eq);
+    return node ? container_of(node, Entry, node) : NULL;
+}
+
+// create an entry for the looked up key and insert it into the key space
+static Entry *entry_new(Entry &key, uint32_t type)
+{
+    Entry *ent = slab_new<Entry>();
+    ent->key.swap(key.key);
+    ent->node.hcode = key.node.hcode;
+    ent->type = type;
+    // not part of a snapshot that is already in progress
+    ent->snap_epoch = g_data.snap.epoch;
+    db_insert(ent);
+    // a client may have cached or watched the missing key
+    tracking_invalidate(ent->key);
+    if (g_watch.nwatching)
+    {
+        ent->version = ++g_watch.clock;
+    }
+    return ent;
+}
+
 // three operations
 static void do_get(std::vector<std::string> &cmd, std::string &out)
 {
@@ -285,6 +848,32 @@ static void do_get(std::vector<std::string> &cmd, std::string &out)
     return out_str(out, ent->val);
 }
 
+// append key value, returns the new length
+static void do_append(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+
+    HNode *node = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = NULL;
+    if (node)
+    {
+        ent = container_of(node, Entry, node);
+        if (ent->type != T_STR)
+        {
+            return out_err(out, ERR_TYPE, "expect string type");
+        }
+        entry_before_write(ent);
+    }
+    else
+    {
+        ent = entry_new(key, T_STR);
+    }
+    ent->val.append(cmd[2]);
+    return out_int(out, (int64_t)ent->val.size());
+}
+
 static void do_set(std::vector<std::string> &cmd, std::string &out)
 {
     Entry key;
@@ -299,33 +888,36 @@ static void do_set(std::vector<std::string> &cmd, std::string &out)
         {
             return out_err(out, ERR_TYPE, "expect string type");
         }
+        entry_before_write(ent);
         ent->val.swap(cmd[2]);
     }
     else
     {
-        Entry *ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
+        Entry *ent = entry_new(key, T_STR);
         ent->val.swap(cmd[2]);
-        hm_insert(&g_data.db, &ent->node);
     }
     return out_nil(out);
 }
 
+// erase an item from the heap by replacing it with the last item in the array
+static void heap_remove(std::vector<HeapItem> &heap, size_t pos)
+{
+    *heap[pos].ref = -1;
+    heap[pos] = heap.back();
+    heap.pop_back();
+    if (pos < heap.size())
+    {
+        heap_update(heap.data(), pos, heap.size());
+    }
+}
+
 // set or remove the TTL
 static void entry_set_ttl(Entry *ent, int64_t ttl_ms)
 {
+    entry_before_write(ent);
     if (ttl_ms < 0 && ent->heap_idx != (size_t)-1)
     {
-        // erase an item from the heap by replacing it with the last item in the array
-        size_t pos = ent->heap_idx;
-        g_data.heap[pos] = g_data.heap.back();
-        g_data.heap.pop_back();
-        if (pos < g_data.heap.size())
-        {
-            heap_update(g_data.heap.data(), pos, g_data.heap.size());
-        }
-        ent->heap_idx = -1;
+        heap_remove(g_data.heap, ent->heap_idx);
     }
     else if (ttl_ms >= 0)
     {
@@ -365,6 +957,19 @@ static void do_expire(std::vector<std::string> &cmd, std::string &out)
     return out_int(out, node ? 1 : 0);
 }
 
+// set the ttl by an absolute unix time in milliseconds
+static void do_expireat(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t deadline_ms = 0;
+    if (!str2int(cmd[2], deadline_ms))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    int64_t ttl_ms = deadline_ms - (int64_t)get_realtime_msec();
+    cmd[2] = std::to_string(ttl_ms < 0 ? 0 : ttl_ms);
+    return do_expire(cmd, out);
+}
+
 // search the remain ttl time
 static void do_ttl(std::vector<std::string> &cmd, std::string &out)
 {
@@ -389,17 +994,82 @@ static void do_ttl(std::vector<std::string> &cmd, std::string &out)
     return out_int(out, expire_at > now_us ? (expire_at - now_us) / 1000 : 0);
 }
 
-// deallocate the key immediately
-static void entry_destroy(Entry *ent)
+// the absolute unix time in ms of the TTL, or -1
+static int64_t entry_expire_at_ms(Entry *ent, uint64_t now_us, uint64_t now_ms)
+{
+    if (ent->heap_idx == (size_t)-1)
+    {
+        return -1;
+    }
+    uint64_t expire_at = g_data.heap[ent->heap_idx].val;
+    uint64_t ttl_ms = expire_at > now_us ? (expire_at - now_us) / 1000 : 0;
+    return (int64_t)(now_ms + ttl_ms);
+}
+
+static bool hnode_same(HNode *lhs, HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+// a spilled entry has no value
+static void entry_free_value(Entry *ent)
 {
+    std::string().swap(ent->val);
+    if (!ent->ptr)
+    {
+        return;
+    }
     switch (ent->type)
     {
     case T_ZSET:
         zset_dispose(ent->zset);
-        delete ent->zset;
+        slab_delete(ent->zset);
+        break;
+    case T_HASH:
+        hash_dispose(ent->hash);
+        slab_delete(ent->hash);
+        break;
+    case T_LIST:
+        qlist_dispose(ent->list);
+        slab_delete(ent->list);
+        break;
+    case T_SET:
+        set_dispose(ent->set);
+        slab_delete(ent->set);
+        break;
+    case T_STREAM:
+        stream_dispose(ent->stream);
+        slab_delete(ent->stream);
+        break;
+    case T_VSET:
+        vset_dispose(ent->vset);
+        slab_delete(ent->vset);
+        break;
+    case T_BLOOM:
+        bloom_dispose(ent->bloom);
+        slab_delete(ent->bloom);
+        break;
+    case T_CMS:
+        cms_dispose(ent->cms);
+        slab_delete(ent->cms);
+        break;
+    case T_TOPK:
+        topk_dispose(ent->topk);
+        slab_delete(ent->topk);
+        break;
+    case T_TS:
+        ts_dispose(ent->series);
+        slab_delete(ent->series);
         break;
     }
-    delete ent;
+    ent->ptr = NULL;
+}
+
+// deallocate the key immediately
+static void entry_destroy(Entry *ent)
+{
+    entry_free_value(ent);
+    slab_delete(ent);
 }
 
 static void entry_del_async(void *arg)
@@ -408,16 +1078,52 @@ static void entry_del_async(void *arg)
 }
 
 // dispose the entry after it got detached from the key space
+static void migrate_forget(Entry *ent);
+static void tier_forget(Entry *ent);
+
 static void entry_del(Entry *ent)
 {
     entry_set_ttl(ent, -1);
+    tier_forget(ent);
+    defrag_forget(ent);
+    if (ent->migrating)
+    {
+        migrate_forget(ent);
+    }
+    if (ent->slot_node.next)
+    {
+        dlist_detach(&ent->slot_node);
+        g_data.cluster.slot_count[key_hash_slot(ent->key.data(), ent->key.size())]--;
+    }
 
     const size_t k_large_container_size = 10000;
     bool too_big = false;
     switch (ent->type)
     {
     case T_ZSET:
-        too_big = hm_size(&ent->zset->hmap) > k_large_container_size;
+        too_big = ent->zset && hm_size(&ent->zset->hmap) > k_large_container_size;
+        break;
+    case T_HASH:
+        too_big = ent->hash && hash_size(ent->hash) > k_large_container_size;
+        break;
+    case T_LIST:
+        too_big = ent->list && ent->list->size > k_large_container_size;
+        break;
+    case T_SET:
+        too_big = ent->set && set_size(ent->set) > k_large_container_size;
+        break;
+    case T_STREAM:
+        too_big = ent->stream && ent->stream->size > k_large_container_size;
+        break;
+    case T_VSET:
+        too_big = ent->vset && vset_size(ent->vset) > k_large_container_size;
+        break;
+    case T_BLOOM:
+        // unmapping the blocks is the cost
+        too_big = ent->bloom && bloom_bytes(ent->bloom) > k_large_container_size * k_bloom_block;
+        break;
+    case T_TS:
+        too_big = ent->series && ent->series->chunks.size() > k_large_container_size;
         break;
     }
 
@@ -476,28 +1182,106 @@ static void do_keys(std::vector<std::string> &cmd, std::string &out)
     h_scan(&g_data.db.ht2, &cb_scan, &out);
 }
 
-static bool str2dbl(const std::string &s, double &out)
+static size_t proc_rss()
 {
-    char *endp = NULL;
-    out = strtod(s.c_str(), &endp);
-    return endp == s.c_str() + s.size() && !isnan(out);
+    long size = 0;
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp)
+    {
+        if (fscanf(fp, "%ld %ld", &size, &pages) != 2)
+        {
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return (size_t)pages * (size_t)sysconf(_SC_PAGESIZE);
 }
 
-static bool str2int(const std::string &s, int64_t &out)
+// info: flat name value pairs, the slab classes in use are listed last
+static void do_info(std::vector<std::string> &cmd, std::string &out)
 {
-    char *endp = NULL;
-    out = strtoll(s.c_str(), &endp, 10);
-    return endp == s.c_str() + s.size();
+    (void)cmd;
+    std::vector<SlabStat> stats;
+    slab_stats(stats);
+    size_t reserved = 0;
+    size_t used = 0;
+    std::vector<std::pair<std::string, size_t>> classes;
+    for (const SlabStat &st : stats)
+    {
+        if (!st.pages)
+        {
+            continue;
+        }
+        reserved += st.pages * k_slab_page;
+        used += st.used * st.size;
+        std::string name = "slab_" + std::to_string(st.size);
+        classes.push_back({name + "_pages", st.pages});
+        classes.push_back({name + "_used", st.used});
+    }
+
+    Defrag &defrag = g_defrag;
+    out_arr(out, (uint32_t)(34 + 2 * classes.size()));
+    out_str(out, "keys");
+    out_int(out, (int64_t)hm_size(&g_data.db));
+    out_str(out, "rss_bytes");
+    out_int(out, (int64_t)proc_rss());
+    out_str(out, "slab_reserved_bytes");
+    out_int(out, (int64_t)reserved);
+    out_str(out, "slab_used_bytes");
+    out_int(out, (int64_t)used);
+    // reserved / used, 1.0 is no waste
+    out_str(out, "slab_frag_ratio");
+    out_dbl(out, used ? (double)reserved / used : 1.0);
+    out_str(out, "defrag_running");
+    out_int(out, defrag.running);
+    out_str(out, "defrag_cycles");
+    out_int(out, (int64_t)defrag.ncycles);
+    out_str(out, "defrag_moved");
+    out_int(out, (int64_t)defrag.nmoved);
+    // slab_frag_ratio when the last cycle started and ended
+    out_str(out, "defrag_ratio_before");
+    out_dbl(out, defrag.ratio_before);
+    out_str(out, "defrag_ratio_after");
+    out_dbl(out, defrag.ratio_after);
+    out_str(out, "pubsub_channels");
+    out_int(out, (int64_t)g_pubsub.channels.size());
+    out_str(out, "pubsub_patterns");
+    out_int(out, (int64_t)pat_count(&g_pubsub.patterns));
+    // slow subscribers over the output limit
+    out_str(out, "pubsub_disconnected");
+    out_int(out, (int64_t)g_pubsub.ndisconnected);
+    // the keys read by tracking clients, and those dropped for the limit
+    out_str(out, "tracking_keys");
+    out_int(out, (int64_t)g_tracking.keys.size());
+    out_str(out, "tracking_evicted");
+    out_int(out, (int64_t)g_tracking.nevicted);
+    // the cached scripts, and the runs aborted for their instruction budget
+    out_str(out, "scripts_cached");
+    out_int(out, (int64_t)g_scripts.cache.size());
+    out_str(out, "scripts_killed");
+    out_int(out, (int64_t)g_scripts.nkilled);
+    for (auto &kv : classes)
+    {
+        out_str(out, kv.first);
+        out_int(out, (int64_t)kv.second);
+    }
 }
 
-// zadd zset score name
+// zadd zset score name [score name ...]
 static void do_zadd(std::vector<std::string> &cmd, std::string &out)
 {
-    double score = 0;
-    if (!str2dbl(cmd[2], score))
+    // validate all the scores before touching anything
+    std::vector<double> scores;
+    for (size_t i = 2; i < cmd.size(); i += 2)
     {
-        return out_err(out, ERR_ARG, "expect fp number");
-    }
+        double score = 0;
+        if (!str2dbl(cmd[i], score))
+        {
+            return out_err(out, ERR_ARG, "expect fp number");
+        }
+        scores.push_back(score);
+    }
 
     // look up or create the zset
     Entry key;
@@ -508,12 +1292,8 @@ static void do_zadd(std::vector<std::string> &cmd, std::string &out)
     Entry *ent = NULL;
     if (!hnode)
     {
-        ent = new Entry();
-        ent->key.swap(key.key);
-        ent->node.hcode = key.node.hcode;
-        ent->type = T_ZSET;
-        ent->zset = new ZSet();
-        hm_insert(&g_data.db, &ent->node);
+        ent = entry_new(key, T_ZSET);
+        ent->zset = slab_new<ZSet>();
     }
     else
     {
@@ -522,12 +1302,17 @@ static void do_zadd(std::vector<std::string> &cmd, std::string &out)
         {
             return out_err(out, ERR_TYPE, "expect zset");
         }
+        entry_before_write(ent);
     }
 
-    // add or update the tuple
-    const std::string &name = cmd[3];
-    bool added = zset_add(ent->zset, name.data(), name.size(), score);
-    return out_int(out, (int64_t)added);
+    // add or update the tuples
+    int64_t added = 0;
+    for (size_t i = 0; i < scores.size(); i++)
+    {
+        const std::string &name = cmd[3 + i * 2];
+        added += zset_add(ent->zset, name.data(), name.size(), scores[i]);
+    }
+    return out_int(out, added);
 }
 
 static bool expect_zset(std::string &out, std::string &s, Entry **ent)
@@ -561,6 +1346,10 @@ static void do_zrem(std::vector<std::string> &cmd, std::string &out)
         return;
     }
     const std::string &name = cmd[2];
+    if (zset_lookup(ent->zset, name.data(), name.size()))
+    {
+        entry_before_write(ent);
+    }
     ZNode *znode = zset_pop(ent->zset, name.data(), name.size());
     if (znode)
     {
@@ -637,238 +1426,8892 @@ static void do_zquery(std::vector<std::string> &cmd, std::string &out)
     return out_update_arr(out, n);
 }
 
-static bool cmd_is(const std::string &word, const char *cmd)
+// geoadd key lon lat member [lon lat member ...]
+static void do_geoadd(std::vector<std::string> &cmd, std::string &out)
 {
-    return 0 == strcasecmp(word.c_str(), cmd);
-}
+    if ((cmd.size() - 2) % 3 != 0)
+    {
+        return out_err(out, ERR_ARG, "expect lon lat member");
+    }
+    std::vector<double> scores;
+    for (size_t i = 2; i < cmd.size(); i += 3)
+    {
+        double lon = 0;
+        double lat = 0;
+        if (!str2dbl(cmd[i], lon) || !str2dbl(cmd[i + 1], lat) || !geo_valid(lon, lat))
+        {
+            return out_err(out, ERR_ARG, "invalid coordinates");
+        }
+        scores.push_back((double)geo_encode(lon, lat));
+    }
 
-static void do_request(std::vector<std::string> &cmd, std::string &out)
-{
-    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent)
     {
-        do_keys(cmd, out);
+        Entry key;
+        key.key.swap(cmd[1]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        ent = entry_new(key, T_ZSET);
+        ent->zset = slab_new<ZSet>();
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    else
     {
-        do_get(cmd, out);
+        if (ent->type != T_ZSET)
+        {
+            return out_err(out, ERR_TYPE, "expect zset");
+        }
+        entry_before_write(ent);
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    int64_t added = 0;
+    for (size_t i = 0; i < scores.size(); i++)
     {
-        do_set(cmd, out);
+        const std::string &name = cmd[4 + i * 3];
+        added += zset_add(ent->zset, name.data(), name.size(), scores[i]);
     }
-    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    return out_int(out, added);
+}
+
+// the members of a geo set are zset members with a geohash score
+static bool geo_pos(ZSet *zset, const std::string &name, double &lon, double &lat)
+{
+    ZNode *znode = zset_lookup(zset, name.data(), name.size());
+    if (!znode)
     {
-        do_del(cmd, out);
+        return false;
     }
-    else if (cmd.size() == 4 && cmd_is(cmd[0], "zadd"))
+    geo_decode((uint64_t)znode->score, lon, lat);
+    return true;
+}
+
+// meters per unit
+static bool geo_unit(const std::string &s, double &unit)
+{
+    if (cmd_is(s, "m"))
     {
-        do_zadd(cmd, out);
+        unit = 1;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    else if (cmd_is(s, "km"))
     {
-        do_zrem(cmd, out);
+        unit = 1000;
     }
-    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    else if (cmd_is(s, "mi"))
     {
-        do_zscore(cmd, out);
+        unit = 1609.34;
     }
-    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    else if (cmd_is(s, "ft"))
     {
-        do_zquery(cmd, out);
+        unit = 0.3048;
     }
     else
     {
-        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+        return false;
     }
+    return true;
 }
 
-static bool try_one_request(Conn *conn)
+// geopos key member [member ...]
+static void do_geopos(std::vector<std::string> &cmd, std::string &out)
 {
-    // try to parse a request from the buffer
-    if (conn->rbuf_size < 4)
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent && ent->type != T_ZSET)
     {
-        return false;
+        return out_err(out, ERR_TYPE, "expect zset");
     }
-    uint32_t len = 0;
-    memcpy(&len, &conn->rbuf[0], 4);
-    if (len > k_max_msg)
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++)
     {
-        msg("too long");
-        conn->state = STATE_END;
-        return false;
+        double lon = 0;
+        double lat = 0;
+        if (!ent || !geo_pos(ent->zset, cmd[i], lon, lat))
+        {
+            out_nil(out);
+            continue;
+        }
+        out_arr(out, 2);
+        out_dbl(out, lon);
+        out_dbl(out, lat);
     }
-    if (4 + len > conn->rbuf_size)
+}
+
+// geodist key member1 member2 [m|km|mi|ft]
+static void do_geodist(std::vector<std::string> &cmd, std::string &out)
+{
+    double unit = 1;
+    if (cmd.size() == 5 && !geo_unit(cmd[4], unit))
     {
-        return false;
+        return out_err(out, ERR_ARG, "unsupported unit");
     }
-
-    // parse the request
-    std::vector<std::string> cmd;
-    if (0 != parse_req(&conn->rbuf[4], len, cmd))
+    Entry *ent = NULL;
+    if (!expect_zset(out, cmd[1], &ent))
     {
-        msg("bad req");
-        conn->state = STATE_END;
-        return false;
+        return;
     }
-
-    // generate the response
-    std::string out;
-    do_request(cmd, out);
-
-    if (4 + out.size() > k_max_msg)
+    double lon1 = 0;
+    double lat1 = 0;
+    double lon2 = 0;
+    double lat2 = 0;
+    if (!geo_pos(ent->zset, cmd[2], lon1, lat1) || !geo_pos(ent->zset, cmd[3], lon2, lat2))
     {
-        out.clear();
-        out_err(out, ERR_2BIG, "response is too big");
+        return out_nil(out);
     }
+    return out_dbl(out, geo_dist(lon1, lat1, lon2, lat2) / unit);
+}
 
-    uint32_t wlen = (uint32_t)out.size();
-    memcpy(&conn->wbuf[0], &wlen, 4);
-    memcpy(&conn->wbuf[4], out.data(), out.size());
-    conn->wbuf_size = 4 + wlen;
+struct GeoHit
+{
+    ZNode *znode = NULL;
+    double dist = 0;
+};
 
-    // remove the request from the read buffer
-    size_t remain = conn->rbuf_size - 4 - len;
-    if (remain)
+// geosearch key frommember member|fromlonlat lon lat
+//   byradius r unit|bybox width height unit
+//   [asc|desc] [count n] [withcoord] [withdist] [withhash]
+// the area is covered by at most 4 cells, each one is a range of scores
+static void do_geosearch(std::vector<std::string> &cmd, std::string &out)
+{
+    std::string from;
+    bool has_center = false;
+    double lon = 0;
+    double lat = 0;
+    bool box = false;
+    double width = -1;
+    double height = -1;
+    double unit = 1;
+    bool desc = false;
+    int64_t count = 0;
+    bool withcoord = false;
+    bool withdist = false;
+    bool withhash = false;
+    size_t i = 2;
+    while (i < cmd.size())
+    {
+        size_t left = cmd.size() - i - 1;
+        if (cmd_is(cmd[i], "frommember") && left >= 1)
+        {
+            from = cmd[i + 1];
+            i += 2;
+        }
+        else if (cmd_is(cmd[i], "fromlonlat") && left >= 2)
+        {
+            if (!str2dbl(cmd[i + 1], lon) || !str2dbl(cmd[i + 2], lat) || !geo_valid(lon, lat))
+            {
+                return out_err(out, ERR_ARG, "invalid coordinates");
+            }
+            has_center = true;
+            i += 3;
+        }
+        else if (cmd_is(cmd[i], "byradius") && left >= 2)
+        {
+            if (!str2dbl(cmd[i + 1], width) || width < 0 || !geo_unit(cmd[i + 2], unit))
+            {
+                return out_err(out, ERR_ARG, "expect radius unit");
+            }
+            width = height = 2 * width * unit;
+            i += 3;
+        }
+        else if (cmd_is(cmd[i], "bybox") && left >= 3)
+        {
+            if (!str2dbl(cmd[i + 1], width) || !str2dbl(cmd[i + 2], height)
+                || width < 0 || height < 0 || !geo_unit(cmd[i + 3], unit))
+            {
+                return out_err(out, ERR_ARG, "expect width height unit");
+            }
+            box = true;
+            width *= unit;
+            height *= unit;
+            i += 4;
+        }
+        else if (cmd_is(cmd[i], "asc") || cmd_is(cmd[i], "desc"))
+        {
+            desc = cmd_is(cmd[i++], "desc");
+        }
+        else if (cmd_is(cmd[i], "count") && left >= 1)
+        {
+            if (!str2int(cmd[i + 1], count) || count <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect count");
+            }
+            i += 2;
+        }
+        else if (cmd_is(cmd[i], "withcoord"))
+        {
+            withcoord = true;
+            i++;
+        }
+        else if (cmd_is(cmd[i], "withdist"))
+        {
+            withdist = true;
+            i++;
+        }
+        else if (cmd_is(cmd[i], "withhash"))
+        {
+            withhash = true;
+            i++;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+    if (from.empty() == !has_center || width < 0)
     {
-        memmove(conn->rbuf, &conn->rbuf[4 + len], remain);
+        return out_err(out, ERR_ARG, "expect a center and an area");
     }
-    conn->rbuf_size = remain;
-
-    conn->state = STATE_RES;
-    state_res(conn);
 
-    return (conn->state == STATE_REQ);
-}
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent && ent->type != T_ZSET)
+    {
+        return out_err(out, ERR_TYPE, "expect zset");
+    }
+    if (!ent)
+    {
+        return out_arr(out, 0);
+    }
+    if (!from.empty() && !geo_pos(ent->zset, from, lon, lat))
+    {
+        return out_err(out, ERR_ARG, "member not found");
+    }
 
-static bool try_fill_buffer(Conn *conn)
-{
-    assert(conn->rbuf_size < sizeof(conn->rbuf));
-    ssize_t rv = 0;
-    do
+    // seek to each range, then filter by the exact distance
+    GeoRange ranges[4];
+    size_t nranges = geo_ranges(lon, lat, width, height, ranges);
+    std::vector<GeoHit> hits;
+    for (size_t k = 0; k < nranges; k++)
     {
-        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
-        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN)
+        ZNode *znode = zset_query(ent->zset, (double)ranges[k].min, "", 0, 0);
+        for (; znode && znode->score < (double)ranges[k].max;
+             znode = container_of(avl_offset(&znode->tree, 1), ZNode, tree))
+        {
+            double plon = 0;
+            double plat = 0;
+            geo_decode((uint64_t)znode->score, plon, plat);
+            GeoHit hit;
+            hit.znode = znode;
+            if (box ? geo_in_box(lon, lat, width, height, plon, plat, hit.dist)
+                    : (hit.dist = geo_dist(lon, lat, plon, plat)) <= width / 2)
+            {
+                hits.push_back(hit);
+            }
+        }
+    }
+
+    auto cmp = [desc](const GeoHit &a, const GeoHit &b) {
+        return desc ? a.dist > b.dist : a.dist < b.dist;
+    };
+    size_t n = hits.size();
+    if (count > 0 && (size_t)count < n)
     {
-        return false;
+        n = (size_t)count;
+        std::partial_sort(hits.begin(), hits.begin() + n, hits.end(), cmp);
     }
-    if (rv < 0)
+    else
     {
-        msg("read() error");
-        conn->state = STATE_END;
-        return false;
+        std::sort(hits.begin(), hits.end(), cmp);
     }
-    if (rv == 0)
+
+    uint32_t nfields = 1 + withdist + withhash + withcoord;
+    out_arr(out, (uint32_t)n);
+    for (size_t k = 0; k < n; k++)
     {
-        if (conn->rbuf_size > 0)
+        ZNode *znode = hits[k].znode;
+        if (nfields == 1)
         {
-            msg("unexpected EOF");
+            out_str(out, znode->name, znode->len);
+            continue;
         }
-        else
+        out_arr(out, nfields);
+        out_str(out, znode->name, znode->len);
+        if (withdist)
         {
-            msg("EOF");
+            out_dbl(out, hits[k].dist / unit);
+        }
+        if (withhash)
+        {
+            out_int(out, (int64_t)znode->score);
+        }
+        if (withcoord)
+        {
+            double plon = 0;
+            double plat = 0;
+            geo_decode((uint64_t)znode->score, plon, plat);
+            out_arr(out, 2);
+            out_dbl(out, plon);
+            out_dbl(out, plat);
         }
-        conn->state = STATE_END;
-        return false;
     }
+}
 
-    conn->rbuf_size += (size_t)rv;
-    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+// look up the hash, `out` is set if there is none
+static bool expect_hash(std::string &out, std::string &s, Entry **ent)
+{
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!hnode)
+    {
+        out_nil(out);
+        return false;
+    }
 
-    // try to process requests one by one
-    while (try_one_request(conn))
+    *ent = container_of(hnode, Entry, node);
+    if ((*ent)->type != T_HASH)
     {
+        out_err(out, ERR_TYPE, "expect hash");
+        return false;
     }
-    return (conn->state == STATE_REQ);
+    return true;
 }
 
-static void state_req(Conn *conn)
+// look up or create the hash for a write
+static Entry *hash_for_write(std::string &out, std::string &s)
 {
-    while (try_fill_buffer(conn))
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    if (!hnode)
+    {
+        Entry *ent = entry_new(key, T_HASH);
+        ent->hash = slab_new<Hash>();
+        return ent;
+    }
+    Entry *ent = container_of(hnode, Entry, node);
+    if (ent->type != T_HASH)
     {
+        out_err(out, ERR_TYPE, "expect hash");
+        return NULL;
     }
+    entry_before_write(ent);
+    return ent;
 }
 
-static bool try_flush_buffer(Conn *conn)
+// hset key field value [field value ...]
+static void do_hset(std::vector<std::string> &cmd, std::string &out)
 {
-    ssize_t rv = 0;
-    do
+    Entry *ent = hash_for_write(out, cmd[1]);
+    if (!ent)
     {
-        size_t remain = conn->wbuf_size - conn->wbuf_sent;
-        rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
-    } while (rv < 0 && errno == EINTR);
-    if (rv < 0 && errno == EAGAIN)
+        return;
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i += 2)
     {
-        return false;
+        const std::string &field = cmd[i];
+        const std::string &val = cmd[i + 1];
+        added += hash_set(ent->hash, field.data(), field.size(), val.data(), val.size());
     }
-    if (rv < 0)
+    return out_int(out, added);
+}
+
+// hget key field
+static void do_hget(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_hash(out, cmd[1], &ent))
     {
-        msg("write() error");
-        conn->state = STATE_END;
-        return false;
+        return;
     }
-    conn->wbuf_sent += (size_t)rv;
-    assert(conn->wbuf_sent <= conn->wbuf_size);
-    if (conn->wbuf_sent == conn->wbuf_size)
+    const char *val = NULL;
+    size_t vlen = 0;
+    if (!hash_get(ent->hash, cmd[2].data(), cmd[2].size(), &val, &vlen))
     {
-        conn->state = STATE_REQ;
-        conn->wbuf_sent = 0;
-        conn->wbuf_size = 0;
-        return false;
+        return out_nil(out);
     }
-    return true;
+    return out_str(out, val, vlen);
 }
 
-static void state_res(Conn *conn)
+// hmget key field [field ...]
+static void do_hmget(std::vector<std::string> &cmd, std::string &out)
 {
-    while (try_flush_buffer(conn))
+    Entry *ent = NULL;
+    std::string tmp;
+    bool found = expect_hash(tmp, cmd[1], &ent);
+    if (!found && !tmp.empty() && tmp[0] == SER_ERR)
     {
+        out.swap(tmp);
+        return;
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        const char *val = NULL;
+        size_t vlen = 0;
+        if (found && hash_get(ent->hash, cmd[i].data(), cmd[i].size(), &val, &vlen))
+        {
+            out_str(out, val, vlen);
+        }
+        else
+        {
+            out_nil(out);
+        }
     }
 }
 
-static void connection_io(Conn *conn)
+// hdel key field [field ...], the key is deleted with its last field
+static void do_hdel(std::vector<std::string> &cmd, std::string &out)
 {
-    // wake up by poll, update the idle timer by moving conn to the end of the list
-    conn->idle_start = get_monotonic_usec();
-    dlist_detach(&conn->idle_list);
-    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
-
-    if (conn->state == STATE_REQ)
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_hash(tmp, cmd[1], &ent))
     {
-        state_req(conn);
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
     }
-    else if (conn->state == STATE_RES)
+    entry_before_write(ent);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++)
     {
-        state_res(conn);
+        removed += hash_del(ent->hash, cmd[i].data(), cmd[i].size());
     }
-    else
+    if (hash_size(ent->hash) == 0)
     {
-        assert(0); // not expected
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
     }
+    return out_int(out, removed);
 }
 
-const uint64_t k_idle_timeout_ms = 5 * 1000;
-
-static uint32_t next_timer_ms()
+// hincrby key field delta
+static void do_hincrby(std::vector<std::string> &cmd, std::string &out)
 {
-    uint64_t now_us = get_monotonic_usec();
-    uint64_t next_us = (uint64_t)-1;
-
-    // idle timers
-    if (!dlist_empty(&g_data.idle_list))
+    int64_t delta = 0;
+    if (!str2int_strict(cmd[3], delta))
     {
-        Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
-        next_us = next->idle_start + k_idle_timeout_ms * 1000;
+        return out_err(out, ERR_ARG, "expect int");
     }
-
-    // ttl timers
-    if (!g_data.heap.empty() && g_data.heap[0].val < next_us)
+    Entry *ent = hash_for_write(out, cmd[1]);
+    if (!ent)
     {
-        next_us = g_data.heap[0].val;
+        return;
     }
-
-    if (next_us == (uint64_t)-1)
+    const std::string &field = cmd[2];
+    int64_t val = 0;
+    const char *cur = NULL;
+    size_t len = 0;
+    if (hash_get(ent->hash, field.data(), field.size(), &cur, &len)
+        && !str2int_strict(std::string(cur, len), val))
+    {
+        return out_err(out, ERR_ARG, "hash value is not an integer");
+    }
+    if ((delta > 0 && val > INT64_MAX - delta) || (delta < 0 && val < INT64_MIN - delta))
+    {
+        return out_err(out, ERR_ARG, "increment would overflow");
+    }
+    val += delta;
+    std::string s = std::to_string(val);
+    hash_set(ent->hash, field.data(), field.size(), s.data(), s.size());
+    return out_int(out, val);
+}
+
+// hlen key
+static void do_hlen(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_hash(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, (int64_t)hash_size(ent->hash));
+}
+
+struct HashOut
+{
+    std::string *out = NULL;
+    uint32_t n = 0;
+};
+
+static void cb_hash_out(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    HashOut *ctx = (HashOut *)arg;
+    out_str(*ctx->out, field, flen);
+    out_str(*ctx->out, val, vlen);
+    ctx->n += 2;
+}
+
+// hgetall key
+static void do_hgetall(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_hash(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    HashOut ctx;
+    ctx.out = &out;
+    out_arr(out, (uint32_t)(2 * hash_size(ent->hash)));
+    hash_scan(ent->hash, 0, (size_t)-1, &cb_hash_out, &ctx);
+}
+
+// hscan key cursor [count]
+// returns the next cursor, 0 at the end, followed by field value pairs
+static void do_hscan(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t cursor = 0;
+    int64_t count = 10;
+    if (!str2int(cmd[2], cursor) || cursor < 0
+        || (cmd.size() == 4 && (!str2int(cmd[3], count) || count <= 0)))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_hash(tmp, cmd[1], &ent))
+    {
+        if (tmp[0] == SER_ERR)
+        {
+            return out.swap(tmp);
+        }
+        out_arr(out, 1);
+        return out_int(out, 0);
+    }
+    HashOut ctx;
+    ctx.out = &out;
+    out_arr(out, 0);
+    out_int(out, 0);
+    uint64_t next = hash_scan(ent->hash, (uint64_t)cursor, (size_t)count, &cb_hash_out, &ctx);
+    // the cursor goes first
+    memcpy(&out[1 + 4 + 1], &next, 8);
+    return out_update_arr(out, 1 + ctx.n);
+}
+
+// look up the list, `out` is set if there is none
+static bool expect_list(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_LIST)
+    {
+        out_err(out, ERR_TYPE, "expect list");
+        return false;
+    }
+    return true;
+}
+
+// a list with no items left is deleted
+static void list_del_if_empty(Entry *ent)
+{
+    if (ent->list->size == 0)
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+// lpush/rpush key value [value ...]
+static void do_push(std::vector<std::string> &cmd, std::string &out, bool left)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = NULL;
+    if (!hnode)
+    {
+        ent = entry_new(key, T_LIST);
+        ent->list = slab_new<QList>();
+    }
+    else
+    {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_LIST)
+        {
+            return out_err(out, ERR_TYPE, "expect list");
+        }
+        entry_before_write(ent);
+    }
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        qlist_push(ent->list, left, cmd[i].data(), cmd[i].size());
+    }
+    // the waiters are served after this request
+    if (g_blocking.waiters.count(ent->key))
+    {
+        g_blocking.ready.push_back(ent->key);
+    }
+    return out_int(out, (int64_t)ent->list->size);
+}
+
+// lpop/rpop key
+static void do_pop(std::vector<std::string> &cmd, std::string &out, bool left)
+{
+    Entry *ent = NULL;
+    if (!expect_list(out, cmd[1], &ent))
+    {
+        return;
+    }
+    entry_before_write(ent);
+    std::string val;
+    qlist_pop(ent->list, left, val);
+    list_del_if_empty(ent);
+    return out_str(out, val);
+}
+
+// negative indexes count from the end, false if the range is empty
+static bool list_range(size_t size, int64_t start, int64_t stop, size_t *first, size_t *last)
+{
+    if (start < 0)
+    {
+        start = std::max<int64_t>(0, (int64_t)size + start);
+    }
+    if (stop < 0)
+    {
+        stop = (int64_t)size + stop;
+    }
+    stop = std::min<int64_t>(stop, (int64_t)size - 1);
+    if (stop < 0 || start > stop)
+    {
+        return false;
+    }
+    *first = (size_t)start;
+    *last = (size_t)stop;
+    return true;
+}
+
+struct ListOut
+{
+    std::string *out = NULL;
+    uint32_t n = 0;
+};
+
+static void cb_list_out(const char *val, size_t len, void *arg)
+{
+    ListOut *ctx = (ListOut *)arg;
+    out_str(*ctx->out, val, len);
+    ctx->n++;
+}
+
+// lrange key start stop
+static void do_lrange(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    size_t first = 0;
+    size_t last = 0;
+    if (!expect_list(tmp, cmd[1], &ent) || !list_range(ent->list->size, start, stop, &first, &last))
+    {
+        return !tmp.empty() && tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    ListOut ctx;
+    ctx.out = &out;
+    out_arr(out, 0);
+    qlist_range(ent->list, first, last, &cb_list_out, &ctx);
+    return out_update_arr(out, ctx.n);
+}
+
+// ltrim key start stop
+static void do_ltrim(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t start = 0;
+    int64_t stop = 0;
+    if (!str2int(cmd[2], start) || !str2int(cmd[3], stop))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_list(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_nil(out);
+    }
+    entry_before_write(ent);
+    size_t first = 1;
+    size_t last = 0;
+    list_range(ent->list->size, start, stop, &first, &last);
+    qlist_trim(ent->list, first, last);
+    list_del_if_empty(ent);
+    return out_nil(out);
+}
+
+// llen key
+static void do_llen(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_list(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, (int64_t)ent->list->size);
+}
+
+// pop for a blocking command, logged as a plain pop of the key that had items
+static void list_serve(Entry *ent, bool left, std::string &out)
+{
+    entry_before_write(ent);
+    std::string val;
+    qlist_pop(ent->list, left, val);
+    if (propagating())
+    {
+        std::vector<std::string> cmd = {left ? "lpop" : "rpop", ent->key};
+        propagate(cmd);
+    }
+    out_arr(out, 2);
+    out_str(out, ent->key);
+    out_str(out, val);
+    list_del_if_empty(ent);
+}
+
+static void block_park(Conn *conn, Blocked *b, double timeout)
+{
+    b->conn = conn;
+    for (const std::string &key : b->keys)
+    {
+        g_blocking.waiters[key].push_back(b);
+    }
+    if (timeout > 0)
+    {
+        HeapItem item;
+        item.ref = &b->heap_idx;
+        item.val = get_monotonic_usec() + (uint64_t)(timeout * 1e6);
+        g_blocking.heap.push_back(item);
+        heap_update(g_blocking.heap.data(), g_blocking.heap.size() - 1, g_blocking.heap.size());
+    }
+    conn->blocked = b;
+    conn->state = STATE_WAIT;
+    // parked clients don't time out
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+}
+
+// the client is served, timed out, or gone
+static void block_remove(Blocked *b)
+{
+    for (const std::string &key : b->keys)
+    {
+        auto it = g_blocking.waiters.find(key);
+        if (it == g_blocking.waiters.end())
+        {
+            continue;
+        }
+        std::deque<Blocked *> &q = it->second;
+        q.erase(std::remove(q.begin(), q.end(), b), q.end());
+        if (q.empty())
+        {
+            g_blocking.waiters.erase(it);
+        }
+    }
+    if (b->heap_idx != (size_t)-1)
+    {
+        heap_remove(g_blocking.heap, b->heap_idx);
+    }
+    b->conn->blocked = NULL;
+    delete b;
+}
+
+// blpop/brpop key [key ...] timeout
+// the timeout is in seconds, 0 waits forever
+static void do_bpop(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool left)
+{
+    double timeout = 0;
+    if (!str2dbl(cmd.back(), timeout) || timeout < 0)
+    {
+        return out_err(out, ERR_ARG, "expect timeout");
+    }
+    for (size_t i = 1; i + 1 < cmd.size(); i++)
+    {
+        Entry *ent = db_lookup(cmd[i]);
+        if (!ent)
+        {
+            continue;
+        }
+        if (ent->type != T_LIST)
+        {
+            return out_err(out, ERR_TYPE, "expect list");
+        }
+        if (ent->tier_len)
+        {
+            tier_load_sync(ent);
+        }
+        return list_serve(ent, left, out);
+    }
+    // replaying the AOF or the primary's stream, or in EXEC
+    if (!conn || conn->executing)
+    {
+        return out_nil(out);
+    }
+    // the reply is deferred
+    Blocked *b = new Blocked();
+    b->left = left;
+    b->keys.assign(cmd.begin() + 1, cmd.end() - 1);
+    block_park(conn, b, timeout);
+}
+
+// look up the set, `out` is set if there is none
+static bool expect_set(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_SET)
+    {
+        out_err(out, ERR_TYPE, "expect set");
+        return false;
+    }
+    return true;
+}
+
+// the sets of cmd[first, last), NULL for a missing key. only the first key
+// of a request is read back from the tier before the handler runs.
+static bool sets_lookup(std::vector<std::string> &cmd, size_t first, size_t last,
+                        std::vector<Set *> &sets, std::string &out)
+{
+    for (size_t i = first; i < last; i++)
+    {
+        Entry *ent = db_lookup(cmd[i]);
+        if (ent && ent->type != T_SET)
+        {
+            out_err(out, ERR_TYPE, "expect set");
+            return false;
+        }
+        if (ent && ent->tier_len)
+        {
+            tier_load_sync(ent);
+        }
+        sets.push_back(ent ? ent->set : NULL);
+    }
+    return true;
+}
+
+// sadd key member [member ...]
+static void do_sadd(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = NULL;
+    if (!hnode)
+    {
+        ent = entry_new(key, T_SET);
+        ent->set = slab_new<Set>();
+    }
+    else
+    {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_SET)
+        {
+            return out_err(out, ERR_TYPE, "expect set");
+        }
+        entry_before_write(ent);
+    }
+    int64_t added = 0;
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        added += set_add(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    return out_int(out, added);
+}
+
+// srem key member [member ...], the key is deleted with its last member
+static void do_srem(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_set(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    entry_before_write(ent);
+    int64_t removed = 0;
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        removed += set_del(ent->set, cmd[i].data(), cmd[i].size());
+    }
+    if (set_size(ent->set) == 0)
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out, removed);
+}
+
+// sismember key member
+static void do_sismember(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_set(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, set_has(ent->set, cmd[2].data(), cmd[2].size()));
+}
+
+// smismember key member [member ...]
+static void do_smismember(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    bool found = expect_set(tmp, cmd[1], &ent);
+    if (!found && tmp[0] == SER_ERR)
+    {
+        return out.swap(tmp);
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        out_int(out, found && set_has(ent->set, cmd[i].data(), cmd[i].size()));
+    }
+}
+
+// scard key
+static void do_scard(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_set(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, (int64_t)set_size(ent->set));
+}
+
+struct SetOut
+{
+    std::string *out = NULL;
+};
+
+static void cb_set_out(const char *name, size_t len, void *arg)
+{
+    out_str(*((SetOut *)arg)->out, name, len);
+}
+
+// sinter key [key ...]
+static void do_sinter(std::vector<std::string> &cmd, std::string &out)
+{
+    std::vector<Set *> sets;
+    if (!sets_lookup(cmd, 1, cmd.size(), sets, out))
+    {
+        return;
+    }
+    if (std::find(sets.begin(), sets.end(), (Set *)NULL) != sets.end())
+    {
+        return out_arr(out, 0);
+    }
+    SetOut ctx;
+    ctx.out = &out;
+    out_arr(out, 0);
+    size_t n = set_inter(sets.data(), sets.size(), 0, &g_data.tp, &cb_set_out, &ctx);
+    return out_update_arr(out, (uint32_t)n);
+}
+
+// sintercard numkeys key [key ...] [limit N]
+static void do_sintercard(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t nkeys = 0;
+    if (!str2int(cmd[1], nkeys) || nkeys <= 0 || (size_t)nkeys > cmd.size() - 2)
+    {
+        return out_err(out, ERR_ARG, "expect numkeys");
+    }
+    size_t rest = 2 + (size_t)nkeys;
+    int64_t limit = 0;
+    if (rest != cmd.size() && (rest + 2 != cmd.size() || !cmd_is(cmd[rest], "limit")
+                               || !str2int(cmd[rest + 1], limit) || limit < 0))
+    {
+        return out_err(out, ERR_ARG, "expect limit");
+    }
+    std::vector<Set *> sets;
+    if (!sets_lookup(cmd, 2, rest, sets, out))
+    {
+        return;
+    }
+    if (std::find(sets.begin(), sets.end(), (Set *)NULL) != sets.end())
+    {
+        return out_int(out, 0);
+    }
+    size_t n = set_inter(sets.data(), sets.size(), (size_t)limit, &g_data.tp, NULL, NULL);
+    return out_int(out, (int64_t)n);
+}
+
+// sunionstore dst key [key ...], replaces dst and returns its size
+static void do_sunionstore(std::vector<std::string> &cmd, std::string &out)
+{
+    std::vector<Set *> sets;
+    if (!sets_lookup(cmd, 2, cmd.size(), sets, out))
+    {
+        return;
+    }
+    sets.erase(std::remove(sets.begin(), sets.end(), (Set *)NULL), sets.end());
+    Set *result = slab_new<Set>();
+    set_union(sets.data(), sets.size(), result);
+
+    Entry key;
+    key.key.swap(cmd[1]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (hnode)
+    {
+        entry_del(container_of(hnode, Entry, node));
+    }
+    size_t n = set_size(result);
+    if (n == 0)
+    {
+        set_dispose(result);
+        slab_delete(result);
+        return out_int(out, 0);
+    }
+    Entry *ent = entry_new(key, T_SET);
+    ent->set = result;
+    return out_int(out, (int64_t)n);
+}
+
+// the HLL of a key, NULL if there is none. only the first key of a request
+// is read back from the tier before the handler runs.
+static bool hll_lookup(const std::string &key, Entry **ent, std::string &out)
+{
+    *ent = db_lookup(key);
+    if (*ent && (*ent)->tier_len)
+    {
+        tier_load_sync(*ent);
+    }
+    if (*ent && ((*ent)->type != T_STR || !hll_valid((*ent)->val)))
+    {
+        out_err(out, ERR_TYPE, "expect hyperloglog");
+        return false;
+    }
+    return true;
+}
+
+// pfadd key [element ...], returns 1 if the estimate may have changed
+static void do_pfadd(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!hll_lookup(cmd[1], &ent, out))
+    {
+        return;
+    }
+    bool changed = false;
+    if (!ent)
+    {
+        Entry key;
+        key.key.swap(cmd[1]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        ent = entry_new(key, T_STR);
+        hll_init(ent->val);
+        changed = true;
+    }
+    else
+    {
+        entry_before_write(ent);
+    }
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        changed = hll_add(ent->val, cmd[i].data(), cmd[i].size()) || changed;
+    }
+    return out_int(out, changed);
+}
+
+// pfcount key [key ...], the estimate of the union
+static void do_pfcount(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (cmd.size() == 2)
+    {
+        if (!hll_lookup(cmd[1], &ent, out))
+        {
+            return;
+        }
+        if (!ent)
+        {
+            return out_int(out, 0);
+        }
+        // the estimate is cached in the value, which isn't a write
+        entry_before_update(ent);
+        return out_int(out, (int64_t)hll_count(ent->val));
+    }
+    uint8_t regs[k_hll_regs];
+    uint8_t max[k_hll_regs] = {};
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        if (!hll_lookup(cmd[i], &ent, out))
+        {
+            return;
+        }
+        if (ent)
+        {
+            hll_registers(ent->val, regs);
+            hll_max(max, regs);
+        }
+    }
+    return out_int(out, (int64_t)hll_estimate(max));
+}
+
+// pfmerge dst [src ...], dst becomes the dense union of itself and the sources
+static void do_pfmerge(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    uint8_t regs[k_hll_regs];
+    uint8_t max[k_hll_regs] = {};
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        if (!hll_lookup(cmd[i], &ent, out))
+        {
+            return;
+        }
+        if (ent)
+        {
+            hll_registers(ent->val, regs);
+            hll_max(max, regs);
+        }
+    }
+    ent = db_lookup(cmd[1]);
+    if (!ent)
+    {
+        Entry key;
+        key.key.swap(cmd[1]);
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        ent = entry_new(key, T_STR);
+    }
+    else
+    {
+        entry_before_write(ent);
+    }
+    hll_store_dense(ent->val, max);
+    return out_nil(out);
+}
+
+// the string of a bitmap command, NULL if there is none. only the first key of
+// a request is read back from the tier before the handler runs.
+static bool bits_lookup(const std::string &key, Entry **ent, std::string &out)
+{
+    *ent = db_lookup(key);
+    if (*ent && (*ent)->tier_len)
+    {
+        tier_load_sync(*ent);
+    }
+    if (*ent && (*ent)->type != T_STR)
+    {
+        out_err(out, ERR_TYPE, "expect string type");
+        return false;
+    }
+    return true;
+}
+
+// look up or create the string for a write, padded with zeros to `len` bytes.
+// it grows in place with the capacity of the std::string.
+static Entry *bits_for_write(std::string &out, std::string &s, size_t len)
+{
+    Entry key;
+    key.key.swap(s);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_lookup(&g_data.db, &key.node, &entry_eq);
+    Entry *ent = NULL;
+    if (!hnode)
+    {
+        ent = entry_new(key, T_STR);
+    }
+    else
+    {
+        ent = container_of(hnode, Entry, node);
+        if (ent->type != T_STR)
+        {
+            out_err(out, ERR_TYPE, "expect string type");
+            return NULL;
+        }
+        entry_before_write(ent);
+    }
+    if (ent->val.size() < len)
+    {
+        ent->val.resize(len, '\0');
+    }
+    return ent;
+}
+
+static bool str2bitoff(const std::string &s, uint64_t &off)
+{
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || (uint64_t)val > k_bit_max_offset)
+    {
+        return false;
+    }
+    off = (uint64_t)val;
+    return true;
+}
+
+// setbit key offset 0|1, returns the old bit
+static void do_setbit(std::vector<std::string> &cmd, std::string &out)
+{
+    uint64_t off = 0;
+    if (!str2bitoff(cmd[2], off))
+    {
+        return out_err(out, ERR_ARG, "expect bit offset");
+    }
+    if (cmd[3] != "0" && cmd[3] != "1")
+    {
+        return out_err(out, ERR_ARG, "expect bit");
+    }
+    Entry *ent = bits_for_write(out, cmd[1], off / 8 + 1);
+    if (!ent)
+    {
+        return;
+    }
+    uint8_t &byte = (uint8_t &)ent->val[off / 8];
+    uint8_t mask = (uint8_t)(1 << (7 - off % 8));
+    int64_t old = (byte & mask) ? 1 : 0;
+    byte = cmd[3] == "1" ? (byte | mask) : (byte & ~mask);
+    return out_int(out, old);
+}
+
+// getbit key offset
+static void do_getbit(std::vector<std::string> &cmd, std::string &out)
+{
+    uint64_t off = 0;
+    if (!str2bitoff(cmd[2], off))
+    {
+        return out_err(out, ERR_ARG, "expect bit offset");
+    }
+    Entry *ent = NULL;
+    if (!bits_lookup(cmd[1], &ent, out))
+    {
+        return;
+    }
+    const uint8_t *data = ent ? (const uint8_t *)ent->val.data() : NULL;
+    size_t len = ent ? ent->val.size() : 0;
+    return out_int(out, (int64_t)bitfield_get(data, len, off, 1));
+}
+
+// bitcount key [start end], the range is in bytes
+static void do_bitcount(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t start = 0;
+    int64_t stop = -1;
+    if (cmd.size() == 4 && (!str2int(cmd[2], start) || !str2int(cmd[3], stop)))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!bits_lookup(cmd[1], &ent, out))
+    {
+        return;
+    }
+    size_t first = 0;
+    size_t last = 0;
+    if (!ent || !list_range(ent->val.size(), start, stop, &first, &last))
+    {
+        return out_int(out, 0);
+    }
+    const uint8_t *data = (const uint8_t *)ent->val.data();
+    return out_int(out, (int64_t)bit_count(data + first, last - first + 1));
+}
+
+// bitpos key 0|1 [start [end]], the range is in bytes
+static void do_bitpos(std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd[2] != "0" && cmd[2] != "1")
+    {
+        return out_err(out, ERR_ARG, "expect bit");
+    }
+    int bit = cmd[2] == "1";
+    int64_t start = 0;
+    int64_t stop = -1;
+    if ((cmd.size() >= 4 && !str2int(cmd[3], start)) || (cmd.size() == 5 && !str2int(cmd[4], stop)))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    Entry *ent = NULL;
+    if (!bits_lookup(cmd[1], &ent, out))
+    {
+        return;
+    }
+    if (!ent)
+    {
+        return out_int(out, bit ? -1 : 0);
+    }
+    size_t first = 0;
+    size_t last = 0;
+    if (!list_range(ent->val.size(), start, stop, &first, &last))
+    {
+        return out_int(out, -1);
+    }
+    const uint8_t *data = (const uint8_t *)ent->val.data();
+    int64_t pos = bit_pos(data + first, last - first + 1, bit);
+    if (pos < 0)
+    {
+        // the string is padded with zeros unless the end is given
+        return out_int(out, bit == 0 && cmd.size() < 5 ? (int64_t)(last + 1) * 8 : -1);
+    }
+    return out_int(out, (int64_t)first * 8 + pos);
+}
+
+// bitop and|or|xor|not dst key [key ...], returns the length of dst.
+// the shorter sources are padded with zeros.
+static void do_bitop(std::vector<std::string> &cmd, std::string &out)
+{
+    int op = -1;
+    const char *names[] = {"and", "or", "xor", "not"};
+    for (int i = 0; i < 4; i++)
+    {
+        op = cmd_is(cmd[1], names[i]) ? i : op;
+    }
+    if (op < 0 || (op == BITOP_NOT && cmd.size() != 4))
+    {
+        return out_err(out, ERR_ARG, "expect op");
+    }
+    std::vector<const std::string *> srcs;
+    size_t len = 0;
+    static const std::string k_empty;
+    for (size_t i = 3; i < cmd.size(); i++)
+    {
+        Entry *ent = NULL;
+        if (!bits_lookup(cmd[i], &ent, out))
+        {
+            return;
+        }
+        srcs.push_back(ent ? &ent->val : &k_empty);
+        len = std::max(len, srcs.back()->size());
+    }
+
+    std::string result(*srcs[0]);
+    result.resize(len, '\0');
+    uint8_t *dst = (uint8_t *)&result[0];
+    if (op == BITOP_NOT)
+    {
+        bit_op(op, dst, dst, len);
+    }
+    for (size_t i = 1; i < srcs.size(); i++)
+    {
+        const std::string &src = *srcs[i];
+        bit_op(op, dst, (const uint8_t *)src.data(), src.size());
+        if (op == BITOP_AND)
+        {
+            memset(dst + src.size(), 0, len - src.size());
+        }
+    }
+
+    Entry key;
+    key.key.swap(cmd[2]);
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    HNode *hnode = hm_pop(&g_data.db, &key.node, &entry_eq);
+    if (hnode)
+    {
+        entry_del(container_of(hnode, Entry, node));
+    }
+    if (len > 0)
+    {
+        entry_new(key, T_STR)->val.swap(result);
+    }
+    return out_int(out, (int64_t)len);
+}
+
+enum
+{
+    BF_WRAP = 0,
+    BF_SAT = 1,
+    BF_FAIL = 2,
+};
+
+struct BitfieldOp
+{
+    // get, set or incrby
+    char kind = 0;
+    bool sign = false;
+    uint32_t bits = 0;
+    uint64_t off = 0;
+    int64_t arg = 0;
+    int overflow = BF_WRAP;
+};
+
+// i1..i64 or u1..u63
+static bool bitfield_type(const std::string &s, BitfieldOp &op)
+{
+    int64_t bits = 0;
+    if (s.size() < 2 || (s[0] != 'i' && s[0] != 'u') || !str2int(s.substr(1), bits))
+    {
+        return false;
+    }
+    op.sign = s[0] == 'i';
+    op.bits = (uint32_t)bits;
+    return bits >= 1 && bits <= (op.sign ? 64 : 63);
+}
+
+// a bit offset, or #n for the n-th field of this type
+static bool bitfield_off(const std::string &s, BitfieldOp &op)
+{
+    uint64_t off = 0;
+    bool nth = !s.empty() && s[0] == '#';
+    if (!str2bitoff(nth ? s.substr(1) : s, off))
+    {
+        return false;
+    }
+    op.off = nth ? off * op.bits : off;
+    return op.off + op.bits - 1 <= k_bit_max_offset;
+}
+
+// fit a value into the field, false if it overflows with BF_FAIL
+static bool bitfield_fit(__int128 val, const BitfieldOp &op, int64_t &fit)
+{
+    __int128 one = 1;
+    __int128 lo = op.sign ? -(one << (op.bits - 1)) : 0;
+    __int128 hi = op.sign ? (one << (op.bits - 1)) - 1 : (one << op.bits) - 1;
+    if (val >= lo && val <= hi)
+    {
+        fit = (int64_t)val;
+        return true;
+    }
+    if (op.overflow == BF_FAIL)
+    {
+        return false;
+    }
+    if (op.overflow == BF_SAT)
+    {
+        fit = (int64_t)(val < lo ? lo : hi);
+        return true;
+    }
+    // wrap around by keeping the low bits
+    uint64_t mask = op.bits == 64 ? ~0ULL : (1ULL << op.bits) - 1;
+    uint64_t low = (uint64_t)val & mask;
+    if (op.sign && op.bits < 64 && (low >> (op.bits - 1)) & 1)
+    {
+        low |= ~mask;
+    }
+    fit = (int64_t)low;
+    return true;
+}
+
+// bitfield key [get type offset] [set type offset value] [incrby type offset delta]
+//     [overflow wrap|sat|fail]
+// returns the value of each get, the old value of each set, the new value
+// of each incrby, or nil if the incrby or set failed on overflow.
+static void do_bitfield(std::vector<std::string> &cmd, std::string &out)
+{
+    std::vector<BitfieldOp> ops;
+    int overflow = BF_WRAP;
+    size_t need = 0;
+    for (size_t i = 2; i < cmd.size();)
+    {
+        BitfieldOp op;
+        op.overflow = overflow;
+        if (i + 1 < cmd.size() && cmd_is(cmd[i], "overflow"))
+        {
+            const std::string &mode = cmd[i + 1];
+            overflow = cmd_is(mode, "wrap") ? BF_WRAP : cmd_is(mode, "sat") ? BF_SAT : -1;
+            overflow = cmd_is(mode, "fail") ? BF_FAIL : overflow;
+            if (overflow < 0)
+            {
+                return out_err(out, ERR_ARG, "expect overflow mode");
+            }
+            i += 2;
+            continue;
+        }
+        bool get = i + 2 < cmd.size() && cmd_is(cmd[i], "get");
+        bool set = i + 3 < cmd.size() && cmd_is(cmd[i], "set");
+        bool incr = i + 3 < cmd.size() && cmd_is(cmd[i], "incrby");
+        if (!get && !set && !incr)
+        {
+            return out_err(out, ERR_ARG, "expect bitfield subcommand");
+        }
+        if (!bitfield_type(cmd[i + 1], op))
+        {
+            return out_err(out, ERR_ARG, "expect bitfield type");
+        }
+        if (!bitfield_off(cmd[i + 2], op))
+        {
+            return out_err(out, ERR_ARG, "expect bit offset");
+        }
+        if (!get && !str2int(cmd[i + 3], op.arg))
+        {
+            return out_err(out, ERR_ARG, "expect int");
+        }
+        op.kind = get ? 'g' : set ? 's' : 'i';
+        if (!get)
+        {
+            need = std::max<size_t>(need, (op.off + op.bits + 7) / 8);
+        }
+        ops.push_back(op);
+        i += get ? 3 : 4;
+    }
+
+    Entry *ent = NULL;
+    if (need > 0)
+    {
+        ent = bits_for_write(out, cmd[1], need);
+        if (!ent)
+        {
+            return;
+        }
+    }
+    else if (!bits_lookup(cmd[1], &ent, out))
+    {
+        return;
+    }
+
+    out_arr(out, (uint32_t)ops.size());
+    for (const BitfieldOp &op : ops)
+    {
+        const uint8_t *data = ent ? (const uint8_t *)ent->val.data() : NULL;
+        size_t len = ent ? ent->val.size() : 0;
+        uint64_t raw = bitfield_get(data, len, op.off, op.bits);
+        int64_t cur = (int64_t)raw;
+        if (op.sign && op.bits < 64 && (raw >> (op.bits - 1)) & 1)
+        {
+            cur = (int64_t)(raw | (~0ULL << op.bits));
+        }
+        if (op.kind == 'g')
+        {
+            out_int(out, cur);
+            continue;
+        }
+        __int128 val = op.kind == 's' ? (__int128)op.arg : (__int128)cur + op.arg;
+        int64_t fit = 0;
+        if (!bitfield_fit(val, op, fit))
+        {
+            out_nil(out);
+            continue;
+        }
+        bitfield_set((uint8_t *)&ent->val[0], op.off, op.bits, (uint64_t)fit);
+        out_int(out, op.kind == 's' ? cur : fit);
+    }
+}
+
+// look up the stream, `out` is set if there is none
+static bool expect_stream(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_STREAM)
+    {
+        out_err(out, ERR_TYPE, "expect stream");
+        return false;
+    }
+    return true;
+}
+
+// xadd key [maxlen [~|=] n] id|* field value [field value ...]
+// logged with the ID it got, and the exact length if it trimmed anything
+static void do_xadd(std::vector<std::string> &cmd, std::string &out)
+{
+    size_t i = 2;
+    bool trim = false;
+    bool approx = false;
+    int64_t maxlen = 0;
+    if (cmd_is(cmd[i], "maxlen"))
+    {
+        i++;
+        if (i < cmd.size() && (cmd[i] == "~" || cmd[i] == "="))
+        {
+            approx = cmd[i++] == "~";
+        }
+        if (i >= cmd.size() || !str2int(cmd[i], maxlen) || maxlen < 0)
+        {
+            return out_err(out, ERR_ARG, "expect maxlen");
+        }
+        trim = true;
+        i++;
+    }
+    // the ID and the field-value pairs
+    if (i + 3 > cmd.size() || (cmd.size() - i) % 2 == 0)
+    {
+        return out_err(out, ERR_ARG, "expect field value pairs");
+    }
+    std::string &idstr = cmd[i];
+    StreamID id;
+    if (idstr != "*" && (!sid_parse(idstr, 0, id) || (id.ms == 0 && id.seq == 0)))
+    {
+        return out_err(out, ERR_ARG, "bad id");
+    }
+
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent && ent->type != T_STREAM)
+    {
+        return out_err(out, ERR_TYPE, "expect stream");
+    }
+    Stream tmp;
+    Stream *stream = ent ? ent->stream : &tmp;
+    if (idstr == "*" && !stream_next_id(stream, get_realtime_msec(), id))
+    {
+        return out_err(out, ERR_ARG, "the stream has run out of IDs");
+    }
+    if (idstr != "*" && !sid_less(stream->last, id))
+    {
+        return out_err(out, ERR_ARG, "id not greater than the last one");
+    }
+    if (!ent)
+    {
+        Entry key;
+        key.key = cmd[1];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        ent = entry_new(key, T_STREAM);
+        ent->stream = slab_new<Stream>();
+    }
+    else
+    {
+        entry_before_write(ent);
+    }
+    stream_append(ent->stream, id, &cmd[i + 1], cmd.size() - i - 1);
+    uint64_t removed = trim ? stream_trim(ent->stream, (uint64_t)maxlen, approx) : 0;
+    idstr = sid_str(id);
+    out_str(out, idstr);
+    if (propagating())
+    {
+        std::vector<std::string> argv = {"xadd", ent->key};
+        if (removed)
+        {
+            argv.push_back("maxlen");
+            argv.push_back(std::to_string(ent->stream->size));
+        }
+        argv.insert(argv.end(), cmd.begin() + i, cmd.end());
+        propagate(argv);
+    }
+    // the readers are served after this request
+    if (g_blocking.waiters.count(ent->key))
+    {
+        g_blocking.ready.push_back(ent->key);
+    }
+    if (ent->stream->size == 0)
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+}
+
+// xlen key
+static void do_xlen(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_stream(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, (int64_t)ent->stream->size);
+}
+
+struct StreamOut
+{
+    std::string *out = NULL;
+    uint32_t n = 0;
+};
+
+// [id, [field, value, ...]]
+static bool cb_stream_out(const StreamID &id, const char *fields, uint32_t nfields, void *arg)
+{
+    StreamOut &ctx = *(StreamOut *)arg;
+    std::string &out = *ctx.out;
+    out_arr(out, 2);
+    out_str(out, sid_str(id));
+    out_arr(out, 2 * nfields);
+    const char *p = fields;
+    for (uint32_t i = 0; i < 2 * nfields; i++)
+    {
+        const char *str = NULL;
+        uint32_t len = 0;
+        p = sfield_next(p, &str, &len);
+        out_str(out, str, len);
+    }
+    ctx.n++;
+    return true;
+}
+
+// "-" and "+" are the smallest and the largest IDs, the sequence number
+// defaults to the whole millisecond
+static bool sid_bound(const std::string &s, bool start, StreamID &id)
+{
+    if (s == (start ? "-" : "+"))
+    {
+        id.ms = id.seq = start ? 0 : UINT64_MAX;
+        return true;
+    }
+    return sid_parse(s, start ? 0 : UINT64_MAX, id);
+}
+
+// xrange key start end [count n]
+// xrevrange key end start [count n]
+static void do_xrange(std::vector<std::string> &cmd, std::string &out, bool rev)
+{
+    StreamID start;
+    StreamID end;
+    int64_t count = 0;
+    if (!sid_bound(cmd[rev ? 3 : 2], true, start) || !sid_bound(cmd[rev ? 2 : 3], false, end))
+    {
+        return out_err(out, ERR_ARG, "bad id");
+    }
+    if (cmd.size() == 6 && (!cmd_is(cmd[4], "count") || !str2int(cmd[5], count)))
+    {
+        return out_err(out, ERR_ARG, "expect count");
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_stream(tmp, cmd[1], &ent) || (cmd.size() == 6 && count <= 0))
+    {
+        return !tmp.empty() && tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    StreamOut ctx;
+    ctx.out = &out;
+    out_arr(out, 0);
+    stream_range(ent->stream, start, end, rev, (size_t)count, &cb_stream_out, &ctx);
+    return out_update_arr(out, ctx.n);
+}
+
+// [[key, [entry, ...]], ...] for the streams with entries after their IDs,
+// false if there is none
+static bool xread_reply(
+    const std::vector<std::string> &keys, const std::vector<StreamID> &ids, size_t count, std::string &out)
+{
+    StreamID end;
+    end.ms = end.seq = UINT64_MAX;
+    uint32_t n = 0;
+    out_arr(out, 0);
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        Entry *ent = db_lookup(keys[i]);
+        if (!ent || ent->type != T_STREAM)
+        {
+            continue;
+        }
+        if (ent->tier_len)
+        {
+            tier_load_sync(ent);
+        }
+        if (!sid_less(ids[i], ent->stream->last))
+        {
+            continue;
+        }
+        out_arr(out, 2);
+        out_str(out, keys[i]);
+        size_t pos = out.size();
+        out_arr(out, 0);
+        StreamOut ctx;
+        ctx.out = &out;
+        stream_range(ent->stream, sid_next(ids[i]), end, false, count, &cb_stream_out, &ctx);
+        memcpy(&out[pos + 1], &ctx.n, 4);
+        n++;
+    }
+    out_update_arr(out, n);
+    return n > 0;
+}
+
+// xread [count n] [block ms] streams key [key ...] id [id ...]
+// "$" is the last ID of the stream, block 0 waits forever
+static void do_xread(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t count = 0;
+    int64_t block_ms = -1;
+    size_t i = 1;
+    for (; i + 1 < cmd.size() && !cmd_is(cmd[i], "streams"); i += 2)
+    {
+        bool ok = false;
+        if (cmd_is(cmd[i], "count"))
+        {
+            ok = str2int(cmd[i + 1], count) && count >= 0;
+        }
+        else if (cmd_is(cmd[i], "block"))
+        {
+            ok = str2int(cmd[i + 1], block_ms) && block_ms >= 0;
+        }
+        if (!ok)
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+    size_t nargs = cmd.size() - i - 1;
+    if (i >= cmd.size() || !cmd_is(cmd[i], "streams") || nargs == 0 || nargs % 2)
+    {
+        return out_err(out, ERR_ARG, "expect streams");
+    }
+
+    Blocked *b = new Blocked();
+    b->stream = true;
+    b->count = (size_t)count;
+    for (size_t k = 0; k < nargs / 2; k++)
+    {
+        const std::string &key = cmd[i + 1 + k];
+        const std::string &idstr = cmd[i + 1 + nargs / 2 + k];
+        Entry *ent = db_lookup(key);
+        StreamID id;
+        if (ent && ent->type != T_STREAM)
+        {
+            delete b;
+            return out_err(out, ERR_TYPE, "expect stream");
+        }
+        if (ent && ent->tier_len)
+        {
+            tier_load_sync(ent);
+        }
+        if (idstr == "$")
+        {
+            id = ent ? ent->stream->last : id;
+        }
+        else if (!sid_parse(idstr, 0, id))
+        {
+            delete b;
+            return out_err(out, ERR_ARG, "bad id");
+        }
+        b->keys.push_back(key);
+        b->ids.push_back(id);
+    }
+    if (xread_reply(b->keys, b->ids, b->count, out))
+    {
+        delete b;
+        return;
+    }
+    out.clear();
+    // not blocking, or replaying the AOF or the primary's stream, or in EXEC
+    if (block_ms < 0 || !conn || conn->executing)
+    {
+        delete b;
+        return out_nil(out);
+    }
+    // the reply is deferred
+    block_park(conn, b, (double)block_ms / 1000);
+}
+
+// values n v1 .. vn, or fp32 blob, from cmd[i] on. advances i past it.
+static bool vec_parse(const std::vector<std::string> &cmd, size_t &i, std::vector<float> &vec)
+{
+    if (i + 1 < cmd.size() && cmd_is(cmd[i], "fp32"))
+    {
+        const std::string &blob = cmd[i + 1];
+        if (blob.empty() || blob.size() % 4 || blob.size() / 4 > k_vset_dim_max)
+        {
+            return false;
+        }
+        vec.resize(blob.size() / 4);
+        memcpy(vec.data(), blob.data(), blob.size());
+        i += 2;
+        return true;
+    }
+    int64_t n = 0;
+    if (i + 1 >= cmd.size() || !cmd_is(cmd[i], "values") || !str2int(cmd[i + 1], n)
+        || n <= 0 || n > (int64_t)k_vset_dim_max || i + 2 + n > cmd.size())
+    {
+        return false;
+    }
+    vec.resize((size_t)n);
+    for (int64_t k = 0; k < n; k++)
+    {
+        double val = 0;
+        if (!str2dbl(cmd[i + 2 + k], val) || isinf(val))
+        {
+            return false;
+        }
+        vec[k] = (float)val;
+    }
+    i += 2 + (size_t)n;
+    return true;
+}
+
+// look up the vector set, `out` is set if there is none
+static bool expect_vset(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_VSET)
+    {
+        out_err(out, ERR_TYPE, "expect vector set");
+        return false;
+    }
+    return true;
+}
+
+// vadd key values n v1 .. vn|fp32 blob element [q8] [l2]
+// the options take effect when the set is created
+static void do_vadd(std::vector<std::string> &cmd, std::string &out)
+{
+    size_t i = 2;
+    std::vector<float> vec;
+    if (!vec_parse(cmd, i, vec) || i >= cmd.size())
+    {
+        return out_err(out, ERR_ARG, "expect vector element");
+    }
+    const std::string &name = cmd[i++];
+    bool q8 = false;
+    uint8_t metric = VSET_COSINE;
+    for (; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "q8"))
+        {
+            q8 = true;
+        }
+        else if (cmd_is(cmd[i], "l2"))
+        {
+            metric = VSET_L2;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent && ent->type != T_VSET)
+    {
+        return out_err(out, ERR_TYPE, "expect vector set");
+    }
+    if (ent && ent->vset->dim != vec.size())
+    {
+        return out_err(out, ERR_ARG, "dimension mismatch");
+    }
+    if (!ent)
+    {
+        Entry key;
+        key.key = cmd[1];
+        key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+        ent = entry_new(key, T_VSET);
+        ent->vset = slab_new<VSet>();
+        ent->vset->dim = (uint32_t)vec.size();
+        ent->vset->metric = metric;
+        ent->vset->q8 = q8;
+    }
+    else
+    {
+        entry_before_write(ent);
+    }
+    return out_int(out, vset_add(ent->vset, name.data(), name.size(), vec.data()));
+}
+
+// vrem key element
+static void do_vrem(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_vset(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    if (!vset_lookup(ent->vset, cmd[2].data(), cmd[2].size()))
+    {
+        return out_int(out, 0);
+    }
+    entry_before_write(ent);
+    vset_del(ent->vset, cmd[2].data(), cmd[2].size());
+    if (vset_size(ent->vset) == 0)
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    return out_int(out, 1);
+}
+
+// vcard key, vdim key
+static void do_vcard(std::vector<std::string> &cmd, std::string &out, bool dim)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_vset(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_int(out, 0);
+    }
+    return out_int(out, dim ? ent->vset->dim : (int64_t)vset_size(ent->vset));
+}
+
+// vemb key element
+// the stored vector, normalized for cosine sets and approximate for Q8
+static void do_vemb(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_vset(out, cmd[1], &ent))
+    {
+        return;
+    }
+    VNode *node = vset_lookup(ent->vset, cmd[2].data(), cmd[2].size());
+    if (!node)
+    {
+        return out_nil(out);
+    }
+    std::vector<float> vec(ent->vset->dim);
+    vset_get(ent->vset, node->pos, vec.data());
+    out_arr(out, (uint32_t)vec.size());
+    for (float v : vec)
+    {
+        out_dbl(out, v);
+    }
+}
+
+// vsim key ele element|values n v1 .. vn|fp32 blob [count k] [withscores]
+// the scores are the cosine similarity or the L2 distance, best first
+static void do_vsim(std::vector<std::string> &cmd, std::string &out)
+{
+    size_t i = 2;
+    std::string ele;
+    std::vector<float> vec;
+    if (i + 1 < cmd.size() && cmd_is(cmd[i], "ele"))
+    {
+        ele = cmd[i + 1];
+        i += 2;
+    }
+    else if (!vec_parse(cmd, i, vec))
+    {
+        return out_err(out, ERR_ARG, "expect a vector or an element");
+    }
+    int64_t count = 10;
+    bool withscores = false;
+    for (; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "count") && i + 1 < cmd.size())
+        {
+            if (!str2int(cmd[++i], count) || count <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect count");
+            }
+        }
+        else if (cmd_is(cmd[i], "withscores"))
+        {
+            withscores = true;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_vset(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    VSet *vset = ent->vset;
+    if (!ele.empty())
+    {
+        VNode *node = vset_lookup(vset, ele.data(), ele.size());
+        if (!node)
+        {
+            return out_err(out, ERR_ARG, "element not found");
+        }
+        vec.resize(vset->dim);
+        vset_get(vset, node->pos, vec.data());
+    }
+    if (vec.size() != vset->dim)
+    {
+        return out_err(out, ERR_ARG, "dimension mismatch");
+    }
+
+    std::vector<VHit> hits;
+    vset_search(vset, vec.data(), (size_t)count, &g_data.tp, hits);
+    out_arr(out, (uint32_t)(hits.size() * (withscores ? 2 : 1)));
+    for (const VHit &hit : hits)
+    {
+        VNode *node = vset->nodes[hit.pos];
+        out_str(out, node->name, node->len);
+        if (withscores)
+        {
+            out_dbl(out, hit.score);
+        }
+    }
+}
+
+// look up the Bloom filter, `out` is set if there is none
+static bool expect_bloom(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_BLOOM)
+    {
+        out_err(out, ERR_TYPE, "expect bloom filter");
+        return false;
+    }
+    return true;
+}
+
+static Entry *bloom_new(
+    const std::string &name, double error, uint64_t capacity, uint32_t expansion, bool scaling)
+{
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_new(key, T_BLOOM);
+    ent->bloom = slab_new<Bloom>();
+    bloom_init(ent->bloom, error, capacity, expansion, scaling);
+    return ent;
+}
+
+// bf.reserve key error capacity [expansion n] [nonscaling]
+static void do_bf_reserve(std::vector<std::string> &cmd, std::string &out)
+{
+    double error = 0;
+    int64_t capacity = 0;
+    if (!str2dbl(cmd[2], error) || !(error > 0 && error < 1))
+    {
+        return out_err(out, ERR_ARG, "expect error rate");
+    }
+    if (!str2int(cmd[3], capacity) || capacity <= 0 || capacity > (int64_t)k_bloom_max_capacity)
+    {
+        return out_err(out, ERR_ARG, "expect capacity");
+    }
+    int64_t expansion = 2;
+    bool scaling = true;
+    for (size_t i = 4; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "expansion") && i + 1 < cmd.size())
+        {
+            if (!str2int(cmd[++i], expansion) || expansion <= 0
+                || expansion > (int64_t)k_bloom_max_expansion)
+            {
+                return out_err(out, ERR_ARG, "expect expansion");
+            }
+        }
+        else if (cmd_is(cmd[i], "nonscaling"))
+        {
+            scaling = false;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+    if (db_lookup(cmd[1]))
+    {
+        return out_err(out, ERR_ARG, "key exists");
+    }
+    bloom_new(cmd[1], error, (uint64_t)capacity, (uint32_t)expansion, scaling);
+    return out_nil(out);
+}
+
+// the filter to add to, created with the defaults
+static Entry *bloom_for_add(std::string &out, const std::string &key)
+{
+    Entry *ent = db_lookup(key);
+    if (ent && ent->type != T_BLOOM)
+    {
+        out_err(out, ERR_TYPE, "expect bloom filter");
+        return NULL;
+    }
+    if (!ent)
+    {
+        return bloom_new(key, 0.01, 100, 2, true);
+    }
+    entry_before_write(ent);
+    return ent;
+}
+
+static void out_bloom_add(std::string &out, int added)
+{
+    if (added < 0)
+    {
+        return out_err(out, ERR_ARG, "filter is full");
+    }
+    return out_int(out, added);
+}
+
+// bf.add key item
+static void do_bf_add(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = bloom_for_add(out, cmd[1]);
+    if (!ent)
+    {
+        return;
+    }
+    return out_bloom_add(out, bloom_add(ent->bloom, bloom_hash(cmd[2].data(), cmd[2].size())));
+}
+
+// bf.madd key item1 item2 ...
+static void do_bf_madd(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = bloom_for_add(out, cmd[1]);
+    if (!ent)
+    {
+        return;
+    }
+    size_t n = cmd.size() - 2;
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        hashes[i] = bloom_hash(cmd[2 + i].data(), cmd[2 + i].size());
+    }
+    std::vector<int> added(n);
+    bloom_add_batch(ent->bloom, hashes.data(), n, added.data());
+    out_arr(out, (uint32_t)n);
+    for (int v : added)
+    {
+        out_bloom_add(out, v);
+    }
+}
+
+// bf.exists key item, bf.mexists key item1 item2 ...
+static void do_bf_exists(std::vector<std::string> &cmd, std::string &out, bool multi)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_bloom(tmp, cmd[1], &ent) && tmp[0] == SER_ERR)
+    {
+        return out.swap(tmp);
+    }
+    size_t n = cmd.size() - 2;
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        hashes[i] = bloom_hash(cmd[2 + i].data(), cmd[2 + i].size());
+    }
+    std::vector<uint8_t> found(n, 0);
+    if (ent)
+    {
+        bloom_has_batch(ent->bloom, hashes.data(), n, found.data());
+    }
+    if (!multi)
+    {
+        return out_int(out, found[0]);
+    }
+    out_arr(out, (uint32_t)n);
+    for (uint8_t v : found)
+    {
+        out_int(out, v);
+    }
+}
+
+// bf.info key
+static void do_bf_info(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_bloom(out, cmd[1], &ent))
+    {
+        return;
+    }
+    Bloom *bloom = ent->bloom;
+    uint64_t capacity = 0;
+    for (const BloomLayer &layer : bloom->layers)
+    {
+        capacity += layer.capacity;
+    }
+    out_arr(out, 12);
+    out_str(out, "capacity");
+    out_int(out, (int64_t)capacity);
+    out_str(out, "size");
+    out_int(out, (int64_t)bloom_bytes(bloom));
+    out_str(out, "filters");
+    out_int(out, (int64_t)bloom->layers.size());
+    out_str(out, "items");
+    out_int(out, (int64_t)bloom_count(bloom));
+    out_str(out, "expansion");
+    out_int(out, bloom->scaling ? bloom->expansion : 0);
+    out_str(out, "error");
+    out_dbl(out, bloom->error);
+}
+
+// bf.loadchunk key layer count offset data
+// restores the bits of a filter made by bf.reserve, see bloom_emit(). a chunk
+// of the layer after the last one adds it.
+static void do_bf_loadchunk(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_bloom(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_err(out, ERR_ARG, "no such filter");
+    }
+    Bloom *bloom = ent->bloom;
+    int64_t layer = 0, count = 0, offset = 0;
+    if (!str2int(cmd[2], layer) || layer < 0 || layer > (int64_t)bloom->layers.size()
+        || !str2int(cmd[3], count) || count < 0 || !str2int(cmd[4], offset) || offset < 0)
+    {
+        return out_err(out, ERR_ARG, "bad chunk");
+    }
+    entry_before_write(ent);
+    BloomLayer *dst = layer < (int64_t)bloom->layers.size() ? &bloom->layers[layer] : bloom_grow(bloom);
+    const std::string &data = cmd[5];
+    if ((uint64_t)offset + data.size() > dst->nblocks * k_bloom_block)
+    {
+        return out_err(out, ERR_ARG, "bad chunk");
+    }
+    memcpy(&dst->blocks[offset], data.data(), data.size());
+    dst->count = (uint64_t)count;
+    return out_nil(out);
+}
+
+// the sketch of a T_CMS or a T_TOPK key, `out` is set if there is none
+static CMS *expect_cms(std::string &out, const std::string &key, Entry **ent, uint32_t type)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return NULL;
+    }
+    if ((*ent)->type != type)
+    {
+        out_err(out, ERR_TYPE, type == T_CMS ? "expect count-min sketch" : "expect top-k");
+        return NULL;
+    }
+    return type == T_CMS ? (*ent)->cms : &(*ent)->topk->cms;
+}
+
+static bool cms_dims_ok(int64_t width, int64_t depth)
+{
+    return width > 0 && depth > 0 && depth <= (int64_t)k_cms_max_depth
+        && (uint64_t)width * (uint64_t)depth <= k_cms_max_cells;
+}
+
+static Entry *sketch_new(const std::string &name, uint32_t type)
+{
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    return entry_new(key, type);
+}
+
+// cms.initbydim key width depth, cms.initbyprob key error probability
+// the error is a fraction of the total count, exceeded with the probability
+static void do_cms_init(std::vector<std::string> &cmd, std::string &out, bool byprob)
+{
+    int64_t width = 0, depth = 0;
+    if (byprob)
+    {
+        double error = 0, prob = 0;
+        if (!str2dbl(cmd[2], error) || !(error > 0 && error < 1) || !str2dbl(cmd[3], prob)
+            || !(prob > 0 && prob < 1))
+        {
+            return out_err(out, ERR_ARG, "expect error and probability");
+        }
+        width = (int64_t)ceil(M_E / error);
+        depth = (int64_t)ceil(log(1 / prob));
+    }
+    else if (!str2int(cmd[2], width) || !str2int(cmd[3], depth))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (!cms_dims_ok(width, depth))
+    {
+        return out_err(out, ERR_ARG, "sketch is too large");
+    }
+    if (db_lookup(cmd[1]))
+    {
+        return out_err(out, ERR_ARG, "key exists");
+    }
+    Entry *ent = sketch_new(cmd[1], T_CMS);
+    ent->cms = slab_new<CMS>();
+    cms_init(ent->cms, (uint32_t)width, (uint32_t)depth);
+    return out_nil(out);
+}
+
+static void hash_items(std::vector<std::string> &cmd, size_t first, size_t step,
+                       std::vector<uint64_t> &hashes)
+{
+    for (size_t i = first; i < cmd.size(); i += step)
+    {
+        hashes.push_back(cms_hash(cmd[i].data(), cmd[i].size()));
+    }
+}
+
+// cms.incrby key item incr [item incr ...]
+// replies with the estimates after the increments
+static void do_cms_incrby(std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd.size() % 2)
+    {
+        return out_err(out, ERR_ARG, "expect item increment pairs");
+    }
+    std::vector<uint32_t> incrs;
+    for (size_t i = 3; i < cmd.size(); i += 2)
+    {
+        int64_t incr = 0;
+        if (!str2int(cmd[i], incr) || incr <= 0 || incr > UINT32_MAX)
+        {
+            return out_err(out, ERR_ARG, "expect increment");
+        }
+        incrs.push_back((uint32_t)incr);
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    CMS *cms = expect_cms(tmp, cmd[1], &ent, T_CMS);
+    if (!cms)
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_err(out, ERR_ARG, "no such sketch");
+    }
+    entry_before_write(ent);
+    std::vector<uint64_t> hashes;
+    hash_items(cmd, 2, 2, hashes);
+    std::vector<uint32_t> est(hashes.size());
+    cms_incr_batch(cms, hashes.data(), incrs.data(), hashes.size(), est.data());
+    out_arr(out, (uint32_t)est.size());
+    for (uint32_t v : est)
+    {
+        out_int(out, v);
+    }
+}
+
+// cms.query key item [item ...]
+static void do_cms_query(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    CMS *cms = expect_cms(tmp, cmd[1], &ent, T_CMS);
+    if (!cms && tmp[0] == SER_ERR)
+    {
+        return out.swap(tmp);
+    }
+    std::vector<uint64_t> hashes;
+    hash_items(cmd, 2, 1, hashes);
+    std::vector<uint32_t> est(hashes.size(), 0);
+    if (cms)
+    {
+        cms_query_batch(cms, hashes.data(), hashes.size(), est.data());
+    }
+    out_arr(out, (uint32_t)est.size());
+    for (uint32_t v : est)
+    {
+        out_int(out, v);
+    }
+}
+
+// cms.info key
+static void do_cms_info(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    CMS *cms = expect_cms(out, cmd[1], &ent, T_CMS);
+    if (!cms)
+    {
+        return;
+    }
+    out_arr(out, 6);
+    out_str(out, "width");
+    out_int(out, cms->width);
+    out_str(out, "depth");
+    out_int(out, cms->depth);
+    out_str(out, "count");
+    out_int(out, (int64_t)cms->total);
+}
+
+// cms.loadchunk key total offset data
+// restores the counters of a CMS or a top-k key, see sketch_emit()
+static void do_cms_loadchunk(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent || (ent->type != T_CMS && ent->type != T_TOPK))
+    {
+        return out_err(out, ERR_ARG, "no such sketch");
+    }
+    CMS *cms = ent->type == T_CMS ? ent->cms : &ent->topk->cms;
+    int64_t total = 0, offset = 0;
+    const std::string &data = cmd[4];
+    if (!str2int(cmd[2], total) || total < 0 || !str2int(cmd[3], offset) || offset < 0
+        || offset % 4 || data.size() % 4
+        || (uint64_t)offset + data.size() > cms->counters.size() * 4)
+    {
+        return out_err(out, ERR_ARG, "bad chunk");
+    }
+    entry_before_write(ent);
+    memcpy((char *)cms->counters.data() + offset, data.data(), data.size());
+    cms->total = (uint64_t)total;
+    return out_nil(out);
+}
+
+// topk.reserve key k [width depth]
+static void do_topk_reserve(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t k = 0, width = 2048, depth = 5;
+    if (!str2int(cmd[2], k) || k <= 0 || k > (int64_t)k_topk_max)
+    {
+        return out_err(out, ERR_ARG, "expect k");
+    }
+    if (cmd.size() == 5 && (!str2int(cmd[3], width) || !str2int(cmd[4], depth)))
+    {
+        return out_err(out, ERR_ARG, "expect int");
+    }
+    if (!cms_dims_ok(width, depth))
+    {
+        return out_err(out, ERR_ARG, "sketch is too large");
+    }
+    if (db_lookup(cmd[1]))
+    {
+        return out_err(out, ERR_ARG, "key exists");
+    }
+    Entry *ent = sketch_new(cmd[1], T_TOPK);
+    ent->topk = slab_new<TopK>();
+    topk_init(ent->topk, (uint32_t)k, (uint32_t)width, (uint32_t)depth);
+    return out_nil(out);
+}
+
+// topk.add key item [item ...]
+// replies with the item each one pushed out of the top, or nil
+static void do_topk_add(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_cms(tmp, cmd[1], &ent, T_TOPK))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_err(out, ERR_ARG, "no such sketch");
+    }
+    entry_before_write(ent);
+    TopK *topk = ent->topk;
+    std::vector<uint64_t> hashes;
+    hash_items(cmd, 2, 1, hashes);
+    std::vector<uint32_t> incrs(hashes.size(), 1);
+    std::vector<uint32_t> est(hashes.size());
+    cms_incr_batch(&topk->cms, hashes.data(), incrs.data(), hashes.size(), est.data());
+    out_arr(out, (uint32_t)hashes.size());
+    for (size_t i = 0; i < hashes.size(); i++)
+    {
+        std::string expelled;
+        if (topk_offer(topk, cmd[2 + i].data(), cmd[2 + i].size(), est[i], expelled))
+        {
+            out_str(out, expelled);
+        }
+        else
+        {
+            out_nil(out);
+        }
+    }
+}
+
+// topk.query key item [item ...]
+static void do_topk_query(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_cms(tmp, cmd[1], &ent, T_TOPK) && tmp[0] == SER_ERR)
+    {
+        return out.swap(tmp);
+    }
+    out_arr(out, (uint32_t)(cmd.size() - 2));
+    for (size_t i = 2; i < cmd.size(); i++)
+    {
+        out_int(out, ent && topk_lookup(ent->topk, cmd[i].data(), cmd[i].size()));
+    }
+}
+
+// topk.list key [withcount]
+static void do_topk_list(std::vector<std::string> &cmd, std::string &out)
+{
+    bool withcount = false;
+    if (cmd.size() == 3)
+    {
+        if (!cmd_is(cmd[2], "withcount"))
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+        withcount = true;
+    }
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_cms(tmp, cmd[1], &ent, T_TOPK))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    std::vector<TopKNode *> nodes;
+    topk_list(ent->topk, nodes);
+    out_arr(out, (uint32_t)(nodes.size() * (withcount ? 2 : 1)));
+    for (TopKNode *node : nodes)
+    {
+        out_str(out, node->name, node->len);
+        if (withcount)
+        {
+            out_int(out, (int64_t)topk_count(ent->topk, node));
+        }
+    }
+}
+
+// topk.info key
+static void do_topk_info(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_cms(out, cmd[1], &ent, T_TOPK))
+    {
+        return;
+    }
+    TopK *topk = ent->topk;
+    out_arr(out, 6);
+    out_str(out, "k");
+    out_int(out, topk->k);
+    out_str(out, "width");
+    out_int(out, topk->cms.width);
+    out_str(out, "depth");
+    out_int(out, topk->cms.depth);
+}
+
+// topk.loaditems key item count [item count ...]
+// restores the candidates, see sketch_emit()
+static void do_topk_loaditems(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_cms(tmp, cmd[1], &ent, T_TOPK))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_err(out, ERR_ARG, "no such sketch");
+    }
+    if (cmd.size() % 2)
+    {
+        return out_err(out, ERR_ARG, "expect item count pairs");
+    }
+    entry_before_write(ent);
+    for (size_t i = 2; i < cmd.size(); i += 2)
+    {
+        int64_t count = 0;
+        if (!str2int(cmd[i + 1], count) || count < 0)
+        {
+            return out_err(out, ERR_ARG, "expect count");
+        }
+        topk_load(ent->topk, cmd[i].data(), cmd[i].size(), (uint64_t)count);
+    }
+    return out_nil(out);
+}
+
+// look up the time series, `out` is set if there is none
+static bool expect_series(std::string &out, const std::string &key, Entry **ent)
+{
+    *ent = db_lookup(key);
+    if (!*ent)
+    {
+        out_nil(out);
+        return false;
+    }
+    if ((*ent)->type != T_TS)
+    {
+        out_err(out, ERR_TYPE, "expect time series");
+        return false;
+    }
+    return true;
+}
+
+// [retention ms] from cmd[i] on
+static bool ts_parse_options(std::vector<std::string> &cmd, size_t i, int64_t &retention)
+{
+    for (; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "retention") && i + 1 < cmd.size())
+        {
+            if (!str2int(cmd[++i], retention) || retention < 0)
+            {
+                return false;
+            }
+        }
+        else
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static Entry *series_new(const std::string &name, int64_t retention)
+{
+    Entry key;
+    key.key = name;
+    key.node.hcode = str_hash((uint8_t *)key.key.data(), key.key.size());
+    Entry *ent = entry_new(key, T_TS);
+    ent->series = slab_new<TSeries>();
+    ent->series->retention = retention;
+    return ent;
+}
+
+// ts.create key [retention ms]
+static void do_ts_create(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t retention = 0;
+    if (!ts_parse_options(cmd, 2, retention))
+    {
+        return out_err(out, ERR_ARG, "bad option");
+    }
+    if (db_lookup(cmd[1]))
+    {
+        return out_err(out, ERR_ARG, "key exists");
+    }
+    series_new(cmd[1], retention);
+    return out_nil(out);
+}
+
+// ts.add key timestamp|* value [retention ms]
+// the retention takes effect when the series is created. logs the timestamp
+// it picked for `*`.
+static void do_ts_add(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t ts = 0;
+    double val = 0;
+    int64_t retention = 0;
+    if (cmd[2] == "*")
+    {
+        ts = (int64_t)get_realtime_msec();
+    }
+    else if (!str2int(cmd[2], ts) || ts < 0)
+    {
+        return out_err(out, ERR_ARG, "expect timestamp");
+    }
+    if (!str2dbl(cmd[3], val) || isnan(val))
+    {
+        return out_err(out, ERR_ARG, "expect fp number");
+    }
+    if (!ts_parse_options(cmd, 4, retention))
+    {
+        return out_err(out, ERR_ARG, "bad option");
+    }
+    Entry *ent = db_lookup(cmd[1]);
+    if (ent && ent->type != T_TS)
+    {
+        return out_err(out, ERR_TYPE, "expect time series");
+    }
+    if (ent && !ent->series->chunks.empty() && ts <= ent->series->chunks.back().last_ts)
+    {
+        return out_err(out, ERR_ARG, "timestamp not after the last sample");
+    }
+    if (!ent)
+    {
+        ent = series_new(cmd[1], retention);
+    }
+    else
+    {
+        entry_before_write(ent);
+    }
+    ts_add(ent->series, ts, val);
+    out_int(out, ts);
+    if (propagating())
+    {
+        std::vector<std::string> argv = {"ts.add", ent->key, std::to_string(ts)};
+        argv.insert(argv.end(), cmd.begin() + 3, cmd.end());
+        propagate(argv);
+    }
+}
+
+static bool ts_parse_bound(const std::string &s, int64_t &ts, bool start)
+{
+    if (s == "-" || s == "+")
+    {
+        ts = (s == "-") ? INT64_MIN : INT64_MAX;
+        return (s == "-") == start;
+    }
+    return str2int(s, ts);
+}
+
+// ts.range key from|- to|+ [count n] [aggregation avg|min|max|sum|count bucket_ms]
+static void do_ts_range(std::vector<std::string> &cmd, std::string &out)
+{
+    int64_t from = 0, to = 0;
+    if (!ts_parse_bound(cmd[2], from, true) || !ts_parse_bound(cmd[3], to, false))
+    {
+        return out_err(out, ERR_ARG, "expect timestamp");
+    }
+    int64_t count = INT64_MAX;
+    int64_t bucket = 0;
+    uint32_t agg = TS_AVG;
+    for (size_t i = 4; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "count") && i + 1 < cmd.size())
+        {
+            if (!str2int(cmd[++i], count) || count <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect count");
+            }
+        }
+        else if (cmd_is(cmd[i], "aggregation") && i + 2 < cmd.size())
+        {
+            static const char *k_aggs[] = {"avg", "min", "max", "sum", "count"};
+            agg = 5;
+            for (uint32_t k = 0; k < 5; k++)
+            {
+                agg = cmd_is(cmd[i + 1], k_aggs[k]) ? k : agg;
+            }
+            if (agg == 5 || !str2int(cmd[i + 2], bucket) || bucket <= 0)
+            {
+                return out_err(out, ERR_ARG, "expect aggregation and bucket");
+            }
+            i += 2;
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_series(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_arr(out, 0);
+    }
+    std::vector<TSample> samples;
+    ts_range(ent->series, from, to, bucket, agg, (size_t)count, samples);
+    out_arr(out, (uint32_t)samples.size());
+    for (const TSample &sample : samples)
+    {
+        out_arr(out, 2);
+        out_int(out, sample.ts);
+        out_dbl(out, sample.val);
+    }
+}
+
+// ts.get key
+// the last sample
+static void do_ts_get(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_series(out, cmd[1], &ent))
+    {
+        return;
+    }
+    TSeries *series = ent->series;
+    if (series->chunks.empty())
+    {
+        return out_arr(out, 0);
+    }
+    int64_t last = series->chunks.back().last_ts;
+    std::vector<TSample> samples;
+    ts_range(series, last, last, 0, TS_AVG, 1, samples);
+    out_arr(out, 2);
+    out_int(out, samples[0].ts);
+    out_dbl(out, samples[0].val);
+}
+
+// ts.info key
+static void do_ts_info(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    if (!expect_series(out, cmd[1], &ent))
+    {
+        return;
+    }
+    TSeries *series = ent->series;
+    out_arr(out, 12);
+    out_str(out, "samples");
+    out_int(out, (int64_t)series->size);
+    out_str(out, "chunks");
+    out_int(out, (int64_t)series->chunks.size());
+    out_str(out, "memory");
+    out_int(out, (int64_t)ts_bytes(series));
+    out_str(out, "first");
+    out_int(out, series->chunks.empty() ? 0 : std::max(series->chunks.front().first_ts, ts_cutoff(series)));
+    out_str(out, "last");
+    out_int(out, series->chunks.empty() ? 0 : series->chunks.back().last_ts);
+    out_str(out, "retention");
+    out_int(out, series->retention);
+}
+
+// ts.loadchunk key nbits count data
+// appends a compressed chunk to a series made by ts.create, see series_emit()
+static void do_ts_loadchunk(std::vector<std::string> &cmd, std::string &out)
+{
+    Entry *ent = NULL;
+    std::string tmp;
+    if (!expect_series(tmp, cmd[1], &ent))
+    {
+        return tmp[0] == SER_ERR ? out.swap(tmp) : out_err(out, ERR_ARG, "no such series");
+    }
+    int64_t nbits = 0, count = 0;
+    if (!str2int(cmd[2], nbits) || nbits <= 0 || nbits > UINT32_MAX || !str2int(cmd[3], count)
+        || count <= 0 || count > UINT32_MAX)
+    {
+        return out_err(out, ERR_ARG, "bad chunk");
+    }
+    entry_before_write(ent);
+    if (!ts_load_chunk(ent->series, cmd[4].data(), cmd[4].size(), (uint32_t)nbits, (uint32_t)count))
+    {
+        return out_err(out, ERR_ARG, "bad chunk");
+    }
+    return out_nil(out);
+}
+
+static void do_bgrewriteaof(std::vector<std::string> &cmd, std::string &out);
+static void do_save(std::vector<std::string> &cmd, std::string &out);
+static void do_bgsave(std::vector<std::string> &cmd, std::string &out);
+
+static void do_cluster(Conn *conn, std::vector<std::string> &cmd, std::string &out);
+static void do_tier(std::vector<std::string> &cmd, std::string &out);
+static void do_defrag(std::vector<std::string> &cmd, std::string &out);
+static void do_psync(Conn *conn, std::vector<std::string> &cmd, std::string &out);
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool pattern);
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool pattern);
+static void do_publish(std::vector<std::string> &cmd, std::string &out);
+static void do_client(Conn *conn, std::vector<std::string> &cmd, std::string &out);
+static void tracking_remember(Conn *conn, const std::string &key);
+static void do_eval(std::vector<std::string> &cmd, std::string &out, bool sha);
+static void do_script(std::vector<std::string> &cmd, std::string &out);
+static void do_multi(Conn *conn, std::string &out);
+static void do_exec(Conn *conn, std::string &out);
+static void do_discard(Conn *conn, std::string &out);
+static void do_watch(Conn *conn, std::vector<std::string> &cmd, std::string &out);
+static void do_unwatch(Conn *conn, std::string &out);
+static void do_replicaof(std::vector<std::string> &cmd, std::string &out);
+static void do_role(std::vector<std::string> &cmd, std::string &out);
+
+static void do_command(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd.size() == 1 && cmd_is(cmd[0], "keys"))
+    {
+        do_keys(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "get"))
+    {
+        do_get(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "set"))
+    {
+        do_set(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "del"))
+    {
+        do_del(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpire"))
+    {
+        do_expire(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "pexpireat"))
+    {
+        do_expireat(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "pttl"))
+    {
+        do_ttl(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd_is(cmd[0], "zadd"))
+    {
+        do_zadd(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zrem"))
+    {
+        do_zrem(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "zscore"))
+    {
+        do_zscore(cmd, out);
+    }
+    else if (cmd.size() == 6 && cmd_is(cmd[0], "zquery"))
+    {
+        do_zquery(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgrewriteaof"))
+    {
+        do_bgrewriteaof(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "ping"))
+    {
+        out_str(out, "pong");
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "subscribe"))
+    {
+        do_subscribe(conn, cmd, out, false);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "psubscribe"))
+    {
+        do_subscribe(conn, cmd, out, true);
+    }
+    else if (cmd_is(cmd[0], "unsubscribe"))
+    {
+        do_unsubscribe(conn, cmd, out, false);
+    }
+    else if (cmd_is(cmd[0], "punsubscribe"))
+    {
+        do_unsubscribe(conn, cmd, out, true);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "publish"))
+    {
+        do_publish(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "client"))
+    {
+        do_client(conn, cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "eval"))
+    {
+        do_eval(cmd, out, false);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "evalsha"))
+    {
+        do_eval(cmd, out, true);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "script"))
+    {
+        do_script(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "multi"))
+    {
+        do_multi(conn, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "exec"))
+    {
+        do_exec(conn, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "discard"))
+    {
+        do_discard(conn, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "watch"))
+    {
+        do_watch(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "unwatch"))
+    {
+        do_unwatch(conn, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "psync"))
+    {
+        do_psync(conn, cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "replicaof"))
+    {
+        do_replicaof(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "role"))
+    {
+        do_role(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "cluster"))
+    {
+        do_cluster(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "asking"))
+    {
+        if (conn)
+        {
+            conn->asking = true;
+        }
+        out_nil(out);
+    }
+    else if (cmd.size() >= 4 && cmd.size() % 2 == 0 && cmd_is(cmd[0], "hset"))
+    {
+        do_hset(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "hget"))
+    {
+        do_hget(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "hmget"))
+    {
+        do_hmget(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "hdel"))
+    {
+        do_hdel(cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "hincrby"))
+    {
+        do_hincrby(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "hlen"))
+    {
+        do_hlen(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "hgetall"))
+    {
+        do_hgetall(cmd, out);
+    }
+    else if ((cmd.size() == 3 || cmd.size() == 4) && cmd_is(cmd[0], "hscan"))
+    {
+        do_hscan(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "lpush"))
+    {
+        do_push(cmd, out, true);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "rpush"))
+    {
+        do_push(cmd, out, false);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "lpop"))
+    {
+        do_pop(cmd, out, true);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "rpop"))
+    {
+        do_pop(cmd, out, false);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "lrange"))
+    {
+        do_lrange(cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "ltrim"))
+    {
+        do_ltrim(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "llen"))
+    {
+        do_llen(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "blpop"))
+    {
+        do_bpop(conn, cmd, out, true);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "brpop"))
+    {
+        do_bpop(conn, cmd, out, false);
+    }
+    else if (cmd.size() >= 5 && cmd_is(cmd[0], "geoadd"))
+    {
+        do_geoadd(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "geopos"))
+    {
+        do_geopos(cmd, out);
+    }
+    else if ((cmd.size() == 4 || cmd.size() == 5) && cmd_is(cmd[0], "geodist"))
+    {
+        do_geodist(cmd, out);
+    }
+    else if (cmd.size() >= 6 && cmd_is(cmd[0], "geosearch"))
+    {
+        do_geosearch(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "bf.reserve"))
+    {
+        do_bf_reserve(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "bf.add"))
+    {
+        do_bf_add(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "bf.madd"))
+    {
+        do_bf_madd(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "bf.exists"))
+    {
+        do_bf_exists(cmd, out, false);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "bf.mexists"))
+    {
+        do_bf_exists(cmd, out, true);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "bf.info"))
+    {
+        do_bf_info(cmd, out);
+    }
+    else if (cmd.size() == 6 && cmd_is(cmd[0], "bf.loadchunk"))
+    {
+        do_bf_loadchunk(cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "cms.initbydim"))
+    {
+        do_cms_init(cmd, out, false);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "cms.initbyprob"))
+    {
+        do_cms_init(cmd, out, true);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "cms.incrby"))
+    {
+        do_cms_incrby(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "cms.query"))
+    {
+        do_cms_query(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "cms.info"))
+    {
+        do_cms_info(cmd, out);
+    }
+    else if (cmd.size() == 5 && cmd_is(cmd[0], "cms.loadchunk"))
+    {
+        do_cms_loadchunk(cmd, out);
+    }
+    else if ((cmd.size() == 3 || cmd.size() == 5) && cmd_is(cmd[0], "topk.reserve"))
+    {
+        do_topk_reserve(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "topk.add"))
+    {
+        do_topk_add(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "topk.query"))
+    {
+        do_topk_query(cmd, out);
+    }
+    else if ((cmd.size() == 2 || cmd.size() == 3) && cmd_is(cmd[0], "topk.list"))
+    {
+        do_topk_list(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "topk.info"))
+    {
+        do_topk_info(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "topk.loaditems"))
+    {
+        do_topk_loaditems(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "ts.create"))
+    {
+        do_ts_create(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "ts.add"))
+    {
+        do_ts_add(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "ts.range"))
+    {
+        do_ts_range(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "ts.get"))
+    {
+        do_ts_get(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "ts.info"))
+    {
+        do_ts_info(cmd, out);
+    }
+    else if (cmd.size() == 5 && cmd_is(cmd[0], "ts.loadchunk"))
+    {
+        do_ts_loadchunk(cmd, out);
+    }
+    else if (cmd.size() >= 5 && cmd_is(cmd[0], "vadd"))
+    {
+        do_vadd(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "vrem"))
+    {
+        do_vrem(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "vsim"))
+    {
+        do_vsim(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "vcard"))
+    {
+        do_vcard(cmd, out, false);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "vdim"))
+    {
+        do_vcard(cmd, out, true);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "vemb"))
+    {
+        do_vemb(cmd, out);
+    }
+    else if (cmd.size() >= 5 && cmd_is(cmd[0], "xadd"))
+    {
+        do_xadd(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "xlen"))
+    {
+        do_xlen(cmd, out);
+    }
+    else if ((cmd.size() == 4 || cmd.size() == 6) && cmd_is(cmd[0], "xrange"))
+    {
+        do_xrange(cmd, out, false);
+    }
+    else if ((cmd.size() == 4 || cmd.size() == 6) && cmd_is(cmd[0], "xrevrange"))
+    {
+        do_xrange(cmd, out, true);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "xread"))
+    {
+        do_xread(conn, cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "info"))
+    {
+        do_info(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "defrag"))
+    {
+        do_defrag(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "tier") && cmd_is(cmd[1], "stats"))
+    {
+        do_tier(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "sadd"))
+    {
+        do_sadd(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "srem"))
+    {
+        do_srem(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "sismember"))
+    {
+        do_sismember(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "smismember"))
+    {
+        do_smismember(cmd, out);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[0], "scard"))
+    {
+        do_scard(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "sinter"))
+    {
+        do_sinter(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "sintercard"))
+    {
+        do_sintercard(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[0], "sunionstore"))
+    {
+        do_sunionstore(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "append"))
+    {
+        do_append(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfadd"))
+    {
+        do_pfadd(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfcount"))
+    {
+        do_pfcount(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "pfmerge"))
+    {
+        do_pfmerge(cmd, out);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[0], "setbit"))
+    {
+        do_setbit(cmd, out);
+    }
+    else if (cmd.size() == 3 && cmd_is(cmd[0], "getbit"))
+    {
+        do_getbit(cmd, out);
+    }
+    else if ((cmd.size() == 2 || cmd.size() == 4) && cmd_is(cmd[0], "bitcount"))
+    {
+        do_bitcount(cmd, out);
+    }
+    else if (cmd.size() >= 3 && cmd.size() <= 5 && cmd_is(cmd[0], "bitpos"))
+    {
+        do_bitpos(cmd, out);
+    }
+    else if (cmd.size() >= 4 && cmd_is(cmd[0], "bitop"))
+    {
+        do_bitop(cmd, out);
+    }
+    else if (cmd.size() >= 2 && cmd_is(cmd[0], "bitfield"))
+    {
+        do_bitfield(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "save"))
+    {
+        do_save(cmd, out);
+    }
+    else if (cmd.size() == 1 && cmd_is(cmd[0], "bgsave"))
+    {
+        do_bgsave(cmd, out);
+    }
+    else
+    {
+        out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    }
+}
+
+static bool cmd_is_write(const std::string &word)
+{
+    static const char *k_writes[] = {
+        "set", "del", "zadd", "zrem", "pexpire", "pexpireat", "hset", "hdel", "hincrby",
+        "lpush", "rpush", "lpop", "rpop", "ltrim", "blpop", "brpop",
+        "sadd", "srem", "sunionstore", "append", "pfadd", "pfmerge",
+        "setbit", "bitop", "bitfield", "xadd", "geoadd", "vadd", "vrem",
+        "bf.reserve", "bf.add", "bf.madd", "bf.loadchunk",
+        "cms.initbydim", "cms.initbyprob", "cms.incrby", "cms.loadchunk",
+        "topk.reserve", "topk.add", "topk.loaditems",
+        "ts.create", "ts.add", "ts.loadchunk",
+    };
+    for (const char *name : k_writes)
+    {
+        if (cmd_is(word, name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the wire format of a request, which is also the record format of the AOF
+static void cmd_serialize(std::string &out, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + (uint32_t)s.size();
+    }
+    out.append((char *)&len, 4);
+    uint32_t n = (uint32_t)cmd.size();
+    out.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t sz = (uint32_t)s.size();
+        out.append((char *)&sz, 4);
+        out.append(s);
+    }
+}
+
+// whether mutations are recorded for the AOF or the replicas
+static bool propagating()
+{
+    return g_data.aof.fd >= 0 || !g_data.repl.backlog.empty();
+}
+
+// feed a mutation into the AOF and the replication stream
+static void propagate(std::vector<std::string> &cmd)
+{
+    AOF &aof = g_data.aof;
+    if (!propagating())
+    {
+        return;
+    }
+
+    // relative TTLs are logged as absolute deadlines, or a replay would extend them
+    int64_t ttl_ms = 0;
+    if (cmd_is(cmd[0], "pexpire") && str2int(cmd[2], ttl_ms) && ttl_ms >= 0)
+    {
+        cmd[0] = "pexpireat";
+        cmd[2] = std::to_string(get_realtime_msec() + ttl_ms);
+    }
+
+    std::string rec;
+    cmd_serialize(rec, cmd);
+    if (aof.fd >= 0)
+    {
+        aof.buf.append(rec);
+        if (aof.child > 0)
+        {
+            aof.rewrite_buf.append(rec);
+        }
+    }
+    if (!g_data.repl.backlog.empty())
+    {
+        g_data.repl.batch.append(rec);
+    }
+}
+
+// MULTI and EXEC records around the writes of a transaction or a script. the
+// ones of a script run by EXEC are left out, the replay doesn't nest them.
+static void propagate_marker(const char *name)
+{
+    static uint32_t depth = 0;
+    bool multi = 0 == strcmp(name, "multi");
+    if (multi ? depth++ > 0 : --depth > 0)
+    {
+        return;
+    }
+    std::vector<std::string> cmd = {name};
+    propagate(cmd);
+}
+
+static bool cluster_route(const std::string &key, bool write, bool asking, std::string &out);
+
+static bool cluster_route_keys(const std::vector<std::string> &cmd, const std::vector<size_t> &keys,
+                               bool write, bool asking, std::string &out);
+
+const size_t k_max_queued = 1 << 16;
+
+static void multi_queue(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    if (conn->multi_queue.size() >= k_max_queued)
+    {
+        // EXEC will fail
+        conn->multi_failed = true;
+        return out_err(out, ERR_2BIG, "too many queued commands");
+    }
+    conn->multi_queue.push_back(std::vector<std::string>());
+    conn->multi_queue.back().swap(cmd);
+    out_str(out, "queued");
+}
+
+static bool conn_subscribed(Conn *conn)
+{
+    return !conn->channels.empty() || !conn->patterns.empty();
+}
+
+static void do_request(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    // a request without any arguments
+    if (cmd.empty())
+    {
+        return out_err(out, ERR_UNKNOWN, "Unknown cmd");
+    }
+
+    // the replies of a subscriber are mixed with its messages
+    if (conn && conn_subscribed(conn) && !cmd_is(cmd[0], "subscribe")
+        && !cmd_is(cmd[0], "psubscribe") && !cmd_is(cmd[0], "unsubscribe")
+        && !cmd_is(cmd[0], "punsubscribe") && !cmd_is(cmd[0], "ping"))
+    {
+        return out_err(out, ERR_ARG, "only (P)SUBSCRIBE, (P)UNSUBSCRIBE and PING while subscribed");
+    }
+
+    // the keys may belong to another server in cluster mode
+    bool keyed = cmd.size() >= 2 && cmd_has_key(cmd[0]);
+    bool write = cmd_is_write(cmd[0]);
+    bool asking = conn && conn->asking;
+    if (conn)
+    {
+        conn->asking = false;
+    }
+    if (conn && g_data.cluster.enabled && !conn->import_link)
+    {
+        // a script declares its keys after the key count
+        std::vector<size_t> keys;
+        cmd_route_keys(cmd, keys);
+        bool scripted = cmd.size() >= 3 && (cmd_is(cmd[0], "eval") || cmd_is(cmd[0], "evalsha"));
+        if (scripted)
+        {
+            g_scripts.asking = asking;
+        }
+        // a script may write any of its keys
+        if (!cluster_route_keys(cmd, keys, write || scripted, asking, out))
+        {
+            return;
+        }
+    }
+
+    if (write && !g_data.repl.primary_host.empty() && !g_data.repl.applying && conn)
+    {
+        return out_err(out, ERR_READONLY, "read-only replica");
+    }
+
+    // in a transaction, the commands wait for EXEC
+    if (conn && conn->multi && !cmd_is(cmd[0], "exec") && !cmd_is(cmd[0], "discard")
+        && !cmd_is(cmd[0], "multi") && !cmd_is(cmd[0], "watch") && !cmd_is(cmd[0], "unwatch"))
+    {
+        return multi_queue(conn, cmd, out);
+    }
+
+    // clients are parked until a spilled value is read back, the others wait here
+    std::string tier_key;
+    if (keyed && g_tier.enabled)
+    {
+        tier_key = cmd[1];
+        Entry *ent = db_lookup(tier_key);
+        if (ent && ent->tier_len && !cmd_is_valueless(cmd[0]))
+        {
+            tier_load_sync(ent);
+        }
+    }
+
+    // the keys read by a tracking client. the keys a write reads, like the
+    // sources of BITOP or SUNIONSTORE, aren't tracked: the reply has no values
+    std::vector<std::string> read_keys;
+    if (!write && conn && conn->tracking && !conn->tracking_bcast)
+    {
+        std::vector<size_t> keys;
+        cmd_keys(cmd, keys);
+        for (size_t i : keys)
+        {
+            read_keys.push_back(cmd[i]);
+        }
+    }
+
+    // the handlers consume their arguments, so keep a copy of mutations
+    std::vector<std::string> argv;
+    // blocking pops log the plain pop they end up doing, XADD and TS.ADD log the
+    // ID or the timestamp they picked
+    bool self_logged = cmd_is(cmd[0], "blpop") || cmd_is(cmd[0], "brpop") || cmd_is(cmd[0], "xadd")
+                       || cmd_is(cmd[0], "ts.add");
+    bool logged = write && propagating() && !self_logged;
+    if (logged)
+    {
+        argv = cmd;
+    }
+    do_command(conn, cmd, out);
+    if (!tier_key.empty())
+    {
+        Entry *ent = db_lookup(tier_key);
+        if (ent)
+        {
+            tier_touch(ent);
+        }
+    }
+    if (logged && out[0] != SER_ERR)
+    {
+        propagate(argv);
+    }
+    for (const std::string &key : read_keys)
+    {
+        if (!out.empty() && out[0] != SER_ERR)
+        {
+            tracking_remember(conn, key);
+        }
+    }
+}
+
+// MULTI/EXEC: EXEC runs the commands queued after MULTI back to back, and
+// replies with an array of their replies. nothing else runs in between, but
+// nothing is rolled back either: a command that fails leaves an error in the
+// array and the next ones still run.
+//
+// WATCH: EXEC runs nothing if a watched key was written since, it compares
+// the version of the entry with the one seen by WATCH.
+const uint64_t k_watch_missing = (uint64_t)-1;
+
+static uint64_t watch_version(const std::string &key)
+{
+    Entry *ent = db_lookup(key);
+    return ent ? ent->version : k_watch_missing;
+}
+
+static void watch_clear(Conn *conn)
+{
+    if (!conn->watched.empty())
+    {
+        g_watch.nwatching--;
+    }
+    conn->watched.clear();
+    conn->watch_dirty = false;
+}
+
+static void do_multi(Conn *conn, std::string &out)
+{
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (conn->multi)
+    {
+        return out_err(out, ERR_ARG, "MULTI inside MULTI");
+    }
+    conn->multi = true;
+    out_nil(out);
+}
+
+static void do_exec(Conn *conn, std::string &out)
+{
+    if (!conn || !conn->multi)
+    {
+        return out_err(out, ERR_ARG, "EXEC without MULTI");
+    }
+    std::vector<std::vector<std::string>> queue;
+    queue.swap(conn->multi_queue);
+    bool failed = conn->multi_failed;
+    conn->multi = false;
+    conn->multi_failed = false;
+    bool dirty = conn->watch_dirty;
+    for (auto &w : conn->watched)
+    {
+        dirty = dirty || watch_version(w.first) != w.second;
+    }
+    watch_clear(conn);
+    if (failed)
+    {
+        return out_err(out, ERR_2BIG, "too many queued commands, nothing was run");
+    }
+    // a watched key has changed
+    if (dirty)
+    {
+        return out_nil(out);
+    }
+
+    // the writes are propagated as one unit, a script may write
+    bool writes = false;
+    for (std::vector<std::string> &cmd : queue)
+    {
+        writes = writes || cmd_is_write(cmd[0]) || cmd_is(cmd[0], "eval") || cmd_is(cmd[0], "evalsha");
+    }
+    if (writes)
+    {
+        propagate_marker("multi");
+    }
+    out_arr(out, (uint32_t)queue.size());
+    conn->executing = true;
+    for (std::vector<std::string> &cmd : queue)
+    {
+        std::string reply;
+        do_request(conn, cmd, reply);
+        out.append(reply);
+    }
+    conn->executing = false;
+    if (writes)
+    {
+        propagate_marker("exec");
+    }
+}
+
+// apply a record from the AOF or from the primary
+static void replay_record(Replay &rp, std::vector<std::string> &cmd)
+{
+    bool marker = cmd.size() == 1 && (cmd_is(cmd[0], "multi") || cmd_is(cmd[0], "exec"));
+    if (marker && cmd_is(cmd[0], "multi"))
+    {
+        rp.in_txn = true;
+        rp.txn.clear();
+        return;
+    }
+    if (rp.in_txn && !marker)
+    {
+        rp.txn.push_back(std::vector<std::string>());
+        rp.txn.back().swap(cmd);
+        return;
+    }
+    std::string out;
+    if (!marker)
+    {
+        return do_request(NULL, cmd, out);
+    }
+    // a stray EXEC applies nothing
+    std::vector<std::vector<std::string>> txn;
+    txn.swap(rp.txn);
+    rp.in_txn = false;
+    if (!txn.empty())
+    {
+        propagate_marker("multi");
+    }
+    for (std::vector<std::string> &queued : txn)
+    {
+        out.clear();
+        do_request(NULL, queued, out);
+    }
+    if (!txn.empty())
+    {
+        propagate_marker("exec");
+    }
+}
+
+static void do_discard(Conn *conn, std::string &out)
+{
+    if (!conn || !conn->multi)
+    {
+        return out_err(out, ERR_ARG, "DISCARD without MULTI");
+    }
+    conn->multi_queue.clear();
+    conn->multi = false;
+    conn->multi_failed = false;
+    watch_clear(conn);
+    out_nil(out);
+}
+
+// watch key [key ...]
+static void do_watch(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (conn->multi)
+    {
+        return out_err(out, ERR_ARG, "WATCH inside MULTI");
+    }
+    if (conn->watched.empty())
+    {
+        g_watch.nwatching++;
+    }
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        conn->watched.push_back({cmd[i], watch_version(cmd[i])});
+    }
+    out_nil(out);
+}
+
+static void do_unwatch(Conn *conn, std::string &out)
+{
+    if (conn)
+    {
+        watch_clear(conn);
+    }
+    out_nil(out);
+}
+
+// commands that can't run inside a script
+static bool script_denied(const std::string &word)
+{
+    static const char *k_denied[] = {"eval", "evalsha", "script", "replicaof", "psync"};
+    for (const char *name : k_denied)
+    {
+        if (cmd_is(word, name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// a reply as a script value, false if the arrays take too much memory
+static bool script_value(ScriptRun *run, const char *&cur, SValue &val)
+{
+    uint8_t type = (uint8_t)*cur++;
+    uint32_t len = 0;
+    switch (type)
+    {
+    case SER_STR:
+        memcpy(&len, cur, 4);
+        val.type = SV_STR;
+        val.s.assign(cur + 4, len);
+        cur += 4 + len;
+        return true;
+    case SER_INT:
+        val.type = SV_INT;
+        memcpy(&val.i, cur, 8);
+        cur += 8;
+        return true;
+    case SER_DBL:
+        val.type = SV_DBL;
+        memcpy(&val.d, cur, 8);
+        cur += 8;
+        return true;
+    case SER_ARR:
+        memcpy(&len, cur, 4);
+        cur += 4;
+        val.type = SV_ARR;
+        val.arr = script_new_arr(run, (size_t)len * sizeof(SValue));
+        if (!val.arr)
+        {
+            return false;
+        }
+        val.arr->resize(len);
+        for (SValue &item : *val.arr)
+        {
+            if (!script_value(run, cur, item))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    val.type = SV_NIL;
+    return true;
+}
+
+// call() from a script: the command runs like a request without a client, so
+// its writes are logged and replicated, not the EVAL. they go between MULTI
+// and EXEC records, a replay applies all of them or none.
+static bool script_call(ScriptRun *run, std::vector<std::string> &cmd, SValue &ret, std::string &err)
+{
+    int32_t &code = *(int32_t *)run->arg;
+    if (script_denied(cmd[0]))
+    {
+        err = "not allowed in a script";
+        return false;
+    }
+    if (cmd_is_write(cmd[0]) && !g_data.repl.primary_host.empty() && !g_data.repl.applying)
+    {
+        code = ERR_READONLY;
+        err = "read-only replica";
+        return false;
+    }
+    std::string out;
+    if (g_data.cluster.enabled)
+    {
+        // only the declared keys are routed before the script runs
+        std::vector<size_t> keys;
+        cmd_keys(cmd, keys);
+        for (size_t i : keys)
+        {
+            if (std::find(run->keys.begin(), run->keys.end(), cmd[i]) == run->keys.end())
+            {
+                err = "the key " + cmd[i] + " is not in KEYS";
+                return false;
+            }
+        }
+        cluster_route_keys(cmd, keys, cmd_is_write(cmd[0]), g_scripts.asking, out);
+    }
+    if (out.empty())
+    {
+        if (!g_scripts.txn && cmd_is_write(cmd[0]) && propagating())
+        {
+            propagate_marker("multi");
+            g_scripts.txn = true;
+        }
+        do_request(NULL, cmd, out);
+    }
+    if (!out.empty() && out[0] == SER_ERR)
+    {
+        // the script fails with the error of the command
+        uint32_t len = 0;
+        memcpy(&code, &out[1], 4);
+        memcpy(&len, &out[5], 4);
+        err.assign(&out[9], len);
+        return false;
+    }
+    const char *cur = out.empty() ? "" : out.data();
+    if (!script_value(run, cur, ret))
+    {
+        err = "out of memory";
+        return false;
+    }
+    return true;
+}
+
+// the value returned by a script as the reply, true is 1 and false is nil
+static bool script_reply(const SValue &val, std::string &out, uint32_t depth)
+{
+    switch (val.type)
+    {
+    case SV_BOOL:
+        return val.b ? (out_int(out, 1), true) : (out_nil(out), true);
+    case SV_INT:
+        out_int(out, val.i);
+        return true;
+    case SV_DBL:
+        out_dbl(out, val.d);
+        return true;
+    case SV_STR:
+        out_str(out, val.s);
+        return true;
+    case SV_ARR:
+        // an array can hold itself
+        if (depth >= 32)
+        {
+            return false;
+        }
+        out_arr(out, (uint32_t)val.arr->size());
+        for (const SValue &item : *val.arr)
+        {
+            if (!script_reply(item, out, depth + 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    out_nil(out);
+    return true;
+}
+
+// the script of the source, compiled on the first use
+static Script *script_load(const std::string &src, std::string &sha, std::string &out)
+{
+    sha = script_sha1(src);
+    auto it = g_scripts.cache.find(sha);
+    if (it != g_scripts.cache.end())
+    {
+        return it->second;
+    }
+    std::string err;
+    Script *script = script_compile(src, err);
+    if (!script)
+    {
+        out_err(out, ERR_SCRIPT, err);
+        return NULL;
+    }
+    g_scripts.cache[sha] = script;
+    return script;
+}
+
+// eval script numkeys [key ...] [arg ...]
+// evalsha sha1 numkeys [key ...] [arg ...]
+static void do_eval(std::vector<std::string> &cmd, std::string &out, bool sha)
+{
+    size_t nkeys = 0;
+    if (!script_keys(cmd, nkeys))
+    {
+        return out_err(out, ERR_ARG, "expect the number of keys");
+    }
+    Script *script = NULL;
+    if (sha)
+    {
+        std::string name = cmd[1];
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        auto it = g_scripts.cache.find(name);
+        if (it == g_scripts.cache.end())
+        {
+            return out_err(out, ERR_NOSCRIPT, "no such script, use EVAL");
+        }
+        script = it->second;
+    }
+    else
+    {
+        std::string name;
+        script = script_load(cmd[1], name, out);
+        if (!script)
+        {
+            return;
+        }
+    }
+
+    int32_t code = ERR_SCRIPT;
+    ScriptRun run;
+    run.keys.assign(cmd.begin() + 3, cmd.begin() + 3 + nkeys);
+    run.argv.assign(cmd.begin() + 3 + nkeys, cmd.end());
+    run.budget = g_scripts.budget;
+    run.call = &script_call;
+    run.arg = &code;
+    SValue ret;
+    std::string err;
+    // the writes done before a failure stay, there is no rollback
+    bool ok = script_run(script, &run, ret, err);
+    if (g_scripts.txn)
+    {
+        propagate_marker("exec");
+        g_scripts.txn = false;
+    }
+    if (!ok)
+    {
+        g_scripts.nkilled += run.out_of_budget;
+        out_err(out, code, err);
+    }
+    else if (!script_reply(ret, out, 0))
+    {
+        out.clear();
+        out_err(out, ERR_SCRIPT, "the reply is nested too deep");
+    }
+    script_run_dispose(&run);
+}
+
+// script load source | script exists sha1 [sha1 ...] | script flush
+static void do_script(std::vector<std::string> &cmd, std::string &out)
+{
+    if (cmd.size() == 3 && cmd_is(cmd[1], "load"))
+    {
+        std::string sha;
+        if (script_load(cmd[2], sha, out))
+        {
+            out_str(out, sha);
+        }
+    }
+    else if (cmd.size() >= 3 && cmd_is(cmd[1], "exists"))
+    {
+        out_arr(out, (uint32_t)(cmd.size() - 2));
+        for (size_t i = 2; i < cmd.size(); i++)
+        {
+            std::transform(cmd[i].begin(), cmd[i].end(), cmd[i].begin(), ::tolower);
+            out_int(out, g_scripts.cache.count(cmd[i]));
+        }
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[1], "flush"))
+    {
+        for (auto &kv : g_scripts.cache)
+        {
+            script_free(kv.second);
+        }
+        g_scripts.cache.clear();
+        out_nil(out);
+    }
+    else
+    {
+        out_err(out, ERR_ARG, "expect LOAD, EXISTS or FLUSH");
+    }
+}
+
+// shortest representation that parses back to the same value
+static std::string dbl2str(double val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", val);
+    if (strtod(buf, NULL) != val)
+    {
+        snprintf(buf, sizeof(buf), "%.17g", val);
+    }
+    return buf;
+}
+
+// state of the rewrite child
+struct RewriteCtx
+{
+    int fd = -1;
+    std::string buf;
+    uint64_t now_us = 0;
+    uint64_t now_ms = 0;
+    bool err = false;
+};
+
+static void rewrite_flush(RewriteCtx &ctx)
+{
+    if (!ctx.err && 0 != write_all(ctx.fd, ctx.buf.data(), ctx.buf.size()))
+    {
+        ctx.err = true;
+    }
+    ctx.buf.clear();
+}
+
+// emit a zset from `znode` on as variadic ZADDs, each one fits into a single
+// request. stops after about `budget` bytes and returns the next node to emit.
+static ZNode *zset_emit(
+    std::string &buf, const std::string &key, ZNode *znode, size_t budget, uint64_t &ncmds)
+{
+    std::vector<std::string> cmd = {"zadd", key};
+    size_t len = 4 + (4 + 4) + (4 + key.size());
+    size_t start = buf.size();
+    while (znode)
+    {
+        std::string score = dbl2str(znode->score);
+        size_t added = 4 + score.size() + 4 + znode->len;
+        if (cmd.size() > 2 && (len + added > k_max_msg || cmd.size() + 2 > k_max_args))
+        {
+            cmd_serialize(buf, cmd);
+            ncmds++;
+            cmd.resize(2);
+            len = 4 + (4 + 4) + (4 + key.size());
+            if (buf.size() - start >= budget)
+            {
+                return znode;
+            }
+        }
+        cmd.push_back(score);
+        cmd.push_back(std::string(znode->name, znode->len));
+        len += added;
+        znode = container_of(avl_offset(&znode->tree, 1), ZNode, tree);
+    }
+    if (cmd.size() > 2)
+    {
+        cmd_serialize(buf, cmd);
+        ncmds++;
+    }
+    return NULL;
+}
+
+// a variadic command being built: | cmd | key | args ... |
+// a string value as a SET followed by APPENDs, so each of them fits in a
+// request. returns the number of commands.
+static uint64_t str_emit(std::string &buf, const std::string &key, const std::string &val)
+{
+    // the header, the 3 lengths, and the longer command name
+    size_t overhead = 4 + 3 * 4 + 6 + key.size();
+    size_t room = k_max_msg > overhead ? k_max_msg - overhead : 1;
+    cmd_serialize(buf, {"set", key, val.substr(0, room)});
+    uint64_t ncmds = 1;
+    for (size_t pos = room; pos < val.size(); pos += room, ncmds++)
+    {
+        cmd_serialize(buf, {"append", key, val.substr(pos, room)});
+    }
+    return ncmds;
+}
+
+struct ArgsEmit
+{
+    std::string *buf = NULL;
+    std::vector<std::string> cmd;
+    size_t len = 0;
+    uint64_t ncmds = 0;
+};
+
+static void args_emit_flush(ArgsEmit &ctx)
+{
+    if (ctx.cmd.size() > 2)
+    {
+        cmd_serialize(*ctx.buf, ctx.cmd);
+        ctx.ncmds++;
+    }
+    ctx.cmd.resize(2);
+    ctx.len = 4 + (4 + ctx.cmd[0].size()) + (4 + ctx.cmd[1].size());
+}
+
+static void cb_hash_emit(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    ArgsEmit &ctx = *(ArgsEmit *)arg;
+    size_t added = 4 + flen + 4 + vlen;
+    if (ctx.len + added > k_max_msg || ctx.cmd.size() + 2 > k_max_args)
+    {
+        args_emit_flush(ctx);
+    }
+    ctx.cmd.push_back(std::string(field, flen));
+    ctx.cmd.push_back(std::string(val, vlen));
+    ctx.len += added;
+}
+
+// emit a hash from `cursor` on as variadic HSETs like zset_emit(). stops after
+// about `budget` bytes and returns the next cursor, or 0 when it's done.
+static uint64_t hash_emit(
+    std::string &buf, const std::string &key, Hash *hash, uint64_t cursor, size_t budget, uint64_t &ncmds)
+{
+    ArgsEmit ctx;
+    ctx.buf = &buf;
+    ctx.cmd = {"hset", key};
+    args_emit_flush(ctx);
+    size_t start = buf.size();
+    do
+    {
+        cursor = hash_scan(hash, cursor, 64, &cb_hash_emit, &ctx);
+    } while (cursor && buf.size() - start < budget);
+    args_emit_flush(ctx);
+    ncmds += ctx.ncmds;
+    return cursor;
+}
+
+static void rewrite_hash(RewriteCtx &ctx, const std::string &key, Hash *hash)
+{
+    uint64_t ncmds = 0;
+    uint64_t cursor = 0;
+    do
+    {
+        cursor = hash_emit(ctx.buf, key, hash, cursor, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (cursor);
+}
+
+static void cb_list_emit(const char *val, size_t len, void *arg)
+{
+    ArgsEmit &ctx = *(ArgsEmit *)arg;
+    if (ctx.len + 4 + len > k_max_msg || ctx.cmd.size() + 1 > k_max_args)
+    {
+        args_emit_flush(ctx);
+    }
+    ctx.cmd.push_back(std::string(val, len));
+    ctx.len += 4 + len;
+}
+
+// emit a list from the item at `pos` on as variadic RPUSHes. stops after
+// about `budget` bytes and returns the next position, or 0 when it's done.
+static uint64_t list_emit(
+    std::string &buf, const std::string &key, QList *list, uint64_t pos, size_t budget, uint64_t &ncmds)
+{
+    ArgsEmit ctx;
+    ctx.buf = &buf;
+    ctx.cmd = {"rpush", key};
+    args_emit_flush(ctx);
+    size_t start = buf.size();
+    do
+    {
+        qlist_range(list, pos, pos + 255, &cb_list_emit, &ctx);
+        pos += 256;
+    } while (pos < list->size && buf.size() - start < budget);
+    args_emit_flush(ctx);
+    ncmds += ctx.ncmds;
+    return pos < list->size ? pos : 0;
+}
+
+static void rewrite_list(RewriteCtx &ctx, const std::string &key, QList *list)
+{
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = list_emit(ctx.buf, key, list, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+// emit a set from `cursor` on as variadic SADDs, see hash_emit()
+static uint64_t set_emit(
+    std::string &buf, const std::string &key, Set *set, uint64_t cursor, size_t budget, uint64_t &ncmds)
+{
+    ArgsEmit ctx;
+    ctx.buf = &buf;
+    ctx.cmd = {"sadd", key};
+    args_emit_flush(ctx);
+    size_t start = buf.size();
+    do
+    {
+        cursor = set_scan(set, cursor, 64, &cb_list_emit, &ctx);
+    } while (cursor && buf.size() - start < budget);
+    args_emit_flush(ctx);
+    ncmds += ctx.ncmds;
+    return cursor;
+}
+
+static void rewrite_set(RewriteCtx &ctx, const std::string &key, Set *set)
+{
+    uint64_t ncmds = 0;
+    uint64_t cursor = 0;
+    do
+    {
+        cursor = set_emit(ctx.buf, key, set, cursor, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (cursor);
+}
+
+struct StreamEmit
+{
+    std::string *buf = NULL;
+    const std::string *key = NULL;
+    size_t start = 0;
+    size_t budget = 0;
+    uint64_t n = 0;
+};
+
+static bool cb_stream_emit(const StreamID &id, const char *fields, uint32_t nfields, void *arg)
+{
+    StreamEmit &ctx = *(StreamEmit *)arg;
+    std::vector<std::string> cmd = {"xadd", *ctx.key, sid_str(id)};
+    const char *p = fields;
+    for (uint32_t i = 0; i < 2 * nfields; i++)
+    {
+        const char *str = NULL;
+        uint32_t len = 0;
+        p = sfield_next(p, &str, &len);
+        cmd.emplace_back(str, len);
+    }
+    cmd_serialize(*ctx.buf, cmd);
+    ctx.n++;
+    return ctx.buf->size() - ctx.start < ctx.budget;
+}
+
+// emit a stream from the `pos`-th entry on as XADDs with their IDs. stops after
+// about `budget` bytes and returns the next position, or 0 when it's done.
+static uint64_t stream_emit(
+    std::string &buf, const std::string &key, Stream *stream, uint64_t pos, size_t budget, uint64_t &ncmds)
+{
+    StreamEmit ctx;
+    ctx.buf = &buf;
+    ctx.key = &key;
+    ctx.start = buf.size();
+    ctx.budget = budget;
+    stream_from(stream, pos, &cb_stream_emit, &ctx);
+    ncmds += ctx.n;
+    pos += ctx.n;
+    return pos < stream->size ? pos : 0;
+}
+
+static void rewrite_stream(RewriteCtx &ctx, const std::string &key, Stream *stream)
+{
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = stream_emit(ctx.buf, key, stream, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+// emit a vector set from the `pos`-th vector on as VADDs with FP32 blobs, see
+// stream_emit(). the first one carries the options of the set.
+static uint64_t vset_emit(
+    std::string &buf, const std::string &key, VSet *vset, uint64_t pos, size_t budget, uint64_t &ncmds)
+{
+    size_t start = buf.size();
+    std::string blob(vset->dim * sizeof(float), '\0');
+    for (; pos < vset_size(vset) && buf.size() - start < budget; pos++)
+    {
+        vset_get(vset, (uint32_t)pos, (float *)&blob[0]);
+        VNode *node = vset->nodes[pos];
+        std::vector<std::string> cmd = {"vadd", key, "fp32", blob, std::string(node->name, node->len)};
+        if (vset->q8)
+        {
+            cmd.push_back("q8");
+        }
+        if (vset->metric == VSET_L2)
+        {
+            cmd.push_back("l2");
+        }
+        cmd_serialize(buf, cmd);
+        ncmds++;
+    }
+    return pos < vset_size(vset) ? pos : 0;
+}
+
+static void rewrite_vset(RewriteCtx &ctx, const std::string &key, VSet *vset)
+{
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = vset_emit(ctx.buf, key, vset, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+// the bits of a Bloom filter and the counters of a sketch go out in chunks
+// that fit in a request
+const size_t k_load_chunk = 2048;
+
+// emit a Bloom filter as BF.RESERVE and BF.LOADCHUNKs from the `pos`-th chunk
+// on, see stream_emit(). the chunks are numbered across the layers. chunks of
+// zeros are skipped, except the first of a layer, which creates it.
+static uint64_t bloom_emit(
+    std::string &buf, const std::string &key, Bloom *bloom, uint64_t pos, size_t budget, uint64_t &ncmds)
+{
+    size_t start = buf.size();
+    if (pos == 0)
+    {
+        std::vector<std::string> cmd = {"bf.reserve", key, dbl2str(bloom->error),
+            std::to_string(bloom->capacity), "expansion", std::to_string(bloom->expansion)};
+        if (!bloom->scaling)
+        {
+            cmd.push_back("nonscaling");
+        }
+        cmd_serialize(buf, cmd);
+        ncmds++;
+    }
+    uint64_t first = 0; // the number of the first chunk of the layer
+    for (size_t i = 0; i < bloom->layers.size(); i++)
+    {
+        const BloomLayer &layer = bloom->layers[i];
+        size_t bytes = layer.nblocks * k_bloom_block;
+        uint64_t nchunks = (bytes + k_load_chunk - 1) / k_load_chunk;
+        for (; pos < first + nchunks; pos++)
+        {
+            if (buf.size() - start >= budget)
+            {
+                return pos;
+            }
+            size_t off = (pos - first) * k_load_chunk;
+            size_t len = std::min(k_load_chunk, bytes - off);
+            const uint8_t *data = &layer.blocks[off];
+            if (pos > first && data[0] == 0 && !memcmp(data, data + 1, len - 1))
+            {
+                continue;
+            }
+            cmd_serialize(buf, {"bf.loadchunk", key, std::to_string(i), std::to_string(layer.count),
+                std::to_string(off), std::string((const char *)data, len)});
+            ncmds++;
+        }
+        first += nchunks;
+    }
+    return 0;
+}
+
+static void rewrite_bloom(RewriteCtx &ctx, const std::string &key, Bloom *bloom)
+{
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = bloom_emit(ctx.buf, key, bloom, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+// emit a CMS or a top-k key from the `pos`-th command on, see stream_emit():
+// the `init` command, the counters in CMS.LOADCHUNKs, skipping zeros but for
+// the first chunk, then the top-k candidates in TOPK.LOADITEMs.
+static uint64_t sketch_emit(std::string &buf, const std::string &key,
+    const std::vector<std::string> &init, CMS *cms, TopK *topk, uint64_t pos, size_t budget,
+    uint64_t &ncmds)
+{
+    size_t start = buf.size();
+    if (pos == 0)
+    {
+        cmd_serialize(buf, init);
+        ncmds++;
+    }
+    size_t bytes = cms->counters.size() * 4;
+    uint64_t nchunks = (bytes + k_load_chunk - 1) / k_load_chunk;
+    for (; pos < nchunks; pos++)
+    {
+        if (buf.size() - start >= budget)
+        {
+            return pos;
+        }
+        size_t off = pos * k_load_chunk;
+        size_t len = std::min(k_load_chunk, bytes - off);
+        const char *data = (const char *)cms->counters.data() + off;
+        if (pos > 0 && data[0] == 0 && !memcmp(data, data + 1, len - 1))
+        {
+            continue;
+        }
+        cmd_serialize(buf, {"cms.loadchunk", key, std::to_string(cms->total), std::to_string(off),
+            std::string(data, len)});
+        ncmds++;
+    }
+    size_t nitems = topk ? topk->heap.size() : 0;
+    while (pos < nchunks + nitems)
+    {
+        if (buf.size() - start >= budget)
+        {
+            return pos;
+        }
+        std::vector<std::string> cmd = {"topk.loaditems", key};
+        size_t size = 0;
+        for (; pos < nchunks + nitems && size < k_load_chunk; pos++)
+        {
+            TopKNode *node = container_of(topk->heap[pos - nchunks].ref, TopKNode, heap_idx);
+            cmd.push_back(std::string(node->name, node->len));
+            cmd.push_back(std::to_string(topk_count(topk, node)));
+            size += node->len;
+        }
+        cmd_serialize(buf, cmd);
+        ncmds++;
+    }
+    return 0;
+}
+
+static std::vector<std::string> cms_init_cmd(const std::string &key, Entry *ent)
+{
+    if (ent->type == T_TOPK)
+    {
+        TopK *topk = ent->topk;
+        return {"topk.reserve", key, std::to_string(topk->k), std::to_string(topk->cms.width),
+            std::to_string(topk->cms.depth)};
+    }
+    return {"cms.initbydim", key, std::to_string(ent->cms->width), std::to_string(ent->cms->depth)};
+}
+
+static void rewrite_sketch(RewriteCtx &ctx, const std::string &key, Entry *src)
+{
+    std::vector<std::string> init = cms_init_cmd(key, src);
+    CMS *cms = src->type == T_TOPK ? &src->topk->cms : src->cms;
+    TopK *topk = src->type == T_TOPK ? src->topk : NULL;
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = sketch_emit(ctx.buf, key, init, cms, topk, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+// emit a time series as TS.CREATE and a TS.LOADCHUNK per compressed chunk
+// from the `pos`-th chunk on, see stream_emit()
+static uint64_t series_emit(
+    std::string &buf, const std::string &key, TSeries *series, uint64_t pos, size_t budget, uint64_t &ncmds)
+{
+    size_t start = buf.size();
+    if (pos == 0)
+    {
+        cmd_serialize(buf, {"ts.create", key, "retention", std::to_string(series->retention)});
+        ncmds++;
+    }
+    for (; pos < series->chunks.size() && buf.size() - start < budget; pos++)
+    {
+        const TChunk &chunk = series->chunks[pos];
+        cmd_serialize(buf, {"ts.loadchunk", key, std::to_string(chunk.nbits), std::to_string(chunk.count),
+            std::string((const char *)chunk.words.data(), chunk.words.size() * 8)});
+        ncmds++;
+    }
+    return pos < series->chunks.size() ? pos : 0;
+}
+
+static void rewrite_series(RewriteCtx &ctx, const std::string &key, TSeries *series)
+{
+    uint64_t ncmds = 0;
+    uint64_t pos = 0;
+    do
+    {
+        pos = series_emit(ctx.buf, key, series, pos, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    } while (pos);
+}
+
+static void rewrite_zset(RewriteCtx &ctx, const std::string &key, ZSet *zset)
+{
+    uint64_t ncmds = 0;
+    ZNode *znode = zset_query(zset, -INFINITY, "", 0, 0);
+    while (znode)
+    {
+        znode = zset_emit(ctx.buf, key, znode, 64 * 1024, ncmds);
+        rewrite_flush(ctx);
+    }
+}
+
+static void cb_rewrite(HNode *node, void *arg)
+{
+    RewriteCtx &ctx = *(RewriteCtx *)arg;
+    Entry *ent = container_of(node, Entry, node);
+    Entry *cold = ent->tier_len ? tier_read(ent) : NULL;
+    Entry *src = cold ? cold : ent;
+    switch (ent->type)
+    {
+    case T_STR:
+        str_emit(ctx.buf, ent->key, src->val);
+        break;
+    case T_ZSET:
+        rewrite_zset(ctx, ent->key, src->zset);
+        break;
+    case T_HASH:
+        rewrite_hash(ctx, ent->key, src->hash);
+        break;
+    case T_LIST:
+        rewrite_list(ctx, ent->key, src->list);
+        break;
+    case T_SET:
+        rewrite_set(ctx, ent->key, src->set);
+        break;
+    case T_STREAM:
+        rewrite_stream(ctx, ent->key, src->stream);
+        break;
+    case T_VSET:
+        rewrite_vset(ctx, ent->key, src->vset);
+        break;
+    case T_BLOOM:
+        rewrite_bloom(ctx, ent->key, src->bloom);
+        break;
+    case T_CMS:
+    case T_TOPK:
+        rewrite_sketch(ctx, ent->key, src);
+        break;
+    case T_TS:
+        rewrite_series(ctx, ent->key, src->series);
+        break;
+    }
+    if (cold)
+    {
+        entry_destroy(cold);
+    }
+
+    int64_t expire_ms = entry_expire_at_ms(ent, ctx.now_us, ctx.now_ms);
+    if (expire_ms >= 0)
+    {
+        cmd_serialize(ctx.buf, {"pexpireat", ent->key, std::to_string(expire_ms)});
+    }
+
+    if (ctx.buf.size() >= 64 * 1024)
+    {
+        rewrite_flush(ctx);
+    }
+}
+
+static std::string aof_temp_path()
+{
+    return g_data.aof.path + ".rewrite";
+}
+
+// runs in the forked child, which sees a frozen copy of the key space
+static int32_t aof_rewrite_child()
+{
+    RewriteCtx ctx;
+    ctx.fd = open(aof_temp_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (ctx.fd < 0)
+    {
+        return -1;
+    }
+    ctx.now_us = get_monotonic_usec();
+    ctx.now_ms = get_realtime_msec();
+    h_scan(&g_data.db.ht1, &cb_rewrite, &ctx);
+    h_scan(&g_data.db.ht2, &cb_rewrite, &ctx);
+    rewrite_flush(ctx);
+    if (ctx.err || 0 != fsync(ctx.fd))
+    {
+        return -1;
+    }
+    return close(ctx.fd);
+}
+
+static int32_t aof_rewrite_start()
+{
+    AOF &aof = g_data.aof;
+    assert(aof.child < 0);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg("fork() error");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        _exit(aof_rewrite_child() == 0 ? 0 : 1);
+    }
+    aof.child = pid;
+    aof.rewrite_buf.clear();
+    return 0;
+}
+
+static void do_bgrewriteaof(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    if (g_data.aof.fd < 0)
+    {
+        return out_err(out, ERR_UNKNOWN, "AOF is disabled");
+    }
+    if (g_data.aof.child > 0 || g_data.snap.child > 0)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save in progress");
+    }
+    if (0 != aof_rewrite_start())
+    {
+        return out_err(out, ERR_UNKNOWN, "fork() error");
+    }
+    return out_nil(out);
+}
+
+// write the records produced by this event loop iteration
+static void aof_flush()
+{
+    AOF &aof = g_data.aof;
+    if (aof.buf.empty())
+    {
+        return;
+    }
+    if (0 != write_all(aof.fd, aof.buf.data(), aof.buf.size()))
+    {
+        die("AOF write()");
+    }
+    aof.size += aof.buf.size();
+    aof.unsynced = true;
+    aof.buf.clear();
+}
+
+static void aof_fsync_async(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    (void)fdatasync(fd);
+    (void)close(fd);
+}
+
+static void aof_close_async(void *arg)
+{
+    (void)close((int)(intptr_t)arg);
+}
+
+// the child finished, swap in the new log
+static void aof_rewrite_done(bool ok)
+{
+    AOF &aof = g_data.aof;
+    aof.child = -1;
+    std::string tmp = aof_temp_path();
+    int fd = -1;
+    if (ok)
+    {
+        // the old log must be complete in case the swap fails
+        aof_flush();
+        fd = open(tmp.c_str(), O_WRONLY | O_APPEND);
+    }
+    // append what arrived during the rewrite, this is proportional to the
+    // write traffic, not to the data set size
+    if (fd < 0 || 0 != write_all(fd, aof.rewrite_buf.data(), aof.rewrite_buf.size())
+        || 0 != rename(tmp.c_str(), aof.path.c_str()))
+    {
+        msg("AOF rewrite failed");
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        unlink(tmp.c_str());
+        std::string().swap(aof.rewrite_buf);
+        return;
+    }
+
+    // the rename unlinked the old file, closing the last reference frees its
+    // blocks, which can take a while
+    thread_pool_queue(&g_data.tp, &aof_close_async, (void *)(intptr_t)aof.fd);
+    aof.fd = fd;
+    aof.size = aof.base_size = (size_t)lseek(fd, 0, SEEK_END);
+    aof.unsynced = true;
+    std::string().swap(aof.rewrite_buf);
+    fprintf(stderr, "AOF rewritten: %zu bytes\n", aof.size);
+}
+
+const size_t k_aof_rewrite_min_size = 64 << 20;
+
+static void process_aof()
+{
+    AOF &aof = g_data.aof;
+    if (aof.fd < 0)
+    {
+        return;
+    }
+    aof_flush();
+
+    if (aof.child > 0)
+    {
+        int status = 0;
+        if (aof.child == waitpid(aof.child, &status, WNOHANG))
+        {
+            aof_rewrite_done(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+    else if (g_data.snap.child < 0 && aof.size >= k_aof_rewrite_min_size
+             && aof.size >= 2 * aof.base_size)
+    {
+        // the log has doubled since the last rewrite
+        (void)aof_rewrite_start();
+    }
+
+    uint64_t now_us = get_monotonic_usec();
+    if (aof.unsynced && now_us - aof.last_fsync_us >= 1000 * 1000)
+    {
+        // fsync at most once per second, off the event loop
+        aof.unsynced = false;
+        aof.last_fsync_us = now_us;
+        thread_pool_queue(&g_data.tp, &aof_fsync_async, (void *)(intptr_t)dup(aof.fd));
+    }
+}
+
+// replay the log, then open it for appending
+static void aof_open(const char *path)
+{
+    AOF &aof = g_data.aof;
+    aof.path = path;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        die("open() AOF");
+    }
+
+    std::string buf;
+    size_t good = 0; // the end of the last complete record or transaction
+    size_t nread = 0;
+    size_t nrecords = 0;
+    Replay replay;
+    char chunk[64 * 1024];
+    while (true)
+    {
+        ssize_t rv = read(fd, chunk, sizeof(chunk));
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0)
+        {
+            die("read() AOF");
+        }
+        if (rv == 0)
+        {
+            break;
+        }
+        buf.append(chunk, (size_t)rv);
+
+        size_t pos = 0;
+        while (buf.size() - pos >= 4)
+        {
+            uint32_t len = 0;
+            memcpy(&len, &buf[pos], 4);
+            if (len > k_max_msg || buf.size() - pos - 4 < len)
+            {
+                break;
+            }
+            std::vector<std::string> cmd;
+            std::string out;
+            if (0 != parse_req((uint8_t *)&buf[pos + 4], len, cmd))
+            {
+                break;
+            }
+            replay_record(replay, cmd);
+            pos += 4 + len;
+            nread += 4 + len;
+            nrecords++;
+            if (!replay.in_txn)
+            {
+                good = nread;
+            }
+        }
+        buf.erase(0, pos);
+        if (buf.size() >= 4 + k_max_msg)
+        {
+            break; // garbage
+        }
+    }
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    if ((size_t)end != good)
+    {
+        // a crash in the middle of a write leaves a partial record or
+        // transaction behind
+        fprintf(stderr, "AOF: truncating %zu bad bytes\n", (size_t)end - good);
+        if (0 != ftruncate(fd, (off_t)good))
+        {
+            die("ftruncate() AOF");
+        }
+    }
+    close(fd);
+
+    aof.fd = open(path, O_WRONLY | O_APPEND);
+    if (aof.fd < 0)
+    {
+        die("open() AOF");
+    }
+    aof.size = aof.base_size = good;
+    fprintf(stderr, "AOF: loaded %zu records\n", nrecords);
+}
+
+// the snapshot file:
+// | header | section 0 | section 1 | ... | section table |
+// each section is a run of whole entries, so sections can be decoded in parallel
+const char k_snap_magic[4] = {'S', 'N', 'A', 'P'};
+const uint32_t k_snap_version = 1;
+const size_t k_snap_section_size = 4 << 20;
+
+struct SnapHeader
+{
+    char magic[4];
+    uint32_t version;
+    uint64_t nkeys;
+    uint64_t nsections;
+    uint64_t table_off;
+};
+
+struct SnapSection
+{
+    uint64_t off;
+    uint64_t size;
+    uint64_t nkeys;
+};
+
+struct SnapWriter
+{
+    int fd = -1;
+    std::string buf;
+    uint64_t off = 0; // the file offset of buf
+    uint64_t nkeys = 0;
+    std::vector<SnapSection> sections;
+    SnapSection cur = {};
+    uint64_t now_us = 0;
+    uint64_t now_ms = 0;
+    bool err = false;
+};
+
+static void put(std::string &buf, const void *data, size_t size)
+{
+    buf.append((const char *)data, size);
+}
+
+static void snap_flush(SnapWriter &w)
+{
+    if (!w.err && 0 != write_all(w.fd, w.buf.data(), w.buf.size()))
+    {
+        w.err = true;
+    }
+    w.off += w.buf.size();
+    w.buf.clear();
+}
+
+// | type:u8 | klen:u32 | key | expire_ms:i64 | value |
+// string value: | len:u32 | data |
+// zset value: | n:u64 | (score:f64 | len:u32 | name) * n |, sorted
+// hash value: | n:u64 | (flen:u32 | field | vlen:u32 | value) * n |
+// list value: | n:u64 | (len:u32 | value) * n |, head first
+// set value: | n:u64 | (len:u32 | member) * n |
+// stream value: | n:u64 | (ms:u64 | seq:u64 | nfields:u32 | (len:u32 | bytes) * 2 * nfields) * n |
+// vector set value: | dim:u32 | metric:u8 | q8:u8 | n:u64 | (len:u32 | name | f32 * dim) * n |
+// bloom value: | error:f64 | capacity:u64 | expansion:u32 | scaling:u8 | n:u32 |
+//              (count:u64 | nblocks:u64 | blocks) * n |
+// cms value: | width:u32 | depth:u32 | total:u64 | u32 * width * depth |
+// top-k value: | k:u32 | cms value | n:u32 | (count:u64 | len:u32 | name) * n |
+// time series value: | retention:i64 | n:u32 | (nbits:u32 | count:u32 | u64 * nwords) * n |
+static void snap_put_cms(std::string &buf, CMS *cms)
+{
+    put(buf, &cms->width, 4);
+    put(buf, &cms->depth, 4);
+    put(buf, &cms->total, 8);
+    put(buf, cms->counters.data(), cms->counters.size() * 4);
+}
+
+static void cb_snap_field(const char *field, size_t flen, const char *val, size_t vlen, void *arg)
+{
+    std::string &buf = *(std::string *)arg;
+    uint32_t len = (uint32_t)flen;
+    put(buf, &len, 4);
+    put(buf, field, flen);
+    len = (uint32_t)vlen;
+    put(buf, &len, 4);
+    put(buf, val, vlen);
+}
+
+static void cb_snap_item(const char *val, size_t len, void *arg)
+{
+    std::string &buf = *(std::string *)arg;
+    uint32_t n = (uint32_t)len;
+    put(buf, &n, 4);
+    put(buf, val, len);
+}
+
+static void snap_put_entry(std::string &buf, Entry *ent, uint64_t now_us, uint64_t now_ms)
+{
+    // a spilled value is read back from the tier file
+    Entry *cold = ent->tier_len ? tier_read(ent) : NULL;
+    Entry *src = cold ? cold : ent;
+    uint8_t type = (uint8_t)ent->type;
+    put(buf, &type, 1);
+    uint32_t klen = (uint32_t)ent->key.size();
+    put(buf, &klen, 4);
+    put(buf, ent->key.data(), klen);
+    int64_t expire_ms = entry_expire_at_ms(ent, now_us, now_ms);
+    put(buf, &expire_ms, 8);
+
+    switch (ent->type)
+    {
+    case T_STR:
+    {
+        uint32_t len = (uint32_t)src->val.size();
+        put(buf, &len, 4);
+        put(buf, src->val.data(), len);
+        break;
+    }
+    case T_ZSET:
+    {
+        uint64_t n = hm_size(&src->zset->hmap);
+        put(buf, &n, 8);
+        ZNode *znode = zset_query(src->zset, -INFINITY, "", 0, 0);
+        for (; znode; znode = container_of(avl_offset(&znode->tree, 1), ZNode, tree))
+        {
+            uint32_t len = (uint32_t)znode->len;
+            put(buf, &znode->score, 8);
+            put(buf, &len, 4);
+            put(buf, znode->name, len);
+        }
+        break;
+    }
+    case T_HASH:
+    {
+        uint64_t n = hash_size(src->hash);
+        put(buf, &n, 8);
+        hash_scan(src->hash, 0, (size_t)-1, &cb_snap_field, &buf);
+        break;
+    }
+    case T_LIST:
+    {
+        uint64_t n = src->list->size;
+        put(buf, &n, 8);
+        qlist_range(src->list, 0, n - 1, &cb_snap_item, &buf);
+        break;
+    }
+    case T_SET:
+    {
+        uint64_t n = set_size(src->set);
+        put(buf, &n, 8);
+        set_scan(src->set, 0, (size_t)-1, &cb_snap_item, &buf);
+        break;
+    }
+    case T_STREAM:
+    {
+        // the nodes hold the entries in this format
+        uint64_t n = src->stream->size;
+        put(buf, &n, 8);
+        for (SNode *node = stream_first(src->stream); node; node = stream_next(node))
+        {
+            put(buf, &node->data[node->start], node->end - node->start);
+        }
+        break;
+    }
+    case T_VSET:
+    {
+        // Q8 vectors are stored dequantized, they quantize back the same
+        VSet *vset = src->vset;
+        uint8_t q8 = vset->q8;
+        uint64_t n = vset_size(vset);
+        put(buf, &vset->dim, 4);
+        put(buf, &vset->metric, 1);
+        put(buf, &q8, 1);
+        put(buf, &n, 8);
+        std::vector<float> vec(vset->dim);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            VNode *node = vset->nodes[i];
+            put(buf, &node->len, 4);
+            put(buf, node->name, node->len);
+            vset_get(vset, (uint32_t)i, vec.data());
+            put(buf, vec.data(), vec.size() * sizeof(float));
+        }
+        break;
+    }
+    case T_BLOOM:
+    {
+        // the layer sizes are checked against the options on load
+        Bloom *bloom = src->bloom;
+        uint8_t scaling = bloom->scaling;
+        uint32_t n = (uint32_t)bloom->layers.size();
+        put(buf, &bloom->error, 8);
+        put(buf, &bloom->capacity, 8);
+        put(buf, &bloom->expansion, 4);
+        put(buf, &scaling, 1);
+        put(buf, &n, 4);
+        for (const BloomLayer &layer : bloom->layers)
+        {
+            put(buf, &layer.count, 8);
+            put(buf, &layer.nblocks, 8);
+            put(buf, layer.blocks, layer.nblocks * k_bloom_block);
+        }
+        break;
+    }
+    case T_CMS:
+        snap_put_cms(buf, src->cms);
+        break;
+    case T_TOPK:
+    {
+        TopK *topk = src->topk;
+        uint32_t n = (uint32_t)topk->heap.size();
+        put(buf, &topk->k, 4);
+        snap_put_cms(buf, &topk->cms);
+        put(buf, &n, 4);
+        for (const HeapItem &item : topk->heap)
+        {
+            TopKNode *node = container_of(item.ref, TopKNode, heap_idx);
+            put(buf, &item.val, 8);
+            put(buf, &node->len, 4);
+            put(buf, node->name, node->len);
+        }
+        break;
+    }
+    case T_TS:
+    {
+        // the words of the chunks as they are, (nbits + 63) / 64 of them
+        TSeries *series = src->series;
+        uint32_t n = (uint32_t)series->chunks.size();
+        put(buf, &series->retention, 8);
+        put(buf, &n, 4);
+        for (const TChunk &chunk : series->chunks)
+        {
+            put(buf, &chunk.nbits, 4);
+            put(buf, &chunk.count, 4);
+            put(buf, chunk.words.data(), chunk.words.size() * 8);
+        }
+        break;
+    }
+    }
+    if (cold)
+    {
+        entry_destroy(cold);
+    }
+}
+
+static void cb_snap_entry(HNode *node, void *arg)
+{
+    SnapWriter &w = *(SnapWriter *)arg;
+    size_t start = w.buf.size();
+    snap_put_entry(w.buf, container_of(node, Entry, node), w.now_us, w.now_ms);
+    w.cur.size += w.buf.size() - start;
+    w.cur.nkeys++;
+    w.nkeys++;
+
+    if (w.cur.size >= k_snap_section_size)
+    {
+        w.sections.push_back(w.cur);
+        w.cur = SnapSection{w.cur.off + w.cur.size, 0, 0};
+    }
+    if (w.buf.size() >= 64 * 1024)
+    {
+        snap_flush(w);
+    }
+}
+
+static std::string snap_temp_path()
+{
+    return g_data.snap.path + ".tmp." + std::to_string(getpid());
+}
+
+static int32_t snap_begin(SnapWriter &w)
+{
+    w.fd = open(snap_temp_path().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (w.fd < 0)
+    {
+        return -1;
+    }
+    w.now_us = get_monotonic_usec();
+    w.now_ms = get_realtime_msec();
+
+    // the header is filled in at the end
+    SnapHeader hdr = {};
+    put(w.buf, &hdr, sizeof(hdr));
+    w.cur.off = sizeof(hdr);
+    return 0;
+}
+
+// write the section table and the header, then rename the file over the snapshot
+static int32_t snap_commit(SnapWriter &w, const std::string &tmp)
+{
+    if (w.cur.nkeys)
+    {
+        w.sections.push_back(w.cur);
+    }
+
+    SnapHeader hdr = {};
+    memcpy(hdr.magic, k_snap_magic, 4);
+    hdr.version = k_snap_version;
+    hdr.nkeys = w.nkeys;
+    hdr.nsections = w.sections.size();
+    hdr.table_off = w.off + w.buf.size();
+    put(w.buf, w.sections.data(), w.sections.size() * sizeof(SnapSection));
+    snap_flush(w);
+
+    bool ok = !w.err && (ssize_t)sizeof(hdr) == pwrite(w.fd, &hdr, sizeof(hdr), 0) && 0 == fsync(w.fd);
+    ok = (0 == close(w.fd)) && ok;
+    if (!ok || 0 != rename(tmp.c_str(), g_data.snap.path.c_str()))
+    {
+        unlink(tmp.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// write the key space in one go, in the foreground or in a forked child
+static int32_t snapshot_write()
+{
+    SnapWriter w;
+    if (0 != snap_begin(w))
+    {
+        return -1;
+    }
+    h_scan(&g_data.db.ht1, &cb_snap_entry, &w);
+    h_scan(&g_data.db.ht2, &cb_snap_entry, &w);
+    return snap_commit(w, snap_temp_path());
+}
+
+// the fork-less snapshot:
+// the key space is scanned a few buckets at a time from the event loop. An
+// entry that is about to be modified or deleted before the scan reaches it is
+// written first, so the file reflects the key space when the snapshot started.
+// Each entry is stamped with the snapshot epoch once written; new entries are
+// stamped at creation, so the scan skips them. The cost of a write is bounded
+// by the size of one entry, rather than by the page table of the process.
+static int32_t snapshot_start_incremental()
+{
+    Snapshot &snap = g_data.snap;
+    SnapWriter *w = new SnapWriter();
+    if (0 != snap_begin(*w))
+    {
+        delete w;
+        return -1;
+    }
+    snap.writer = w;
+    snap.epoch++;
+    snap.nkeys = hm_size(&g_data.db);
+    snap.nwritten = 0;
+    snap.cursor_tab = 0;
+    snap.cursor_pos = 0;
+    return 0;
+}
+
+static void snap_capture(Entry *ent)
+{
+    Snapshot &snap = g_data.snap;
+    ent->snap_epoch = snap.epoch;
+    snap.nwritten++;
+    cb_snap_entry(&ent->node, snap.writer);
+}
+
+// copy-on-write at the entry granularity, for a change of the representation
+// that the clients can't see
+static void entry_before_update(Entry *ent)
+{
+    Snapshot &snap = g_data.snap;
+    if (snap.writer && !snap.committing && ent->snap_epoch != snap.epoch)
+    {
+        snap_capture(ent);
+    }
+}
+
+// a logical write, this is also where the tracking clients and the watchers
+// learn that the key changed
+static void entry_before_write(Entry *ent)
+{
+    tracking_invalidate(ent->key);
+    if (g_watch.nwatching)
+    {
+        ent->version = ++g_watch.clock;
+    }
+    defrag_forget(ent);
+    entry_before_update(ent);
+}
+
+struct SnapCommit
+{
+    SnapWriter *w = NULL;
+    std::string tmp;
+};
+
+// the final fsync() of a large file doesn't belong on the event loop
+static void snap_commit_async(void *arg)
+{
+    SnapCommit *job = (SnapCommit *)arg;
+    int32_t rv = snap_commit(*job->w, job->tmp);
+    g_data.snap.commit_status.store(rv == 0 ? 1 : -1);
+    delete job->w;
+    delete job;
+}
+
+const uint64_t k_snap_step_us = 1000;
+
+// scan for a bounded amount of time
+static void snapshot_step()
+{
+    Snapshot &snap = g_data.snap;
+    uint64_t deadline = get_monotonic_usec() + k_snap_step_us;
+    size_t nwork = 0;
+    while (snap.nwritten < snap.nkeys)
+    {
+        // the resizing moves nodes from ht2 to ht1, so ht2 is scanned first.
+        // A node can still be missed if a new resizing swaps the tables during
+        // a pass, in which case another pass picks it up.
+        HTab *tab = snap.cursor_tab == 0 ? &g_data.db.ht2 : &g_data.db.ht1;
+        if (!tab->tab || snap.cursor_pos > tab->mask)
+        {
+            snap.cursor_tab = (snap.cursor_tab + 1) % 2;
+            snap.cursor_pos = 0;
+            continue;
+        }
+        for (HNode *node = tab->tab[snap.cursor_pos]; node; node = node->next)
+        {
+            Entry *ent = container_of(node, Entry, node);
+            if (ent->snap_epoch != snap.epoch)
+            {
+                snap_capture(ent);
+            }
+        }
+        snap.cursor_pos++;
+        if (++nwork % 64 == 0 && get_monotonic_usec() >= deadline)
+        {
+            return;
+        }
+    }
+
+    SnapCommit *job = new SnapCommit();
+    job->w = snap.writer;
+    job->tmp = snap_temp_path();
+    snap.committing = true;
+    thread_pool_queue(&g_data.tp, &snap_commit_async, job);
+}
+
+static void do_save(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    if (g_data.snap.writer)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save in progress");
+    }
+    if (0 != snapshot_write())
+    {
+        return out_err(out, ERR_UNKNOWN, "snapshot failed");
+    }
+    return out_nil(out);
+}
+
+static int32_t snapshot_start_background()
+{
+    if (g_data.snap.incremental)
+    {
+        return snapshot_start_incremental();
+    }
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        msg("fork() error");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        _exit(snapshot_write() == 0 ? 0 : 1);
+    }
+    g_data.snap.child = pid;
+    return 0;
+}
+
+static void do_bgsave(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    if (g_data.aof.child > 0 || g_data.snap.child > 0 || g_data.snap.writer)
+    {
+        return out_err(out, ERR_UNKNOWN, "background save in progress");
+    }
+    if (0 != snapshot_start_background())
+    {
+        return out_err(out, ERR_UNKNOWN, "snapshot failed");
+    }
+    return out_nil(out);
+}
+
+static void repl_snapshot_done(bool ok);
+
+static void process_snapshot()
+{
+    Snapshot &snap = g_data.snap;
+    int status = 0;
+    if (snap.child > 0 && snap.child == waitpid(snap.child, &status, WNOHANG))
+    {
+        snap.child = -1;
+        bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        msg(ok ? "background save done" : "background save failed");
+        repl_snapshot_done(ok);
+    }
+
+    if (snap.writer && !snap.committing)
+    {
+        snapshot_step();
+    }
+    else if (snap.committing && (status = snap.commit_status.load()) != 0)
+    {
+        snap.commit_status.store(0);
+        snap.committing = false;
+        snap.writer = NULL;
+        msg(status > 0 ? "background save done" : "background save failed");
+        repl_snapshot_done(status > 0);
+    }
+}
+
+// bounds-checked decoding
+struct SnapReader
+{
+    const uint8_t *cur = NULL;
+    const uint8_t *end = NULL;
+    bool err = false;
+};
+
+static bool get(SnapReader &r, void *out, size_t size)
+{
+    if (r.err || (size_t)(r.end - r.cur) < size)
+    {
+        r.err = true;
+        return false;
+    }
+    memcpy(out, r.cur, size);
+    r.cur += size;
+    return true;
+}
+
+static const char *get_bytes(SnapReader &r, size_t size)
+{
+    if (r.err || (size_t)(r.end - r.cur) < size)
+    {
+        r.err = true;
+        return NULL;
+    }
+    const char *data = (const char *)r.cur;
+    r.cur += size;
+    return data;
+}
+
+static void snap_get_cms(SnapReader &r, CMS *cms)
+{
+    uint32_t width = 0, depth = 0;
+    uint64_t total = 0;
+    get(r, &width, 4);
+    get(r, &depth, 4);
+    get(r, &total, 8);
+    if (r.err || !cms_dims_ok(width, depth) || (uint64_t)width * depth > (size_t)(r.end - r.cur) / 4)
+    {
+        r.err = true;
+        return;
+    }
+    cms_init(cms, width, depth);
+    cms->total = total;
+    memcpy(cms->counters.data(), get_bytes(r, cms->counters.size() * 4), cms->counters.size() * 4);
+}
+
+static Entry *snap_get_entry(SnapReader &r, int64_t &expire_ms)
+{
+    uint8_t type = 0;
+    uint32_t klen = 0;
+    get(r, &type, 1);
+    get(r, &klen, 4);
+    const char *key = get_bytes(r, klen);
+    get(r, &expire_ms, 8);
+    if (r.err || type > T_TS)
+    {
+        r.err = true;
+        return NULL;
+    }
+
+    Entry *ent = slab_new<Entry>();
+    ent->key.assign(key, klen);
+    ent->node.hcode = str_hash((uint8_t *)key, klen);
+    ent->type = type;
+    if (type == T_STR)
+    {
+        uint32_t len = 0;
+        get(r, &len, 4);
+        const char *val = get_bytes(r, len);
+        if (val)
+        {
+            ent->val.assign(val, len);
+        }
+        return ent;
+    }
+    if (type == T_HASH)
+    {
+        ent->hash = slab_new<Hash>();
+        uint64_t n = 0;
+        get(r, &n, 8);
+        if (n > (size_t)(r.end - r.cur) / 8)
+        {
+            r.err = true;
+            return ent;
+        }
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint32_t flen = 0;
+            uint32_t vlen = 0;
+            get(r, &flen, 4);
+            const char *field = get_bytes(r, flen);
+            get(r, &vlen, 4);
+            const char *val = get_bytes(r, vlen);
+            if (!val)
+            {
+                break;
+            }
+            hash_set(ent->hash, field, flen, val, vlen);
+        }
+        return ent;
+    }
+    if (type == T_LIST)
+    {
+        ent->list = slab_new<QList>();
+        uint64_t n = 0;
+        get(r, &n, 8);
+        if (n > (size_t)(r.end - r.cur) / 4)
+        {
+            r.err = true;
+            return ent;
+        }
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint32_t len = 0;
+            get(r, &len, 4);
+            const char *val = get_bytes(r, len);
+            if (!val)
+            {
+                break;
+            }
+            qlist_push(ent->list, false, val, len);
+        }
+        return ent;
+    }
+    if (type == T_SET)
+    {
+        ent->set = slab_new<Set>();
+        uint64_t n = 0;
+        get(r, &n, 8);
+        if (n > (size_t)(r.end - r.cur) / 4)
+        {
+            r.err = true;
+            return ent;
+        }
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint32_t len = 0;
+            get(r, &len, 4);
+            const char *val = get_bytes(r, len);
+            if (!val)
+            {
+                break;
+            }
+            set_add(ent->set, val, len);
+        }
+        return ent;
+    }
+    if (type == T_STREAM)
+    {
+        ent->stream = slab_new<Stream>();
+        uint64_t n = 0;
+        get(r, &n, 8);
+        if (n > (size_t)(r.end - r.cur) / 20)
+        {
+            r.err = true;
+            return ent;
+        }
+        std::vector<std::string> fv;
+        for (uint64_t i = 0; i < n && !r.err; i++)
+        {
+            StreamID id;
+            uint32_t nfields = 0;
+            get(r, &id.ms, 8);
+            get(r, &id.seq, 8);
+            get(r, &nfields, 4);
+            if (r.err || nfields > (size_t)(r.end - r.cur) / 8 || !sid_less(ent->stream->last, id))
+            {
+                r.err = true;
+                break;
+            }
+            fv.resize(2 * nfields);
+            for (uint32_t k = 0; k < 2 * nfields; k++)
+            {
+                uint32_t len = 0;
+                get(r, &len, 4);
+                const char *val = get_bytes(r, len);
+                fv[k].assign(val ? val : "", val ? len : 0);
+            }
+            if (!r.err)
+            {
+                stream_append(ent->stream, id, fv.data(), fv.size());
+            }
+        }
+        return ent;
+    }
+
+    if (type == T_VSET)
+    {
+        VSet *vset = ent->vset = slab_new<VSet>();
+        uint8_t q8 = 0;
+        uint64_t n = 0;
+        get(r, &vset->dim, 4);
+        get(r, &vset->metric, 1);
+        get(r, &q8, 1);
+        get(r, &n, 8);
+        vset->q8 = q8;
+        size_t vlen = (size_t)vset->dim * sizeof(float);
+        if (vset->dim == 0 || vset->dim > k_vset_dim_max || vset->metric > VSET_L2
+            || n > (size_t)(r.end - r.cur) / (4 + vlen))
+        {
+            r.err = true;
+            return ent;
+        }
+        std::vector<float> vec(vset->dim);
+        for (uint64_t i = 0; i < n; i++)
+        {
+            uint32_t len = 0;
+            get(r, &len, 4);
+            const char *name = get_bytes(r, len);
+            const char *data = get_bytes(r, vlen);
+            if (!data)
+            {
+                break;
+            }
+            memcpy(vec.data(), data, vlen);
+            vset_add(vset, name, len, vec.data());
+        }
+        return ent;
+    }
+
+    if (type == T_BLOOM)
+    {
+        Bloom *bloom = ent->bloom = slab_new<Bloom>();
+        uint8_t scaling = 0;
+        uint32_t n = 0;
+        get(r, &bloom->error, 8);
+        get(r, &bloom->capacity, 8);
+        get(r, &bloom->expansion, 4);
+        get(r, &scaling, 1);
+        get(r, &n, 4);
+        bloom->scaling = scaling;
+        if (!(bloom->error > 0 && bloom->error < 1) || bloom->capacity == 0
+            || bloom->capacity > k_bloom_max_capacity || bloom->expansion == 0
+            || bloom->expansion > k_bloom_max_expansion || n == 0 || n > (size_t)(r.end - r.cur) / 16)
+        {
+            r.err = true;
+            return ent;
+        }
+        for (uint32_t i = 0; i < n && !r.err; i++)
+        {
+            uint64_t count = 0, nblocks = 0;
+            get(r, &count, 8);
+            get(r, &nblocks, 8);
+            // checked before the layer is allocated
+            if (nblocks != bloom_layer_blocks(bloom, i)
+                || nblocks > (size_t)(r.end - r.cur) / k_bloom_block)
+            {
+                r.err = true;
+                break;
+            }
+            BloomLayer *layer = bloom_grow(bloom);
+            memcpy(layer->blocks, get_bytes(r, nblocks * k_bloom_block), nblocks * k_bloom_block);
+            layer->count = count;
+        }
+        return ent;
+    }
+
+    if (type == T_CMS)
+    {
+        ent->cms = slab_new<CMS>();
+        snap_get_cms(r, ent->cms);
+        return ent;
+    }
+
+    if (type == T_TOPK)
+    {
+        TopK *topk = ent->topk = slab_new<TopK>();
+        uint32_t k = 0, n = 0;
+        get(r, &k, 4);
+        snap_get_cms(r, &topk->cms);
+        get(r, &n, 4);
+        if (r.err || k == 0 || k > k_topk_max || n > k)
+        {
+            r.err = true;
+            return ent;
+        }
+        topk->k = k;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint64_t count = 0;
+            uint32_t len = 0;
+            get(r, &count, 8);
+            get(r, &len, 4);
+            const char *name = get_bytes(r, len);
+            if (!name)
+            {
+                break;
+            }
+            topk_load(topk, name, len, count);
+        }
+        return ent;
+    }
+
+    if (type == T_TS)
+    {
+        TSeries *series = ent->series = slab_new<TSeries>();
+        uint32_t n = 0;
+        get(r, &series->retention, 8);
+        get(r, &n, 4);
+        for (uint32_t i = 0; i < n && !r.err; i++)
+        {
+            uint32_t nbits = 0, count = 0;
+            get(r, &nbits, 4);
+            get(r, &count, 4);
+            size_t len = ((size_t)nbits + 63) / 64 * 8;
+            const char *data = get_bytes(r, len);
+            if (!data || !ts_load_chunk(series, data, len, nbits, count))
+            {
+                r.err = true;
+            }
+        }
+        return ent;
+    }
+
+    // the members are stored sorted, so the zset is built without comparisons
+    ent->zset = slab_new<ZSet>();
+    uint64_t n = 0;
+    get(r, &n, 8);
+    if (n > (size_t)(r.end - r.cur) / 12)
+    {
+        r.err = true;
+        return ent;
+    }
+    std::vector<ZNode *> nodes;
+    nodes.reserve(n);
+    for (uint64_t i = 0; i < n; i++)
+    {
+        double score = 0;
+        uint32_t len = 0;
+        get(r, &score, 8);
+        get(r, &len, 4);
+        const char *name = get_bytes(r, len);
+        if (!name)
+        {
+            break;
+        }
+        nodes.push_back(znode_new(name, len, score));
+    }
+    zset_build(ent->zset, nodes.data(), nodes.size());
+    return ent;
+}
+
+// tiered storage, see the Tier struct
+static void tier_unlink(Entry *ent)
+{
+    if (ent->tier_node.next)
+    {
+        dlist_detach(&ent->tier_node);
+        ent->tier_node = DList();
+    }
+}
+
+// update the access time of a resident entry
+static void tier_touch(Entry *ent)
+{
+    if (!g_tier.enabled || ent->tier_len)
+    {
+        return;
+    }
+    tier_unlink(ent);
+    size_t size = 0;
+    switch (ent->type)
+    {
+    case T_STR:
+        size = ent->val.size();
+        break;
+    case T_ZSET:
+        size = hm_size(&ent->zset->hmap) * (sizeof(ZNode) + 16);
+        break;
+    case T_HASH:
+        size = ent->hash->is_map ? hm_size(&ent->hash->map) * (sizeof(HashNode) + 32)
+                                 : ent->hash->packed.size();
+        break;
+    case T_LIST:
+        size = ent->list->nchunks * k_qchunk_bytes;
+        break;
+    case T_SET:
+        size = ent->set->is_map ? hm_size(&ent->set->map) * (sizeof(SetNode) + 16)
+                                : ent->set->ints.size() * 8;
+        break;
+    case T_STREAM:
+        size = ent->stream->nnodes * k_snode_bytes;
+        break;
+    case T_VSET:
+        size = vset_size(ent->vset) * (ent->vset->dim * (ent->vset->q8 ? 1 : 4) + sizeof(VNode) + 16);
+        break;
+    case T_BLOOM:
+        size = bloom_bytes(ent->bloom);
+        break;
+    case T_CMS:
+        size = ent->cms->counters.size() * 4;
+        break;
+    case T_TOPK:
+        size = ent->topk->cms.counters.size() * 4 + ent->topk->heap.size() * (sizeof(TopKNode) + 16);
+        break;
+    case T_TS:
+        size = ts_bytes(ent->series);
+        break;
+    }
+    if (size >= g_tier.min_size)
+    {
+        ent->atime_us = get_monotonic_usec();
+        dlist_insert_before(&g_tier.lru, &ent->tier_node);
+    }
+}
+
+// move the value of a cold entry to the tier file
+static void tier_spill(Entry *ent)
+{
+    Tier &tier = g_tier;
+    std::string buf;
+    snap_put_entry(buf, ent, 0, 0);
+    if (0 != write_all(tier.fd, buf.data(), buf.size()))
+    {
+        die("write() tier file");
+    }
+    ent->tier_off = tier.size;
+    ent->tier_len = (uint32_t)buf.size();
+    tier.size += buf.size();
+    tier.live += buf.size();
+    tier.nspilled++;
+
+    defrag_forget(ent);
+    entry_free_value(ent);
+    tier_unlink(ent);
+    dlist_insert_before(&tier.spilled, &ent->tier_node);
+}
+
+// the entry is deleted
+static void tier_forget(Entry *ent)
+{
+    if (ent->tier_len)
+    {
+        g_tier.live -= ent->tier_len;
+        g_tier.nspilled--;
+    }
+    tier_unlink(ent);
+}
+
+static Entry *tier_decode(const uint8_t *data, uint32_t len)
+{
+    SnapReader r;
+    r.cur = data;
+    r.end = data + len;
+    int64_t expire_ms = 0;
+    Entry *ent = snap_get_entry(r, expire_ms);
+    if (r.err && ent)
+    {
+        entry_destroy(ent);
+        ent = NULL;
+    }
+    return ent;
+}
+
+static Entry *tier_pread(int fd, uint64_t off, uint32_t len)
+{
+    std::string buf(len, '\0');
+    if ((ssize_t)len != pread(fd, &buf[0], len, (off_t)off))
+    {
+        return NULL;
+    }
+    return tier_decode((uint8_t *)buf.data(), len);
+}
+
+// read a spilled value into a temporary entry, without bringing it back
+static Entry *tier_read(Entry *ent)
+{
+    Entry *cold = tier_pread(g_tier.fd, ent->tier_off, ent->tier_len);
+    if (!cold)
+    {
+        die("read tier file");
+    }
+    return cold;
+}
+
+// make the entry resident with the value that was read back
+static void tier_install(Entry *ent, Entry *cold)
+{
+    tier_forget(ent);
+    ent->tier_off = 0;
+    ent->tier_len = 0;
+    ent->val.swap(cold->val);
+    std::swap(ent->ptr, cold->ptr);
+    entry_destroy(cold);
+    g_tier.nfaults++;
+}
+
+// for the paths that can't wait
+static void tier_load_sync(Entry *ent)
+{
+    tier_install(ent, tier_read(ent));
+}
+
+static void tier_load_done(void *arg)
+{
+    TierLoad *load = (TierLoad *)arg;
+    std::vector<TierLoad *> &loads = g_tier.loads;
+    loads.erase(std::find(loads.begin(), loads.end(), load));
+    if (!load->cold)
+    {
+        die("read tier file");
+    }
+
+    // the entry may have changed in the meantime
+    Entry *ent = db_lookup(load->key);
+    bool same = ent && ent->tier_len && ent->tier_off == load->off && load->gen == g_tier.gen;
+    if (same)
+    {
+        tier_install(ent, load->cold);
+    }
+    else
+    {
+        entry_destroy(load->cold);
+    }
+
+    // replay the parked requests
+    for (Conn *conn : load->waiters)
+    {
+        conn_resume(conn);
+    }
+    delete load;
+}
+
+static void tier_load_job(void *arg)
+{
+    TierLoad *load = (TierLoad *)arg;
+    load->cold = tier_pread(load->fd, load->off, load->len);
+    loop_post(&tier_load_done, load);
+}
+
+// commands that don't need the value
+static bool cmd_is_valueless(const std::string &word)
+{
+    static const char *k_names[] = {"del", "pexpire", "pexpireat", "pttl"};
+    for (const char *name : k_names)
+    {
+        if (cmd_is(word, name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// park the connection if the request needs a spilled value
+static bool tier_park(Conn *conn, const std::vector<std::string> &cmd)
+{
+    if (!g_tier.enabled || cmd.size() < 2 || !cmd_has_key(cmd[0]) || cmd_is_valueless(cmd[0]))
+    {
+        return false;
+    }
+    Entry *ent = db_lookup(cmd[1]);
+    if (!ent || !ent->tier_len)
+    {
+        return false;
+    }
+
+    TierLoad *load = NULL;
+    for (TierLoad *cur : g_tier.loads)
+    {
+        if (cur->key == cmd[1])
+        {
+            load = cur;
+        }
+    }
+    if (!load)
+    {
+        load = new TierLoad();
+        load->key = cmd[1];
+        load->fd = g_tier.fd;
+        load->off = ent->tier_off;
+        load->len = ent->tier_len;
+        load->gen = g_tier.gen;
+        g_tier.loads.push_back(load);
+        thread_pool_queue(&g_data.tp, &tier_load_job, load);
+    }
+    load->waiters.push_back(conn);
+    conn->state = STATE_WAIT;
+    return true;
+}
+
+// a parked connection is closed
+static void tier_unpark(Conn *conn)
+{
+    for (TierLoad *load : g_tier.loads)
+    {
+        std::vector<Conn *> &w = load->waiters;
+        w.erase(std::remove(w.begin(), w.end(), conn), w.end());
+    }
+}
+
+static void tier_compact_done(void *arg)
+{
+    (void)arg;
+    g_tier.compact_done = true;
+}
+
+static void tier_compact_job(void *arg)
+{
+    TierCompact *job = (TierCompact *)arg;
+    std::string buf;
+    for (auto &rec : job->recs)
+    {
+        size_t start = buf.size();
+        buf.resize(start + rec.second);
+        ssize_t rv = pread(job->old_fd, &buf[start], rec.second, (off_t)rec.first);
+        job->err = job->err || rv != (ssize_t)rec.second;
+        job->new_offs.push_back(job->end);
+        job->end += rec.second;
+        if (buf.size() >= (1 << 20))
+        {
+            job->err = job->err || 0 != write_all(job->new_fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+    job->err = job->err || 0 != write_all(job->new_fd, buf.data(), buf.size());
+    loop_post(&tier_compact_done, NULL);
+}
+
+static void tier_compact_start()
+{
+    Tier &tier = g_tier;
+    TierCompact *job = new TierCompact();
+    job->path = tier.path + ".compact";
+    job->new_fd = open(job->path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (job->new_fd < 0)
+    {
+        msg("tier: cannot compact");
+        delete job;
+        return;
+    }
+    job->old_fd = tier.fd;
+    for (DList *node = tier.spilled.next; node != &tier.spilled; node = node->next)
+    {
+        Entry *ent = container_of(node, Entry, tier_node);
+        job->recs.push_back(std::make_pair(ent->tier_off, ent->tier_len));
+    }
+    std::sort(job->recs.begin(), job->recs.end());
+    tier.compact = job;
+    // the file is appended during the compaction, those records are copied at the end
+    tier.compact_start = tier.size;
+    thread_pool_queue(&g_data.tp, &tier_compact_job, job);
+}
+
+// switch to the compacted file once no reads are in flight
+static void tier_compact_finish()
+{
+    Tier &tier = g_tier;
+    TierCompact *job = tier.compact;
+    tier.compact = NULL;
+    tier.compact_done = false;
+
+    // the records appended since the start
+    uint64_t tail = job->end;
+    std::string buf(tier.size - tier.compact_start, '\0');
+    ssize_t rv = pread(tier.fd, &buf[0], buf.size(), (off_t)tier.compact_start);
+    job->err = job->err || rv != (ssize_t)buf.size();
+    job->err = job->err || 0 != write_all(job->new_fd, buf.data(), buf.size());
+    if (job->err || 0 != rename(job->path.c_str(), tier.path.c_str()))
+    {
+        msg("tier: compaction failed");
+        close(job->new_fd);
+        unlink(job->path.c_str());
+        delete job;
+        return;
+    }
+
+    for (DList *node = tier.spilled.next; node != &tier.spilled; node = node->next)
+    {
+        Entry *ent = container_of(node, Entry, tier_node);
+        if (ent->tier_off >= tier.compact_start)
+        {
+            ent->tier_off = tail + (ent->tier_off - tier.compact_start);
+            continue;
+        }
+        auto it = std::lower_bound(
+            job->recs.begin(), job->recs.end(), std::make_pair(ent->tier_off, (uint32_t)0));
+        assert(it != job->recs.end() && it->first == ent->tier_off);
+        ent->tier_off = job->new_offs[it - job->recs.begin()];
+    }
+    close(tier.fd);
+    tier.fd = job->new_fd;
+    tier.size = tail + buf.size();
+    tier.gen++;
+    tier.ncompactions++;
+    delete job;
+}
+
+static void process_tier()
+{
+    Tier &tier = g_tier;
+    if (!tier.enabled)
+    {
+        return;
+    }
+
+    // spill the cold entries, a bounded amount per iteration
+    uint64_t now_us = get_monotonic_usec();
+    size_t spilled = 0;
+    while (!dlist_empty(&tier.lru) && spilled < k_tier_spill_budget)
+    {
+        Entry *ent = container_of(tier.lru.next, Entry, tier_node);
+        if (now_us - ent->atime_us < tier.cold_us)
+        {
+            break;
+        }
+        if (ent->migrating)
+        {
+            // the migration still reads the value, try again later
+            tier_touch(ent);
+            continue;
+        }
+        tier_spill(ent);
+        spilled += ent->tier_len;
+    }
+
+    // compact when it's mostly garbage
+    if (tier.compact_done && tier.loads.empty())
+    {
+        tier_compact_finish();
+    }
+    bool child = g_data.aof.child > 0 || g_data.snap.child > 0;
+    if (!tier.compact && !child && tier.size >= k_tier_compact_min && tier.live * 2 < tier.size)
+    {
+        tier_compact_start();
+    }
+}
+
+// tier stats
+static void do_tier(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    Tier &tier = g_tier;
+    out_arr(out, 10);
+    out_str(out, "spilled_keys");
+    out_int(out, (int64_t)tier.nspilled);
+    out_str(out, "live_bytes");
+    out_int(out, (int64_t)tier.live);
+    out_str(out, "file_bytes");
+    out_int(out, (int64_t)tier.size);
+    out_str(out, "faults");
+    out_int(out, (int64_t)tier.nfaults);
+    out_str(out, "compactions");
+    return out_int(out, (int64_t)tier.ncompactions);
+}
+
+static void tier_open(const char *path)
+{
+    Tier &tier = g_tier;
+    tier.enabled = true;
+    tier.path = path;
+    // only a cache of the key space, it doesn't survive a restart
+    tier.fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (tier.fd < 0)
+    {
+        die("open tier file");
+    }
+    dlist_init(&tier.lru);
+    dlist_init(&tier.spilled);
+}
+
+// a section decoded by a worker thread
+struct SnapLoad
+{
+    SnapReader r;
+    uint64_t nkeys = 0;
+    uint64_t now_ms = 0;
+    std::vector<Entry *> ents;
+    std::vector<int64_t> expires;
+    WaitGroup *wg = NULL;
+};
+
+static void snap_load_section(void *arg)
+{
+    SnapLoad &job = *(SnapLoad *)arg;
+    job.ents.reserve(job.nkeys);
+    job.expires.reserve(job.nkeys);
+    for (uint64_t i = 0; i < job.nkeys && !job.r.err; i++)
+    {
+        int64_t expire_ms = -1;
+        Entry *ent = snap_get_entry(job.r, expire_ms);
+        if (ent && (job.r.err || (expire_ms >= 0 && (uint64_t)expire_ms <= job.now_ms)))
+        {
+            entry_destroy(ent); // bad or expired
+            continue;
+        }
+        if (ent)
+        {
+            job.ents.push_back(ent);
+            job.expires.push_back(expire_ms);
+        }
+    }
+    if (job.r.cur != job.r.end)
+    {
+        job.r.err = true;
+    }
+    wait_group_done(job.wg);
+}
+
+// mmap the snapshot and decode the sections on the thread pool
+static void snapshot_load(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+        {
+            die("open() snapshot");
+        }
+        return;
+    }
+    struct stat st = {};
+    if (0 != fstat(fd, &st))
+    {
+        die("fstat() snapshot");
+    }
+    size_t size = (size_t)st.st_size;
+    if (size < sizeof(SnapHeader))
+    {
+        die("bad snapshot");
+    }
+    uint64_t start_us = get_monotonic_usec();
+    const uint8_t *data = (const uint8_t *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        die("mmap() snapshot");
+    }
+    close(fd);
+    (void)madvise((void *)data, size, MADV_WILLNEED);
+
+    SnapHeader hdr = {};
+    memcpy(&hdr, data, sizeof(hdr));
+    if (0 != memcmp(hdr.magic, k_snap_magic, 4) || hdr.version != k_snap_version
+        || hdr.table_off > size || (size - hdr.table_off) / sizeof(SnapSection) != hdr.nsections)
+    {
+        die("bad snapshot");
+    }
+
+    std::vector<SnapLoad> jobs(hdr.nsections);
+    WaitGroup wg;
+    wait_group_init(&wg, jobs.size());
+    uint64_t now_ms = get_realtime_msec();
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        SnapSection sec = {};
+        memcpy(&sec, data + hdr.table_off + i * sizeof(sec), sizeof(sec));
+        if (sec.off > hdr.table_off || sec.size > hdr.table_off - sec.off)
+        {
+            die("bad snapshot");
+        }
+        jobs[i].r.cur = data + sec.off;
+        jobs[i].r.end = data + sec.off + sec.size;
+        jobs[i].nkeys = sec.nkeys;
+        jobs[i].now_ms = now_ms;
+        jobs[i].wg = &wg;
+        thread_pool_queue(&g_data.tp, &snap_load_section, &jobs[i]);
+    }
+    wait_group_wait(&wg);
+    munmap((void *)data, size);
+
+    // presized, so the inserts never trigger resizing
+    hm_reserve(&g_data.db, hdr.nkeys);
+    size_t nkeys = 0;
+    for (SnapLoad &job : jobs)
+    {
+        if (job.r.err)
+        {
+            die("bad snapshot");
+        }
+        for (size_t i = 0; i < job.ents.size(); i++)
+        {
+            db_insert(job.ents[i]);
+            if (job.expires[i] >= 0)
+            {
+                entry_set_ttl(job.ents[i], job.expires[i] - (int64_t)now_ms);
+            }
+            if (g_tier.enabled)
+            {
+                tier_touch(job.ents[i]);
+            }
+        }
+        nkeys += job.ents.size();
+    }
+
+    double secs = (double)(get_monotonic_usec() - start_us) / 1e6;
+    double mb = (double)size / (1 << 20);
+    fprintf(stderr, "snapshot: loaded %zu keys, %.1f MB in %.3f s (%.1f MB/s)\n",
+            nkeys, mb, secs, secs > 0 ? mb / secs : 0.0);
+}
+
+// replication:
+// the primary serializes each mutation once into the command stream, which is
+// batched per event loop iteration, appended to a circular backlog, and sent to
+// the replicas. A new replica gets a snapshot followed by the stream produced
+// since the snapshot started. A reconnecting replica asks for the stream from
+// its last offset, which is served from the backlog if it's still there.
+const size_t k_repl_max_pending = 256 << 20;
+const uint64_t k_repl_ping_us = 1000 * 1000;
+const uint64_t k_repl_retry_us = 1000 * 1000;
+
+static std::string gen_replid()
+{
+    uint8_t buf[20] = {};
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0 || (ssize_t)sizeof(buf) != read(fd, buf, sizeof(buf)))
+    {
+        die("/dev/urandom");
+    }
+    close(fd);
+    std::string id;
+    for (uint8_t b : buf)
+    {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", b);
+        id += hex;
+    }
+    return id;
+}
+
+static void conn_send(Conn *conn, const char *data, size_t size)
+{
+    if (conn->wbuf_sent > 0 && conn->wbuf_sent >= conn->wbuf.size() / 2)
+    {
+        conn->wbuf.erase(0, conn->wbuf_sent);
+        conn->wbuf_sent = 0;
+    }
+    conn->wbuf.append(data, size);
+    if (conn->state == STATE_REQ)
+    {
+        conn->state = STATE_RES;
+    }
+}
+
+// append to the command stream and the replicas
+static void repl_feed(const std::string &data)
+{
+    Repl &repl = g_data.repl;
+    size_t cap = repl.backlog.size();
+    const char *p = data.data();
+    size_t n = data.size();
+    if (n > cap)
+    {
+        p += n - cap; // only the tail fits
+        n = cap;
+    }
+    while (n > 0)
+    {
+        size_t chunk = std::min(n, cap - repl.backlog_idx);
+        memcpy(&repl.backlog[repl.backlog_idx], p, chunk);
+        repl.backlog_idx = (repl.backlog_idx + chunk) % cap;
+        p += chunk;
+        n -= chunk;
+    }
+    repl.backlog_histlen = std::min(cap, repl.backlog_histlen + data.size());
+    repl.offset += data.size();
+
+    for (Conn *conn : repl.replicas)
+    {
+        switch (conn->repl_state)
+        {
+        case REPL_ONLINE:
+            conn_send(conn, data.data(), data.size());
+            break;
+        case REPL_WAIT_SNAPSHOT_END:
+        case REPL_SEND_SNAPSHOT:
+            conn->repl_pending.append(data);
+            break;
+        }
+        if (conn->wbuf.size() + conn->repl_pending.size() > k_repl_max_pending)
+        {
+            msg("replica is too far behind");
+            conn->state = STATE_END;
+        }
+    }
+}
+
+// psync replid offset
+static void do_psync(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    Repl &repl = g_data.repl;
+    int64_t offset = 0;
+    if (!str2int(cmd[2], offset))
+    {
+        return out_err(out, ERR_ARG, "expect int64");
+    }
+    if (!conn || !repl.primary_host.empty())
+    {
+        return out_err(out, ERR_UNKNOWN, "not a primary");
+    }
+    if (repl.backlog.empty())
+    {
+        repl.backlog.resize(repl.backlog_size);
+    }
+
+    // replicas don't time out
+    dlist_detach(&conn->idle_list);
+    dlist_init(&conn->idle_list);
+    repl.replicas.push_back(conn);
+
+    uint64_t start = repl.offset - repl.backlog_histlen;
+    if (cmd[1] == repl.replid && offset >= (int64_t)start && offset <= (int64_t)repl.offset)
+    {
+        // partial resync, send the rest of the stream from the backlog
+        size_t cap = repl.backlog.size();
+        size_t skip = (size_t)(repl.offset - (uint64_t)offset);
+        size_t pos = (repl.backlog_idx + cap - skip) % cap;
+        while (skip > 0)
+        {
+            size_t chunk = std::min(skip, cap - pos);
+            conn->repl_pending.append(&repl.backlog[pos], chunk);
+            pos = (pos + chunk) % cap;
+            skip -= chunk;
+        }
+        // the pending stream goes out after this reply
+        conn->repl_state = REPL_SEND_SNAPSHOT;
+        repl.stat_partial_syncs++;
+        out_arr(out, 2);
+        out_str(out, "continue");
+        return out_str(out, repl.replid);
+    }
+
+    // full resync, the reply is deferred until the snapshot is done
+    conn->repl_state = REPL_WAIT_SNAPSHOT_START;
+    repl.stat_full_syncs++;
+}
+
+static int32_t snapshot_start_background();
+
+// the snapshot for the waiting replicas is done, send it
+static void repl_snapshot_done(bool ok)
+{
+    Repl &repl = g_data.repl;
+    for (Conn *conn : repl.replicas)
+    {
+        if (conn->repl_state != REPL_WAIT_SNAPSHOT_END)
+        {
+            continue;
+        }
+        int fd = ok ? open(g_data.snap.path.c_str(), O_RDONLY) : -1;
+        struct stat st = {};
+        if (fd < 0 || 0 != fstat(fd, &st))
+        {
+            msg("failed to send the snapshot");
+            conn->state = STATE_END;
+            continue;
+        }
+
+        std::string out;
+        out_arr(out, 4);
+        out_str(out, "fullresync");
+        out_str(out, repl.replid);
+        out_int(out, (int64_t)conn->repl_offset);
+        out_int(out, (int64_t)st.st_size);
+        uint32_t len = (uint32_t)out.size();
+        conn_send(conn, (char *)&len, 4);
+        conn_send(conn, out.data(), out.size());
+
+        conn->repl_snap_fd = fd;
+        conn->repl_snap_left = (size_t)st.st_size;
+        conn->repl_state = REPL_SEND_SNAPSHOT;
+    }
+}
+
+// stream the snapshot file to a replica, one chunk at a time,
+// then switch to the command stream
+static bool repl_refill(Conn *conn)
+{
+    if (conn->repl_state != REPL_SEND_SNAPSHOT)
+    {
+        return false;
+    }
+    if (conn->repl_snap_left > 0)
+    {
+        size_t chunk = std::min(conn->repl_snap_left, (size_t)64 * 1024);
+        conn->wbuf.resize(chunk);
+        ssize_t rv = read(conn->repl_snap_fd, &conn->wbuf[0], chunk);
+        if (rv <= 0)
+        {
+            msg("read() snapshot");
+            conn->wbuf.clear();
+            conn->state = STATE_END;
+            return false;
+        }
+        conn->wbuf.resize((size_t)rv);
+        conn->repl_snap_left -= (size_t)rv;
+        return true;
+    }
+    if (conn->repl_snap_fd >= 0)
+    {
+        close(conn->repl_snap_fd);
+        conn->repl_snap_fd = -1;
+    }
+    conn->wbuf.swap(conn->repl_pending);
+    std::string().swap(conn->repl_pending);
+    conn->repl_state = REPL_ONLINE;
+    return !conn->wbuf.empty();
+}
+
+static void repl_detach_replica(Conn *conn)
+{
+    std::vector<Conn *> &replicas = g_data.repl.replicas;
+    for (size_t i = 0; i < replicas.size(); i++)
+    {
+        if (replicas[i] == conn)
+        {
+            replicas.erase(replicas.begin() + i);
+            break;
+        }
+    }
+    if (conn->repl_snap_fd >= 0)
+    {
+        close(conn->repl_snap_fd);
+    }
+}
+
+static void conn_consume(Conn *conn, size_t n)
+{
+    size_t remain = conn->rbuf_size - n;
+    if (remain)
+    {
+        memmove(conn->rbuf, &conn->rbuf[n], remain);
+    }
+    conn->rbuf_size = remain;
+}
+
+static void cb_collect(HNode *node, void *arg)
+{
+    ((std::vector<Entry *> *)arg)->push_back(container_of(node, Entry, node));
+}
+
+// empty the key space
+static void db_flush()
+{
+    std::vector<Entry *> ents;
+    h_scan(&g_data.db.ht1, &cb_collect, &ents);
+    h_scan(&g_data.db.ht2, &cb_collect, &ents);
+    for (Entry *ent : ents)
+    {
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        entry_del(ent);
+    }
+    hm_destroy(&g_data.db);
+    // the keys loaded next have no versions to compare
+    for (auto &kv : g_tracking.clients)
+    {
+        kv.second->watch_dirty = !kv.second->watched.empty();
+    }
+}
+
+static bool read_str(const uint8_t *&cur, const uint8_t *end, std::string &out)
+{
+    uint32_t len = 0;
+    if (end - cur < 5 || cur[0] != SER_STR)
+    {
+        return false;
+    }
+    memcpy(&len, cur + 1, 4);
+    if ((size_t)(end - cur - 5) < len)
+    {
+        return false;
+    }
+    out.assign((char *)cur + 5, len);
+    cur += 5 + len;
+    return true;
+}
+
+static bool read_int(const uint8_t *&cur, const uint8_t *end, int64_t &out)
+{
+    if (end - cur < 9 || cur[0] != SER_INT)
+    {
+        return false;
+    }
+    memcpy(&out, cur + 1, 8);
+    cur += 9;
+    return true;
+}
+
+// the reply to psync: ["fullresync", replid, offset, size] or ["continue", replid]
+static bool repl_handshake(const uint8_t *data, size_t len)
+{
+    Repl &repl = g_data.repl;
+    const uint8_t *cur = data + 5;
+    const uint8_t *end = data + len;
+    std::string kind, replid;
+    if (len < 5 || data[0] != SER_ARR || !read_str(cur, end, kind) || !read_str(cur, end, replid))
+    {
+        return false;
+    }
+    if (kind == "continue")
+    {
+        fprintf(stderr, "replication: partial resync from offset %zu\n", (size_t)repl.primary_offset);
+        repl.primary_replid = replid;
+        repl.link_state = LINK_CONNECTED;
+        return true;
+    }
+
+    int64_t offset = 0, size = 0;
+    if (kind != "fullresync" || !read_int(cur, end, offset) || !read_int(cur, end, size))
+    {
+        return false;
+    }
+    std::string tmp = g_data.snap.path + ".repl";
+    repl.transfer_fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (repl.transfer_fd < 0)
+    {
+        return false;
+    }
+    fprintf(stderr, "replication: full resync, %zu bytes\n", (size_t)size);
+    repl.primary_replid = replid;
+    repl.primary_offset = (uint64_t)offset;
+    repl.transfer_left = (uint64_t)size;
+    repl.link_state = LINK_TRANSFER;
+    return true;
+}
+
+static void snapshot_load(const char *path);
+
+// process the input from the primary, which is not replied to
+static bool repl_try_one(Conn *conn)
+{
+    Repl &repl = g_data.repl;
+    if (repl.link_state == LINK_TRANSFER)
+    {
+        size_t n = (size_t)std::min<uint64_t>(repl.transfer_left, conn->rbuf_size);
+        if (0 != write_all(repl.transfer_fd, (char *)conn->rbuf, n))
+        {
+            msg("write() replication snapshot");
+            conn->state = STATE_END;
+            return false;
+        }
+        conn_consume(conn, n);
+        repl.transfer_left -= n;
+        if (repl.transfer_left > 0)
+        {
+            return false;
+        }
+
+        // replace the key space with the snapshot
+        close(repl.transfer_fd);
+        repl.transfer_fd = -1;
+        std::string tmp = g_data.snap.path + ".repl";
+        if (0 != rename(tmp.c_str(), g_data.snap.path.c_str()))
+        {
+            die("rename() replication snapshot");
+        }
+        db_flush();
+        snapshot_load(g_data.snap.path.c_str());
+        repl.link_state = LINK_CONNECTED;
+        return true;
+    }
+
+    if (conn->rbuf_size < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[0], 4);
+    if (len > k_max_msg)
+    {
+        msg("too long");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + len > conn->rbuf_size)
+    {
+        return false;
+    }
+
+    if (repl.link_state == LINK_HANDSHAKE)
+    {
+        if (!repl_handshake(&conn->rbuf[4], len))
+        {
+            msg("bad psync reply");
+            conn->state = STATE_END;
+            return false;
+        }
+        conn_consume(conn, 4 + len);
+        return true;
+    }
+
+    // apply the command stream
+    std::vector<std::string> cmd;
+    if (0 != parse_req(&conn->rbuf[4], len, cmd))
+    {
+        msg("bad req");
+        conn->state = STATE_END;
+        return false;
+    }
+    repl.applying = true;
+    replay_record(repl.replay, cmd);
+    repl.applying = false;
+    // a transaction is resent from its start after a reconnect
+    repl.txn_bytes += 4 + len;
+    if (!repl.replay.in_txn)
+    {
+        repl.primary_offset += repl.txn_bytes;
+        repl.txn_bytes = 0;
+    }
+    conn_consume(conn, 4 + len);
+    return true;
+}
+
+static Conn *conn_new(int fd);
+
+// connect to the primary, the psync request goes out once connected
+static void repl_connect()
+{
+    Repl &repl = g_data.repl;
+    repl.link_retry_us = get_monotonic_usec() + k_repl_retry_us;
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(repl.primary_port);
+    if (1 != inet_pton(AF_INET, repl.primary_host.c_str(), &addr.sin_addr))
+    {
+        msg("bad primary address");
+        return;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        msg("socket() error");
+        return;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    if (rv < 0 && errno != EINPROGRESS)
+    {
+        msg("connect() error");
+        close(fd);
+        return;
+    }
+
+    Conn *conn = conn_new(fd);
+    std::string replid = repl.primary_replid.empty() ? "?" : repl.primary_replid;
+    cmd_serialize(conn->wbuf, {"psync", replid, std::to_string(repl.primary_offset)});
+    conn->state = STATE_RES;
+    repl.link = conn;
+    repl.link_state = LINK_HANDSHAKE;
+}
+
+static void repl_link_lost()
+{
+    Repl &repl = g_data.repl;
+    repl.link = NULL;
+    repl.replay = Replay();
+    repl.txn_bytes = 0;
+    if (repl.transfer_fd >= 0)
+    {
+        close(repl.transfer_fd);
+        repl.transfer_fd = -1;
+        unlink((g_data.snap.path + ".repl").c_str());
+    }
+    repl.link_state = repl.primary_host.empty() ? LINK_NONE : LINK_CONNECT;
+}
+
+static void conn_done(Conn *conn);
+
+// replicaof host port | replicaof no one
+static void do_replicaof(std::vector<std::string> &cmd, std::string &out)
+{
+    Repl &repl = g_data.repl;
+    bool no_one = cmd_is(cmd[1], "no") && cmd_is(cmd[2], "one");
+    int64_t port = 0;
+    if (!no_one && (!str2int(cmd[2], port) || port <= 0 || port > 65535))
+    {
+        return out_err(out, ERR_ARG, "expect port");
+    }
+    if (!no_one && !repl.replicas.empty())
+    {
+        return out_err(out, ERR_UNKNOWN, "has replicas");
+    }
+
+    // a new primary means a different stream
+    if (no_one || cmd[1] != repl.primary_host || port != repl.primary_port)
+    {
+        repl.primary_replid.clear();
+        repl.primary_offset = 0;
+    }
+    repl.primary_host = no_one ? "" : cmd[1];
+    repl.primary_port = (uint16_t)port;
+    if (repl.link)
+    {
+        conn_done(repl.link);
+    }
+    repl_link_lost();
+    repl.link_retry_us = 0;
+    return out_nil(out);
+}
+
+static void do_role(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    Repl &repl = g_data.repl;
+    if (repl.primary_host.empty())
+    {
+        out_arr(out, 5);
+        out_str(out, "primary");
+        out_int(out, (int64_t)repl.offset);
+        out_int(out, (int64_t)repl.replicas.size());
+        out_int(out, (int64_t)repl.stat_full_syncs);
+        return out_int(out, (int64_t)repl.stat_partial_syncs);
+    }
+    static const char *k_link_states[] = {"none", "connect", "handshake", "transfer", "connected"};
+    out_arr(out, 5);
+    out_str(out, "replica");
+    out_str(out, repl.primary_host);
+    out_int(out, repl.primary_port);
+    out_str(out, k_link_states[repl.link_state]);
+    return out_int(out, (int64_t)repl.primary_offset);
+}
+
+static void process_replication()
+{
+    Repl &repl = g_data.repl;
+    uint64_t now_us = get_monotonic_usec();
+
+    // as a primary, keep the replica links alive and send this iteration's batch
+    if (!repl.replicas.empty() && repl.batch.empty() && now_us - repl.last_send_us >= k_repl_ping_us)
+    {
+        cmd_serialize(repl.batch, {"ping"});
+    }
+    if (!repl.batch.empty())
+    {
+        repl_feed(repl.batch);
+        repl.batch.clear();
+        repl.last_send_us = now_us;
+    }
+
+    // start a snapshot for the new replicas, they get the stream from now on
+    bool waiting = false;
+    for (Conn *conn : repl.replicas)
+    {
+        waiting = waiting || conn->repl_state == REPL_WAIT_SNAPSHOT_START;
+    }
+    if (waiting && g_data.aof.child < 0 && g_data.snap.child < 0 && !g_data.snap.writer
+        && 0 == snapshot_start_background())
+    {
+        for (Conn *conn : repl.replicas)
+        {
+            if (conn->repl_state == REPL_WAIT_SNAPSHOT_START)
+            {
+                conn->repl_state = REPL_WAIT_SNAPSHOT_END;
+                conn->repl_offset = repl.offset;
+            }
+        }
+    }
+
+    // as a replica
+    if (repl.link_state == LINK_CONNECT && now_us >= repl.link_retry_us)
+    {
+        repl_connect();
+    }
+}
+
+// slot migration:
+// the source streams the keys of a migrating slot to the target over a link
+// that the target trusts to write into its importing slot. Each step sends a
+// bounded batch of commands, a large zset is sent as a series of ZADDs over
+// several steps. A key is deleted from the source once the target has acked
+// all of its commands. While a key is in flight, writes to it get TRYAGAIN,
+// and requests for keys no longer at the source get ASK to the target.
+const size_t k_migrate_batch = 16 * 1024;
+const uint64_t k_migrate_inflight = 512;
+
+struct Migration
+{
+    int32_t slot = -1;
+    int32_t target = -1;
+    Conn *link = NULL;
+    // the key being sent, and the next zset member, or the hash cursor or
+    // list position to send
+    Entry *ent = NULL;
+    ZNode *cursor = NULL;
+    uint64_t pos = 0;
+    // commands sent and replies received
+    uint64_t sent = 0;
+    uint64_t acked = 0;
+    // the keys fully sent, by the number of commands that must be acked
+    std::deque<std::pair<uint64_t, Entry *>> done;
+    // the ownership change is sent
+    bool finishing = false;
+    size_t nmoved = 0;
+};
+
+static Migration g_migration;
+
+static void migrate_send(std::string &buf, const std::vector<std::string> &cmd)
+{
+    cmd_serialize(buf, cmd);
+    g_migration.sent++;
+}
+
+static void migrate_reset()
+{
+    Migration &mig = g_migration;
+    if (mig.ent)
+    {
+        mig.ent->migrating = false;
+    }
+    for (auto &item : mig.done)
+    {
+        item.second->migrating = false;
+    }
+    if (mig.link)
+    {
+        mig.link->state = STATE_END; // reaped by the event loop
+    }
+    mig = Migration();
+}
+
+static void migrate_abort(const char *reason)
+{
+    fprintf(stderr, "migration: slot %d aborted: %s\n", g_migration.slot, reason);
+    migrate_reset();
+}
+
+// a key in flight is deleted by expiration
+static void migrate_forget(Entry *ent)
+{
+    Migration &mig = g_migration;
+    ent->migrating = false;
+    if (ent == mig.ent)
+    {
+        mig.ent = NULL;
+        mig.cursor = NULL;
+    }
+    for (size_t i = 0; i < mig.done.size(); i++)
+    {
+        if (mig.done[i].second == ent)
+        {
+            mig.done.erase(mig.done.begin() + i);
+            break;
+        }
+    }
+    if (mig.link)
+    {
+        migrate_send(mig.link->wbuf, {"del", ent->key});
+        mig.link->state = STATE_RES;
+    }
+}
+
+// the replies from the target
+static bool migrate_try_one(Conn *conn)
+{
+    if (conn->rbuf_size < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[0], 4);
+    if (len > k_max_msg)
+    {
+        migrate_abort("bad reply");
+        return false;
+    }
+    if (4 + len > conn->rbuf_size)
+    {
+        return false;
+    }
+    if (len == 0 || conn->rbuf[4] == SER_ERR)
+    {
+        migrate_abort("error from the target");
+        return false;
+    }
+    g_migration.acked++;
+    conn_consume(conn, 4 + len);
+    return true;
+}
+
+static int32_t migrate_connect(const std::string &addr)
+{
+    struct sockaddr_in sa = {};
+    sa.sin_family = AF_INET;
+    size_t colon = addr.rfind(':');
+    sa.sin_port = htons((uint16_t)atoi(addr.c_str() + colon + 1));
+    if (colon == std::string::npos
+        || 1 != inet_pton(AF_INET, addr.substr(0, colon).c_str(), &sa.sin_addr))
+    {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    fd_set_nb(fd);
+    int rv = connect(fd, (const struct sockaddr *)&sa, sizeof(sa));
+    if (rv < 0 && errno != EINPROGRESS)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// start moving a slot to the target
+static int32_t migrate_start(uint32_t slot, int32_t target)
+{
+    Migration &mig = g_migration;
+    Cluster &cl = g_data.cluster;
+    int fd = migrate_connect(cl.nodes[target]);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    mig.slot = (int32_t)slot;
+    mig.target = target;
+    mig.link = conn_new(fd);
+    migrate_send(mig.link->wbuf, {"cluster", "setslot", std::to_string(slot), "importing", cl.myself});
+    mig.link->state = STATE_RES;
+    return 0;
+}
+
+// queue the commands for a part of the current key
+static void migrate_key(std::string &buf)
+{
+    Migration &mig = g_migration;
+    Entry *ent = mig.ent;
+    if (ent->type == T_ZSET && mig.cursor)
+    {
+        mig.cursor = zset_emit(buf, ent->key, mig.cursor, k_migrate_batch, mig.sent);
+        if (mig.cursor)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_HASH)
+    {
+        mig.pos = hash_emit(buf, ent->key, ent->hash, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_LIST)
+    {
+        mig.pos = list_emit(buf, ent->key, ent->list, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_SET)
+    {
+        mig.pos = set_emit(buf, ent->key, ent->set, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_STREAM)
+    {
+        mig.pos = stream_emit(buf, ent->key, ent->stream, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_VSET)
+    {
+        mig.pos = vset_emit(buf, ent->key, ent->vset, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_BLOOM)
+    {
+        mig.pos = bloom_emit(buf, ent->key, ent->bloom, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_CMS || ent->type == T_TOPK)
+    {
+        CMS *cms = ent->type == T_TOPK ? &ent->topk->cms : ent->cms;
+        TopK *topk = ent->type == T_TOPK ? ent->topk : NULL;
+        mig.pos = sketch_emit(buf, ent->key, cms_init_cmd(ent->key, ent), cms, topk, mig.pos,
+                              k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_TS)
+    {
+        mig.pos = series_emit(buf, ent->key, ent->series, mig.pos, k_migrate_batch, mig.sent);
+        if (mig.pos)
+        {
+            return;
+        }
+    }
+    else if (ent->type == T_STR)
+    {
+        mig.sent += str_emit(buf, ent->key, ent->val);
+    }
+
+    int64_t expire_ms = entry_expire_at_ms(ent, get_monotonic_usec(), get_realtime_msec());
+    if (expire_ms >= 0)
+    {
+        migrate_send(buf, {"pexpireat", ent->key, std::to_string(expire_ms)});
+    }
+    mig.done.push_back(std::make_pair(mig.sent, ent));
+    mig.ent = NULL;
+}
+
+static void process_migration()
+{
+    Migration &mig = g_migration;
+    Cluster &cl = g_data.cluster;
+    if (mig.slot < 0)
+    {
+        return;
+    }
+
+    // the target has the keys, delete them here
+    while (!mig.done.empty() && mig.done.front().first <= mig.acked)
+    {
+        Entry *ent = mig.done.front().second;
+        mig.done.pop_front();
+        ent->migrating = false;
+        hm_pop(&g_data.db, &ent->node, &hnode_same);
+        if (propagating())
+        {
+            std::vector<std::string> cmd = {"del", ent->key};
+            propagate(cmd);
+        }
+        entry_del(ent);
+        mig.nmoved++;
+    }
+    if (mig.finishing)
+    {
+        if (mig.acked == mig.sent)
+        {
+            cl.owner[mig.slot] = mig.target;
+            fprintf(stderr, "migration: slot %d moved to %s, %zu keys\n",
+                    mig.slot, cl.nodes[mig.target].c_str(), mig.nmoved);
+            migrate_reset();
+        }
+        return;
+    }
+
+    // a bounded batch per step
+    Conn *link = mig.link;
+    if (link->wbuf.size() - link->wbuf_sent >= k_migrate_batch
+        || mig.sent - mig.acked >= k_migrate_inflight)
+    {
+        return;
+    }
+    std::string buf;
+    while (buf.size() < k_migrate_batch && mig.sent - mig.acked < k_migrate_inflight)
+    {
+        if (!mig.ent)
+        {
+            // the keys in flight are moved to the tail of the list
+            DList *head = &cl.slot_keys[mig.slot];
+            Entry *ent = container_of(head->next, Entry, slot_node);
+            if (head->next == head || ent->migrating)
+            {
+                break;
+            }
+            dlist_detach(&ent->slot_node);
+            dlist_insert_before(head, &ent->slot_node);
+            ent->migrating = true;
+            mig.ent = ent;
+            if (ent->tier_len)
+            {
+                tier_load_sync(ent);
+            }
+            mig.cursor = ent->type == T_ZSET ? zset_query(ent->zset, -INFINITY, "", 0, 0) : NULL;
+            mig.pos = 0;
+            migrate_send(buf, {"del", ent->key});
+        }
+        migrate_key(buf);
+    }
+
+    // all keys are sent, hand over the slot once they are acked
+    if (!mig.ent && mig.done.empty() && mig.acked == mig.sent
+        && dlist_empty(&cl.slot_keys[mig.slot]))
+    {
+        std::string slot = std::to_string(mig.slot);
+        migrate_send(buf, {"cluster", "setslot", slot, "node", cl.nodes[mig.target]});
+        mig.finishing = true;
+    }
+    if (!buf.empty())
+    {
+        conn_send(link, buf.data(), buf.size());
+    }
+}
+
+// cluster mode:
+// the slots are assigned to servers by a config file shared by all of them,
+// one `first-last host:port` range per line. A request for a key in a slot
+// served by another server gets a MOVED error with the owner's address.
+static int32_t cluster_node(const std::string &addr)
+{
+    Cluster &cl = g_data.cluster;
+    for (size_t i = 0; i < cl.nodes.size(); i++)
+    {
+        if (cl.nodes[i] == addr)
+        {
+            return (int32_t)i;
+        }
+    }
+    cl.nodes.push_back(addr);
+    return (int32_t)cl.nodes.size() - 1;
+}
+
+static void cluster_init(const char *path)
+{
+    Cluster &cl = g_data.cluster;
+    cl.enabled = true;
+    cl.owner.assign(k_cluster_slots, -1);
+    cl.importing.assign(k_cluster_slots, -1);
+    cl.slot_count.assign(k_cluster_slots, 0);
+    cl.slot_keys.resize(k_cluster_slots);
+    for (DList &head : cl.slot_keys)
+    {
+        dlist_init(&head);
+    }
+    (void)cluster_node(cl.myself);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        die("open cluster config");
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp))
+    {
+        unsigned first = 0, last = 0;
+        char addr[200] = {};
+        if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+        {
+            continue;
+        }
+        if (3 != sscanf(line, "%u-%u %199s", &first, &last, addr)
+            || first > last || last >= k_cluster_slots)
+        {
+            die("bad cluster config");
+        }
+        int32_t node = cluster_node(addr);
+        for (uint32_t slot = first; slot <= last; slot++)
+        {
+            cl.owner[slot] = node;
+        }
+    }
+    fclose(fp);
+}
+
+// check if the key is served here, otherwise output the redirection
+static bool cluster_route(const std::string &key, bool write, bool asking, std::string &out)
+{
+    Cluster &cl = g_data.cluster;
+    uint32_t slot = key_hash_slot(key.data(), key.size());
+    int32_t node = cl.owner[slot];
+    if (node == 0 && g_migration.slot == (int32_t)slot)
+    {
+        // the slot is being moved away
+        Entry *ent = db_lookup(key);
+        if (!ent)
+        {
+            out_err(out, ERR_ASK, std::to_string(slot) + " " + cl.nodes[g_migration.target]);
+            return false;
+        }
+        if (ent->migrating && write)
+        {
+            out_err(out, ERR_TRYAGAIN, "the key is being moved");
+            return false;
+        }
+    }
+    if (node == 0)
+    {
+        return true; // myself
+    }
+    if (asking && cl.importing[slot] >= 0)
+    {
+        return true;
+    }
+    if (node < 0)
+    {
+        out_err(out, ERR_CLUSTERDOWN, "slot " + std::to_string(slot) + " is not served");
+        return false;
+    }
+    out_err(out, ERR_MOVED, std::to_string(slot) + " " + cl.nodes[node]);
+    return false;
+}
+
+// a command runs where its keys are, so they all have to be in one slot
+static bool cluster_route_keys(const std::vector<std::string> &cmd, const std::vector<size_t> &keys,
+                               bool write, bool asking, std::string &out)
+{
+    uint32_t slot = 0;
+    size_t here = 0;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        const std::string &key = cmd[keys[i]];
+        uint32_t s = key_hash_slot(key.data(), key.size());
+        if (i > 0 && s != slot)
+        {
+            out_err(out, ERR_CROSSSLOT, "the keys are in different slots");
+            return false;
+        }
+        slot = s;
+        here += db_lookup(key) != NULL;
+    }
+    // some of the keys have been moved and the others not yet
+    if (keys.size() > 1 && g_migration.slot == (int32_t)slot && here && here < keys.size())
+    {
+        out_err(out, ERR_TRYAGAIN, "the keys are being moved");
+        return false;
+    }
+    for (size_t i : keys)
+    {
+        if (!cluster_route(cmd[i], write, asking, out))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool str2slot(const std::string &s, uint32_t &slot)
+{
+    int64_t val = 0;
+    if (!str2int(s, val) || val < 0 || val >= (int64_t)k_cluster_slots)
+    {
+        return false;
+    }
+    slot = (uint32_t)val;
+    return true;
+}
+
+// cluster keyslot key
+// cluster countkeysinslot slot
+// cluster getkeysinslot slot count
+// cluster slots
+// cluster setslot slot node|migrating|importing host:port
+// cluster setslot slot stable
+static void do_cluster(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    Cluster &cl = g_data.cluster;
+    if (cmd.size() == 3 && cmd_is(cmd[1], "keyslot"))
+    {
+        return out_int(out, key_hash_slot(cmd[2].data(), cmd[2].size()));
+    }
+    if (!cl.enabled)
+    {
+        return out_err(out, ERR_UNKNOWN, "cluster mode is disabled");
+    }
+
+    uint32_t slot = 0;
+    if (cmd.size() == 3 && cmd_is(cmd[1], "countkeysinslot"))
+    {
+        if (!str2slot(cmd[2], slot))
+        {
+            return out_err(out, ERR_ARG, "expect slot");
+        }
+        return out_int(out, cl.slot_count[slot]);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[1], "getkeysinslot"))
+    {
+        int64_t limit = 0;
+        if (!str2slot(cmd[2], slot) || !str2int(cmd[3], limit) || limit < 0)
+        {
+            return out_err(out, ERR_ARG, "expect slot and count");
+        }
+        out_arr(out, 0);
+        uint32_t n = 0;
+        DList *head = &cl.slot_keys[slot];
+        for (DList *node = head->next; node != head && n < (uint64_t)limit; node = node->next)
+        {
+            Entry *ent = container_of(node, Entry, slot_node);
+            out_str(out, ent->key);
+            n++;
+        }
+        return out_update_arr(out, n);
+    }
+    else if (cmd.size() == 2 && cmd_is(cmd[1], "slots"))
+    {
+        // (first, last, host:port) for each assigned range
+        out_arr(out, 0);
+        uint32_t n = 0;
+        for (uint32_t first = 0; first < k_cluster_slots;)
+        {
+            uint32_t last = first;
+            while (last + 1 < k_cluster_slots && cl.owner[last + 1] == cl.owner[first])
+            {
+                last++;
+            }
+            if (cl.owner[first] >= 0)
+            {
+                out_int(out, first);
+                out_int(out, last);
+                out_str(out, cl.nodes[cl.owner[first]]);
+                n += 3;
+            }
+            first = last + 1;
+        }
+        return out_update_arr(out, n);
+    }
+    else if (cmd.size() == 4 && cmd_is(cmd[1], "setslot") && cmd_is(cmd[3], "stable"))
+    {
+        if (!str2slot(cmd[2], slot))
+        {
+            return out_err(out, ERR_ARG, "expect slot");
+        }
+        cl.importing[slot] = -1;
+        if (g_migration.slot == (int32_t)slot)
+        {
+            migrate_abort("cancelled");
+        }
+        return out_nil(out);
+    }
+    else if (cmd.size() != 5 || !cmd_is(cmd[1], "setslot"))
+    {
+        return out_err(out, ERR_UNKNOWN, "unknown cluster command");
+    }
+
+    if (!str2slot(cmd[2], slot))
+    {
+        return out_err(out, ERR_ARG, "expect slot");
+    }
+    int32_t node = cluster_node(cmd[4]);
+    if (cmd_is(cmd[3], "node"))
+    {
+        cl.owner[slot] = node;
+        cl.importing[slot] = -1;
+    }
+    else if (cmd_is(cmd[3], "importing"))
+    {
+        if (node == 0 || cl.owner[slot] == 0)
+        {
+            return out_err(out, ERR_ARG, "the slot is served here");
+        }
+        // the migration link
+        cl.importing[slot] = node;
+        if (conn)
+        {
+            conn->import_link = true;
+        }
+    }
+    else if (cmd_is(cmd[3], "migrating"))
+    {
+        if (node == 0 || cl.owner[slot] != 0)
+        {
+            return out_err(out, ERR_ARG, "the slot is not served here");
+        }
+        if (g_migration.slot >= 0)
+        {
+            return out_err(out, ERR_UNKNOWN, "a migration is in progress");
+        }
+        if (0 != migrate_start(slot, node))
+        {
+            return out_err(out, ERR_UNKNOWN, "cannot connect to the target");
+        }
+    }
+    else
+    {
+        return out_err(out, ERR_UNKNOWN, "unknown cluster command");
+    }
+    return out_nil(out);
+}
+
+static bool try_one_request(Conn *conn)
+{
+    // try to parse a request from the buffer
+    if (conn->rbuf_size < 4)
+    {
+        return false;
+    }
+    uint32_t len = 0;
+    memcpy(&len, &conn->rbuf[0], 4);
+    if (len > k_max_msg)
+    {
+        msg("too long");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (4 + len > conn->rbuf_size)
+    {
+        return false;
+    }
+
+    // parse the request
+    std::vector<std::string> cmd;
+    if (0 != parse_req(&conn->rbuf[4], len, cmd))
+    {
+        msg("bad req");
+        conn->state = STATE_END;
+        return false;
+    }
+
+    // the request is replayed once the value is read back
+    if (tier_park(conn, cmd))
+    {
+        return false;
+    }
+
+    // generate the response, an empty one means the reply is deferred
+    std::string out;
+    do_request(conn, cmd, out);
+
+    if (4 + out.size() > k_max_msg)
+    {
+        out.clear();
+        out_err(out, ERR_2BIG, "response is too big");
+    }
+
+    if (!out.empty() && !conn->pubq.empty())
+    {
+        // after the messages already queued
+        PubMsg *pm = pubmsg_new(out);
+        conn->pubq.push_back(pm);
+        conn->pubq_bytes += pm->len;
+    }
+    else if (!out.empty())
+    {
+        uint32_t wlen = (uint32_t)out.size();
+        conn->wbuf.append((char *)&wlen, 4);
+        conn->wbuf.append(out);
+    }
+
+    // remove the request from the read buffer
+    conn_consume(conn, 4 + len);
+
+    // a parked client flushes the earlier replies from the event loop
+    if ((!conn->wbuf.empty() || !conn->pubq.empty()) && conn->state != STATE_WAIT)
+    {
+        conn->state = STATE_RES;
+        state_res(conn);
+    }
+
+    return (conn->state == STATE_REQ);
+}
+
+static void conn_process(Conn *conn);
+
+static bool try_fill_buffer(Conn *conn)
+{
+    assert(conn->rbuf_size < sizeof(conn->rbuf));
+    ssize_t rv = 0;
+    do
+    {
+        size_t cap = sizeof(conn->rbuf) - conn->rbuf_size;
+        rv = read(conn->fd, &conn->rbuf[conn->rbuf_size], cap);
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN)
+    {
+        return false;
+    }
+    if (rv < 0)
+    {
+        msg("read() error");
+        conn->state = STATE_END;
+        return false;
+    }
+    if (rv == 0)
+    {
+        if (conn->rbuf_size > 0)
+        {
+            msg("unexpected EOF");
+        }
+        else
+        {
+            msg("EOF");
+        }
+        conn->state = STATE_END;
+        return false;
+    }
+
+    conn->rbuf_size += (size_t)rv;
+    assert(conn->rbuf_size <= sizeof(conn->rbuf));
+    conn_process(conn);
+    return (conn->state == STATE_REQ);
+}
+
+// try to process requests one by one
+static void conn_process(Conn *conn)
+{
+    while (true)
+    {
+        bool more = false;
+        if (conn == g_data.repl.link)
+        {
+            more = repl_try_one(conn);
+        }
+        else if (conn == g_migration.link)
+        {
+            more = migrate_try_one(conn);
+        }
+        else
+        {
+            more = try_one_request(conn);
+        }
+        if (!more)
+        {
+            break;
+        }
+    }
+}
+
+// replay the requests of a connection that was parked
+static void conn_resume(Conn *conn)
+{
+    conn->state = STATE_REQ;
+    while (try_one_request(conn))
+    {
+    }
+}
+
+static void state_req(Conn *conn)
+{
+    while (try_fill_buffer(conn))
+    {
+    }
+}
+
+const int k_max_iov = 64;
+
+// the rest of wbuf, then the shared messages, without copying them
+static ssize_t conn_writev(Conn *conn)
+{
+    struct iovec iov[k_max_iov];
+    int n = 0;
+    size_t remain = conn->wbuf.size() - conn->wbuf_sent;
+    if (remain)
+    {
+        iov[n].iov_base = &conn->wbuf[conn->wbuf_sent];
+        iov[n].iov_len = remain;
+        n++;
+    }
+    size_t skip = conn->pubq_sent;
+    for (size_t i = 0; i < conn->pubq.size() && n < k_max_iov; i++, n++)
+    {
+        PubMsg *pm = conn->pubq[i];
+        iov[n].iov_base = &pm->data[skip];
+        iov[n].iov_len = pm->len - skip;
+        skip = 0;
+    }
+    return writev(conn->fd, iov, n);
+}
+
+// drop the messages that are fully sent
+static void pubq_consume(Conn *conn, size_t n)
+{
+    conn->pubq_bytes -= n;
+    while (n > 0)
+    {
+        PubMsg *pm = conn->pubq.front();
+        size_t left = pm->len - conn->pubq_sent;
+        if (n < left)
+        {
+            conn->pubq_sent += n;
+            break;
+        }
+        n -= left;
+        conn->pubq_sent = 0;
+        conn->pubq.pop_front();
+        pubmsg_unref(pm);
+    }
+}
+
+static bool try_flush_buffer(Conn *conn)
+{
+    ssize_t rv = 0;
+    do
+    {
+        size_t remain = conn->wbuf.size() - conn->wbuf_sent;
+        if (conn->pubq.empty())
+        {
+            rv = write(conn->fd, &conn->wbuf[conn->wbuf_sent], remain);
+        }
+        else
+        {
+            rv = conn_writev(conn);
+        }
+    } while (rv < 0 && errno == EINTR);
+    if (rv < 0 && errno == EAGAIN)
+    {
+        return false;
+    }
+    if (rv < 0)
+    {
+        msg("write() error");
+        conn->state = STATE_END;
+        return false;
+    }
+    size_t sent = std::min((size_t)rv, conn->wbuf.size() - conn->wbuf_sent);
+    conn->wbuf_sent += sent;
+    pubq_consume(conn, (size_t)rv - sent);
+    assert(conn->wbuf_sent <= conn->wbuf.size());
+    if (conn->wbuf_sent == conn->wbuf.size() && conn->pubq.empty())
+    {
+        conn->wbuf.clear();
+        conn->wbuf_sent = 0;
+        if (repl_refill(conn))
+        {
+            return true;
+        }
+        if (conn->state == STATE_RES)
+        {
+            conn->state = STATE_REQ;
+        }
+        return false;
+    }
+    return true;
+}
+
+static void state_res(Conn *conn)
+{
+    while (try_flush_buffer(conn))
+    {
+    }
+}
+
+// reply to a parked client and go on with its pipelined requests
+static void block_done(Blocked *b, const std::string &out)
+{
+    Conn *conn = b->conn;
+    block_remove(b);
+    std::string err;
+    if (4 + out.size() > k_max_msg)
+    {
+        out_err(err, ERR_2BIG, "response is too big");
+    }
+    const std::string &res = err.empty() ? out : err;
+    uint32_t wlen = (uint32_t)res.size();
+    conn->wbuf.append((char *)&wlen, 4);
+    conn->wbuf.append(res);
+    conn->idle_start = get_monotonic_usec();
+    dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    conn->state = STATE_RES;
+    state_res(conn);
+    if (conn->state == STATE_REQ)
+    {
+        conn_resume(conn);
+    }
+}
+
+// every XREAD on the stream gets the entries after its ID
+static void stream_wake(const std::string &key)
+{
+    auto it = g_blocking.waiters.find(key);
+    if (it == g_blocking.waiters.end())
+    {
+        return;
+    }
+    // served readers leave the queue
+    std::vector<Blocked *> readers(it->second.begin(), it->second.end());
+    for (Blocked *b : readers)
+    {
+        std::string out;
+        if (b->stream && xread_reply(b->keys, b->ids, b->count, out))
+        {
+            block_done(b, out);
+        }
+    }
+}
+
+// hand the items pushed by this iteration to the waiters, first come first served
+static void process_blocked()
+{
+    while (!g_blocking.ready.empty())
+    {
+        std::vector<std::string> keys;
+        keys.swap(g_blocking.ready);
+        for (const std::string &key : keys)
+        {
+            Entry *ent = db_lookup(key);
+            if (ent && ent->type == T_STREAM)
+            {
+                stream_wake(key);
+                continue;
+            }
+            while (true)
+            {
+                auto it = g_blocking.waiters.find(key);
+                ent = db_lookup(key);
+                if (it == g_blocking.waiters.end() || !ent || ent->type != T_LIST || ent->migrating)
+                {
+                    break;
+                }
+                if (ent->tier_len)
+                {
+                    tier_load_sync(ent);
+                }
+                // readers of a stream that doesn't exist yet keep waiting
+                std::deque<Blocked *> &q = it->second;
+                auto pos = std::find_if(q.begin(), q.end(), [](Blocked *w) { return !w->stream; });
+                if (pos == q.end())
+                {
+                    break;
+                }
+                Blocked *b = *pos;
+                std::string out;
+                list_serve(ent, b->left, out);
+                block_done(b, out);
+            }
+        }
+    }
+}
+
+// queue a message for a subscriber, which is cut off if it is too far behind
+static bool pubsub_push(Conn *conn, PubMsg *pm)
+{
+    if (conn->state == STATE_END)
+    {
+        return false;
+    }
+    pm->refs++;
+    conn->pubq.push_back(pm);
+    conn->pubq_bytes += pm->len;
+    if (conn->pubq_bytes > g_pubsub.max_output)
+    {
+        msg("subscriber is too far behind");
+        conn->state = STATE_END;
+        g_pubsub.ndisconnected++;
+    }
+    else if (conn->state == STATE_REQ)
+    {
+        conn->state = STATE_RES;
+    }
+    return true;
+}
+
+// subscribers wait for messages without the idle timeout
+static void pubsub_idle(Conn *conn, bool was_subscribed)
+{
+    if (!was_subscribed && conn_subscribed(conn))
+    {
+        dlist_detach(&conn->idle_list);
+        dlist_init(&conn->idle_list);
+    }
+    else if (was_subscribed && !conn_subscribed(conn))
+    {
+        conn->idle_start = get_monotonic_usec();
+        dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    }
+}
+
+static void channel_del(const std::string &channel, Conn *conn)
+{
+    auto it = g_pubsub.channels.find(channel);
+    std::vector<Conn *> &subs = it->second;
+    auto pos = std::find(subs.begin(), subs.end(), conn);
+    *pos = subs.back();
+    subs.pop_back();
+    if (subs.empty())
+    {
+        g_pubsub.channels.erase(it);
+    }
+}
+
+// a connection has few subscriptions, false if `name` is already there
+static bool name_add(std::vector<std::string> &names, const std::string &name)
+{
+    if (std::find(names.begin(), names.end(), name) != names.end())
+    {
+        return false;
+    }
+    names.push_back(name);
+    return true;
+}
+
+static bool name_del(std::vector<std::string> &names, const std::string &name)
+{
+    auto it = std::find(names.begin(), names.end(), name);
+    if (it == names.end())
+    {
+        return false;
+    }
+    names.erase(it);
+    return true;
+}
+
+// subscribe channel [channel ...]
+// psubscribe pattern [pattern ...]
+// the reply is the number of subscriptions of the connection
+static void do_subscribe(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool pattern)
+{
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    bool was_subscribed = conn_subscribed(conn);
+    for (size_t i = 1; i < cmd.size(); i++)
+    {
+        if (pattern && name_add(conn->patterns, cmd[i]))
+        {
+            pat_add(&g_pubsub.patterns, cmd[i], conn);
+        }
+        else if (!pattern && name_add(conn->channels, cmd[i]))
+        {
+            g_pubsub.channels[cmd[i]].push_back(conn);
+        }
+    }
+    pubsub_idle(conn, was_subscribed);
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+// unsubscribe [channel ...]
+// punsubscribe [pattern ...]
+// all of them without arguments
+static void do_unsubscribe(Conn *conn, std::vector<std::string> &cmd, std::string &out, bool pattern)
+{
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    bool was_subscribed = conn_subscribed(conn);
+    std::vector<std::string> &subs = pattern ? conn->patterns : conn->channels;
+    std::vector<std::string> names(cmd.begin() + 1, cmd.end());
+    if (names.empty())
+    {
+        names = subs;
+    }
+    for (const std::string &name : names)
+    {
+        if (!name_del(subs, name))
+        {
+            continue;
+        }
+        if (pattern)
+        {
+            pat_del(&g_pubsub.patterns, name, conn);
+        }
+        else
+        {
+            channel_del(name, conn);
+        }
+    }
+    pubsub_idle(conn, was_subscribed);
+    out_int(out, (int64_t)(conn->channels.size() + conn->patterns.size()));
+}
+
+// when the connection is closed
+static void pubsub_drop(Conn *conn)
+{
+    for (const std::string &channel : conn->channels)
+    {
+        channel_del(channel, conn);
+    }
+    for (const std::string &pattern : conn->patterns)
+    {
+        pat_del(&g_pubsub.patterns, pattern, conn);
+    }
+    for (PubMsg *pm : conn->pubq)
+    {
+        pubmsg_unref(pm);
+    }
+    conn->channels.clear();
+    conn->patterns.clear();
+    conn->pubq.clear();
+}
+
+// publish channel message
+// each message is serialized once: [message, channel, msg] for the channel,
+// and [pmessage, pattern, channel, msg] for each matching pattern. the reply
+// is the number of deliveries.
+static void do_publish(std::vector<std::string> &cmd, std::string &out)
+{
+    const std::string &channel = cmd[1];
+    const std::string &message = cmd[2];
+    std::vector<const PatSubs *> pats;
+    pat_match(&g_pubsub.patterns, channel, pats);
+    size_t longest = 0;
+    for (const PatSubs *ps : pats)
+    {
+        longest = std::max(longest, ps->pattern.size());
+    }
+    // so every frame is readable by the clients
+    if (4 + 1 + 4 + (5 + 8) + (5 + longest) + (5 + channel.size()) + (5 + message.size()) > k_max_msg)
+    {
+        return out_err(out, ERR_2BIG, "message is too big");
+    }
+
+    int64_t n = 0;
+    auto it = g_pubsub.channels.find(channel);
+    if (it != g_pubsub.channels.end())
+    {
+        std::string body;
+        out_arr(body, 3);
+        out_str(body, "message");
+        out_str(body, channel);
+        out_str(body, message);
+        PubMsg *pm = pubmsg_new(body);
+        for (Conn *conn : it->second)
+        {
+            n += pubsub_push(conn, pm);
+        }
+        pubmsg_unref(pm);
+    }
+    for (const PatSubs *ps : pats)
+    {
+        std::string body;
+        out_arr(body, 4);
+        out_str(body, "pmessage");
+        out_str(body, ps->pattern);
+        out_str(body, channel);
+        out_str(body, message);
+        PubMsg *pm = pubmsg_new(body);
+        for (void *sub : ps->subs)
+        {
+            n += pubsub_push((Conn *)sub, pm);
+        }
+        pubmsg_unref(pm);
+    }
+    out_int(out, n);
+}
+
+// the connection that gets the invalidations of a tracking client, if it
+// still exists and listens
+static Conn *tracking_target(uint64_t id)
+{
+    auto it = g_tracking.clients.find(id);
+    if (it == g_tracking.clients.end() || !it->second->tracking)
+    {
+        return NULL;
+    }
+    it = g_tracking.clients.find(it->second->tracking_redirect);
+    if (it == g_tracking.clients.end())
+    {
+        return NULL;
+    }
+    std::vector<std::string> &channels = it->second->channels;
+    bool listening = std::find(channels.begin(), channels.end(), k_invalidate_channel) != channels.end();
+    return listening ? it->second : NULL;
+}
+
+// one message shared by the targets of the clients, each target gets it once
+static void tracking_send(const std::string &key, const std::vector<uint64_t> &ids)
+{
+    std::vector<Conn *> targets;
+    for (uint64_t id : ids)
+    {
+        Conn *target = tracking_target(id);
+        if (target)
+        {
+            targets.push_back(target);
+        }
+    }
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    if (targets.empty())
+    {
+        return;
+    }
+    std::string body;
+    out_arr(body, 3);
+    out_str(body, "message");
+    out_str(body, k_invalidate_channel);
+    out_str(body, key);
+    PubMsg *pm = pubmsg_new(body);
+    for (Conn *target : targets)
+    {
+        pubsub_push(target, pm);
+    }
+    pubmsg_unref(pm);
+}
+
+// called on every write, so it costs a branch while no one is tracking
+static void tracking_invalidate(const std::string &key)
+{
+    if (g_tracking.keys.empty() && g_tracking.prefixes.empty())
+    {
+        return;
+    }
+    std::vector<uint64_t> ids;
+    auto it = g_tracking.keys.find(key);
+    if (it != g_tracking.keys.end())
+    {
+        // the readers track it again with their next read
+        ids.swap(it->second);
+        g_tracking.keys.erase(it);
+    }
+    for (auto &kv : g_tracking.prefixes)
+    {
+        if (0 == key.compare(0, kv.first.size(), kv.first))
+        {
+            ids.insert(ids.end(), kv.second.begin(), kv.second.end());
+        }
+    }
+    if (!ids.empty())
+    {
+        tracking_send(key, ids);
+    }
+}
+
+// a key read by a tracking client
+static void tracking_remember(Conn *conn, const std::string &key)
+{
+    std::vector<uint64_t> &ids = g_tracking.keys[key];
+    if (std::find(ids.begin(), ids.end(), conn->id) == ids.end())
+    {
+        ids.push_back(conn->id);
+    }
+    // a key that is forgotten is invalidated, the clients can't keep it either
+    while (g_tracking.keys.size() > g_tracking.max_keys)
+    {
+        auto victim = g_tracking.keys.begin();
+        if (victim->first == key)
+        {
+            ++victim;
+        }
+        std::string name = victim->first;
+        std::vector<uint64_t> readers;
+        readers.swap(victim->second);
+        g_tracking.keys.erase(victim);
+        tracking_send(name, readers);
+        g_tracking.nevicted++;
+    }
+}
+
+// the keys read by the earlier session stay until they are invalidated
+static void tracking_off(Conn *conn)
+{
+    for (const std::string &prefix : conn->tracking_prefixes)
+    {
+        std::vector<uint64_t> &ids = g_tracking.prefixes[prefix];
+        ids.erase(std::find(ids.begin(), ids.end(), conn->id));
+        if (ids.empty())
+        {
+            g_tracking.prefixes.erase(prefix);
+        }
+    }
+    conn->tracking_prefixes.clear();
+    conn->tracking = false;
+    conn->tracking_bcast = false;
+    conn->tracking_redirect = 0;
+}
+
+// client id
+// client tracking on redirect id [bcast] [prefix p ...]
+// client tracking off
+// the invalidations are messages on __redis__:invalidate sent to the `redirect`
+// connection, which subscribes to it. in BCAST mode they are sent for every
+// key under the prefixes, or any key without one, read or not.
+static void do_client(Conn *conn, std::vector<std::string> &cmd, std::string &out)
+{
+    if (!conn)
+    {
+        return out_err(out, ERR_UNKNOWN, "not a client");
+    }
+    if (cmd.size() == 2 && cmd_is(cmd[1], "id"))
+    {
+        return out_int(out, (int64_t)conn->id);
+    }
+    if (cmd.size() == 3 && cmd_is(cmd[1], "tracking") && cmd_is(cmd[2], "off"))
+    {
+        tracking_off(conn);
+        return out_nil(out);
+    }
+    if (cmd.size() < 3 || !cmd_is(cmd[1], "tracking") || !cmd_is(cmd[2], "on"))
+    {
+        return out_err(out, ERR_ARG, "unknown client command");
+    }
+    int64_t redirect = 0;
+    bool bcast = false;
+    std::vector<std::string> prefixes;
+    for (size_t i = 3; i < cmd.size(); i++)
+    {
+        if (cmd_is(cmd[i], "redirect") && i + 1 < cmd.size() && str2int(cmd[i + 1], redirect))
+        {
+            i++;
+        }
+        else if (cmd_is(cmd[i], "bcast"))
+        {
+            bcast = true;
+        }
+        else if (cmd_is(cmd[i], "prefix") && i + 1 < cmd.size())
+        {
+            prefixes.push_back(cmd[++i]);
+        }
+        else
+        {
+            return out_err(out, ERR_ARG, "bad option");
+        }
+    }
+    if (!g_tracking.clients.count((uint64_t)redirect))
+    {
+        return out_err(out, ERR_ARG, "expect REDIRECT with the CLIENT ID of a connection");
+    }
+    if (!prefixes.empty() && !bcast)
+    {
+        return out_err(out, ERR_ARG, "PREFIX needs BCAST");
+    }
+    tracking_off(conn);
+    conn->tracking = true;
+    conn->tracking_bcast = bcast;
+    conn->tracking_redirect = (uint64_t)redirect;
+    if (bcast && prefixes.empty())
+    {
+        prefixes.push_back("");
+    }
+    for (const std::string &prefix : prefixes)
+    {
+        if (name_add(conn->tracking_prefixes, prefix))
+        {
+            g_tracking.prefixes[prefix].push_back(conn->id);
+        }
+    }
+    return out_nil(out);
+}
+
+static void connection_io(Conn *conn)
+{
+    // wake up by poll, update the idle timer by moving conn to the end of the list
+    if (conn->repl_state == REPL_NONE && !conn_subscribed(conn))
+    {
+        conn->idle_start = get_monotonic_usec();
+        dlist_detach(&conn->idle_list);
+        dlist_insert_before(&g_data.idle_list, &conn->idle_list);
+    }
+
+    if (conn->state == STATE_REQ)
+    {
+        state_req(conn);
+    }
+    else if (conn->state == STATE_RES)
+    {
+        state_res(conn);
+        // the requests that arrived while the replies or the messages were going out
+        if (conn->state == STATE_REQ && conn->rbuf_size > 0)
+        {
+            conn_process(conn);
+        }
+    }
+    else if (conn->state == STATE_WAIT)
+    {
+        // the replies before the parked request
+        state_res(conn);
+    }
+    else
+    {
+        assert(0); // not expected
+    }
+}
+
+// the slab memory held over the bytes of the live objects
+static double slab_frag_ratio(size_t *reserved)
+{
+    std::vector<SlabStat> stats;
+    slab_stats(stats);
+    size_t used = 0;
+    *reserved = 0;
+    for (const SlabStat &st : stats)
+    {
+        *reserved += st.pages * k_slab_page;
+        used += st.used * st.size;
+    }
+    return used ? (double)*reserved / used : 1.0;
+}
+
+static void entry_relocate(void *dst, void *src, void *arg)
+{
+    Entry *old = (Entry *)src;
+    Entry *ent = new (dst) Entry(std::move(*old));
+    old->~Entry();
+    // the bucket or the previous node in the chain
+    *(HNode **)arg = &ent->node;
+    if (ent->heap_idx != (size_t)-1)
+    {
+        g_data.heap[ent->heap_idx].ref = &ent->heap_idx;
+    }
+    dlist_relink(&ent->slot_node);
+    dlist_relink(&ent->tier_node);
+}
+
+static void zset_relocate(void *dst, void *src, void *arg)
+{
+    memcpy(dst, src, sizeof(ZSet));
+    ((Entry *)arg)->zset = (ZSet *)dst;
+}
+
+struct ZNodeMove
+{
+    ZSet *zset = NULL;
+    HNode **from = NULL;
+};
+
+static void znode_relocate(void *dst, void *src, void *arg)
+{
+    ZNodeMove *move = (ZNodeMove *)arg;
+    ZNode *old = (ZNode *)src;
+    ZNode *node = (ZNode *)dst;
+    memcpy(node, old, sizeof(ZNode) + old->len);
+    *move->from = &node->hmap;
+    AVLNode *parent = node->tree.parent;
+    if (!parent)
+    {
+        move->zset->tree = &node->tree;
+    }
+    else if (parent->left == &old->tree)
+    {
+        parent->left = &node->tree;
+    }
+    else
+    {
+        parent->right = &node->tree;
+    }
+    if (node->tree.left)
+    {
+        node->tree.left->parent = &node->tree;
+    }
+    if (node->tree.right)
+    {
+        node->tree.right->parent = &node->tree;
+    }
+}
+
+// move the nodes of a bucket, returns the number of objects visited
+static size_t defrag_zset_bucket(ZSet *zset, HNode **from)
+{
+    size_t n = 0;
+    for (; *from; from = &(*from)->next, n++)
+    {
+        ZNode *node = container_of(*from, ZNode, hmap);
+        ZNodeMove move;
+        move.zset = zset;
+        move.from = from;
+        if (slab_move(node, sizeof(ZNode) + node->len, &znode_relocate, &move))
+        {
+            g_defrag.nmoved++;
+        }
+    }
+    return n;
+}
+
+static void hash_relocate(void *dst, void *src, void *arg)
+{
+    Hash *old = (Hash *)src;
+    Hash *hash = new (dst) Hash(std::move(*old));
+    old->~Hash();
+    ((Entry *)arg)->hash = hash;
+}
+
+static void hnode_relocate(void *dst, void *src, void *arg)
+{
+    memcpy(dst, src, hash_node_size((HashNode *)src));
+    *(HNode **)arg = &((HashNode *)dst)->node;
+}
+
+static size_t defrag_hash_bucket(HNode **from)
+{
+    size_t n = 0;
+    for (; *from; from = &(*from)->next, n++)
+    {
+        HashNode *node = container_of(*from, HashNode, node);
+        if (slab_move(node, hash_node_size(node), &hnode_relocate, from))
+        {
+            g_defrag.nmoved++;
+        }
+    }
+    return n;
+}
+
+static void set_relocate(void *dst, void *src, void *arg)
+{
+    Set *old = (Set *)src;
+    Set *set = new (dst) Set(std::move(*old));
+    old->~Set();
+    ((Entry *)arg)->set = set;
+}
+
+static void snode_relocate(void *dst, void *src, void *arg)
+{
+    memcpy(dst, src, set_node_size((SetNode *)src));
+    *(HNode **)arg = &((SetNode *)dst)->node;
+}
+
+static size_t defrag_set_bucket(HNode **from)
+{
+    size_t n = 0;
+    for (; *from; from = &(*from)->next, n++)
+    {
+        SetNode *node = container_of(*from, SetNode, node);
+        if (slab_move(node, set_node_size(node), &snode_relocate, from))
+        {
+            g_defrag.nmoved++;
+        }
+    }
+    return n;
+}
+
+static void vset_relocate(void *dst, void *src, void *arg)
+{
+    VSet *old = (VSet *)src;
+    VSet *vset = new (dst) VSet(std::move(*old));
+    old->~VSet();
+    ((Entry *)arg)->vset = vset;
+}
+
+// the blocks are not in the slab, only the header moves
+static void bloom_relocate(void *dst, void *src, void *arg)
+{
+    Bloom *old = (Bloom *)src;
+    Bloom *bloom = new (dst) Bloom(std::move(*old));
+    old->~Bloom();
+    ((Entry *)arg)->bloom = bloom;
+}
+
+static void cms_relocate(void *dst, void *src, void *arg)
+{
+    CMS *old = (CMS *)src;
+    CMS *cms = new (dst) CMS(std::move(*old));
+    old->~CMS();
+    ((Entry *)arg)->cms = cms;
+}
+
+// the candidates point to the heap items, which stay where they are
+static void topk_relocate(void *dst, void *src, void *arg)
+{
+    TopK *old = (TopK *)src;
+    TopK *topk = new (dst) TopK(std::move(*old));
+    old->~TopK();
+    ((Entry *)arg)->topk = topk;
+}
+
+static void series_relocate(void *dst, void *src, void *arg)
+{
+    TSeries *old = (TSeries *)src;
+    TSeries *series = new (dst) TSeries(std::move(*old));
+    old->~TSeries();
+    ((Entry *)arg)->series = series;
+}
+
+struct VNodeMove
+{
+    VSet *vset = NULL;
+    HNode **from = NULL;
+};
+
+// the node is also referenced by its position
+static void vnode_relocate(void *dst, void *src, void *arg)
+{
+    VNodeMove *move = (VNodeMove *)arg;
+    VNode *node = (VNode *)dst;
+    memcpy(dst, src, vset_node_size((VNode *)src));
+    *move->from = &node->node;
+    move->vset->nodes[node->pos] = node;
+}
+
+static size_t defrag_vset_bucket(VSet *vset, HNode **from)
+{
+    size_t n = 0;
+    for (; *from; from = &(*from)->next, n++)
+    {
+        VNode *node = container_of(*from, VNode, node);
+        VNodeMove move;
+        move.vset = vset;
+        move.from = from;
+        if (slab_move(node, vset_node_size(node), &vnode_relocate, &move))
+        {
+            g_defrag.nmoved++;
+        }
+    }
+    return n;
+}
+
+static void qlist_relocate(void *dst, void *src, void *arg)
+{
+    QList *list = (QList *)dst;
+    memcpy(dst, src, sizeof(QList));
+    if (list->nchunks)
+    {
+        dlist_relink(&list->chunks);
+    }
+    else
+    {
+        dlist_init(&list->chunks);
+    }
+    ((Entry *)arg)->list = list;
+}
+
+static void qchunk_relocate(void *dst, void *src, void *arg)
+{
+    (void)arg;
+    memcpy(dst, src, qlist_chunk_size((QChunk *)src));
+    dlist_relink(&((QChunk *)dst)->node);
+}
+
+// move the chunks from where the last step stopped, false if the time is up
+static bool defrag_list(QList *list, uint64_t deadline)
+{
+    Defrag &defrag = g_defrag;
+    DList *node = list->chunks.next;
+    if (defrag.cpos > 0)
+    {
+        // written since the last step, it's left for the next cycle
+        if (defrag.cvalue != list)
+        {
+            return true;
+        }
+        node = (DList *)defrag.cnode;
+    }
+    size_t nwork = 0;
+    while (node != &list->chunks)
+    {
+        QChunk *chunk = container_of(node, QChunk, node);
+        QChunk *moved = (QChunk *)slab_move(chunk, qlist_chunk_size(chunk), &qchunk_relocate, NULL);
+        if (moved)
+        {
+            chunk = moved;
+            defrag.nmoved++;
+        }
+        node = chunk->node.next;
+        defrag.cpos++;
+        if (++nwork >= 64)
+        {
+            nwork = 0;
+            if (get_monotonic_usec() >= deadline)
+            {
+                defrag.cvalue = list;
+                defrag.cnode = node;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void stream_relocate(void *dst, void *src, void *arg)
+{
+    memcpy(dst, src, sizeof(Stream));
+    ((Entry *)arg)->stream = (Stream *)dst;
+}
+
+static void stream_node_relocate(void *dst, void *src, void *arg)
+{
+    Stream *stream = (Stream *)arg;
+    SNode *old = (SNode *)src;
+    SNode *node = (SNode *)dst;
+    memcpy(node, old, stream_node_size(old));
+    AVLNode *parent = node->tree.parent;
+    if (!parent)
+    {
+        stream->tree = &node->tree;
+    }
+    else if (parent->left == &old->tree)
+    {
+        parent->left = &node->tree;
+    }
+    else
+    {
+        parent->right = &node->tree;
+    }
+    if (node->tree.left)
+    {
+        node->tree.left->parent = &node->tree;
+    }
+    if (node->tree.right)
+    {
+        node->tree.right->parent = &node->tree;
+    }
+}
+
+// move the nodes from where the last step stopped, like defrag_list()
+static bool defrag_stream(Stream *stream, uint64_t deadline)
+{
+    Defrag &defrag = g_defrag;
+    SNode *node = stream_first(stream);
+    if (defrag.cpos > 0)
+    {
+        if (defrag.cvalue != stream)
+        {
+            return true;
+        }
+        node = (SNode *)defrag.cnode;
+    }
+    size_t nwork = 0;
+    while (node)
+    {
+        SNode *moved = (SNode *)slab_move(node, stream_node_size(node), &stream_node_relocate, stream);
+        if (moved)
+        {
+            node = moved;
+            defrag.nmoved++;
+        }
+        node = stream_next(node);
+        defrag.cpos++;
+        if (++nwork >= 64)
+        {
+            nwork = 0;
+            if (get_monotonic_usec() >= deadline)
+            {
+                defrag.cvalue = stream;
+                defrag.cnode = node;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// move the value of the entry, true if it moved
+static bool defrag_value(Entry *ent)
+{
+    if (!ent->ptr)
+    {
+        return false;
+    }
+    void *moved = NULL;
+    switch (ent->type)
+    {
+    case T_ZSET:
+        moved = slab_move(ent->zset, sizeof(ZSet), &zset_relocate, ent);
+        break;
+    case T_HASH:
+        moved = slab_move(ent->hash, sizeof(Hash), &hash_relocate, ent);
+        break;
+    case T_LIST:
+        moved = slab_move(ent->list, sizeof(QList), &qlist_relocate, ent);
+        break;
+    case T_SET:
+        moved = slab_move(ent->set, sizeof(Set), &set_relocate, ent);
+        break;
+    case T_STREAM:
+        moved = slab_move(ent->stream, sizeof(Stream), &stream_relocate, ent);
+        break;
+    case T_VSET:
+        moved = slab_move(ent->vset, sizeof(VSet), &vset_relocate, ent);
+        break;
+    case T_BLOOM:
+        moved = slab_move(ent->bloom, sizeof(Bloom), &bloom_relocate, ent);
+        break;
+    case T_CMS:
+        moved = slab_move(ent->cms, sizeof(CMS), &cms_relocate, ent);
+        break;
+    case T_TOPK:
+        moved = slab_move(ent->topk, sizeof(TopK), &topk_relocate, ent);
+        break;
+    case T_TS:
+        moved = slab_move(ent->series, sizeof(TSeries), &series_relocate, ent);
+        break;
+    }
+    return moved != NULL;
+}
+
+// the value has nodes of its own, which are walked later
+static bool defrag_is_container(Entry *ent)
+{
+    if (!ent->ptr)
+    {
+        return false;
+    }
+    switch (ent->type)
+    {
+    case T_ZSET:
+    case T_LIST:
+    case T_STREAM:
+    case T_VSET:
+        return true;
+    case T_HASH:
+        return ent->hash->is_map;
+    case T_SET:
+        return ent->set->is_map;
+    }
+    return false;
+}
+
+// walk the container at the back of the list, false if the time is up
+static bool defrag_container(uint64_t deadline)
+{
+    Defrag &defrag = g_defrag;
+    Entry *ent = db_lookup(defrag.containers.back());
+    // gone, spilled or being moved to another server
+    if (!ent || !ent->ptr || ent->migrating)
+    {
+        ent = NULL;
+    }
+    if (ent && ent->type == T_LIST && !defrag_list(ent->list, deadline))
+    {
+        return false;
+    }
+    if (ent && ent->type == T_STREAM && !defrag_stream(ent->stream, deadline))
+    {
+        return false;
+    }
+    HMap *map = NULL;
+    if (ent && ent->type == T_ZSET)
+    {
+        map = &ent->zset->hmap;
+    }
+    else if (ent && ent->type == T_HASH && ent->hash->is_map)
+    {
+        map = &ent->hash->map;
+    }
+    else if (ent && ent->type == T_SET && ent->set->is_map)
+    {
+        map = &ent->set->map;
+    }
+    else if (ent && ent->type == T_VSET)
+    {
+        map = &ent->vset->index;
+    }
+    size_t nwork = 0;
+    while (map && defrag.ctab < 2)
+    {
+        HTab *tab = defrag.ctab == 0 ? &map->ht2 : &map->ht1;
+        if (!tab->tab || defrag.cpos > tab->mask)
+        {
+            defrag.ctab++;
+            defrag.cpos = 0;
+            continue;
+        }
+        HNode **from = &tab->tab[defrag.cpos];
+        if (ent->type == T_ZSET)
+        {
+            nwork += defrag_zset_bucket(ent->zset, from);
+        }
+        else if (ent->type == T_VSET)
+        {
+            nwork += defrag_vset_bucket(ent->vset, from);
+        }
+        else
+        {
+            nwork += ent->type == T_SET ? defrag_set_bucket(from) : defrag_hash_bucket(from);
+        }
+        defrag.cpos++;
+        if (nwork >= 64)
+        {
+            nwork = 0;
+            if (get_monotonic_usec() >= deadline)
+            {
+                return false;
+            }
+        }
+    }
+    defrag.containers.pop_back();
+    defrag.ctab = 0;
+    defrag.cpos = 0;
+    defrag.cvalue = NULL;
+    defrag.cnode = NULL;
+    return true;
+}
+
+static void defrag_start()
+{
+    Defrag &defrag = g_defrag;
+    size_t reserved = 0;
+    // the free objects cached by the event loop pin pages too
+    slab_flush();
+    defrag.ratio_before = slab_frag_ratio(&reserved);
+    defrag.nmoved_start = defrag.nmoved;
+    defrag.running = true;
+    defrag.cursor_tab = 0;
+    defrag.cursor_pos = 0;
+    defrag.containers.clear();
+    defrag.ctab = 0;
+    defrag.cpos = 0;
+    defrag.cvalue = NULL;
+    defrag.cnode = NULL;
+    defrag.next_us = 0;
+}
+
+static void defrag_step()
+{
+    Defrag &defrag = g_defrag;
+    uint64_t deadline = get_monotonic_usec() + k_defrag_step_us;
+    size_t nwork = 0;
+    while (true)
+    {
+        if (!defrag.containers.empty())
+        {
+            if (!defrag_container(deadline))
+            {
+                return;
+            }
+            continue;
+        }
+        if (defrag.cursor_tab == 2)
+        {
+            break;
+        }
+        // the same order as the incremental snapshot
+        HTab *tab = defrag.cursor_tab == 0 ? &g_data.db.ht2 : &g_data.db.ht1;
+        if (!tab->tab || defrag.cursor_pos > tab->mask)
+        {
+            defrag.cursor_tab++;
+            defrag.cursor_pos = 0;
+            continue;
+        }
+        for (HNode **from = &tab->tab[defrag.cursor_pos]; *from; from = &(*from)->next)
+        {
+            Entry *ent = container_of(*from, Entry, node);
+            nwork++;
+            // the migration holds pointers to the entry and its nodes
+            if (ent->migrating)
+            {
+                continue;
+            }
+            Entry *moved = (Entry *)slab_move(ent, sizeof(Entry), &entry_relocate, from);
+            if (moved)
+            {
+                ent = moved;
+                defrag.nmoved++;
+            }
+            if (defrag_value(ent))
+            {
+                defrag.nmoved++;
+            }
+            if (defrag_is_container(ent))
+            {
+                defrag.containers.push_back(ent->key);
+            }
+        }
+        defrag.cursor_pos++;
+        if (nwork >= 64)
+        {
+            nwork = 0;
+            if (get_monotonic_usec() >= deadline)
+            {
+                return;
+            }
+        }
+    }
+
+    size_t reserved = 0;
+    slab_flush();
+    defrag.ratio_after = slab_frag_ratio(&reserved);
+    defrag.running = false;
+    defrag.ncycles++;
+    fprintf(stderr, "defrag: fragmentation %.2f -> %.2f, %zu objects moved\n",
+            defrag.ratio_before, defrag.ratio_after, defrag.nmoved - defrag.nmoved_start);
+}
+
+static void process_defrag()
+{
+    Defrag &defrag = g_defrag;
+    uint64_t now_us = get_monotonic_usec();
+    if (now_us < defrag.next_us)
+    {
+        return;
+    }
+    if (!defrag.running)
+    {
+        defrag.next_us = now_us + k_defrag_check_us;
+        size_t reserved = 0;
+        if (defrag.threshold <= 0 || slab_frag_ratio(&reserved) < defrag.threshold
+            || reserved < defrag.min_bytes)
+        {
+            return;
+        }
+        defrag_start();
+    }
+    defrag_step();
+    defrag.next_us = get_monotonic_usec() + k_defrag_interval_us;
+}
+
+// start a cycle regardless of the threshold
+static void do_defrag(std::vector<std::string> &cmd, std::string &out)
+{
+    (void)cmd;
+    if (!g_defrag.running)
+    {
+        defrag_start();
+    }
+    return out_nil(out);
+}
+
+const uint64_t k_idle_timeout_ms = 5 * 1000;
+
+static uint32_t next_timer_ms()
+{
+    uint64_t now_us = get_monotonic_usec();
+    uint64_t next_us = (uint64_t)-1;
+
+    // idle timers
+    if (!dlist_empty(&g_data.idle_list))
+    {
+        Conn *next = container_of(g_data.idle_list.next, Conn, idle_list);
+        next_us = next->idle_start + k_idle_timeout_ms * 1000;
+    }
+
+    // ttl timers
+    if (!g_data.heap.empty() && g_data.heap[0].val < next_us)
+    {
+        next_us = g_data.heap[0].val;
+    }
+    // blocking pop timeouts
+    if (!g_blocking.heap.empty() && g_blocking.heap[0].val < next_us)
+    {
+        next_us = g_blocking.heap[0].val;
+    }
+
+    // poll for the background child
+    bool child = g_data.aof.child > 0 || g_data.snap.child > 0 || g_data.snap.committing;
+    if (child && next_us > now_us + 100 * 1000)
+    {
+        next_us = now_us + 100 * 1000;
+    }
+    // the replication link
+    bool repl = !g_data.repl.replicas.empty() || g_data.repl.link_state == LINK_CONNECT
+                || g_migration.slot >= 0;
+    if (repl && next_us > now_us + 100 * 1000)
+    {
+        next_us = now_us + 100 * 1000;
+    }
+    // the coldest entry for the tier
+    if (g_tier.enabled && !dlist_empty(&g_tier.lru))
+    {
+        Entry *ent = container_of(g_tier.lru.next, Entry, tier_node);
+        next_us = std::min(next_us, ent->atime_us + g_tier.cold_us);
+    }
+    if (g_tier.compact_done && next_us > now_us + 100 * 1000)
+    {
+        next_us = now_us + 100 * 1000;
+    }
+    // the next defrag step
+    if (g_defrag.running)
+    {
+        next_us = std::min(next_us, g_defrag.next_us);
+    }
+    // keep scanning for the incremental snapshot
+    if (g_data.snap.writer && !g_data.snap.committing)
+    {
+        next_us = now_us;
+    }
+
+    if (next_us == (uint64_t)-1)
     {
         return 10000; // no timer
     }
@@ -882,16 +10325,37 @@ static uint32_t next_timer_ms()
 
 static void conn_done(Conn *conn)
 {
+    if (conn->repl_state != REPL_NONE)
+    {
+        repl_detach_replica(conn);
+    }
+    if (conn == g_data.repl.link)
+    {
+        repl_link_lost();
+    }
+    if (conn == g_migration.link)
+    {
+        g_migration.link = NULL;
+        migrate_abort("lost the link");
+    }
+    if (conn->state == STATE_WAIT)
+    {
+        tier_unpark(conn);
+    }
+    if (conn->blocked)
+    {
+        block_remove(conn->blocked);
+    }
+    pubsub_drop(conn);
+    tracking_off(conn);
+    watch_clear(conn);
+    g_tracking.clients.erase(conn->id);
     g_data.fd2conn[conn->fd] = NULL;
     (void)close(conn->fd);
     dlist_detach(&conn->idle_list);
-    free(conn);
+    delete conn;
 }
 
-static bool hnode_same(HNode *lhs, HNode *rhs)
-{
-    return lhs == rhs;
-}
 
 static void process_timers()
 {
@@ -912,14 +10376,29 @@ static void process_timers()
         conn_done(next);
     }
 
-    // TTL timers
+    // blocking pops that time out
+    while (!g_blocking.heap.empty() && g_blocking.heap[0].val < now_us)
+    {
+        Blocked *b = container_of(g_blocking.heap[0].ref, Blocked, heap_idx);
+        std::string out;
+        out_nil(out);
+        block_done(b, out);
+    }
+
+    // TTL timers, a replica waits for the deletions from its primary
     const size_t k_max_works = 2000;
     size_t nworks = 0;
-    while (!g_data.heap.empty() && g_data.heap[0].val < now_us)
+    bool replica = !g_data.repl.primary_host.empty();
+    while (!replica && !g_data.heap.empty() && g_data.heap[0].val < now_us)
     {
         Entry *ent = container_of(g_data.heap[0].ref, Entry, heap_idx);
         HNode *node = hm_pop(&g_data.db, &ent->node, &hnode_same);
         assert(node == &ent->node);
+        if (propagating())
+        {
+            std::vector<std::string> cmd = {"del", ent->key};
+            propagate(cmd);
+        }
         entry_del(ent);
         if (nworks++ >= k_max_works)
         {
@@ -929,10 +10408,129 @@ static void process_timers()
     }
 }
 
-int main()
+static void usage()
 {
+    fprintf(stderr, "usage: server [--port N] [--appendonly FILE] [--snapshot FILE]"
+                    " [--snapshot-mode fork|incremental] [--replicaof HOST:PORT]"
+                    " [--repl-backlog-size BYTES] [--cluster FILE]"
+                    " [--cluster-announce HOST:PORT] [--tier FILE]"
+                    " [--tier-min-size BYTES] [--tier-cold-ms MS]"
+                    " [--defrag-threshold RATIO] [--pubsub-output-limit BYTES]"
+                    " [--tracking-table-max-keys N] [--script-budget N]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t port = 1234;
+    const char *aof_path = NULL;
+    const char *cluster_path = NULL;
+    const char *tier_path = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (0 == strcmp(argv[i], "--port") && i + 1 < argc)
+        {
+            port = (uint16_t)atoi(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--appendonly") && i + 1 < argc)
+        {
+            aof_path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--snapshot") && i + 1 < argc)
+        {
+            g_data.snap.path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--snapshot-mode") && i + 1 < argc)
+        {
+            g_data.snap.incremental = 0 == strcmp(argv[++i], "incremental");
+        }
+        else if (0 == strcmp(argv[i], "--replicaof") && i + 1 < argc && strchr(argv[i + 1], ':'))
+        {
+            std::string addr = argv[++i];
+            g_data.repl.primary_host = addr.substr(0, addr.find(':'));
+            g_data.repl.primary_port = (uint16_t)atoi(addr.c_str() + addr.find(':') + 1);
+            g_data.repl.link_state = LINK_CONNECT;
+        }
+        else if (0 == strcmp(argv[i], "--repl-backlog-size") && i + 1 < argc)
+        {
+            g_data.repl.backlog_size = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--cluster") && i + 1 < argc)
+        {
+            cluster_path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--cluster-announce") && i + 1 < argc)
+        {
+            g_data.cluster.myself = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--tier") && i + 1 < argc)
+        {
+            tier_path = argv[++i];
+        }
+        else if (0 == strcmp(argv[i], "--tier-min-size") && i + 1 < argc)
+        {
+            g_tier.min_size = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--tier-cold-ms") && i + 1 < argc)
+        {
+            g_tier.cold_us = (uint64_t)atoll(argv[++i]) * 1000;
+        }
+        else if (0 == strcmp(argv[i], "--defrag-threshold") && i + 1 < argc)
+        {
+            g_defrag.threshold = atof(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--pubsub-output-limit") && i + 1 < argc)
+        {
+            g_pubsub.max_output = (size_t)atoll(argv[++i]);
+        }
+        else if (0 == strcmp(argv[i], "--tracking-table-max-keys") && i + 1 < argc)
+        {
+            g_tracking.max_keys = std::max((size_t)atoll(argv[++i]), (size_t)1);
+        }
+        else if (0 == strcmp(argv[i], "--script-budget") && i + 1 < argc)
+        {
+            g_scripts.budget = (uint64_t)atoll(argv[++i]);
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (g_data.repl.backlog_size == 0)
+    {
+        usage();
+    }
+    signal(SIGPIPE, SIG_IGN);
     dlist_init(&g_data.idle_list);
     thread_pool_init(&g_data.tp, 4);
+    g_posted.fd = eventfd(0, EFD_NONBLOCK);
+    if (g_posted.fd < 0)
+    {
+        die("eventfd()");
+    }
+    if (tier_path)
+    {
+        tier_open(tier_path);
+    }
+    g_data.repl.replid = gen_replid();
+    if (cluster_path)
+    {
+        if (g_data.cluster.myself.empty())
+        {
+            g_data.cluster.myself = "127.0.0.1:" + std::to_string(port);
+        }
+        cluster_init(cluster_path);
+    }
+    // the AOF is more complete than the snapshot, if enabled
+    if (aof_path)
+    {
+        aof_open(aof_path);
+    }
+    else
+    {
+        snapshot_load(g_data.snap.path.c_str());
+    }
 
     int fd = socket(AF_INET, SOCK_STREAM, 0);
     if (fd < 0)
@@ -946,7 +10544,7 @@ int main()
     // bind
     struct sockaddr_in addr = {};
     addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
+    addr.sin_port = ntohs(port);
     addr.sin_addr.s_addr = ntohl(0);
     int rv = bind(fd, (const sockaddr *)&addr, sizeof(addr));
     if (rv)
@@ -969,9 +10567,16 @@ int main()
         poll_args.clear();
         struct pollfd pfd = {fd, POLLIN, 0};
         poll_args.push_back(pfd);
+        pfd = {g_posted.fd, POLLIN, 0};
+        poll_args.push_back(pfd);
 
         for (Conn *conn : g_data.fd2conn)
         {
+            if (conn && conn->state == STATE_END)
+            {
+                conn_done(conn); // closed by someone else
+                continue;
+            }
             if (!conn)
             {
                 continue;
@@ -979,6 +10584,11 @@ int main()
             struct pollfd pfd = {};
             pfd.fd = conn->fd;
             pfd.events = (conn->state == STATE_REQ) ? POLLIN : POLLOUT;
+            if (conn->state == STATE_WAIT)
+            {
+                // flush the earlier replies, and notice a client that hangs up
+                pfd.events = (conn->wbuf.empty() ? 0 : POLLOUT) | POLLRDHUP;
+            }
             pfd.events = pfd.events | POLLERR;
             poll_args.push_back(pfd);
         }
@@ -992,12 +10602,23 @@ int main()
         }
 
         // process active connections
-        for (size_t i = 1; i < poll_args.size(); ++i)
+        for (size_t i = 2; i < poll_args.size(); ++i)
         {
             if (poll_args[i].revents)
             {
                 Conn *conn = g_data.fd2conn[poll_args[i].fd];
-                connection_io(conn);
+                if (!conn || conn->state == STATE_END)
+                {
+                    continue;
+                }
+                if (conn->state == STATE_WAIT && (poll_args[i].revents & (POLLRDHUP | POLLHUP | POLLERR)))
+                {
+                    conn->state = STATE_END;
+                }
+                else
+                {
+                    connection_io(conn);
+                }
                 if (conn->state == STATE_END)
                 {
                     // client closed normally
@@ -1006,13 +10627,39 @@ int main()
             }
         }
 
+        // the work done by the thread pool
+        if (poll_args[1].revents)
+        {
+            process_posted();
+        }
+
+        // the clients waiting for the lists pushed to
+        process_blocked();
+
         // handle timers
         process_timers();
 
-        // accept a new connection
+        // persistence
+        process_aof();
+        process_snapshot();
+
+        // replication
+        process_replication();
+        process_migration();
+
+        // tiered storage
+        process_tier();
+
+        // memory
+        process_defrag();
+
+        // accept the new connections, all of them, or a burst of them takes
+        // an iteration each
         if (poll_args[0].revents)
         {
-            (void)accept_new_conn(fd);
+            while (0 == accept_new_conn(fd))
+            {
+            }
         }
     }
 
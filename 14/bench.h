@@ -0,0 +1,151 @@
+#pragma once
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <vector>
+
+// the benchmarks that start a fresh ./server and talk to it over a socket
+
+const size_t k_max_msg = 4096;
+
+inline void die(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    abort();
+}
+
+inline double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+inline void req_append(std::string &buf, const std::vector<std::string> &cmd)
+{
+    uint32_t len = 4;
+    for (const std::string &s : cmd)
+    {
+        len += 4 + s.size();
+    }
+    assert(len <= k_max_msg);
+    uint32_t n = cmd.size();
+    buf.append((char *)&len, 4);
+    buf.append((char *)&n, 4);
+    for (const std::string &s : cmd)
+    {
+        uint32_t p = (uint32_t)s.size();
+        buf.append((char *)&p, 4);
+        buf.append(s);
+    }
+}
+
+inline void write_all(int fd, const std::string &buf)
+{
+    size_t off = 0;
+    while (off < buf.size())
+    {
+        ssize_t rv = write(fd, buf.data() + off, buf.size() - off);
+        if (rv <= 0)
+        {
+            die("write()");
+        }
+        off += (size_t)rv;
+    }
+}
+
+inline void read_full(int fd, char *buf, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t rv = read(fd, buf, n);
+        if (rv <= 0)
+        {
+            die("read()");
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+}
+
+inline std::string read_res(int fd)
+{
+    uint32_t len = 0;
+    read_full(fd, (char *)&len, 4);
+    std::string body(len, '\0');
+    read_full(fd, &body[0], len);
+    return body;
+}
+
+inline std::string command(int fd, const std::vector<std::string> &cmd)
+{
+    std::string buf;
+    req_append(buf, cmd);
+    write_all(fd, buf);
+    return read_res(fd);
+}
+
+// the int following `name` in the flat INFO reply
+inline int64_t info_int(const std::string &info, const char *name)
+{
+    uint32_t nlen = strlen(name);
+    std::string pat = std::string(1, 2) + std::string((char *)&nlen, 4) + name + std::string(1, 3);
+    size_t pos = info.find(pat);
+    if (pos == std::string::npos)
+    {
+        die("no such INFO field");
+    }
+    int64_t val = 0;
+    memcpy(&val, &info[pos + pat.size()], 8);
+    return val;
+}
+
+inline pid_t spawn_server(uint16_t port)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        std::string arg = std::to_string(port);
+        execl("./server", "./server", "--port", arg.c_str(), (char *)NULL);
+        _exit(127);
+    }
+    return pid;
+}
+
+// retries until the server is up, `rcvbuf` 0 keeps the default buffer
+inline int connect_server(uint16_t port, int rcvbuf)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (rcvbuf)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        }
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = ntohs(port);
+        addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
+        if (0 == connect(fd, (const struct sockaddr *)&addr, sizeof(addr)))
+        {
+            // no delayed ACK stall at the end of each batch
+            int val = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+            return fd;
+        }
+        close(fd);
+        usleep(20 * 1000);
+    }
+    die("connect()");
+    return -1;
+}
@@ -0,0 +1,89 @@
+// Bloom filter speed: adds and lookups one at a time and in prefetched
+// batches on a filter larger than the caches, and the measured error rate.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "bloom.h"
+
+static double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+static std::vector<uint64_t> gen(const char *prefix, size_t n)
+{
+    std::vector<uint64_t> hashes(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        std::string item = prefix + std::to_string(i);
+        hashes[i] = bloom_hash(item.data(), item.size());
+    }
+    return hashes;
+}
+
+static void report(const char *name, size_t n, double secs)
+{
+    printf("%-12s %8.1f ms  %6.1f ns/item\n", name, secs * 1e3, secs / n * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    double error = argc > 2 ? strtod(argv[2], NULL) : 0.01;
+    const size_t k_batch = 256;
+    std::vector<uint64_t> in = gen("in:", n);
+    std::vector<uint64_t> out = gen("out:", n);
+
+    Bloom single;
+    bloom_init(&single, error, n, 2, true);
+    double start = now_sec();
+    for (uint64_t h : in)
+    {
+        bloom_add(&single, h);
+    }
+    report("add", n, now_sec() - start);
+
+    Bloom batched;
+    bloom_init(&batched, error, n, 2, true);
+    std::vector<int> added(k_batch);
+    start = now_sec();
+    for (size_t i = 0; i < n; i += k_batch)
+    {
+        bloom_add_batch(&batched, &in[i], std::min(k_batch, n - i), added.data());
+    }
+    report("add batch", n, now_sec() - start);
+    printf("%zu layers, %.1f MB\n", single.layers.size(), bloom_bytes(&single) / 1e6);
+
+    size_t fp = 0;
+    start = now_sec();
+    for (uint64_t h : out)
+    {
+        fp += bloom_has(&single, h);
+    }
+    report("exists", n, now_sec() - start);
+
+    std::vector<uint8_t> found(k_batch);
+    size_t fp_batch = 0;
+    start = now_sec();
+    for (size_t i = 0; i < n; i += k_batch)
+    {
+        size_t m = std::min(k_batch, n - i);
+        bloom_has_batch(&single, &out[i], m, found.data());
+        for (size_t j = 0; j < m; j++)
+        {
+            fp_batch += found[j];
+        }
+    }
+    report("exists batch", n, now_sec() - start);
+    printf("error rate %.5f (%.5f requested)%s\n", (double)fp / n, error,
+           fp == fp_batch ? "" : ", batch mismatch");
+
+    bloom_dispose(&single);
+    bloom_dispose(&batched);
+    return 0;
+}
@@ -0,0 +1,101 @@
+// memory of user profiles stored as one string key per field against one hash
+// per user. a fresh ./server is started for each layout, loaded with the same
+// fields through pipelined commands, and its INFO is compared with the numbers
+// before the load.
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+const size_t k_nfields = 20;
+const uint16_t k_port = 1299;
+
+static const char *k_fields[k_nfields] = {
+    "name", "email", "age", "country", "city", "lang", "plan", "created",
+    "last_login", "logins", "avatar", "theme", "tz", "phone", "referrer",
+    "score", "level", "badges", "status", "verified",
+};
+
+// send the commands, then wait for all the replies
+static void pipeline(int fd, const std::vector<std::vector<std::string>> &cmds)
+{
+    std::string buf;
+    for (const std::vector<std::string> &cmd : cmds)
+    {
+        req_append(buf, cmd);
+    }
+    write_all(fd, buf);
+    for (size_t i = 0; i < cmds.size(); i++)
+    {
+        read_res(fd);
+    }
+}
+
+static std::string info(int fd)
+{
+    return command(fd, {"info"});
+}
+
+static std::string field_value(size_t user, size_t field)
+{
+    return "v" + std::to_string(user * 31 + field) + "-" + k_fields[field];
+}
+
+static void run(const char *layout, size_t nusers)
+{
+    pid_t pid = spawn_server(k_port);
+    int fd = connect_server(k_port, 0);
+    std::string before = info(fd);
+    bool as_hash = 0 == strcmp(layout, "hash");
+
+    double start = now_sec();
+    std::vector<std::vector<std::string>> cmds;
+    for (size_t u = 0; u < nusers; u++)
+    {
+        std::string key = "user:" + std::to_string(u);
+        if (as_hash)
+        {
+            std::vector<std::string> cmd = {"hset", key};
+            for (size_t f = 0; f < k_nfields; f++)
+            {
+                cmd.push_back(k_fields[f]);
+                cmd.push_back(field_value(u, f));
+            }
+            cmds.push_back(cmd);
+        }
+        else
+        {
+            for (size_t f = 0; f < k_nfields; f++)
+            {
+                cmds.push_back({"set", key + ":" + k_fields[f], field_value(u, f)});
+            }
+        }
+        if (cmds.size() >= 10000)
+        {
+            pipeline(fd, cmds);
+            cmds.clear();
+        }
+    }
+    pipeline(fd, cmds);
+    double secs = now_sec() - start;
+
+    std::string after = info(fd);
+    int64_t rss = info_int(after, "rss_bytes") - info_int(before, "rss_bytes");
+    int64_t slab = info_int(after, "slab_reserved_bytes") - info_int(before, "slab_reserved_bytes");
+    size_t nfields = nusers * k_nfields;
+    printf("%-8s keys %8lld  rss %7.1f MB  slab %7.1f MB  %5.1f bytes/field  load %.2f s\n",
+           layout, (long long)info_int(after, "keys"), rss / 1e6, slab / 1e6,
+           (double)rss / nfields, secs);
+
+    close(fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nusers = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    run("strings", nusers);
+    run("hash", nusers);
+    return 0;
+}
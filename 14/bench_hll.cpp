@@ -0,0 +1,101 @@
+// HyperLogLog speed: PFADD throughput on sparse and dense HLLs, then merging
+// 1000 dense HLLs into one, with the vectorized and the scalar register max,
+// and the error of the merged estimate.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "hll.h"
+
+static double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+// each key gets `per_key` elements, the keys overlap by half
+static void bench_add(std::vector<std::string> &hlls, size_t per_key)
+{
+    char buf[32];
+    size_t nsparse = 0;
+    double start = now_sec();
+    for (size_t k = 0; k < hlls.size(); k++)
+    {
+        hll_init(hlls[k]);
+        for (size_t i = 0; i < per_key; i++)
+        {
+            int len = snprintf(buf, sizeof(buf), "user:%zu", k * per_key / 2 + i);
+            hll_add(hlls[k], buf, (size_t)len);
+        }
+        nsparse += hlls[k][4] == HLL_SPARSE;
+    }
+    double secs = now_sec() - start;
+    size_t n = hlls.size() * per_key;
+    printf("add     %7zu keys x %6zu  %6.1f M adds/s  sparse keys %zu\n",
+           hlls.size(), per_key, n / secs / 1e6, nsparse);
+}
+
+static void bench_merge(const char *name, std::vector<std::string> &hlls,
+                        void (*fmax)(uint8_t *, const uint8_t *), size_t truth)
+{
+    static uint8_t regs[k_hll_regs];
+    static uint8_t max[k_hll_regs];
+    const int k_rounds = 10;
+    uint64_t est = 0;
+    double start = now_sec();
+    for (int r = 0; r < k_rounds; r++)
+    {
+        memset(max, 0, sizeof(max));
+        for (const std::string &hll : hlls)
+        {
+            hll_registers(hll, regs);
+            fmax(max, regs);
+        }
+        est = hll_estimate(max);
+    }
+    double secs = (now_sec() - start) / k_rounds;
+    printf("merge   %-7s %zu keys  %7.2f ms  estimate %llu  error %+.2f%%\n",
+           name, hlls.size(), secs * 1e3, (unsigned long long)est,
+           100.0 * ((double)est - truth) / truth);
+}
+
+// the register max alone, without the unpacking
+static void bench_max(const char *name, void (*fmax)(uint8_t *, const uint8_t *))
+{
+    static uint8_t a[k_hll_regs];
+    static uint8_t b[k_hll_regs];
+    for (uint32_t i = 0; i < k_hll_regs; i++)
+    {
+        a[i] = (uint8_t)(i * 7 % 20);
+        b[i] = (uint8_t)(i * 13 % 20);
+    }
+    const size_t k_rounds = 100000;
+    double start = now_sec();
+    for (size_t r = 0; r < k_rounds; r++)
+    {
+        fmax(a, b);
+        b[r % k_hll_regs]++;
+    }
+    double secs = now_sec() - start;
+    printf("max     %-7s %7.1f ns per 16K registers\n", name, secs / k_rounds * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+    std::vector<std::string> small(nkeys);
+    bench_add(small, 200);
+    std::vector<std::string> hlls(nkeys);
+    size_t per_key = 20000;
+    bench_add(hlls, per_key);
+    size_t truth = (nkeys + 1) * per_key / 2;
+    bench_merge("avx2", hlls, &hll_max, truth);
+    bench_merge("scalar", hlls, &hll_max_scalar, truth);
+    bench_max("avx2", &hll_max);
+    bench_max("scalar", &hll_max_scalar);
+    return 0;
+}
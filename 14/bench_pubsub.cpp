@@ -0,0 +1,143 @@
+// pub/sub fan-out: one publisher and 10k subscribers of the same channel on a
+// fresh ./server. first the time for every subscriber to get every message,
+// then the server memory while the subscribers stop reading, against what a
+// copy of each message per subscriber would take.
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "bench.h"
+
+const uint16_t k_port = 1298;
+
+// read from the subscribers until each one got `want` more bytes
+static void drain(int ep, const std::vector<int> &subs, std::vector<size_t> &got, size_t want)
+{
+    size_t done = 0;
+    for (size_t i = 0; i < subs.size(); i++)
+    {
+        done += got[i] >= want;
+    }
+    std::vector<epoll_event> events(1024);
+    static char buf[1 << 16];
+    while (done < subs.size())
+    {
+        int n = epoll_wait(ep, events.data(), (int)events.size(), 10 * 1000);
+        if (n <= 0)
+        {
+            die("epoll_wait()");
+        }
+        for (int k = 0; k < n; k++)
+        {
+            size_t i = events[k].data.u64;
+            ssize_t rv = 0;
+            while ((rv = read(subs[i], buf, sizeof(buf))) > 0)
+            {
+                bool before = got[i] >= want;
+                got[i] += (size_t)rv;
+                done += !before && got[i] >= want;
+            }
+            if (rv == 0)
+            {
+                die("a subscriber was disconnected");
+            }
+        }
+    }
+    for (size_t &g : got)
+    {
+        g -= want;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t nsubs = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000;
+    size_t nmsgs = argc > 2 ? strtoul(argv[2], NULL, 10) : 100;
+    size_t msg_size = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+
+    // the server inherits the fd limit
+    struct rlimit rl = {};
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < nsubs + 64)
+    {
+        die("not enough fds");
+    }
+
+    pid_t pid = spawn_server(k_port);
+    int ep = epoll_create1(0);
+    std::vector<int> subs;
+    for (size_t i = 0; i < nsubs; i++)
+    {
+        // small buffers so the messages pile up in the server, not the kernel
+        int fd = connect_server(k_port, 16 * 1024);
+        std::string buf;
+        req_append(buf, {"subscribe", "bench"});
+        write_all(fd, buf);
+        subs.push_back(fd);
+    }
+    for (int fd : subs)
+    {
+        read_res(fd);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+    // after the subscribers, so it isn't closed as idle in the meantime
+    int pub = connect_server(k_port, 0);
+    for (size_t i = 0; i < nsubs; i++)
+    {
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, subs[i], &ev);
+    }
+
+    // | len | arr | str message | str bench | str payload |
+    std::string payload(msg_size, 'x');
+    size_t frame = 4 + (1 + 4) + (1 + 4 + 7) + (1 + 4 + 5) + (1 + 4 + msg_size);
+    std::string pubs;
+    for (size_t i = 0; i < nmsgs; i++)
+    {
+        req_append(pubs, {"publish", "bench", payload});
+    }
+    std::vector<size_t> got(nsubs, 0);
+
+    // all the subscribers reading
+    double start = now_sec();
+    write_all(pub, pubs);
+    for (size_t i = 0; i < nmsgs; i++)
+    {
+        read_res(pub);
+    }
+    double published = now_sec() - start;
+    drain(ep, subs, got, nmsgs * frame);
+    double secs = now_sec() - start;
+    size_t deliveries = nsubs * nmsgs;
+    printf("fan-out   %zu subscribers x %zu msgs of %zu bytes\n", nsubs, nmsgs, msg_size);
+    printf("publish   %8.1f ms  %8.2f us/msg\n", published * 1e3, published / nmsgs * 1e6);
+    printf("delivered %8.1f ms  %8.1f ns/delivery  %6.2f M deliveries/s\n", secs * 1e3,
+           secs / deliveries * 1e9, deliveries / secs / 1e6);
+
+    // the subscribers stop reading, the messages wait in the server
+    int64_t rss_before = info_int(command(pub, {"info"}), "rss_bytes");
+    write_all(pub, pubs);
+    for (size_t i = 0; i < nmsgs; i++)
+    {
+        read_res(pub);
+    }
+    int64_t rss_after = info_int(command(pub, {"info"}), "rss_bytes");
+    printf("backlog   rss +%.1f MB, a copy per subscriber would be %.1f MB\n",
+           (rss_after - rss_before) / 1e6, (double)deliveries * frame / 1e6);
+    drain(ep, subs, got, nmsgs * frame);
+
+    for (int fd : subs)
+    {
+        close(fd);
+    }
+    close(pub);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return 0;
+}
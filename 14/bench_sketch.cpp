@@ -0,0 +1,122 @@
+// count-min sketch speed: the column and gather kernels, scalar and AVX2,
+// and increments and queries one item at a time against batches.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <random>
+#include <vector>
+
+#include "sketch.h"
+
+static double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, size_t n, double secs)
+{
+    printf("%-16s %8.1f ms  %6.2f ns/item\n", name, secs * 1e3, secs / n * 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 4000000;
+    uint32_t width = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 65536;
+    uint32_t depth = argc > 3 ? (uint32_t)strtoul(argv[3], NULL, 10) : 5;
+    const size_t k_batch = 256;
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> hashes(n);
+    for (uint64_t &h : hashes)
+    {
+        h = rng();
+    }
+    std::vector<uint32_t> cols(n);
+    std::vector<uint32_t> cols2(n);
+
+    double start = now_sec();
+    for (uint32_t row = 0; row < depth; row++)
+    {
+        cms_cols_scalar(hashes.data(), n, row, width, cols.data());
+    }
+    report("cols scalar", n * depth, now_sec() - start);
+    start = now_sec();
+    for (uint32_t row = 0; row < depth; row++)
+    {
+        cms_cols(hashes.data(), n, row, width, cols2.data());
+    }
+    report("cols avx2", n * depth, now_sec() - start);
+    if (cols != cols2)
+    {
+        printf("cols mismatch\n");
+        return 1;
+    }
+
+    std::vector<uint32_t> counters(width);
+    for (uint32_t &c : counters)
+    {
+        c = (uint32_t)rng();
+    }
+    std::vector<uint32_t> est(n, UINT32_MAX);
+    std::vector<uint32_t> est2(n, UINT32_MAX);
+    start = now_sec();
+    cms_min_scalar(counters.data(), cols.data(), n, est.data());
+    report("min scalar", n, now_sec() - start);
+    start = now_sec();
+    cms_min(counters.data(), cols.data(), n, est2.data());
+    report("min avx2", n, now_sec() - start);
+    if (est != est2)
+    {
+        printf("min mismatch\n");
+        return 1;
+    }
+
+    CMS single;
+    cms_init(&single, width, depth);
+    uint32_t one = 1;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        cms_incr_batch(&single, &hashes[i], &one, 1, &est[i]);
+    }
+    report("incr", n, now_sec() - start);
+
+    CMS batched;
+    cms_init(&batched, width, depth);
+    std::vector<uint32_t> ones(k_batch, 1);
+    start = now_sec();
+    for (size_t i = 0; i < n; i += k_batch)
+    {
+        size_t m = std::min(k_batch, n - i);
+        cms_incr_batch(&batched, &hashes[i], ones.data(), m, &est[i]);
+    }
+    report("incr batch", n, now_sec() - start);
+    if (single.counters != batched.counters)
+    {
+        printf("counters mismatch\n");
+        return 1;
+    }
+
+    start = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        cms_query_batch(&batched, &hashes[i], 1, &est[i]);
+    }
+    report("query", n, now_sec() - start);
+    start = now_sec();
+    for (size_t i = 0; i < n; i += k_batch)
+    {
+        cms_query_batch(&batched, &hashes[i], std::min(k_batch, n - i), &est2[i]);
+    }
+    report("query batch", n, now_sec() - start);
+    if (est != est2)
+    {
+        printf("query mismatch\n");
+        return 1;
+    }
+
+    cms_dispose(&single);
+    cms_dispose(&batched);
+    return 0;
+}
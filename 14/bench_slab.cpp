@@ -0,0 +1,196 @@
+// fragmentation and speed of the slab allocator against malloc() under churn.
+// the objects are sized like zset nodes with short names, a run fills the
+// heap, replaces random halves a few times with the same sizes, then with
+// larger ones, then frees most of them. the ratio is the memory held by the
+// allocator over the bytes that are live.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <vector>
+
+#include "slab.h"
+
+struct Obj
+{
+    void *ptr = NULL;
+    size_t size = 0;
+};
+
+struct Alloc
+{
+    const char *name;
+    void *(*alloc)(size_t);
+    void (*free)(void *, size_t);
+    size_t (*held)();
+};
+
+static void *m_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static void m_free(void *ptr, size_t size)
+{
+    (void)size;
+    free(ptr);
+}
+
+static size_t m_held()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.arena + mi.hblkhd;
+}
+
+static size_t s_held()
+{
+    std::vector<SlabStat> stats;
+    slab_stats(stats);
+    size_t held = 0;
+    for (const SlabStat &st : stats)
+    {
+        held += st.pages * k_slab_page;
+    }
+    return held;
+}
+
+static uint64_t rng_state = 1;
+
+static uint64_t rng()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+static void report(const Alloc &a, const char *phase, const std::vector<Obj> &objs)
+{
+    size_t live = 0;
+    for (const Obj &o : objs)
+    {
+        live += o.ptr ? o.size : 0;
+    }
+    size_t held = a.held();
+    printf("%-6s %-10s live %8.1f MB  held %8.1f MB  ratio %.2f\n",
+           a.name, phase, live / 1e6, held / 1e6, live ? (double)held / live : 0.0);
+}
+
+static void churn(const Alloc &a, size_t n)
+{
+    std::vector<Obj> objs(n);
+    rng_state = 1;
+    double start = now_sec();
+    size_t nops = 0;
+
+    // zset nodes with names of 8 to 40 bytes
+    for (Obj &o : objs)
+    {
+        o.size = 56 + 8 + rng() % 33;
+        o.ptr = a.alloc(o.size);
+        memset(o.ptr, 1, o.size);
+        nops++;
+    }
+    report(a, "fill", objs);
+
+    // the same sizes, then the values grow over time
+    for (size_t round = 0; round < 8; round++)
+    {
+        size_t grow = round < 4 ? 0 : (round - 3) * 24;
+        for (Obj &o : objs)
+        {
+            if (rng() & 1)
+            {
+                a.free(o.ptr, o.size);
+                o.size = 56 + 8 + grow + rng() % 33;
+                o.ptr = a.alloc(o.size);
+                memset(o.ptr, 1, o.size);
+                nops += 2;
+            }
+        }
+        if (round == 3)
+        {
+            report(a, "steady", objs);
+        }
+    }
+    report(a, "grow", objs);
+
+    // most keys expire
+    for (Obj &o : objs)
+    {
+        if (rng() % 10 != 0)
+        {
+            a.free(o.ptr, o.size);
+            o.ptr = NULL;
+            nops++;
+        }
+    }
+    report(a, "expire", objs);
+    double secs = now_sec() - start;
+    printf("%-6s %.1f ns/op\n", a.name, secs * 1e9 / nops);
+
+    for (Obj &o : objs)
+    {
+        if (o.ptr)
+        {
+            a.free(o.ptr, o.size);
+        }
+    }
+}
+
+// objects allocated by one thread and freed by another, like the lazy free
+static std::vector<void *> g_handoff;
+
+static void *free_worker(void *arg)
+{
+    const Alloc &a = *(const Alloc *)arg;
+    for (void *ptr : g_handoff)
+    {
+        a.free(ptr, 96);
+    }
+    return NULL;
+}
+
+static void handoff(const Alloc &a, size_t n)
+{
+    double start = now_sec();
+    for (size_t round = 0; round < 4; round++)
+    {
+        g_handoff.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            g_handoff[i] = a.alloc(96);
+        }
+        pthread_t th;
+        pthread_create(&th, NULL, &free_worker, (void *)&a);
+        pthread_join(th, NULL);
+    }
+    double secs = now_sec() - start;
+    printf("%-6s cross-thread free %.1f ns/op, held after %.1f MB\n",
+           a.name, secs * 1e9 / (8 * n), a.held() / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    Alloc allocs[] = {
+        {"malloc", &m_alloc, &m_free, &m_held},
+        {"slab", &slab_alloc, &slab_free, &s_held},
+    };
+    for (const Alloc &a : allocs)
+    {
+        churn(a, n);
+        handoff(a, n);
+        malloc_trim(0);
+    }
+    return 0;
+}
@@ -0,0 +1,173 @@
+// vector set speed: the brute-force scan with the scalar, AVX2 and int8
+// kernels, VSIM latency on one thread and across the thread pool, and the
+// recall of Q8 against the exact float search on clustered synthetic data.
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "vset.h"
+
+static double now_sec()
+{
+    timespec tv = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec + tv.tv_nsec * 1e-9;
+}
+
+// points around a few hundred centers, like embeddings of related items
+static void gen(std::vector<float> &data, size_t n, size_t dim, std::mt19937 &rng)
+{
+    std::normal_distribution<float> norm(0, 1);
+    const size_t k_centers = 256;
+    std::vector<float> centers(k_centers * dim);
+    for (float &v : centers)
+    {
+        v = norm(rng);
+    }
+    data.resize(n * dim);
+    for (size_t i = 0; i < n; i++)
+    {
+        size_t c = rng() % k_centers;
+        for (size_t d = 0; d < dim; d++)
+        {
+            data[i * dim + d] = centers[c * dim + d] + 0.5f * norm(rng);
+        }
+    }
+}
+
+static void bench_kernel(const char *name, const std::vector<float> &data, size_t dim,
+                         float (*f)(const float *, const float *, size_t))
+{
+    size_t n = data.size() / dim;
+    const float *q = &data[0];
+    float sink = 0;
+    double start = now_sec();
+    for (size_t i = 0; i < n; i++)
+    {
+        sink += f(&data[i * dim], q, dim);
+    }
+    double secs = now_sec() - start;
+    printf("scan    %-10s %7.2f ms  %6.1f ns/vector  %5.1f GB/s  (%g)\n", name, secs * 1e3,
+           secs / n * 1e9, n * dim * 4 / secs / 1e9, (double)(sink > 0));
+}
+
+static void bench_kernel_q8(const std::vector<int8_t> &qdata, size_t dim)
+{
+    size_t n = qdata.size() / dim;
+    int64_t sink = 0;
+    for (int scalar = 0; scalar < 2; scalar++)
+    {
+        double start = now_sec();
+        for (size_t i = 0; i < n; i++)
+        {
+            sink += scalar ? vec_dot_q8_scalar(&qdata[i * dim], &qdata[0], dim)
+                           : vec_dot_q8(&qdata[i * dim], &qdata[0], dim);
+        }
+        double secs = now_sec() - start;
+        printf("scan    %-10s %7.2f ms  %6.1f ns/vector  %5.1f GB/s  (%d)\n",
+               scalar ? "q8 scalar" : "q8 avx2", secs * 1e3, secs / n * 1e9,
+               n * dim / secs / 1e9, sink > 0);
+    }
+}
+
+static void load(VSet *vset, const std::vector<float> &data, size_t dim)
+{
+    vset->dim = (uint32_t)dim;
+    char name[32];
+    for (size_t i = 0; i < data.size() / dim; i++)
+    {
+        int len = snprintf(name, sizeof(name), "item:%zu", i);
+        vset_add(vset, name, (size_t)len, &data[i * dim]);
+    }
+}
+
+// the average latency of the queries, and the recall against `exact` if given
+static void bench_search(const char *name, VSet *vset, const std::vector<float> &queries, size_t k,
+                         ThreadPool *tp, std::vector<std::vector<VHit>> *exact)
+{
+    size_t nq = queries.size() / vset->dim;
+    std::vector<std::vector<VHit>> results(nq);
+    double start = now_sec();
+    for (size_t i = 0; i < nq; i++)
+    {
+        vset_search(vset, &queries[i * vset->dim], k, tp, results[i]);
+    }
+    double secs = (now_sec() - start) / nq;
+    double recall = 1;
+    if (exact)
+    {
+        size_t found = 0;
+        for (size_t i = 0; i < nq; i++)
+        {
+            for (const VHit &hit : results[i])
+            {
+                for (const VHit &want : (*exact)[i])
+                {
+                    found += hit.pos == want.pos;
+                }
+            }
+        }
+        recall = (double)found / (nq * k);
+    }
+    printf("vsim    %-18s %zu x %u  %7.2f ms/query  recall@%zu %.3f\n", name, vset_size(vset),
+           vset->dim, secs * 1e3, k, recall);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+    size_t dim = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    const size_t k_queries = 20;
+    const size_t k = 10;
+    std::mt19937 rng(1);
+    std::vector<float> data;
+    gen(data, n, dim, rng);
+    std::vector<float> queries;
+    gen(queries, k_queries, dim, rng);
+
+    bench_kernel("dot scalar", data, dim, &vec_dot_scalar);
+    bench_kernel("dot avx2", data, dim, &vec_dot);
+    bench_kernel("l2 scalar", data, dim, &vec_l2_scalar);
+    bench_kernel("l2 avx2", data, dim, &vec_l2);
+    std::vector<int8_t> qdata(data.size());
+    for (size_t i = 0; i < n; i++)
+    {
+        vec_quantize(&data[i * dim], dim, &qdata[i * dim]);
+    }
+    bench_kernel_q8(qdata, dim);
+
+    ThreadPool tp;
+    thread_pool_init(&tp, 4);
+    for (uint8_t metric : {VSET_COSINE, VSET_L2})
+    {
+        const char *mname = metric == VSET_COSINE ? "cosine" : "l2";
+        VSet fp;
+        fp.metric = metric;
+        load(&fp, data, dim);
+        VSet q8;
+        q8.metric = metric;
+        q8.q8 = true;
+        load(&q8, data, dim);
+
+        // the exact float search is the ground truth
+        std::vector<std::vector<VHit>> exact(k_queries);
+        for (size_t i = 0; i < k_queries; i++)
+        {
+            vset_search(&fp, &queries[i * dim], k, NULL, exact[i]);
+        }
+        std::string label = std::string(mname) + " fp32 1t";
+        bench_search(label.c_str(), &fp, queries, k, NULL, NULL);
+        label = std::string(mname) + " fp32 pool";
+        bench_search(label.c_str(), &fp, queries, k, &tp, &exact);
+        label = std::string(mname) + " q8 1t";
+        bench_search(label.c_str(), &q8, queries, k, NULL, &exact);
+        label = std::string(mname) + " q8 pool";
+        bench_search(label.c_str(), &q8, queries, k, &tp, &exact);
+        vset_dispose(&fp);
+        vset_dispose(&q8);
+    }
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "bitops.h"
+
+static const bool g_has_avx2 = __builtin_cpu_supports("avx2");
+static const bool g_has_popcnt = __builtin_cpu_supports("popcnt");
+
+// without -mpopcnt the builtin is a bit-twiddling routine
+uint64_t bit_count_scalar(const uint8_t *data, size_t len)
+{
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w = 0;
+        memcpy(&w, &data[i], 8);
+        n += __builtin_popcountll(w);
+    }
+    for (; i < len; i++)
+    {
+        n += __builtin_popcount(data[i]);
+    }
+    return n;
+}
+
+__attribute__((target("popcnt")))
+static uint64_t bit_count_popcnt(const uint8_t *data, size_t len)
+{
+    uint64_t n = 0;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w = 0;
+        memcpy(&w, &data[i], 8);
+        n += __builtin_popcountll(w);
+    }
+    for (; i < len; i++)
+    {
+        n += __builtin_popcount(data[i]);
+    }
+    return n;
+}
+
+// the nibbles are counted with a table lookup, then summed per 8 bytes
+__attribute__((target("avx2")))
+static uint64_t bit_count_avx2(const uint8_t *data, size_t len)
+{
+    const __m256i table = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        __m256i lo = _mm256_and_si256(v, low);
+        __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), low);
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(table, lo), _mm256_shuffle_epi8(table, hi));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    uint64_t n = (uint64_t)_mm256_extract_epi64(acc, 0) + (uint64_t)_mm256_extract_epi64(acc, 1)
+                 + (uint64_t)_mm256_extract_epi64(acc, 2) + (uint64_t)_mm256_extract_epi64(acc, 3);
+    return n + bit_count_popcnt(&data[i], len - i);
+}
+
+uint64_t bit_count(const uint8_t *data, size_t len)
+{
+    if (g_has_avx2 && g_has_popcnt)
+    {
+        return bit_count_avx2(data, len);
+    }
+    if (g_has_popcnt)
+    {
+        return bit_count_popcnt(data, len);
+    }
+    return bit_count_scalar(data, len);
+}
+
+// the byte offset of the first 32-byte block that isn't all `skip`
+__attribute__((target("avx2")))
+static size_t bit_skip_avx2(const uint8_t *data, size_t len, uint8_t skip)
+{
+    const __m256i pat = _mm256_set1_epi8((char)skip);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)&data[i]);
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, pat)) != 0xffffffffu)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+int64_t bit_pos(const uint8_t *data, size_t len, int bit)
+{
+    // the bytes that can't hold the bit
+    uint8_t skip = bit ? 0x00 : 0xff;
+    size_t i = g_has_avx2 ? bit_skip_avx2(data, len, skip) : 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        uint64_t w = 0;
+        memcpy(&w, &data[i], 8);
+        if (w != (bit ? 0 : ~0ULL))
+        {
+            break;
+        }
+    }
+    for (; i < len; i++)
+    {
+        if (data[i] != skip)
+        {
+            uint8_t byte = bit ? data[i] : (uint8_t)~data[i];
+            return (int64_t)(i * 8) + __builtin_clz(byte) - 24;
+        }
+    }
+    return -1;
+}
+
+void bit_op_scalar(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        switch (op)
+        {
+        case BITOP_AND:
+            dst[i] &= src[i];
+            break;
+        case BITOP_OR:
+            dst[i] |= src[i];
+            break;
+        case BITOP_XOR:
+            dst[i] ^= src[i];
+            break;
+        case BITOP_NOT:
+            dst[i] = (uint8_t)~src[i];
+            break;
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static size_t bit_op_avx2(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi8(-1);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&src[i]);
+        switch (op)
+        {
+        case BITOP_AND:
+            a = _mm256_and_si256(a, b);
+            break;
+        case BITOP_OR:
+            a = _mm256_or_si256(a, b);
+            break;
+        case BITOP_XOR:
+            a = _mm256_xor_si256(a, b);
+            break;
+        case BITOP_NOT:
+            a = _mm256_xor_si256(b, ones);
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)&dst[i], a);
+    }
+    return i;
+}
+
+void bit_op(int op, uint8_t *dst, const uint8_t *src, size_t n)
+{
+    size_t done = g_has_avx2 ? bit_op_avx2(op, dst, src, n) : 0;
+    bit_op_scalar(op, dst + done, src + done, n - done);
+}
+
+uint64_t bitfield_get(const uint8_t *data, size_t len, uint64_t off, uint32_t bits)
+{
+    uint64_t val = 0;
+    for (uint64_t pos = off; pos < off + bits; pos++)
+    {
+        uint64_t byte = pos / 8;
+        uint64_t b = byte < len ? (data[byte] >> (7 - pos % 8)) & 1 : 0;
+        val = (val << 1) | b;
+    }
+    return val;
+}
+
+void bitfield_set(uint8_t *data, uint64_t off, uint32_t bits, uint64_t val)
+{
+    for (uint32_t j = 0; j < bits; j++)
+    {
+        uint64_t pos = off + j;
+        uint8_t mask = (uint8_t)(1 << (7 - pos % 8));
+        uint64_t b = (val >> (bits - 1 - j)) & 1;
+        data[pos / 8] = b ? (data[pos / 8] | mask) : (data[pos / 8] & ~mask);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// bitmaps are string values, bit 0 is the most significant bit of byte 0.
+// the kernels use AVX2 and POPCNT when the CPU has them.
+
+// bit offsets are limited like in Redis, a value is at most 512 MB
+const uint64_t k_bit_max_offset = (1ULL << 32) - 1;
+
+enum
+{
+    BITOP_AND = 0,
+    BITOP_OR = 1,
+    BITOP_XOR = 2,
+    BITOP_NOT = 3,
+};
+
+uint64_t bit_count(const uint8_t *data, size_t len);
+uint64_t bit_count_scalar(const uint8_t *data, size_t len);
+// the offset of the first bit equal to `bit`, or -1
+int64_t bit_pos(const uint8_t *data, size_t len, int bit);
+// dst = dst op src over n bytes, or dst = ~src for BITOP_NOT
+void bit_op(int op, uint8_t *dst, const uint8_t *src, size_t n);
+void bit_op_scalar(int op, uint8_t *dst, const uint8_t *src, size_t n);
+
+// an unsigned field of up to 64 bits at a bit offset, past the end reads 0
+uint64_t bitfield_get(const uint8_t *data, size_t len, uint64_t off, uint32_t bits);
+// the field must be within the data
+void bitfield_set(uint8_t *data, uint64_t off, uint32_t bits, uint64_t val);
@@ -0,0 +1,225 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "bloom.h"
+#include "common.h"
+
+// how many items ahead a batch prefetches
+const size_t k_bloom_prefetch = 8;
+// a block holds 512 bits, more hashes just fill it faster
+const uint32_t k_bloom_max_k = 24;
+
+static uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t bloom_hash(const char *data, size_t len)
+{
+    return str_hash64((const uint8_t *)data, len);
+}
+
+static uint8_t *block_of(const BloomLayer &layer, uint64_t hash)
+{
+    uint64_t idx = (uint64_t)(((unsigned __int128)hash * layer.nblocks) >> 64);
+    return &layer.blocks[idx * k_bloom_block];
+}
+
+// the bits within the block are 9-bit slices of a second hash. double hashing
+// (a + i*b) would leave too few distinct bit sets for 512 bits, items that
+// share all of them put a floor under the error rate.
+static uint32_t next_bit(uint64_t &g, uint32_t i)
+{
+    if (i > 0 && i % 7 == 0)
+    {
+        g = mix64(g + i);
+    }
+    uint32_t bit = (uint32_t)(g % k_bloom_block_bits);
+    g /= k_bloom_block_bits;
+    return bit;
+}
+
+static bool block_has(const BloomLayer &layer, const uint8_t *block, uint64_t hash)
+{
+    uint64_t g = mix64(hash);
+    for (uint32_t i = 0; i < layer.k; i++)
+    {
+        uint32_t bit = next_bit(g, i);
+        if (!(block[bit / 8] & (1 << (bit % 8))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void block_set(const BloomLayer &layer, uint8_t *block, uint64_t hash)
+{
+    uint64_t g = mix64(hash);
+    for (uint32_t i = 0; i < layer.k; i++)
+    {
+        uint32_t bit = next_bit(g, i);
+        block[bit / 8] |= (uint8_t)(1 << (bit % 8));
+    }
+}
+
+// the classic sizing is m = -n ln(p) / ln(2)^2 bits with k = -log2(p). the
+// items don't spread evenly over the blocks and the fuller blocks give more
+// false positives, more so for small error rates. the extra bits are fitted to
+// measurements to stay under the requested rate down to 1e-6.
+static double extra_bits(double error)
+{
+    double digits = -log10(error);
+    return 1.05 + 0.05 * digits + 0.25 * exp(digits - 4);
+}
+
+static void layer_size(Bloom *bloom, size_t i, BloomLayer &layer)
+{
+    layer.capacity = bloom->capacity;
+    for (size_t j = 0; j < i; j++)
+    {
+        layer.capacity *= bloom->expansion;
+    }
+    double error = bloom->error * pow(0.5, (double)i);
+    double bits = -(double)layer.capacity * log(error) / (M_LN2 * M_LN2) * extra_bits(error);
+    layer.nblocks = std::max((uint64_t)ceil(bits / k_bloom_block_bits), (uint64_t)1);
+    layer.k = (uint32_t)ceil(-log2(error));
+    layer.k = std::min(std::max(layer.k, (uint32_t)1), k_bloom_max_k);
+}
+
+uint64_t bloom_layer_blocks(Bloom *bloom, size_t i)
+{
+    BloomLayer layer;
+    layer_size(bloom, i, layer);
+    return layer.nblocks;
+}
+
+BloomLayer *bloom_grow(Bloom *bloom)
+{
+    BloomLayer layer;
+    layer_size(bloom, bloom->layers.size(), layer);
+    layer.blocks = (uint8_t *)aligned_alloc(k_bloom_block, layer.nblocks * k_bloom_block);
+    memset(layer.blocks, 0, layer.nblocks * k_bloom_block);
+    bloom->layers.push_back(layer);
+    return &bloom->layers.back();
+}
+
+void bloom_init(Bloom *bloom, double error, uint64_t capacity, uint32_t expansion, bool scaling)
+{
+    bloom->error = error;
+    bloom->capacity = capacity;
+    bloom->expansion = expansion;
+    bloom->scaling = scaling;
+    bloom_grow(bloom);
+}
+
+bool bloom_has(Bloom *bloom, uint64_t hash)
+{
+    // the newer layers are larger
+    for (size_t i = bloom->layers.size(); i-- > 0;)
+    {
+        const BloomLayer &layer = bloom->layers[i];
+        if (block_has(layer, block_of(layer, hash), hash))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int bloom_add(Bloom *bloom, uint64_t hash)
+{
+    if (bloom_has(bloom, hash))
+    {
+        return 0;
+    }
+    BloomLayer *layer = &bloom->layers.back();
+    if (layer->count >= layer->capacity)
+    {
+        if (!bloom->scaling)
+        {
+            return -1;
+        }
+        layer = bloom_grow(bloom);
+    }
+    block_set(*layer, block_of(*layer, hash), hash);
+    layer->count++;
+    return 1;
+}
+
+static void prefetch(Bloom *bloom, uint64_t hash)
+{
+    for (const BloomLayer &layer : bloom->layers)
+    {
+        __builtin_prefetch(block_of(layer, hash));
+    }
+}
+
+void bloom_has_batch(Bloom *bloom, const uint64_t *hashes, size_t n, uint8_t *out)
+{
+    for (size_t i = 0; i < n && i < k_bloom_prefetch; i++)
+    {
+        prefetch(bloom, hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i + k_bloom_prefetch < n)
+        {
+            prefetch(bloom, hashes[i + k_bloom_prefetch]);
+        }
+        out[i] = bloom_has(bloom, hashes[i]);
+    }
+}
+
+// in order, so a duplicate in the batch is only added once
+void bloom_add_batch(Bloom *bloom, const uint64_t *hashes, size_t n, int *out)
+{
+    for (size_t i = 0; i < n && i < k_bloom_prefetch; i++)
+    {
+        prefetch(bloom, hashes[i]);
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i + k_bloom_prefetch < n)
+        {
+            prefetch(bloom, hashes[i + k_bloom_prefetch]);
+        }
+        out[i] = bloom_add(bloom, hashes[i]);
+    }
+}
+
+uint64_t bloom_count(Bloom *bloom)
+{
+    uint64_t n = 0;
+    for (const BloomLayer &layer : bloom->layers)
+    {
+        n += layer.count;
+    }
+    return n;
+}
+
+size_t bloom_bytes(Bloom *bloom)
+{
+    size_t n = 0;
+    for (const BloomLayer &layer : bloom->layers)
+    {
+        n += layer.nblocks * k_bloom_block;
+    }
+    return n;
+}
+
+void bloom_dispose(Bloom *bloom)
+{
+    for (BloomLayer &layer : bloom->layers)
+    {
+        free(layer.blocks);
+    }
+    std::vector<BloomLayer>().swap(bloom->layers);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// a blocked Bloom filter: an item hashes to one 64-byte block, which is one
+// cache line, and all of its k bits are in that block. a probe costs a single
+// cache miss instead of k, for a slightly higher error rate than a classic
+// filter of the same size, which the sizing makes up for.
+//
+// a scalable filter chains layers: once the last one holds its capacity, a
+// new one is added with `expansion` times the capacity and half the error
+// rate, so the total error rate stays below twice the requested one.
+const size_t k_bloom_block = 64;
+const uint32_t k_bloom_block_bits = 512;
+// limits of BF.RESERVE
+const uint64_t k_bloom_max_capacity = (uint64_t)1 << 30;
+const uint32_t k_bloom_max_expansion = 32;
+
+struct BloomLayer
+{
+    uint64_t capacity = 0;
+    uint64_t count = 0;
+    uint64_t nblocks = 0;
+    uint32_t k = 0;
+    // aligned to the cache line
+    uint8_t *blocks = NULL;
+};
+
+struct Bloom
+{
+    double error = 0.01;
+    // of the first layer
+    uint64_t capacity = 0;
+    uint32_t expansion = 2;
+    bool scaling = true;
+    std::vector<BloomLayer> layers;
+};
+
+// with the first layer
+void bloom_init(Bloom *bloom, double error, uint64_t capacity, uint32_t expansion, bool scaling);
+// add the next empty layer. the size of a layer only depends on the options
+// and its position, so a dump only has to carry the bits.
+BloomLayer *bloom_grow(Bloom *bloom);
+// the number of blocks of the `i`-th layer
+uint64_t bloom_layer_blocks(Bloom *bloom, size_t i);
+uint64_t bloom_hash(const char *data, size_t len);
+bool bloom_has(Bloom *bloom, uint64_t hash);
+// 1 if added, 0 if it was there, -1 if a non-scaling filter is full
+int bloom_add(Bloom *bloom, uint64_t hash);
+// the same for a batch, the blocks are prefetched a few items ahead
+void bloom_has_batch(Bloom *bloom, const uint64_t *hashes, size_t n, uint8_t *out);
+void bloom_add_batch(Bloom *bloom, const uint64_t *hashes, size_t n, int *out);
+// the items added, and the memory of the blocks
+uint64_t bloom_count(Bloom *bloom);
+size_t bloom_bytes(Bloom *bloom);
+void bloom_dispose(Bloom *bloom);
@@ -0,0 +1,53 @@
+#include "cluster.h"
+
+// CRC16-CCITT (XMODEM): polynomial 0x1021, initial value 0
+static uint16_t g_crc16_tab[256];
+
+static bool crc16_init()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint16_t crc = (uint16_t)(i << 8);
+        for (int j = 0; j < 8; j++)
+        {
+            crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+        }
+        g_crc16_tab[i] = crc;
+    }
+    return true;
+}
+
+static bool g_crc16_ready = crc16_init();
+
+uint16_t crc16(const uint8_t *data, size_t len)
+{
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (uint16_t)((crc << 8) ^ g_crc16_tab[((crc >> 8) ^ data[i]) & 0xff]);
+    }
+    return crc;
+}
+
+// only the part between the first `{` and the next `}` is hashed if it's
+// not empty, so related keys can be put into the same slot
+uint32_t key_hash_slot(const char *key, size_t len)
+{
+    size_t start = 0;
+    for (; start < len && key[start] != '{'; start++)
+    {
+    }
+    if (start < len)
+    {
+        size_t end = start + 1;
+        for (; end < len && key[end] != '}'; end++)
+        {
+        }
+        if (end < len && end != start + 1)
+        {
+            key += start + 1;
+            len = end - start - 1;
+        }
+    }
+    return crc16((const uint8_t *)key, len) & (k_cluster_slots - 1);
+}
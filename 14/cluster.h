@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the key space is divided into a fixed number of slots
+const uint32_t k_cluster_slots = 16384;
+
+uint16_t crc16(const uint8_t *data, size_t len);
+uint32_t key_hash_slot(const char *key, size_t len);
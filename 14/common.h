@@ -17,6 +17,41 @@ inline uint64_t str_hash(const uint8_t *data, size_t len)
     return h;
 }
 
+// MurmurHash64A, for the uses that need all 64 bits
+inline uint64_t str_hash64(const uint8_t *data, size_t len, uint64_t seed = 0xadc83b19ULL)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const uint8_t *end = data + (len & ~(size_t)7);
+    for (; data != end; data += 8)
+    {
+        uint64_t k = 0;
+        __builtin_memcpy(&k, data, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7)
+    {
+    case 7: h ^= (uint64_t)data[6] << 48; // fallthrough
+    case 6: h ^= (uint64_t)data[5] << 40; // fallthrough
+    case 5: h ^= (uint64_t)data[4] << 32; // fallthrough
+    case 4: h ^= (uint64_t)data[3] << 24; // fallthrough
+    case 3: h ^= (uint64_t)data[2] << 16; // fallthrough
+    case 2: h ^= (uint64_t)data[1] << 8;  // fallthrough
+    case 1:
+        h ^= (uint64_t)data[0];
+        h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
 enum
 {
     SER_NIL = 0,
@@ -0,0 +1,156 @@
+#include <math.h>
+#include <algorithm>
+
+#include "geo.h"
+
+// the same constants as Redis, so the distances agree
+const double k_earth_radius = 6372797.560856;
+const double k_deg_meters = k_earth_radius * M_PI / 180;
+
+static double deg2rad(double deg)
+{
+    return deg * M_PI / 180;
+}
+
+// spread the lower 32 bits to the even bits
+static uint64_t spread(uint64_t x)
+{
+    x &= 0xffffffff;
+    x = (x | (x << 16)) & 0x0000ffff0000ffffULL;
+    x = (x | (x << 8)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x << 2)) & 0x3333333333333333ULL;
+    x = (x | (x << 1)) & 0x5555555555555555ULL;
+    return x;
+}
+
+// the reverse of spread()
+static uint64_t squash(uint64_t x)
+{
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0fULL;
+    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffULL;
+    x = (x | (x >> 8)) & 0x0000ffff0000ffffULL;
+    x = (x | (x >> 16)) & 0x00000000ffffffffULL;
+    return x;
+}
+
+// the cell index of a coordinate at `step` bits
+static int64_t cell_index(double v, double min, double max, uint32_t step)
+{
+    return (int64_t)floor((v - min) / (max - min) * (double)(1ULL << step));
+}
+
+bool geo_valid(double lon, double lat)
+{
+    return lon >= k_geo_lon_min && lon <= k_geo_lon_max
+           && lat >= k_geo_lat_min && lat <= k_geo_lat_max;
+}
+
+uint64_t geo_encode(double lon, double lat)
+{
+    const int64_t k_last = (1LL << k_geo_step_max) - 1;
+    int64_t x = std::min(cell_index(lon, k_geo_lon_min, k_geo_lon_max, k_geo_step_max), k_last);
+    int64_t y = std::min(cell_index(lat, k_geo_lat_min, k_geo_lat_max, k_geo_step_max), k_last);
+    return spread((uint64_t)y) | (spread((uint64_t)x) << 1);
+}
+
+void geo_decode(uint64_t hash, double &lon, double &lat)
+{
+    double cells = (double)(1ULL << k_geo_step_max);
+    double x = (double)squash(hash >> 1);
+    double y = (double)squash(hash);
+    lon = k_geo_lon_min + (x + 0.5) * (k_geo_lon_max - k_geo_lon_min) / cells;
+    lat = k_geo_lat_min + (y + 0.5) * (k_geo_lat_max - k_geo_lat_min) / cells;
+}
+
+// haversine
+double geo_dist(double lon1, double lat1, double lon2, double lat2)
+{
+    double u = sin((deg2rad(lat2) - deg2rad(lat1)) / 2);
+    double v = sin((deg2rad(lon2) - deg2rad(lon1)) / 2);
+    double a = u * u + cos(deg2rad(lat1)) * cos(deg2rad(lat2)) * v * v;
+    return 2 * k_earth_radius * asin(sqrt(a));
+}
+
+// the height is measured along the meridian, the width along the parallel of
+// the point, like GEOSEARCH BYBOX in Redis
+bool geo_in_box(double clon, double clat, double width, double height,
+                double lon, double lat, double &dist)
+{
+    double dy = geo_dist(clon, clat, clon, lat);
+    if (dy > height / 2)
+    {
+        return false;
+    }
+    double dx = geo_dist(clon, lat, lon, lat);
+    if (dx > width / 2)
+    {
+        return false;
+    }
+    dist = geo_dist(clon, clat, lon, lat);
+    return true;
+}
+
+size_t geo_ranges(double lon, double lat, double width, double height, GeoRange *ranges)
+{
+    // the extent in degrees, the parallels shrink towards the poles
+    double dlat = height / 2 / k_deg_meters;
+    double lat_lo = std::max(lat - dlat, k_geo_lat_min);
+    double lat_hi = std::min(lat + dlat, k_geo_lat_max);
+    double widest = std::max(fabs(lat_lo), fabs(lat_hi));
+    double dlon = width / 2 / (k_deg_meters * std::max(cos(deg2rad(widest)), 1e-9));
+
+    // the finest step whose cells are at least as large as the box, so it
+    // overlaps at most 2 cells in each direction
+    uint32_t step = k_geo_step_max;
+    while (step > 0
+           && ((k_geo_lon_max - k_geo_lon_min) / (double)(1ULL << step) < 2 * dlon
+               || (k_geo_lat_max - k_geo_lat_min) / (double)(1ULL << step) < 2 * dlat))
+    {
+        step--;
+    }
+
+    int64_t cells = 1LL << step;
+    int64_t x_lo = cell_index(lon - dlon, k_geo_lon_min, k_geo_lon_max, step);
+    int64_t x_hi = cell_index(lon + dlon, k_geo_lon_min, k_geo_lon_max, step);
+    int64_t y_lo = std::max(cell_index(lat_lo, k_geo_lat_min, k_geo_lat_max, step), (int64_t)0);
+    int64_t y_hi = std::min(cell_index(lat_hi, k_geo_lat_min, k_geo_lat_max, step), cells - 1);
+    if (x_hi - x_lo >= cells)
+    {
+        // around the globe
+        x_lo = 0;
+        x_hi = cells - 1;
+    }
+
+    uint32_t shift = 2 * (k_geo_step_max - step);
+    size_t n = 0;
+    for (int64_t y = y_lo; y <= y_hi; y++)
+    {
+        for (int64_t x = x_lo; x <= x_hi; x++)
+        {
+            // wrap around the antimeridian
+            uint64_t xi = (uint64_t)(((x % cells) + cells) % cells);
+            uint64_t hash = spread((uint64_t)y) | (spread(xi) << 1);
+            ranges[n].min = hash << shift;
+            ranges[n].max = (hash + 1) << shift;
+            n++;
+        }
+    }
+
+    std::sort(ranges, ranges + n, [](const GeoRange &a, const GeoRange &b) { return a.min < b.min; });
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (m > 0 && ranges[m - 1].max >= ranges[i].min)
+        {
+            ranges[m - 1].max = std::max(ranges[m - 1].max, ranges[i].max);
+        }
+        else
+        {
+            ranges[m++] = ranges[i];
+        }
+    }
+    return m;
+}
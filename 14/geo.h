@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// geospatial members are stored in a zset, the score is a 52-bit geohash:
+// 26 bits of latitude and 26 bits of longitude interleaved, latitude in the
+// even bits. a cell of 2 * step bits is a contiguous score range, so an area
+// is searched by seeking to the ranges of the few cells that cover it.
+//
+// the latitude is limited to the range of Web Mercator like in Redis.
+const double k_geo_lon_min = -180;
+const double k_geo_lon_max = 180;
+const double k_geo_lat_min = -85.05112878;
+const double k_geo_lat_max = 85.05112878;
+const uint32_t k_geo_step_max = 26;
+
+// [min, max) of the scores
+struct GeoRange
+{
+    uint64_t min = 0;
+    uint64_t max = 0;
+};
+
+bool geo_valid(double lon, double lat);
+uint64_t geo_encode(double lon, double lat);
+// the center of the finest cell
+void geo_decode(uint64_t hash, double &lon, double &lat);
+// the great-circle distance in meters
+double geo_dist(double lon1, double lat1, double lon2, double lat2);
+// whether (lon, lat) is within the box of width x height meters centered on
+// (clon, clat), and its distance to the center
+bool geo_in_box(double clon, double clat, double width, double height,
+                double lon, double lat, double &dist);
+// the sorted, merged score ranges of the cells covering the box of width x
+// height meters centered on (lon, lat), a radius search passes its diameter.
+// returns the number of ranges, at most 4.
+size_t geo_ranges(double lon, double lat, double width, double height, GeoRange *ranges);
@@ -0,0 +1,254 @@
+#include <string.h>
+
+#include "hash.h"
+#include "common.h"
+#include "slab.h"
+
+size_t hash_node_size(HashNode *node)
+{
+    return sizeof(HashNode) + node->flen + node->vlen;
+}
+
+static HashNode *hnode_new(const char *field, size_t flen, const char *val, size_t vlen)
+{
+    HashNode *node = (HashNode *)slab_alloc(sizeof(HashNode) + flen + vlen);
+    node->node.next = NULL;
+    node->node.hcode = str_hash((uint8_t *)field, flen);
+    node->flen = (uint32_t)flen;
+    node->vlen = (uint32_t)vlen;
+    memcpy(&node->data[0], field, flen);
+    memcpy(&node->data[flen], val, vlen);
+    return node;
+}
+
+static void hnode_del(HashNode *node)
+{
+    slab_free(node, hash_node_size(node));
+}
+
+// a helper structure for the hashtable lookup
+struct HKey
+{
+    HNode node;
+    const char *field = NULL;
+    size_t flen = 0;
+};
+
+static bool hcmp(HNode *node, HNode *key)
+{
+    if (node->hcode != key->hcode)
+    {
+        return false;
+    }
+    HashNode *hnode = container_of(node, HashNode, node);
+    HKey *hkey = container_of(key, HKey, node);
+    return hnode->flen == hkey->flen && 0 == memcmp(hnode->data, hkey->field, hkey->flen);
+}
+
+static HNode *map_lookup(Hash *hash, const char *field, size_t flen, bool pop)
+{
+    HKey key;
+    key.node.hcode = str_hash((uint8_t *)field, flen);
+    key.field = field;
+    key.flen = flen;
+    return pop ? hm_pop(&hash->map, &key.node, &hcmp) : hm_lookup(&hash->map, &key.node, &hcmp);
+}
+
+// the offset of the pair in the packed buffer, or npos
+static size_t packed_find(Hash *hash, const char *field, size_t flen)
+{
+    const std::string &buf = hash->packed;
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        size_t len = (uint8_t)buf[pos];
+        size_t vlen = (uint8_t)buf[pos + 1 + len];
+        if (len == flen && 0 == memcmp(&buf[pos + 1], field, flen))
+        {
+            return pos;
+        }
+        pos += 1 + len + 1 + vlen;
+    }
+    return std::string::npos;
+}
+
+static void packed_pair(const std::string &buf, size_t pos,
+                        const char **field, size_t *flen, const char **val, size_t *vlen)
+{
+    *flen = (uint8_t)buf[pos];
+    *field = &buf[pos + 1];
+    *vlen = (uint8_t)buf[pos + 1 + *flen];
+    *val = &buf[pos + 1 + *flen + 1];
+}
+
+static void packed_erase(Hash *hash, size_t pos)
+{
+    size_t flen = (uint8_t)hash->packed[pos];
+    size_t vlen = (uint8_t)hash->packed[pos + 1 + flen];
+    hash->packed.erase(pos, 1 + flen + 1 + vlen);
+    hash->npacked--;
+}
+
+// move the packed pairs into the HMap
+static void hash_convert(Hash *hash)
+{
+    hm_reserve(&hash->map, hash->npacked + 1);
+    size_t pos = 0;
+    while (pos < hash->packed.size())
+    {
+        const char *field, *val;
+        size_t flen, vlen;
+        packed_pair(hash->packed, pos, &field, &flen, &val, &vlen);
+        hm_insert(&hash->map, &hnode_new(field, flen, val, vlen)->node);
+        pos += 1 + flen + 1 + vlen;
+    }
+    std::string().swap(hash->packed);
+    hash->npacked = 0;
+    hash->is_map = true;
+}
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen)
+{
+    if (hash->is_map)
+    {
+        HNode *node = map_lookup(hash, field, flen, false);
+        if (!node)
+        {
+            return false;
+        }
+        HashNode *hnode = container_of(node, HashNode, node);
+        *val = &hnode->data[hnode->flen];
+        *vlen = hnode->vlen;
+        return true;
+    }
+    size_t pos = packed_find(hash, field, flen);
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+    const char *f;
+    size_t n;
+    packed_pair(hash->packed, pos, &f, &n, val, vlen);
+    return true;
+}
+
+// returns true if the field is new
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen)
+{
+    if (!hash->is_map)
+    {
+        size_t pos = packed_find(hash, field, flen);
+        bool added = pos == std::string::npos;
+        bool fits = flen <= k_hash_packed_max_len && vlen <= k_hash_packed_max_len
+                    && hash->npacked + added <= k_hash_packed_max_fields;
+        if (fits && !added)
+        {
+            // overwrite the value in place to keep the order
+            size_t vpos = pos + 1 + flen;
+            size_t old = (uint8_t)hash->packed[vpos];
+            hash->packed[vpos] = (char)vlen;
+            hash->packed.replace(vpos + 1, old, val, vlen);
+            return false;
+        }
+        if (fits)
+        {
+            hash->packed.push_back((char)flen);
+            hash->packed.append(field, flen);
+            hash->packed.push_back((char)vlen);
+            hash->packed.append(val, vlen);
+            hash->npacked++;
+            return true;
+        }
+        hash_convert(hash);
+    }
+
+    HNode *old = map_lookup(hash, field, flen, true);
+    if (old)
+    {
+        hnode_del(container_of(old, HashNode, node));
+    }
+    hm_insert(&hash->map, &hnode_new(field, flen, val, vlen)->node);
+    return !old;
+}
+
+bool hash_del(Hash *hash, const char *field, size_t flen)
+{
+    if (hash->is_map)
+    {
+        HNode *node = map_lookup(hash, field, flen, true);
+        if (node)
+        {
+            hnode_del(container_of(node, HashNode, node));
+        }
+        return node != NULL;
+    }
+    size_t pos = packed_find(hash, field, flen);
+    if (pos == std::string::npos)
+    {
+        return false;
+    }
+    packed_erase(hash, pos);
+    return true;
+}
+
+size_t hash_size(Hash *hash)
+{
+    return hash->is_map ? hm_size(&hash->map) : hash->npacked;
+}
+
+struct ScanCtx
+{
+    void (*f)(const char *, size_t, const char *, size_t, void *) = NULL;
+    void *arg = NULL;
+};
+
+static void cb_scan(HNode *node, void *arg)
+{
+    ScanCtx *ctx = (ScanCtx *)arg;
+    HashNode *hnode = container_of(node, HashNode, node);
+    ctx->f(hnode->data, hnode->flen, &hnode->data[hnode->flen], hnode->vlen, ctx->arg);
+}
+
+uint64_t hash_scan(Hash *hash, uint64_t cursor, size_t count,
+                   void (*f)(const char *, size_t, const char *, size_t, void *), void *arg)
+{
+    if (hash->is_map)
+    {
+        ScanCtx ctx;
+        ctx.f = f;
+        ctx.arg = arg;
+        return hm_scan(&hash->map, cursor, count, &cb_scan, &ctx);
+    }
+    // small enough to be returned at once
+    size_t pos = 0;
+    while (pos < hash->packed.size())
+    {
+        const char *field, *val;
+        size_t flen, vlen;
+        packed_pair(hash->packed, pos, &field, &flen, &val, &vlen);
+        f(field, flen, val, vlen, arg);
+        pos += 1 + flen + 1 + vlen;
+    }
+    return 0;
+}
+
+void hash_dispose(Hash *hash)
+{
+    HTab *tabs[2] = {&hash->map.ht1, &hash->map.ht2};
+    for (HTab *tab : tabs)
+    {
+        for (size_t i = 0; tab->tab && i <= tab->mask; i++)
+        {
+            HNode *node = tab->tab[i];
+            while (node)
+            {
+                HNode *next = node->next;
+                hnode_del(container_of(node, HashNode, node));
+                node = next;
+            }
+        }
+    }
+    hm_destroy(&hash->map);
+    std::string().swap(hash->packed);
+    hash->npacked = 0;
+}
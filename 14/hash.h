@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+
+#include "hashtable.h"
+
+// a hash starts as a packed buffer of | flen:u8 | field | vlen:u8 | value |
+// pairs, which is scanned linearly. it's converted to a HMap of HashNode once
+// it has too many fields or a field or value is too long.
+const size_t k_hash_packed_max_fields = 64;
+const size_t k_hash_packed_max_len = 64;
+
+struct Hash
+{
+    std::string packed;
+    uint32_t npacked = 0;
+    bool is_map = false;
+    HMap map;
+};
+
+struct HashNode
+{
+    HNode node;
+    uint32_t flen = 0;
+    uint32_t vlen = 0;
+    char data[0];   // the field, then the value
+};
+
+bool hash_get(Hash *hash, const char *field, size_t flen, const char **val, size_t *vlen);
+bool hash_set(Hash *hash, const char *field, size_t flen, const char *val, size_t vlen);
+bool hash_del(Hash *hash, const char *field, size_t flen);
+size_t hash_size(Hash *hash);
+// calls f(field, flen, val, vlen, arg) for about `count` fields from the
+// cursor, returns the next cursor or 0 at the end. see hm_scan().
+uint64_t hash_scan(Hash *hash, uint64_t cursor, size_t count,
+                   void (*f)(const char *, size_t, const char *, size_t, void *), void *arg);
+void hash_dispose(Hash *hash);
+size_t hash_node_size(HashNode *node);
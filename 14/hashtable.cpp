@@ -53,6 +53,7 @@ static HNode *h_detach(HTab *htab, HNode **from)
 }
 
 const size_t k_resizing_work = 128;
+const size_t k_max_load_factor = 8;
 
 static void hm_help_resizing(HMap *hmap)
 {
@@ -91,9 +92,8 @@ static void hm_start_resizing(HMap *hmap)
     hmap->resizing_pos = 0;
 }
 
-HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
+HNode *hm_find(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
 {
-    hm_help_resizing(hmap);
     HNode **from = h_lookup(&hmap->ht1, key, cmp);
     if (!from)
     {
@@ -102,7 +102,11 @@ HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
     return from ? *from : NULL;
 }
 
-const size_t k_max_load_factor = 8;
+HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *))
+{
+    hm_help_resizing(hmap);
+    return hm_find(hmap, key, cmp);
+}
 
 void hm_insert(HMap *hmap, HNode *node)
 {
@@ -145,10 +149,58 @@ size_t hm_size(HMap *hmap)
     return hmap->ht1.size + hmap->ht2.size;
 }
 
+// presize an empty table for n nodes, so that inserting them won't trigger resizing
+void hm_reserve(HMap *hmap, size_t n)
+{
+    if (hmap->ht1.tab || hmap->ht2.tab)
+    {
+        return;
+    }
+    size_t cap = 4;
+    while (n >= cap * k_max_load_factor)
+    {
+        cap *= 2;
+    }
+    h_init(&hmap->ht1, cap);
+}
+
+// free the tables, the nodes are owned by the caller
 void hm_destroy(HMap *hmap)
 {
-    assert(hmap->ht1.size + hmap->ht2.size == 0);
     free(hmap->ht1.tab);
     free(hmap->ht2.tab);
     *hmap = HMap{};
+}
+
+// visit the buckets from `pos` until at least `count` nodes are visited, returns
+// the position to continue from, or 0 at the end.
+// ht1[pos] and ht2[pos] are visited together: a node of ht2[pos] can only move
+// to ht1[pos] or a later bucket, and a new resizing keeps the nodes of ht1[pos]
+// at or after pos. So a node that stays in the map is visited at least once
+// across the calls, and exactly once if the map isn't changed in between.
+size_t hm_scan(HMap *hmap, size_t pos, size_t count, void (*f)(HNode *, void *), void *arg)
+{
+    size_t nvisited = 0;
+    while (hmap->ht1.tab && pos <= hmap->ht1.mask)
+    {
+        HTab *tabs[2] = {&hmap->ht1, &hmap->ht2};
+        for (HTab *tab : tabs)
+        {
+            if (!tab->tab || pos > tab->mask)
+            {
+                continue;
+            }
+            for (HNode *node = tab->tab[pos]; node; node = node->next)
+            {
+                f(node, arg);
+                nvisited++;
+            }
+        }
+        pos++;
+        if (nvisited >= count)
+        {
+            break;
+        }
+    }
+    return hmap->ht1.tab && pos <= hmap->ht1.mask ? pos : 0;
 }
\ No newline at end of file
@@ -28,7 +28,11 @@ struct HMap
 };
 
 HNode *hm_lookup(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
+// a lookup without the resizing work, so threads can share a read-only map
+HNode *hm_find(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 void hm_insert(HMap *hmap, HNode *node);
 HNode *hm_pop(HMap *hmap, HNode *key, bool (*cmp)(HNode *, HNode *));
 size_t hm_size(HMap *hmap);
-void hm_destroy(HMap *hmap);
\ No newline at end of file
+void hm_reserve(HMap *hmap, size_t n);
+void hm_destroy(HMap *hmap);
+size_t hm_scan(HMap *hmap, size_t pos, size_t count, void (*f)(HNode *, void *), void *arg);
\ No newline at end of file
@@ -0,0 +1,353 @@
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hll.h"
+#include "common.h"
+
+const uint64_t k_hll_stale = 1ULL << 63;
+// registers count at most this many zeros plus one
+const uint32_t k_hll_q = 64 - k_hll_p;
+
+static uint64_t hdr_card(const std::string &hll)
+{
+    uint64_t card = 0;
+    memcpy(&card, &hll[8], 8);
+    return card;
+}
+
+static void hdr_set_card(std::string &hll, uint64_t card)
+{
+    memcpy(&hll[8], &card, 8);
+}
+
+static std::string hdr_new(uint8_t enc)
+{
+    std::string hll(k_hll_hdr, '\0');
+    memcpy(&hll[0], "HYLL", 4);
+    hll[4] = (char)enc;
+    hdr_set_card(hll, k_hll_stale);
+    return hll;
+}
+
+void hll_init(std::string &hll)
+{
+    hll = hdr_new(HLL_SPARSE);
+    hdr_set_card(hll, 0);
+}
+
+static uint16_t sparse_idx(const uint8_t *item)
+{
+    uint16_t idx = 0;
+    memcpy(&idx, item, 2);
+    return idx;
+}
+
+bool hll_valid(const std::string &hll)
+{
+    if (hll.size() < k_hll_hdr || 0 != memcmp(hll.data(), "HYLL", 4))
+    {
+        return false;
+    }
+    if (hll[4] == HLL_DENSE)
+    {
+        return hll.size() == k_hll_dense_size;
+    }
+    if (hll[4] != HLL_SPARSE || (hll.size() - k_hll_hdr) % 3 != 0)
+    {
+        return false;
+    }
+    // the indexes are used as is, so a SET can't be trusted
+    const uint8_t *p = (const uint8_t *)&hll[k_hll_hdr];
+    size_t n = (hll.size() - k_hll_hdr) / 3;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint16_t idx = sparse_idx(&p[3 * i]);
+        if (idx >= k_hll_regs || p[3 * i + 2] == 0 || p[3 * i + 2] > k_hll_q + 1
+            || (i > 0 && idx <= sparse_idx(&p[3 * i - 3])))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a 6-bit register that may straddle two bytes
+static uint8_t dense_get(const uint8_t *regs, uint32_t i)
+{
+    uint32_t byte = i * 6 / 8;
+    uint32_t shift = i * 6 % 8;
+    uint32_t v = regs[byte];
+    if (shift > 2)
+    {
+        v |= (uint32_t)regs[byte + 1] << 8;
+    }
+    return (uint8_t)((v >> shift) & 63);
+}
+
+static void dense_set(uint8_t *regs, uint32_t i, uint8_t val)
+{
+    uint32_t byte = i * 6 / 8;
+    uint32_t shift = i * 6 % 8;
+    uint32_t v = regs[byte];
+    if (shift > 2)
+    {
+        v |= (uint32_t)regs[byte + 1] << 8;
+    }
+    v = (v & ~(63u << shift)) | ((uint32_t)val << shift);
+    regs[byte] = (uint8_t)v;
+    if (shift > 2)
+    {
+        regs[byte + 1] = (uint8_t)(v >> 8);
+    }
+}
+
+// the register index and the count of trailing zeros plus one
+static uint32_t hll_pos(const char *data, size_t len, uint8_t *count)
+{
+    uint64_t h = str_hash64((const uint8_t *)data, len);
+    uint32_t idx = (uint32_t)(h & (k_hll_regs - 1));
+    h >>= k_hll_p;
+    h |= 1ULL << k_hll_q;
+    *count = (uint8_t)(__builtin_ctzll(h) + 1);
+    return idx;
+}
+
+// 4 registers from every 3 bytes
+static void dense_unpack(const uint8_t *p, uint8_t *regs, uint32_t start)
+{
+    for (uint32_t i = start; i < k_hll_regs; i += 4, p += 3)
+    {
+        uint32_t v = p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+        regs[i] = v & 63;
+        regs[i + 1] = (v >> 6) & 63;
+        regs[i + 2] = (v >> 12) & 63;
+        regs[i + 3] = (v >> 18) & 63;
+    }
+}
+
+// 32 registers from every 24 bytes: each lane spreads 12 bytes into 4 dwords of
+// 3 bytes, then the 4 registers of a dword are shifted into its 4 bytes.
+__attribute__((target("avx2")))
+static void dense_unpack_avx2(const uint8_t *p, uint8_t *regs)
+{
+    const __m256i spread = _mm256_setr_epi8(
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+        0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i m0 = _mm256_set1_epi32(0x3f);
+    const __m256i m1 = _mm256_set1_epi32(0x3f00);
+    const __m256i m2 = _mm256_set1_epi32(0x3f0000);
+    const __m256i m3 = _mm256_set1_epi32(0x3f000000);
+    // the loads of the last block would go past the end
+    uint32_t i = 0;
+    for (; i + 64 <= k_hll_regs; i += 32, p += 24)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)p);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + 12));
+        __m256i v = _mm256_shuffle_epi8(_mm256_set_m128i(hi, lo), spread);
+        __m256i r = _mm256_and_si256(v, m0);
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(v, 2), m1));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(v, 4), m2));
+        r = _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(v, 6), m3));
+        _mm256_storeu_si256((__m256i *)&regs[i], r);
+    }
+    dense_unpack(p, regs, i);
+}
+
+static const bool g_has_avx2 = __builtin_cpu_supports("avx2");
+
+void hll_registers(const std::string &hll, uint8_t *regs)
+{
+    const uint8_t *p = (const uint8_t *)&hll[k_hll_hdr];
+    if (hll[4] == HLL_DENSE)
+    {
+        if (g_has_avx2)
+        {
+            return dense_unpack_avx2(p, regs);
+        }
+        return dense_unpack(p, regs, 0);
+    }
+    memset(regs, 0, k_hll_regs);
+    size_t n = (hll.size() - k_hll_hdr) / 3;
+    for (size_t i = 0; i < n; i++)
+    {
+        regs[sparse_idx(&p[3 * i])] = p[3 * i + 2];
+    }
+}
+
+void hll_store_dense(std::string &hll, const uint8_t *regs)
+{
+    std::string dense = hdr_new(HLL_DENSE);
+    dense.resize(k_hll_dense_size);
+    uint8_t *p = (uint8_t *)&dense[k_hll_hdr];
+    for (uint32_t i = 0; i < k_hll_regs; i += 4, p += 3)
+    {
+        uint32_t v = regs[i] | (uint32_t)regs[i + 1] << 6
+                     | (uint32_t)regs[i + 2] << 12 | (uint32_t)regs[i + 3] << 18;
+        p[0] = (uint8_t)v;
+        p[1] = (uint8_t)(v >> 8);
+        p[2] = (uint8_t)(v >> 16);
+    }
+    hll.swap(dense);
+}
+
+bool hll_add(std::string &hll, const char *data, size_t len)
+{
+    uint8_t count = 0;
+    uint32_t idx = hll_pos(data, len, &count);
+    if (hll[4] == HLL_DENSE)
+    {
+        uint8_t *regs = (uint8_t *)&hll[k_hll_hdr];
+        if (dense_get(regs, idx) >= count)
+        {
+            return false;
+        }
+        dense_set(regs, idx, count);
+        hdr_set_card(hll, k_hll_stale);
+        return true;
+    }
+
+    // binary search for the index
+    uint8_t *p = (uint8_t *)&hll[k_hll_hdr];
+    size_t lo = 0;
+    size_t hi = (hll.size() - k_hll_hdr) / 3;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (sparse_idx(&p[3 * mid]) < idx)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    size_t off = k_hll_hdr + 3 * lo;
+    if (off < hll.size() && sparse_idx(&p[3 * lo]) == idx)
+    {
+        if (p[3 * lo + 2] >= count)
+        {
+            return false;
+        }
+        p[3 * lo + 2] = count;
+    }
+    else if (hll.size() + 3 > k_hll_sparse_max)
+    {
+        uint8_t regs[k_hll_regs];
+        hll_registers(hll, regs);
+        regs[idx] = count;
+        hll_store_dense(hll, regs);
+        return true;
+    }
+    else
+    {
+        uint16_t idx16 = (uint16_t)idx;
+        char item[3];
+        memcpy(item, &idx16, 2);
+        item[2] = (char)count;
+        hll.insert(off, item, 3);
+    }
+    hdr_set_card(hll, k_hll_stale);
+    return true;
+}
+
+void hll_max_scalar(uint8_t *dst, const uint8_t *src)
+{
+    for (uint32_t i = 0; i < k_hll_regs; i++)
+    {
+        dst[i] = dst[i] < src[i] ? src[i] : dst[i];
+    }
+}
+
+__attribute__((target("avx2")))
+static void hll_max_avx2(uint8_t *dst, const uint8_t *src)
+{
+    for (uint32_t i = 0; i < k_hll_regs; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&dst[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&src[i]);
+        _mm256_storeu_si256((__m256i *)&dst[i], _mm256_max_epu8(a, b));
+    }
+}
+
+void hll_max(uint8_t *dst, const uint8_t *src)
+{
+    if (g_has_avx2)
+    {
+        return hll_max_avx2(dst, src);
+    }
+    return hll_max_scalar(dst, src);
+}
+
+// Ertl, "New cardinality estimation algorithms for HyperLogLog sketches"
+static double hll_sigma(double x)
+{
+    if (x == 1.)
+    {
+        return INFINITY;
+    }
+    double prev;
+    double y = 1;
+    double z = x;
+    do
+    {
+        x *= x;
+        prev = z;
+        z += x * y;
+        y += y;
+    } while (prev != z);
+    return z;
+}
+
+static double hll_tau(double x)
+{
+    if (x == 0. || x == 1.)
+    {
+        return 0.;
+    }
+    double prev;
+    double y = 1.0;
+    double z = 1 - x;
+    do
+    {
+        x = sqrt(x);
+        prev = z;
+        y *= 0.5;
+        z -= pow(1 - x, 2) * y;
+    } while (prev != z);
+    return z / 3;
+}
+
+uint64_t hll_estimate(const uint8_t *regs)
+{
+    // the estimator only needs how many registers hold each value
+    uint32_t hist[64] = {};
+    for (uint32_t i = 0; i < k_hll_regs; i++)
+    {
+        hist[regs[i] & 63]++;
+    }
+    double m = k_hll_regs;
+    double z = m * hll_tau((m - hist[k_hll_q + 1]) / m);
+    for (int j = (int)k_hll_q; j >= 1; j--)
+    {
+        z += hist[j];
+        z *= 0.5;
+    }
+    z += m * hll_sigma(hist[0] / m);
+    return (uint64_t)llroundl(0.5 / log(2.) * m * m / z);
+}
+
+uint64_t hll_count(std::string &hll)
+{
+    uint64_t card = hdr_card(hll);
+    if (!(card & k_hll_stale))
+    {
+        return card;
+    }
+    uint8_t regs[k_hll_regs];
+    hll_registers(hll, regs);
+    card = hll_estimate(regs);
+    hdr_set_card(hll, card);
+    return card;
+}
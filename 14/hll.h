@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// HyperLogLog cardinality estimation, kept in a string value like Redis does:
+//
+// | "HYLL" | encoding:u8 | unused:3 | card:u64 | registers |
+//
+// 2^14 registers hold the longest run of trailing zeros (+1) seen in the
+// upper 50 bits of a 64-bit hash, indexed by the lower 14 bits. the standard
+// error is 1.04 / sqrt(2^14) = 0.81%, so 99% of the estimates are within about
+// 2.4% of the true count.
+//
+// dense: 6-bit registers packed little-endian, 12 KB.
+// sparse: (index:u16 | value:u8) for the non-zero registers sorted by index,
+// converted to dense past k_hll_sparse_max bytes.
+//
+// card caches the last estimate, the top bit is set when it's stale.
+const uint32_t k_hll_p = 14;
+const uint32_t k_hll_regs = 1 << k_hll_p;
+const uint32_t k_hll_hdr = 16;
+const size_t k_hll_dense_size = k_hll_hdr + k_hll_regs * 6 / 8;
+const size_t k_hll_sparse_max = 3000;
+
+enum
+{
+    HLL_DENSE = 0,
+    HLL_SPARSE = 1,
+};
+
+// an empty sparse HLL
+void hll_init(std::string &hll);
+// whether a string value can be used as a HLL
+bool hll_valid(const std::string &hll);
+// returns true if a register has changed
+bool hll_add(std::string &hll, const char *data, size_t len);
+// the estimate, cached in the header
+uint64_t hll_count(std::string &hll);
+
+// the registers as bytes, for merging several HLLs
+void hll_registers(const std::string &hll, uint8_t *regs);
+// dst[i] = max(dst[i], src[i]) over k_hll_regs bytes
+void hll_max(uint8_t *dst, const uint8_t *src);
+void hll_max_scalar(uint8_t *dst, const uint8_t *src);
+uint64_t hll_estimate(const uint8_t *regs);
+// replace the HLL with a dense one holding the registers
+void hll_store_dense(std::string &hll, const uint8_t *regs);
@@ -0,0 +1,124 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+
+#include "keys.h"
+
+static bool str2int(const std::string &s, int64_t &out)
+{
+    char *endp = NULL;
+    out = strtoll(s.c_str(), &endp, 10);
+    return endp == s.c_str() + s.size();
+}
+
+bool cmd_is(const std::string &word, const char *cmd)
+{
+    return 0 == strcasecmp(word.c_str(), cmd);
+}
+
+// commands whose first argument is a key
+bool cmd_has_key(const std::string &word)
+{
+    static const char *k_keyed[] = {
+        "get", "set", "del", "pexpire", "pexpireat", "pttl",
+        "zadd", "zrem", "zscore", "zquery",
+        "hset", "hget", "hmget", "hdel", "hincrby", "hlen", "hgetall", "hscan",
+        "lpush", "rpush", "lpop", "rpop", "lrange", "ltrim", "llen", "blpop", "brpop",
+        "sadd", "srem", "sismember", "smismember", "scard", "sinter", "sunionstore",
+        "append", "pfadd", "pfcount", "pfmerge",
+        "setbit", "getbit", "bitcount", "bitpos", "bitfield",
+        "xadd", "xlen", "xrange", "xrevrange",
+        "geoadd", "geopos", "geodist", "geosearch",
+        "vadd", "vrem", "vsim", "vcard", "vdim", "vemb",
+        "bf.reserve", "bf.add", "bf.madd", "bf.exists", "bf.mexists", "bf.info", "bf.loadchunk",
+        "cms.initbydim", "cms.initbyprob", "cms.incrby", "cms.query", "cms.info", "cms.loadchunk",
+        "topk.reserve", "topk.add", "topk.query", "topk.list", "topk.info", "topk.loaditems",
+        "ts.create", "ts.add", "ts.range", "ts.get", "ts.info", "ts.loadchunk",
+    };
+    for (const char *name : k_keyed)
+    {
+        if (cmd_is(word, name))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// the positions of all the keys of a command
+void cmd_keys(const std::vector<std::string> &cmd, std::vector<size_t> &keys)
+{
+    const std::string &word = cmd[0];
+    size_t first = 1, last = 0;
+    if (cmd_is(word, "sinter") || cmd_is(word, "sunionstore") || cmd_is(word, "pfcount")
+        || cmd_is(word, "pfmerge"))
+    {
+        last = cmd.size();
+    }
+    else if (cmd_is(word, "blpop") || cmd_is(word, "brpop"))
+    {
+        last = cmd.size() - 1; // the timeout
+    }
+    else if (cmd_is(word, "bitop") && cmd.size() >= 3)
+    {
+        first = 2;
+        last = cmd.size();
+    }
+    else if (cmd_is(word, "sintercard") && cmd.size() >= 2)
+    {
+        // sintercard numkeys key [key ...] [limit N]
+        int64_t n = 0;
+        if (str2int(cmd[1], n) && n > 0 && (size_t)n <= cmd.size() - 2)
+        {
+            first = 2;
+            last = 2 + (size_t)n;
+        }
+    }
+    else if (cmd_is(word, "xread"))
+    {
+        // the keys and then as many IDs after STREAMS
+        for (size_t i = 1; i < cmd.size(); i++)
+        {
+            if (cmd_is(cmd[i], "streams"))
+            {
+                first = i + 1;
+                last = first + (cmd.size() - first) / 2;
+                break;
+            }
+        }
+    }
+    else if (cmd.size() >= 2 && cmd_has_key(word))
+    {
+        last = 2;
+    }
+    for (size_t i = first; i < last; i++)
+    {
+        keys.push_back(i);
+    }
+}
+
+// EVAL script numkeys [key ...] [arg ...]
+bool script_keys(const std::vector<std::string> &cmd, size_t &nkeys)
+{
+    int64_t n = 0;
+    if (!str2int(cmd[2], n) || n < 0 || (size_t)n > cmd.size() - 3)
+    {
+        return false;
+    }
+    nkeys = (size_t)n;
+    return true;
+}
+
+void cmd_route_keys(const std::vector<std::string> &cmd, std::vector<size_t> &keys)
+{
+    cmd_keys(cmd, keys);
+    size_t nkeys = 0;
+    bool scripted = cmd.size() >= 3 && (cmd_is(cmd[0], "eval") || cmd_is(cmd[0], "evalsha"));
+    if (scripted && script_keys(cmd, nkeys))
+    {
+        for (size_t i = 3; i < 3 + nkeys; i++)
+        {
+            keys.push_back(i);
+        }
+    }
+}
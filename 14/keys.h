@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// where the keys of a command are, so the server and the proxy route the
+// requests by the same keys
+
+bool cmd_is(const std::string &word, const char *cmd);
+
+// commands whose first argument is a key
+bool cmd_has_key(const std::string &word);
+
+// the positions of all the keys of a command
+void cmd_keys(const std::vector<std::string> &cmd, std::vector<size_t> &keys);
+
+// EVAL script numkeys [key ...] [arg ...]
+bool script_keys(const std::vector<std::string> &cmd, size_t &nkeys);
+
+// the keys that pick the slot of a request, including the keys a script declares
+void cmd_route_keys(const std::vector<std::string> &cmd, std::vector<size_t> &keys);
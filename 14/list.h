@@ -26,11 +26,21 @@ inline void dlist_detach(DList *node)
     next->prev = prev;
 }
 
+// the node was moved in memory, point the neighbors at it
+inline void dlist_relink(DList *node)
+{
+    if (node->next)
+    {
+        node->prev->next = node;
+        node->next->prev = node;
+    }
+}
+
 inline void dlist_insert_before(DList *target, DList *added)
 {
     DList *prev = target->prev;
     prev->next = added;
     added->prev = prev;
     added->next = target;
-    target->prev = target;
+    target->prev = added;
 }
\ No newline at end of file
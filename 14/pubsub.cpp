@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+#include "pubsub.h"
+
+PubMsg *pubmsg_new(const std::string &body)
+{
+    size_t len = 4 + body.size();
+    void *mem = malloc(sizeof(PubMsg) + len);
+    if (!mem)
+    {
+        abort();
+    }
+    PubMsg *msg = new (mem) PubMsg();
+    msg->refs = 1;
+    msg->len = (uint32_t)len;
+    uint32_t blen = (uint32_t)body.size();
+    memcpy(&msg->data[0], &blen, 4);
+    memcpy(&msg->data[4], body.data(), body.size());
+    return msg;
+}
+
+void pubmsg_unref(PubMsg *msg)
+{
+    if (--msg->refs == 0)
+    {
+        free(msg);
+    }
+}
+
+// a [...] class at `p`, after the '['. moves `p` past the ']'.
+static bool class_match(const char *&p, const char *end, char c)
+{
+    bool neg = p < end && *p == '^';
+    p += neg;
+    bool hit = false;
+    while (p < end && *p != ']')
+    {
+        if (*p == '\\' && p + 1 < end)
+        {
+            hit |= p[1] == c;
+            p += 2;
+        }
+        else if (p + 2 < end && p[1] == '-' && p[2] != ']')
+        {
+            uint8_t lo = (uint8_t)p[0], hi = (uint8_t)p[2];
+            if (lo > hi)
+            {
+                std::swap(lo, hi);
+            }
+            hit |= (uint8_t)c >= lo && (uint8_t)c <= hi;
+            p += 3;
+        }
+        else
+        {
+            hit |= *p == c;
+            p++;
+        }
+    }
+    p += p < end; // the ']'
+    return hit != neg;
+}
+
+// on a mismatch, the last '*' takes one more character
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen)
+{
+    size_t p = 0, s = 0;
+    size_t star_p = (size_t)-1, star_s = 0;
+    while (s < slen)
+    {
+        if (p < plen)
+        {
+            char c = pat[p];
+            if (c == '*')
+            {
+                star_p = ++p;
+                star_s = s;
+                continue;
+            }
+            if (c == '?')
+            {
+                p++;
+                s++;
+                continue;
+            }
+            if (c == '[')
+            {
+                const char *q = pat + p + 1;
+                if (class_match(q, pat + plen, str[s]))
+                {
+                    p = (size_t)(q - pat);
+                    s++;
+                    continue;
+                }
+            }
+            else
+            {
+                size_t next = (c == '\\' && p + 1 < plen) ? p + 1 : p;
+                if (pat[next] == str[s])
+                {
+                    p = next + 1;
+                    s++;
+                    continue;
+                }
+            }
+        }
+        if (star_p == (size_t)-1)
+        {
+            return false;
+        }
+        p = star_p;
+        s = ++star_s;
+    }
+    while (p < plen && pat[p] == '*')
+    {
+        p++;
+    }
+    return p == plen;
+}
+
+static size_t literal_prefix(const std::string &pattern)
+{
+    size_t n = pattern.find_first_of("*?[\\");
+    return n == std::string::npos ? pattern.size() : n;
+}
+
+bool pat_add(PatNode *root, const std::string &pattern, void *sub)
+{
+    PatNode *node = root;
+    size_t n = literal_prefix(pattern);
+    for (size_t i = 0; i < n; i++)
+    {
+        PatNode *&next = node->next[pattern[i]];
+        if (!next)
+        {
+            next = new PatNode();
+        }
+        node = next;
+    }
+    for (PatSubs &ps : node->pats)
+    {
+        if (ps.pattern == pattern)
+        {
+            for (void *s : ps.subs)
+            {
+                if (s == sub)
+                {
+                    return false;
+                }
+            }
+            ps.subs.push_back(sub);
+            return true;
+        }
+    }
+    node->pats.push_back(PatSubs());
+    node->pats.back().pattern = pattern;
+    node->pats.back().subs.push_back(sub);
+    return true;
+}
+
+// the order of the subscribers doesn't matter, so the last one fills the hole
+template <class T>
+static void swap_remove(std::vector<T> &v, size_t i)
+{
+    std::swap(v[i], v.back());
+    v.pop_back();
+}
+
+bool pat_del(PatNode *root, const std::string &pattern, void *sub)
+{
+    std::vector<PatNode *> path = {root};
+    size_t n = literal_prefix(pattern);
+    for (size_t i = 0; i < n; i++)
+    {
+        auto it = path.back()->next.find(pattern[i]);
+        if (it == path.back()->next.end())
+        {
+            return false;
+        }
+        path.push_back(it->second);
+    }
+    std::vector<PatSubs> &pats = path.back()->pats;
+    bool found = false;
+    for (size_t i = 0; i < pats.size() && !found; i++)
+    {
+        std::vector<void *> &subs = pats[i].subs;
+        for (size_t j = 0; j < subs.size() && !found; j++)
+        {
+            if (pats[i].pattern == pattern && subs[j] == sub)
+            {
+                swap_remove(subs, j);
+                found = true;
+            }
+        }
+        if (found && subs.empty())
+        {
+            swap_remove(pats, i);
+        }
+    }
+    // free the nodes left empty, bottom up
+    for (size_t i = n; found && i > 0; i--)
+    {
+        PatNode *node = path[i];
+        if (!node->next.empty() || !node->pats.empty())
+        {
+            break;
+        }
+        path[i - 1]->next.erase(pattern[i - 1]);
+        delete node;
+    }
+    return found;
+}
+
+void pat_match(PatNode *root, const std::string &channel, std::vector<const PatSubs *> &out)
+{
+    const char *name = channel.data();
+    size_t len = channel.size();
+    PatNode *node = root;
+    for (size_t depth = 0; node; depth++)
+    {
+        for (const PatSubs &ps : node->pats)
+        {
+            const char *rest = ps.pattern.data() + depth;
+            if (glob_match(rest, ps.pattern.size() - depth, name + depth, len - depth))
+            {
+                out.push_back(&ps);
+            }
+        }
+        if (depth == len)
+        {
+            break;
+        }
+        auto it = node->next.find(name[depth]);
+        node = it == node->next.end() ? NULL : it->second;
+    }
+}
+
+size_t pat_count(PatNode *root)
+{
+    size_t n = root->pats.size();
+    for (auto &kv : root->next)
+    {
+        n += pat_count(kv.second);
+    }
+    return n;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// a published message, framed once and shared by the output queues of all
+// its subscribers. it starts with one reference for the publisher, and the
+// last one to let go frees it.
+struct PubMsg
+{
+    uint32_t refs = 0;
+    uint32_t len = 0;
+    char data[0];
+};
+
+// the frame is the 4-byte length and `body`
+PubMsg *pubmsg_new(const std::string &body);
+void pubmsg_unref(PubMsg *msg);
+
+// glob-style: * ? [abc] [^a-z] and \ to escape
+bool glob_match(const char *pat, size_t plen, const char *str, size_t slen);
+
+// the pattern subscriptions in a trie keyed by the literal prefix of each
+// pattern, the part before its first wildcard. a channel walks down the trie
+// along its own name, so only the patterns whose prefix it starts with are
+// tried on the rest of the name.
+struct PatSubs
+{
+    std::string pattern;
+    std::vector<void *> subs;
+};
+
+struct PatNode
+{
+    std::map<char, PatNode *> next;
+    // the patterns whose prefix ends here
+    std::vector<PatSubs> pats;
+};
+
+// false if `sub` already has the pattern
+bool pat_add(PatNode *root, const std::string &pattern, void *sub);
+// false if `sub` doesn't have the pattern
+bool pat_del(PatNode *root, const std::string &pattern, void *sub);
+// the patterns matching the channel, with their subscribers
+void pat_match(PatNode *root, const std::string &channel, std::vector<const PatSubs *> &out);
+size_t pat_count(PatNode *root);
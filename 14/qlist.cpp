@@ -0,0 +1,223 @@
+#include <string.h>
+#include <algorithm>
+
+#include "qlist.h"
+#include "common.h"
+#include "slab.h"
+
+// the length before and after the bytes
+const size_t k_qitem_overhead = 8;
+
+size_t qlist_chunk_size(QChunk *chunk)
+{
+    return sizeof(QChunk) + chunk->cap;
+}
+
+static QChunk *chunk_new(size_t need)
+{
+    size_t cap = std::max(k_qchunk_bytes - sizeof(QChunk), need);
+    QChunk *chunk = new (slab_alloc(sizeof(QChunk) + cap)) QChunk();
+    chunk->cap = (uint32_t)cap;
+    return chunk;
+}
+
+static void chunk_del(QList *list, QChunk *chunk)
+{
+    dlist_detach(&chunk->node);
+    list->nchunks--;
+    slab_free(chunk, qlist_chunk_size(chunk));
+}
+
+static QChunk *first_chunk(QList *list)
+{
+    return container_of(list->chunks.next, QChunk, node);
+}
+
+static QChunk *last_chunk(QList *list)
+{
+    return container_of(list->chunks.prev, QChunk, node);
+}
+
+// make room for `need` bytes on one side by moving the items to the other
+static bool chunk_make_room(QChunk *chunk, bool left, size_t need)
+{
+    uint32_t used = chunk->end - chunk->start;
+    if (left ? chunk->start >= need : chunk->cap - chunk->end >= need)
+    {
+        return true;
+    }
+    if (chunk->cap - used < need)
+    {
+        return false;
+    }
+    uint32_t start = left ? chunk->cap - used : 0;
+    memmove(&chunk->data[start], &chunk->data[chunk->start], used);
+    chunk->start = start;
+    chunk->end = start + used;
+    return true;
+}
+
+void qlist_push(QList *list, bool left, const char *val, size_t len)
+{
+    size_t need = len + k_qitem_overhead;
+    QChunk *chunk = NULL;
+    if (!dlist_empty(&list->chunks))
+    {
+        chunk = left ? first_chunk(list) : last_chunk(list);
+    }
+    if (!chunk || !chunk_make_room(chunk, left, need))
+    {
+        chunk = chunk_new(need);
+        // an empty chunk is filled from the end facing the rest of the list
+        chunk->start = chunk->end = left ? chunk->cap : 0;
+        if (left)
+        {
+            dlist_insert_before(list->chunks.next, &chunk->node);
+        }
+        else
+        {
+            dlist_insert_before(&list->chunks, &chunk->node);
+        }
+        list->nchunks++;
+    }
+
+    uint32_t pos = left ? chunk->start - (uint32_t)need : chunk->end;
+    uint32_t n = (uint32_t)len;
+    memcpy(&chunk->data[pos], &n, 4);
+    memcpy(&chunk->data[pos + 4], val, len);
+    memcpy(&chunk->data[pos + 4 + len], &n, 4);
+    if (left)
+    {
+        chunk->start = pos;
+    }
+    else
+    {
+        chunk->end = pos + (uint32_t)need;
+    }
+    chunk->nitems++;
+    list->size++;
+}
+
+bool qlist_pop(QList *list, bool left, std::string &val)
+{
+    if (dlist_empty(&list->chunks))
+    {
+        return false;
+    }
+    QChunk *chunk = left ? first_chunk(list) : last_chunk(list);
+    uint32_t len = 0;
+    if (left)
+    {
+        memcpy(&len, &chunk->data[chunk->start], 4);
+        val.assign(&chunk->data[chunk->start + 4], len);
+        chunk->start += len + k_qitem_overhead;
+    }
+    else
+    {
+        memcpy(&len, &chunk->data[chunk->end - 4], 4);
+        chunk->end -= len + k_qitem_overhead;
+        val.assign(&chunk->data[chunk->end + 4], len);
+    }
+    chunk->nitems--;
+    list->size--;
+    if (chunk->nitems == 0)
+    {
+        chunk_del(list, chunk);
+    }
+    return true;
+}
+
+// the byte offset of the next item
+static uint32_t item_next(QChunk *chunk, uint32_t pos)
+{
+    uint32_t len = 0;
+    memcpy(&len, &chunk->data[pos], 4);
+    return pos + len + (uint32_t)k_qitem_overhead;
+}
+
+void qlist_range(QList *list, size_t start, size_t stop,
+                 void (*f)(const char *, size_t, void *), void *arg)
+{
+    if (start > stop || start >= list->size)
+    {
+        return;
+    }
+    // skip the whole chunks before the start
+    size_t idx = 0;
+    DList *node = list->chunks.next;
+    QChunk *chunk = container_of(node, QChunk, node);
+    while (idx + chunk->nitems <= start)
+    {
+        idx += chunk->nitems;
+        node = node->next;
+        chunk = container_of(node, QChunk, node);
+    }
+    while (node != &list->chunks && idx <= stop)
+    {
+        chunk = container_of(node, QChunk, node);
+        for (uint32_t pos = chunk->start; pos < chunk->end && idx <= stop; idx++)
+        {
+            if (idx >= start)
+            {
+                uint32_t len = 0;
+                memcpy(&len, &chunk->data[pos], 4);
+                f(&chunk->data[pos + 4], len, arg);
+            }
+            pos = item_next(chunk, pos);
+        }
+        node = node->next;
+    }
+}
+
+// remove n items from one end, whole chunks are freed without a walk
+static void qlist_drop(QList *list, bool left, size_t n)
+{
+    while (n > 0)
+    {
+        QChunk *chunk = left ? first_chunk(list) : last_chunk(list);
+        if (chunk->nitems <= n)
+        {
+            n -= chunk->nitems;
+            list->size -= chunk->nitems;
+            chunk_del(list, chunk);
+            continue;
+        }
+        for (; n > 0; n--)
+        {
+            uint32_t len = 0;
+            if (left)
+            {
+                memcpy(&len, &chunk->data[chunk->start], 4);
+                chunk->start += len + (uint32_t)k_qitem_overhead;
+            }
+            else
+            {
+                memcpy(&len, &chunk->data[chunk->end - 4], 4);
+                chunk->end -= len + (uint32_t)k_qitem_overhead;
+            }
+            chunk->nitems--;
+            list->size--;
+        }
+    }
+}
+
+void qlist_trim(QList *list, size_t start, size_t stop)
+{
+    if (start > stop || start >= list->size)
+    {
+        qlist_drop(list, true, list->size);
+        return;
+    }
+    stop = std::min(stop, list->size - 1);
+    qlist_drop(list, false, list->size - 1 - stop);
+    qlist_drop(list, true, start);
+}
+
+void qlist_dispose(QList *list)
+{
+    while (!dlist_empty(&list->chunks))
+    {
+        chunk_del(list, first_chunk(list));
+    }
+    list->size = 0;
+}
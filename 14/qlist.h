@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "list.h"
+
+// a list is a DList of chunks, each one packs the items of a contiguous range
+// as | len:u32 | bytes | len:u32 |, so both ends can be walked and popped.
+// the items sit in [start, end) of the buffer, leaving room on both sides for
+// pushes. chunks are sized for the slab allocator, a larger item gets a chunk
+// of its own.
+const size_t k_qchunk_bytes = 1024;
+
+struct QChunk
+{
+    DList node;
+    uint32_t cap = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    uint32_t nitems = 0;
+    char data[0];
+};
+
+struct QList
+{
+    DList chunks;
+    size_t size = 0;
+    size_t nchunks = 0;
+
+    QList()
+    {
+        dlist_init(&chunks);
+    }
+};
+
+void qlist_push(QList *list, bool left, const char *val, size_t len);
+bool qlist_pop(QList *list, bool left, std::string &val);
+// calls f(val, len, arg) for the items in [start, stop]
+void qlist_range(QList *list, size_t start, size_t stop,
+                 void (*f)(const char *, size_t, void *), void *arg);
+// keep only the items in [start, stop], all of them are removed if start > stop
+void qlist_trim(QList *list, size_t start, size_t stop);
+void qlist_dispose(QList *list);
+size_t qlist_chunk_size(QChunk *chunk);
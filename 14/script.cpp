@@ -0,0 +1,1564 @@
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "script.h"
+
+const size_t k_max_locals = 200;
+const uint32_t k_max_depth = 200;
+
+enum
+{
+    OP_NIL = 0,
+    OP_TRUE,
+    OP_FALSE,
+    OP_CONST,   // push consts[a]
+    OP_GET,     // push locals[a]
+    OP_SET,     // pop into locals[a]
+    OP_POP,
+    OP_NEWARR,  // pop `a` values into a new array
+    OP_INDEX,   // t k -> t[k]
+    OP_SETINDEX, // t k v ->
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_CONCAT,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_NEG,
+    OP_NOT,
+    OP_LEN,
+    OP_JMP,     // to a
+    OP_JMPF,    // pop, to a if false
+    OP_AND,     // to a keeping the value if false, else pop
+    OP_OR,      // to a keeping the value if true, else pop
+    OP_FORPREP, // check the counter, the limit and the step in locals[a..a+2]
+    OP_FORTEST, // to b if the counter is past the limit, else copy it to locals[a+3]
+    OP_FORSTEP, // add the step to the counter, to b
+    OP_BUILTIN, // builtin a with b arguments
+    OP_RETURN,
+};
+
+enum
+{
+    B_CALL = 0,
+    B_TONUMBER,
+    B_TOSTRING,
+    B_TYPE,
+    B_ERROR,
+};
+
+static const char *k_builtins[] = {"call", "tonumber", "tostring", "type", "error"};
+
+// the compiler
+
+enum
+{
+    T_EOF = 256,
+    T_NAME,
+    T_INT,
+    T_DBL,
+    T_STR,
+    // keywords, in the order of k_keywords
+    T_AND,
+    T_BREAK,
+    T_DO,
+    T_ELSE,
+    T_ELSEIF,
+    T_END,
+    T_FALSE,
+    T_FOR,
+    T_IF,
+    T_LOCAL,
+    T_NIL,
+    T_NOT,
+    T_OR,
+    T_RETURN,
+    T_THEN,
+    T_TRUE,
+    T_WHILE,
+    // the symbols of more than one character
+    T_EQ,
+    T_NE,
+    T_LE,
+    T_GE,
+    T_CONCAT,
+};
+
+static const char *k_keywords[] = {
+    "and", "break", "do", "else", "elseif", "end", "false", "for", "if", "local",
+    "nil", "not", "or", "return", "then", "true", "while",
+};
+
+struct Compiler
+{
+    const std::string *src = NULL;
+    size_t pos = 0;
+    uint32_t line = 1;
+    // the current token
+    int tok = 0;
+    uint32_t tok_line = 1;
+    std::string tok_str;
+    int64_t tok_int = 0;
+    double tok_dbl = 0;
+    Script *script = NULL;
+    // the slot of a local is its index, the innermost last
+    std::vector<std::string> locals;
+    // the jumps of the breaks out of each enclosing loop
+    std::vector<std::vector<size_t>> breaks;
+    uint32_t depth = 0;
+    // the first error. the rest of the source is dropped, so the parsing
+    // winds down at the end of the input.
+    std::string err;
+};
+
+static void fail(Compiler &c, const std::string &msg)
+{
+    if (c.err.empty())
+    {
+        c.err = "line " + std::to_string(c.tok_line) + ": " + msg;
+    }
+    c.pos = c.src->size();
+    c.tok = T_EOF;
+}
+
+static void lex_string(Compiler &c, char quote)
+{
+    const std::string &s = *c.src;
+    c.tok_str.clear();
+    while (c.pos < s.size() && s[c.pos] != quote)
+    {
+        char ch = s[c.pos++];
+        if (ch == '\n')
+        {
+            return fail(c, "unfinished string");
+        }
+        if (ch == '\\' && c.pos < s.size())
+        {
+            ch = s[c.pos++];
+            switch (ch)
+            {
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case '0': ch = '\0'; break;
+            case 'x':
+                if (c.pos + 2 > s.size() || !isxdigit((uint8_t)s[c.pos]) || !isxdigit((uint8_t)s[c.pos + 1]))
+                {
+                    return fail(c, "bad escape");
+                }
+                ch = (char)strtol(s.substr(c.pos, 2).c_str(), NULL, 16);
+                c.pos += 2;
+                break;
+            case '\\': case '"': case '\'':
+                break;
+            default:
+                return fail(c, "bad escape");
+            }
+        }
+        c.tok_str.push_back(ch);
+    }
+    if (c.pos >= s.size())
+    {
+        return fail(c, "unfinished string");
+    }
+    c.pos++;
+    c.tok = T_STR;
+}
+
+static void lex_number(Compiler &c)
+{
+    const char *start = c.src->c_str() + c.pos;
+    char *end = NULL;
+    errno = 0;
+    if (start[0] == '0' && (start[1] == 'x' || start[1] == 'X'))
+    {
+        c.tok_int = (int64_t)strtoull(start, &end, 16);
+        c.tok = T_INT;
+    }
+    else
+    {
+        c.tok_int = strtoll(start, &end, 10);
+        c.tok = T_INT;
+        if (*end == '.' || *end == 'e' || *end == 'E' || errno == ERANGE)
+        {
+            c.tok_dbl = strtod(start, &end);
+            c.tok = T_DBL;
+        }
+    }
+    c.pos += (size_t)(end - start);
+    if (c.pos < c.src->size() && (isalnum((uint8_t)(*c.src)[c.pos]) || (*c.src)[c.pos] == '_'))
+    {
+        fail(c, "malformed number");
+    }
+}
+
+static void next(Compiler &c)
+{
+    const std::string &s = *c.src;
+    // spaces and comments
+    while (c.pos < s.size())
+    {
+        if (s[c.pos] == '\n')
+        {
+            c.line++;
+            c.pos++;
+        }
+        else if (isspace((uint8_t)s[c.pos]))
+        {
+            c.pos++;
+        }
+        else if (s.compare(c.pos, 4, "--[[") == 0)
+        {
+            size_t end = s.find("]]", c.pos);
+            end = end == std::string::npos ? s.size() : end + 2;
+            c.line += (uint32_t)std::count(s.begin() + c.pos, s.begin() + end, '\n');
+            c.pos = end;
+        }
+        else if (s.compare(c.pos, 2, "--") == 0)
+        {
+            size_t end = s.find('\n', c.pos);
+            c.pos = end == std::string::npos ? s.size() : end;
+        }
+        else
+        {
+            break;
+        }
+    }
+    c.tok_line = c.line;
+    if (c.pos >= s.size())
+    {
+        c.tok = T_EOF;
+        return;
+    }
+
+    char ch = s[c.pos];
+    char ch2 = c.pos + 1 < s.size() ? s[c.pos + 1] : '\0';
+    if (isalpha((uint8_t)ch) || ch == '_')
+    {
+        size_t start = c.pos;
+        while (c.pos < s.size() && (isalnum((uint8_t)s[c.pos]) || s[c.pos] == '_'))
+        {
+            c.pos++;
+        }
+        c.tok_str = s.substr(start, c.pos - start);
+        c.tok = T_NAME;
+        for (size_t i = 0; i < sizeof(k_keywords) / sizeof(k_keywords[0]); i++)
+        {
+            if (c.tok_str == k_keywords[i])
+            {
+                c.tok = T_AND + (int)i;
+            }
+        }
+        return;
+    }
+    if (isdigit((uint8_t)ch) || (ch == '.' && isdigit((uint8_t)ch2)))
+    {
+        return lex_number(c);
+    }
+    if (ch == '"' || ch == '\'')
+    {
+        c.pos++;
+        return lex_string(c, ch);
+    }
+
+    static const struct
+    {
+        const char *text;
+        int tok;
+    } k_pairs[] = {{"==", T_EQ}, {"~=", T_NE}, {"<=", T_LE}, {">=", T_GE}, {"..", T_CONCAT}};
+    for (auto &p : k_pairs)
+    {
+        if (ch == p.text[0] && ch2 == p.text[1])
+        {
+            c.pos += 2;
+            c.tok = p.tok;
+            return;
+        }
+    }
+    if (ch && strchr("+-*/%#<>=(){}[];,", ch))
+    {
+        c.pos++;
+        c.tok = ch;
+        return;
+    }
+    fail(c, std::string("unexpected character '") + ch + "'");
+}
+
+static size_t emit(Compiler &c, uint32_t op, int32_t a = 0, int32_t b = 0)
+{
+    SInstr in;
+    in.op = op;
+    in.a = a;
+    in.b = b;
+    c.script->code.push_back(in);
+    c.script->lines.push_back(c.tok_line);
+    return c.script->code.size() - 1;
+}
+
+// point the jump at the next instruction
+static void patch(Compiler &c, size_t at)
+{
+    SInstr &in = c.script->code[at];
+    (in.op == OP_FORTEST ? in.b : in.a) = (int32_t)c.script->code.size();
+}
+
+static void emit_const(Compiler &c, const SValue &val)
+{
+    c.script->consts.push_back(val);
+    emit(c, OP_CONST, (int32_t)c.script->consts.size() - 1);
+}
+
+static void expect(Compiler &c, int tok, const char *what)
+{
+    if (c.tok != tok)
+    {
+        return fail(c, std::string("'") + what + "' expected");
+    }
+    next(c);
+}
+
+static std::string expect_name(Compiler &c)
+{
+    std::string name = c.tok_str;
+    if (c.tok != T_NAME)
+    {
+        fail(c, "name expected");
+    }
+    next(c);
+    return name;
+}
+
+static int32_t add_local(Compiler &c, const std::string &name)
+{
+    if (c.locals.size() >= k_max_locals)
+    {
+        fail(c, "too many local variables");
+    }
+    c.locals.push_back(name);
+    c.script->nlocals = std::max(c.script->nlocals, (uint32_t)c.locals.size());
+    return (int32_t)c.locals.size() - 1;
+}
+
+static int32_t find_local(Compiler &c, const std::string &name)
+{
+    for (size_t i = c.locals.size(); i-- > 0;)
+    {
+        if (c.locals[i] == name)
+        {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+// an expression whose value isn't on the stack yet
+enum
+{
+    E_VALUE = 0,  // on the stack
+    E_CALL = 1,   // on the stack, from a builtin
+    E_LOCAL = 2,  // a local, to read or assign
+    E_INDEXED = 3, // the array and the index on the stack
+};
+
+struct Expr
+{
+    int kind = E_VALUE;
+    int32_t slot = 0;
+};
+
+static void discharge(Compiler &c, Expr &e)
+{
+    if (e.kind == E_LOCAL)
+    {
+        emit(c, OP_GET, e.slot);
+    }
+    else if (e.kind == E_INDEXED)
+    {
+        emit(c, OP_INDEX);
+    }
+    e.kind = E_VALUE;
+}
+
+static void expr(Compiler &c);
+static void block(Compiler &c);
+
+static void builtin_call(Compiler &c, int32_t id)
+{
+    uint32_t line = c.tok_line;
+    next(c); // '('
+    int32_t nargs = 0;
+    if (c.tok != ')')
+    {
+        for (;;)
+        {
+            expr(c);
+            nargs++;
+            if (c.tok != ',')
+            {
+                break;
+            }
+            next(c);
+        }
+    }
+    expect(c, ')', ")");
+    if (id == B_CALL ? nargs < 1 : nargs != 1)
+    {
+        c.tok_line = line;
+        return fail(c, std::string(k_builtins[id]) + "() takes "
+                           + (id == B_CALL ? "a command" : "1 argument"));
+    }
+    emit(c, OP_BUILTIN, id, nargs);
+}
+
+static void primary_expr(Compiler &c, Expr &e)
+{
+    if (c.tok == '(')
+    {
+        next(c);
+        expr(c);
+        expect(c, ')', ")");
+        e.kind = E_VALUE;
+        return;
+    }
+    if (c.tok != T_NAME)
+    {
+        return fail(c, "unexpected symbol");
+    }
+    std::string name = c.tok_str;
+    next(c);
+    int32_t slot = find_local(c, name);
+    if (slot >= 0)
+    {
+        e.kind = E_LOCAL;
+        e.slot = slot;
+        return;
+    }
+    for (size_t i = 0; i < sizeof(k_builtins) / sizeof(k_builtins[0]); i++)
+    {
+        if (name == k_builtins[i] && c.tok == '(')
+        {
+            builtin_call(c, (int32_t)i);
+            e.kind = E_CALL;
+            return;
+        }
+    }
+    fail(c, "unknown variable '" + name + "'");
+}
+
+// a name or a parenthesized expression, then any indexes
+static void suffixed_expr(Compiler &c, Expr &e)
+{
+    primary_expr(c, e);
+    for (;;)
+    {
+        if (c.tok == '[')
+        {
+            discharge(c, e);
+            next(c);
+            expr(c);
+            expect(c, ']', "]");
+            e.kind = E_INDEXED;
+        }
+        else if (c.tok == '(')
+        {
+            return fail(c, "only the builtins can be called");
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+static void constructor(Compiler &c)
+{
+    next(c); // '{'
+    int32_t n = 0;
+    while (c.tok != '}' && c.tok != T_EOF)
+    {
+        expr(c);
+        n++;
+        if (c.tok != ',' && c.tok != ';')
+        {
+            break;
+        }
+        next(c);
+    }
+    expect(c, '}', "}");
+    emit(c, OP_NEWARR, n);
+}
+
+static void simple_expr(Compiler &c)
+{
+    SValue val;
+    switch (c.tok)
+    {
+    case T_INT:
+        val.type = SV_INT;
+        val.i = c.tok_int;
+        emit_const(c, val);
+        return next(c);
+    case T_DBL:
+        val.type = SV_DBL;
+        val.d = c.tok_dbl;
+        emit_const(c, val);
+        return next(c);
+    case T_STR:
+        val.type = SV_STR;
+        val.s = c.tok_str;
+        emit_const(c, val);
+        return next(c);
+    case T_NIL:
+        emit(c, OP_NIL);
+        return next(c);
+    case T_TRUE:
+        emit(c, OP_TRUE);
+        return next(c);
+    case T_FALSE:
+        emit(c, OP_FALSE);
+        return next(c);
+    case '{':
+        return constructor(c);
+    }
+    Expr e;
+    suffixed_expr(c, e);
+    discharge(c, e);
+}
+
+struct BinOp
+{
+    int tok;
+    uint32_t op;
+    // the priorities on the left and on the right, as in Lua
+    uint32_t left;
+    uint32_t right;
+};
+
+static const BinOp k_binops[] = {
+    {T_OR, OP_OR, 1, 1}, {T_AND, OP_AND, 2, 2},
+    {'<', OP_LT, 3, 3}, {'>', OP_GT, 3, 3}, {T_LE, OP_LE, 3, 3}, {T_GE, OP_GE, 3, 3},
+    {T_NE, OP_NE, 3, 3}, {T_EQ, OP_EQ, 3, 3},
+    {T_CONCAT, OP_CONCAT, 9, 8}, // right associative
+    {'+', OP_ADD, 10, 10}, {'-', OP_SUB, 10, 10},
+    {'*', OP_MUL, 11, 11}, {'/', OP_DIV, 11, 11}, {'%', OP_MOD, 11, 11},
+};
+const uint32_t k_unary_priority = 12;
+
+// the operators binding tighter than `limit`
+static void sub_expr(Compiler &c, uint32_t limit)
+{
+    if (++c.depth > k_max_depth)
+    {
+        return fail(c, "too deeply nested");
+    }
+    if (c.tok == '-' || c.tok == T_NOT || c.tok == '#')
+    {
+        uint32_t op = c.tok == '-' ? OP_NEG : c.tok == T_NOT ? OP_NOT : OP_LEN;
+        next(c);
+        sub_expr(c, k_unary_priority);
+        emit(c, op);
+    }
+    else
+    {
+        simple_expr(c);
+    }
+    for (;;)
+    {
+        const BinOp *bin = NULL;
+        for (const BinOp &b : k_binops)
+        {
+            if (b.tok == c.tok)
+            {
+                bin = &b;
+            }
+        }
+        if (!bin || bin->left <= limit)
+        {
+            break;
+        }
+        next(c);
+        if (bin->op == OP_AND || bin->op == OP_OR)
+        {
+            // short circuit
+            size_t jump = emit(c, bin->op);
+            sub_expr(c, bin->right);
+            patch(c, jump);
+        }
+        else
+        {
+            sub_expr(c, bin->right);
+            emit(c, bin->op);
+        }
+    }
+    c.depth--;
+}
+
+static void expr(Compiler &c)
+{
+    sub_expr(c, 0);
+}
+
+static bool block_follow(int tok)
+{
+    return tok == T_EOF || tok == T_END || tok == T_ELSE || tok == T_ELSEIF;
+}
+
+static void if_stat(Compiler &c)
+{
+    std::vector<size_t> escapes;
+    next(c); // 'if'
+    expr(c);
+    expect(c, T_THEN, "then");
+    size_t skip = emit(c, OP_JMPF);
+    block(c);
+    while (c.tok == T_ELSEIF)
+    {
+        escapes.push_back(emit(c, OP_JMP));
+        patch(c, skip);
+        next(c);
+        expr(c);
+        expect(c, T_THEN, "then");
+        skip = emit(c, OP_JMPF);
+        block(c);
+    }
+    if (c.tok == T_ELSE)
+    {
+        escapes.push_back(emit(c, OP_JMP));
+        patch(c, skip);
+        next(c);
+        block(c);
+    }
+    else
+    {
+        patch(c, skip);
+    }
+    expect(c, T_END, "end");
+    for (size_t at : escapes)
+    {
+        patch(c, at);
+    }
+}
+
+// the body of a loop, then the breaks land after it
+static void loop_body(Compiler &c)
+{
+    c.breaks.push_back({});
+    block(c);
+}
+
+static void loop_exit(Compiler &c)
+{
+    for (size_t at : c.breaks.back())
+    {
+        patch(c, at);
+    }
+    c.breaks.pop_back();
+}
+
+static void while_stat(Compiler &c)
+{
+    next(c); // 'while'
+    int32_t top = (int32_t)c.script->code.size();
+    expr(c);
+    expect(c, T_DO, "do");
+    size_t exit = emit(c, OP_JMPF);
+    loop_body(c);
+    emit(c, OP_JMP, top);
+    patch(c, exit);
+    loop_exit(c);
+    expect(c, T_END, "end");
+}
+
+// for i = first, last [, step] do ... end
+static void for_stat(Compiler &c)
+{
+    next(c); // 'for'
+    std::string name = expect_name(c);
+    expect(c, '=', "=");
+    // the counter, the limit and the step, hidden from the body
+    size_t saved = c.locals.size();
+    int32_t base = add_local(c, "(for)");
+    add_local(c, "(for)");
+    add_local(c, "(for)");
+    expr(c);
+    emit(c, OP_SET, base);
+    expect(c, ',', ",");
+    expr(c);
+    emit(c, OP_SET, base + 1);
+    if (c.tok == ',')
+    {
+        next(c);
+        expr(c);
+    }
+    else
+    {
+        SValue one;
+        one.type = SV_INT;
+        one.i = 1;
+        emit_const(c, one);
+    }
+    emit(c, OP_SET, base + 2);
+    emit(c, OP_FORPREP, base);
+    expect(c, T_DO, "do");
+    size_t test = emit(c, OP_FORTEST, base);
+    add_local(c, name);
+    loop_body(c);
+    emit(c, OP_FORSTEP, base, (int32_t)test);
+    patch(c, test);
+    loop_exit(c);
+    c.locals.resize(saved);
+    expect(c, T_END, "end");
+}
+
+// local a [, b ...] [= e [, e ...]]
+static void local_stat(Compiler &c)
+{
+    next(c); // 'local'
+    std::vector<std::string> names = {expect_name(c)};
+    while (c.tok == ',')
+    {
+        next(c);
+        names.push_back(expect_name(c));
+    }
+    size_t nexprs = 0;
+    if (c.tok == '=')
+    {
+        next(c);
+        for (;;)
+        {
+            expr(c);
+            nexprs++;
+            if (c.tok != ',')
+            {
+                break;
+            }
+            next(c);
+        }
+    }
+    for (; nexprs > names.size(); nexprs--)
+    {
+        emit(c, OP_POP);
+    }
+    for (; nexprs < names.size(); nexprs++)
+    {
+        emit(c, OP_NIL);
+    }
+    // in scope after the values, so `local x = x` reads the outer one
+    int32_t first = (int32_t)c.locals.size();
+    for (const std::string &name : names)
+    {
+        add_local(c, name);
+    }
+    for (size_t i = names.size(); i-- > 0;)
+    {
+        emit(c, OP_SET, first + (int32_t)i);
+    }
+}
+
+// an assignment or a call
+static void expr_stat(Compiler &c)
+{
+    Expr e;
+    suffixed_expr(c, e);
+    if (c.tok == '=')
+    {
+        if (e.kind != E_LOCAL && e.kind != E_INDEXED)
+        {
+            return fail(c, "cannot assign to that");
+        }
+        next(c);
+        expr(c);
+        if (e.kind == E_LOCAL)
+        {
+            emit(c, OP_SET, e.slot);
+        }
+        else
+        {
+            emit(c, OP_SETINDEX);
+        }
+    }
+    else if (e.kind == E_CALL)
+    {
+        emit(c, OP_POP);
+    }
+    else
+    {
+        fail(c, "syntax error");
+    }
+}
+
+static void statement(Compiler &c)
+{
+    switch (c.tok)
+    {
+    case ';':
+        return next(c);
+    case T_IF:
+        return if_stat(c);
+    case T_WHILE:
+        return while_stat(c);
+    case T_FOR:
+        return for_stat(c);
+    case T_DO:
+        next(c);
+        block(c);
+        return expect(c, T_END, "end");
+    case T_LOCAL:
+        return local_stat(c);
+    case T_RETURN:
+        next(c);
+        if (block_follow(c.tok) || c.tok == ';')
+        {
+            emit(c, OP_NIL);
+        }
+        else
+        {
+            expr(c);
+        }
+        emit(c, OP_RETURN);
+        return;
+    case T_BREAK:
+        if (c.breaks.empty())
+        {
+            return fail(c, "break outside a loop");
+        }
+        c.breaks.back().push_back(emit(c, OP_JMP));
+        return next(c);
+    }
+    expr_stat(c);
+}
+
+static void block(Compiler &c)
+{
+    size_t saved = c.locals.size();
+    while (!block_follow(c.tok))
+    {
+        statement(c);
+    }
+    c.locals.resize(saved);
+}
+
+Script *script_compile(const std::string &src, std::string &err)
+{
+    Compiler c;
+    c.src = &src;
+    c.script = new Script();
+    add_local(c, "KEYS");
+    add_local(c, "ARGV");
+    next(c);
+    block(c);
+    if (c.tok != T_EOF)
+    {
+        fail(c, "'<eof>' expected");
+    }
+    emit(c, OP_NIL);
+    emit(c, OP_RETURN);
+    if (!c.err.empty())
+    {
+        err = c.err;
+        delete c.script;
+        return NULL;
+    }
+    return c.script;
+}
+
+void script_free(Script *script)
+{
+    delete script;
+}
+
+// the VM
+
+static const char *type_name(const SValue &v)
+{
+    static const char *k_names[] = {"nil", "boolean", "number", "number", "string", "table"};
+    return k_names[v.type];
+}
+
+static bool truthy(const SValue &v)
+{
+    return !(v.type == SV_NIL || (v.type == SV_BOOL && !v.b));
+}
+
+static bool is_num(const SValue &v)
+{
+    return v.type == SV_INT || v.type == SV_DBL;
+}
+
+static double num_dbl(const SValue &v)
+{
+    return v.type == SV_INT ? (double)v.i : v.d;
+}
+
+// shortest representation that parses back to the same value
+static std::string dbl2str(double val)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", val);
+    if (strtod(buf, NULL) != val)
+    {
+        snprintf(buf, sizeof(buf), "%.17g", val);
+    }
+    return buf;
+}
+
+// a number, or a string holding one
+static bool to_num(const SValue &v, SValue &out)
+{
+    if (is_num(v))
+    {
+        out = v;
+        return true;
+    }
+    if (v.type != SV_STR || v.s.empty())
+    {
+        return false;
+    }
+    const char *start = v.s.c_str();
+    const char *end = start + v.s.size();
+    char *endp = NULL;
+    errno = 0;
+    out.i = strtoll(start, &endp, 10);
+    if (endp == end && errno == 0)
+    {
+        out.type = SV_INT;
+        return true;
+    }
+    out.d = strtod(start, &endp);
+    out.type = SV_DBL;
+    return endp == end && !isnan(out.d);
+}
+
+// a string, or a number as one
+static bool to_str(const SValue &v, std::string &out)
+{
+    switch (v.type)
+    {
+    case SV_STR:
+        out = v.s;
+        return true;
+    case SV_INT:
+        out = std::to_string(v.i);
+        return true;
+    case SV_DBL:
+        out = dbl2str(v.d);
+        return true;
+    }
+    return false;
+}
+
+static bool arith(uint32_t op, const SValue &a, const SValue &b, SValue &out, std::string &err)
+{
+    SValue x, y;
+    if (!to_num(a, x) || !to_num(b, y))
+    {
+        err = std::string("attempt to perform arithmetic on a ") + type_name(to_num(a, x) ? b : a) + " value";
+        return false;
+    }
+    out.s.clear();
+    if (x.type == SV_INT && y.type == SV_INT && op != OP_DIV)
+    {
+        // wrapping like Lua
+        uint64_t ux = (uint64_t)x.i, uy = (uint64_t)y.i;
+        out.type = SV_INT;
+        switch (op)
+        {
+        case OP_ADD: out.i = (int64_t)(ux + uy); break;
+        case OP_SUB: out.i = (int64_t)(ux - uy); break;
+        case OP_MUL: out.i = (int64_t)(ux * uy); break;
+        case OP_MOD:
+            if (y.i == 0)
+            {
+                err = "attempt to perform 'n%0'";
+                return false;
+            }
+            out.i = y.i == -1 ? 0 : x.i % y.i;
+            // the sign of the divisor
+            if (out.i != 0 && (out.i ^ y.i) < 0)
+            {
+                out.i += y.i;
+            }
+            break;
+        }
+        return true;
+    }
+    double dx = num_dbl(x), dy = num_dbl(y);
+    out.type = SV_DBL;
+    switch (op)
+    {
+    case OP_ADD: out.d = dx + dy; break;
+    case OP_SUB: out.d = dx - dy; break;
+    case OP_MUL: out.d = dx * dy; break;
+    case OP_DIV: out.d = dx / dy; break;
+    case OP_MOD:
+        out.d = fmod(dx, dy);
+        if (out.d != 0 && (out.d < 0) != (dy < 0))
+        {
+            out.d += dy;
+        }
+        break;
+    }
+    return true;
+}
+
+static bool equal(const SValue &a, const SValue &b)
+{
+    if (is_num(a) && is_num(b))
+    {
+        return a.type == SV_INT && b.type == SV_INT ? a.i == b.i : num_dbl(a) == num_dbl(b);
+    }
+    if (a.type != b.type)
+    {
+        return false;
+    }
+    switch (a.type)
+    {
+    case SV_NIL: return true;
+    case SV_BOOL: return a.b == b.b;
+    case SV_STR: return a.s == b.s;
+    case SV_ARR: return a.arr == b.arr;
+    }
+    return false;
+}
+
+// -1, 0, 1 for numbers or strings
+static bool compare(const SValue &a, const SValue &b, int &cmp, std::string &err)
+{
+    if (is_num(a) && is_num(b))
+    {
+        if (a.type == SV_INT && b.type == SV_INT)
+        {
+            cmp = (a.i > b.i) - (a.i < b.i);
+        }
+        else
+        {
+            double x = num_dbl(a), y = num_dbl(b);
+            // NaN is neither smaller nor larger, nor equal
+            cmp = x < y ? -1 : x > y ? 1 : x == y ? 0 : 2;
+        }
+        return true;
+    }
+    if (a.type == SV_STR && b.type == SV_STR)
+    {
+        int r = a.s.compare(b.s);
+        cmp = (r > 0) - (r < 0);
+        return true;
+    }
+    err = std::string("attempt to compare ") + type_name(a) + " with " + type_name(b);
+    return false;
+}
+
+// 0 unless an integral number
+static int64_t arr_index(const SValue &k)
+{
+    if (k.type == SV_INT)
+    {
+        return k.i;
+    }
+    bool integral = k.type == SV_DBL && k.d == floor(k.d) && fabs(k.d) < 9007199254740992.0;
+    return integral ? (int64_t)k.d : 0;
+}
+
+static size_t value_bytes(const SValue &v)
+{
+    return sizeof(SValue) + v.s.size();
+}
+
+std::vector<SValue> *script_new_arr(ScriptRun *run, size_t bytes)
+{
+    bytes += sizeof(std::vector<SValue>);
+    if (run->mem + bytes > k_script_max_mem)
+    {
+        return NULL;
+    }
+    run->mem += bytes;
+    run->arrays.push_back(new std::vector<SValue>());
+    return run->arrays.back();
+}
+
+static SValue str_arr(ScriptRun *run, const std::vector<std::string> &items)
+{
+    SValue v;
+    v.type = SV_ARR;
+    v.arr = script_new_arr(run, 0);
+    for (const std::string &s : items)
+    {
+        v.arr->push_back(SValue());
+        v.arr->back().type = SV_STR;
+        v.arr->back().s = s;
+    }
+    return v;
+}
+
+static bool builtin(ScriptRun *run, int32_t id, SValue *args, int32_t nargs, SValue &ret, std::string &err)
+{
+    switch (id)
+    {
+    case B_CALL:
+        {
+            std::vector<std::string> cmd(nargs);
+            for (int32_t i = 0; i < nargs; i++)
+            {
+                if (!to_str(args[i], cmd[i]))
+                {
+                    err = "call() takes strings and numbers";
+                    return false;
+                }
+            }
+            return run->call(run, cmd, ret, err);
+        }
+    case B_TONUMBER:
+        if (!to_num(args[0], ret))
+        {
+            ret = SValue();
+        }
+        return true;
+    case B_TOSTRING:
+        ret.type = SV_STR;
+        if (!to_str(args[0], ret.s))
+        {
+            ret.s = args[0].type == SV_BOOL ? (args[0].b ? "true" : "false") : type_name(args[0]);
+        }
+        return true;
+    case B_TYPE:
+        ret.type = SV_STR;
+        ret.s = type_name(args[0]);
+        return true;
+    case B_ERROR:
+        if (!to_str(args[0], err))
+        {
+            err = "error";
+        }
+        return false;
+    }
+    return false;
+}
+
+bool script_run(const Script *script, ScriptRun *run, SValue &ret, std::string &err)
+{
+    std::vector<SValue> locals(script->nlocals);
+    locals[0] = str_arr(run, run->keys);
+    locals[1] = str_arr(run, run->argv);
+    std::vector<SValue> stack;
+    stack.reserve(16);
+    size_t pc = 0;
+    std::string msg;
+    for (;;)
+    {
+        if (run->budget == 0)
+        {
+            run->out_of_budget = true;
+            err = "the script ran out of its instruction budget";
+            return false;
+        }
+        run->budget--;
+        const SInstr &in = script->code[pc++];
+        switch (in.op)
+        {
+        case OP_NIL:
+            stack.push_back(SValue());
+            break;
+        case OP_TRUE:
+        case OP_FALSE:
+            stack.push_back(SValue());
+            stack.back().type = SV_BOOL;
+            stack.back().b = in.op == OP_TRUE;
+            break;
+        case OP_CONST:
+            stack.push_back(script->consts[in.a]);
+            break;
+        case OP_GET:
+            stack.push_back(locals[in.a]);
+            break;
+        case OP_SET:
+            locals[in.a] = std::move(stack.back());
+            stack.pop_back();
+            break;
+        case OP_POP:
+            stack.pop_back();
+            break;
+        case OP_NEWARR:
+            {
+                size_t bytes = 0;
+                for (size_t i = stack.size() - in.a; i < stack.size(); i++)
+                {
+                    bytes += value_bytes(stack[i]);
+                }
+                SValue v;
+                v.type = SV_ARR;
+                v.arr = script_new_arr(run, bytes);
+                if (!v.arr)
+                {
+                    msg = "out of memory";
+                    goto fail;
+                }
+                v.arr->assign(std::make_move_iterator(stack.end() - in.a),
+                              std::make_move_iterator(stack.end()));
+                stack.resize(stack.size() - in.a);
+                stack.push_back(v);
+            }
+            break;
+        case OP_INDEX:
+        case OP_SETINDEX:
+            {
+                bool set = in.op == OP_SETINDEX;
+                SValue &t = stack[stack.size() - (set ? 3 : 2)];
+                SValue &k = stack[stack.size() - (set ? 2 : 1)];
+                if (t.type != SV_ARR)
+                {
+                    msg = std::string("attempt to index a ") + type_name(t) + " value";
+                    goto fail;
+                }
+                int64_t idx = arr_index(k);
+                std::vector<SValue> &arr = *t.arr;
+                if (!set)
+                {
+                    SValue v = idx >= 1 && (uint64_t)idx <= arr.size() ? arr[idx - 1] : SValue();
+                    stack.resize(stack.size() - 2);
+                    stack.push_back(std::move(v));
+                    break;
+                }
+                // the arrays have no holes, they grow by one at the end
+                if (idx < 1 || (uint64_t)idx > arr.size() + 1)
+                {
+                    msg = "array index out of range";
+                    goto fail;
+                }
+                SValue &v = stack.back();
+                if (v.s.size() > k_script_max_str || run->mem + value_bytes(v) > k_script_max_mem)
+                {
+                    msg = "out of memory";
+                    goto fail;
+                }
+                if ((uint64_t)idx == arr.size() + 1)
+                {
+                    run->mem += value_bytes(v);
+                    arr.push_back(std::move(v));
+                }
+                else
+                {
+                    arr[idx - 1] = std::move(v);
+                }
+                stack.resize(stack.size() - 3);
+            }
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+            {
+                SValue r;
+                if (!arith(in.op, stack[stack.size() - 2], stack.back(), r, msg))
+                {
+                    goto fail;
+                }
+                stack.pop_back();
+                stack.back() = r;
+            }
+            break;
+        case OP_CONCAT:
+            {
+                std::string x, y;
+                SValue &a = stack[stack.size() - 2];
+                if (!to_str(a, x) || !to_str(stack.back(), y))
+                {
+                    msg = std::string("attempt to concatenate a ")
+                          + type_name(to_str(a, x) ? stack.back() : a) + " value";
+                    goto fail;
+                }
+                if (x.size() + y.size() > k_script_max_str)
+                {
+                    msg = "string too long";
+                    goto fail;
+                }
+                stack.pop_back();
+                stack.back().type = SV_STR;
+                stack.back().s = x + y;
+            }
+            break;
+        case OP_EQ:
+        case OP_NE:
+            {
+                bool eq = equal(stack[stack.size() - 2], stack.back());
+                stack.pop_back();
+                stack.back() = SValue();
+                stack.back().type = SV_BOOL;
+                stack.back().b = eq == (in.op == OP_EQ);
+            }
+            break;
+        case OP_LT:
+        case OP_LE:
+        case OP_GT:
+        case OP_GE:
+            {
+                int cmp = 0;
+                if (!compare(stack[stack.size() - 2], stack.back(), cmp, msg))
+                {
+                    goto fail;
+                }
+                bool r = in.op == OP_LT ? cmp == -1 : in.op == OP_LE ? (cmp == -1 || cmp == 0)
+                         : in.op == OP_GT ? cmp == 1 : (cmp == 1 || cmp == 0);
+                stack.pop_back();
+                stack.back() = SValue();
+                stack.back().type = SV_BOOL;
+                stack.back().b = r;
+            }
+            break;
+        case OP_NEG:
+            {
+                SValue r;
+                if (!to_num(stack.back(), r))
+                {
+                    msg = std::string("attempt to perform arithmetic on a ") + type_name(stack.back()) + " value";
+                    goto fail;
+                }
+                if (r.type == SV_INT)
+                {
+                    r.i = (int64_t)(0 - (uint64_t)r.i);
+                }
+                else
+                {
+                    r.d = -r.d;
+                }
+                stack.back() = r;
+            }
+            break;
+        case OP_NOT:
+            {
+                bool r = !truthy(stack.back());
+                stack.back() = SValue();
+                stack.back().type = SV_BOOL;
+                stack.back().b = r;
+            }
+            break;
+        case OP_LEN:
+            {
+                SValue &v = stack.back();
+                int64_t n = 0;
+                if (v.type == SV_STR)
+                {
+                    n = (int64_t)v.s.size();
+                }
+                else if (v.type == SV_ARR)
+                {
+                    n = (int64_t)v.arr->size();
+                }
+                else
+                {
+                    msg = std::string("attempt to get the length of a ") + type_name(v) + " value";
+                    goto fail;
+                }
+                v = SValue();
+                v.type = SV_INT;
+                v.i = n;
+            }
+            break;
+        case OP_JMP:
+            pc = (size_t)in.a;
+            break;
+        case OP_JMPF:
+            if (!truthy(stack.back()))
+            {
+                pc = (size_t)in.a;
+            }
+            stack.pop_back();
+            break;
+        case OP_AND:
+        case OP_OR:
+            if (truthy(stack.back()) == (in.op == OP_OR))
+            {
+                pc = (size_t)in.a;
+            }
+            else
+            {
+                stack.pop_back();
+            }
+            break;
+        case OP_FORPREP:
+            {
+                SValue *f = &locals[in.a];
+                if (!is_num(f[0]) || !is_num(f[1]) || !is_num(f[2]))
+                {
+                    msg = "'for' takes numbers";
+                    goto fail;
+                }
+                if (num_dbl(f[2]) == 0)
+                {
+                    msg = "'for' step is zero";
+                    goto fail;
+                }
+                // an integer loop if they all are
+                if (f[0].type != SV_INT || f[1].type != SV_INT || f[2].type != SV_INT)
+                {
+                    for (int i = 0; i < 3; i++)
+                    {
+                        f[i].d = num_dbl(f[i]);
+                        f[i].type = SV_DBL;
+                    }
+                }
+            }
+            break;
+        case OP_FORTEST:
+            {
+                SValue *f = &locals[in.a];
+                bool up = num_dbl(f[2]) > 0;
+                bool past = f[0].type == SV_INT ? (up ? f[0].i > f[1].i : f[0].i < f[1].i)
+                                                : (up ? f[0].d > f[1].d : f[0].d < f[1].d);
+                if (past)
+                {
+                    pc = (size_t)in.b;
+                }
+                else
+                {
+                    f[3] = f[0];
+                }
+            }
+            break;
+        case OP_FORSTEP:
+            {
+                SValue *f = &locals[in.a];
+                if (f[0].type == SV_INT)
+                {
+                    // stop rather than wrap around
+                    if (__builtin_add_overflow(f[0].i, f[2].i, &f[0].i))
+                    {
+                        pc = script->code[in.b].b;
+                        break;
+                    }
+                }
+                else
+                {
+                    f[0].d += f[2].d;
+                }
+                pc = (size_t)in.b;
+            }
+            break;
+        case OP_BUILTIN:
+            {
+                SValue r;
+                SValue *args = &stack[stack.size() - in.b];
+                if (!builtin(run, in.a, args, in.b, r, err))
+                {
+                    // the errors of the commands go back as they are
+                    return false;
+                }
+                stack.resize(stack.size() - in.b);
+                stack.push_back(std::move(r));
+            }
+            break;
+        case OP_RETURN:
+            ret = std::move(stack.back());
+            return true;
+        }
+    }
+
+fail:
+    err = "line " + std::to_string(script->lines[pc - 1]) + ": " + msg;
+    return false;
+}
+
+void script_run_dispose(ScriptRun *run)
+{
+    for (std::vector<SValue> *arr : run->arrays)
+    {
+        delete arr;
+    }
+    run->arrays.clear();
+    run->mem = 0;
+}
+
+// SHA-1, for the names of the cached scripts
+
+static uint32_t rol(uint32_t x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(uint32_t h[5], const uint8_t *p)
+{
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16
+               | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++)
+    {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++)
+    {
+        uint32_t f = 0, k = 0;
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+}
+
+std::string script_sha1(const std::string &src)
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    // the message, a 1 bit, zeros, and the length in bits
+    std::string msg = src;
+    msg.push_back((char)0x80);
+    while (msg.size() % 64 != 56)
+    {
+        msg.push_back('\0');
+    }
+    uint64_t bits = (uint64_t)src.size() * 8;
+    for (int i = 7; i >= 0; i--)
+    {
+        msg.push_back((char)(bits >> (8 * i)));
+    }
+    for (size_t off = 0; off < msg.size(); off += 64)
+    {
+        sha1_block(h, (const uint8_t *)msg.data() + off);
+    }
+    char hex[41];
+    for (int i = 0; i < 5; i++)
+    {
+        snprintf(hex + 8 * i, 9, "%08x", h[i]);
+    }
+    return std::string(hex, 40);
+}
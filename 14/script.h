@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// server-side scripts in a small subset of Lua:
+//
+//   local n = tonumber(call("get", KEYS[1])) or 0
+//   if n < tonumber(ARGV[1]) then
+//       call("set", KEYS[1], ARGV[1])
+//       return 1
+//   end
+//   return 0
+//
+// there are local variables, if/elseif/else, while, numeric for, break,
+// arrays indexed from 1 ({...}, t[i], #t), the usual operators and the
+// builtins call(), tonumber(), tostring(), type() and error(). there are no
+// user functions or global variables. KEYS and ARGV are predefined.
+//
+// a script is compiled once into bytecode for a stack machine, then run any
+// number of times. call() goes straight to the host, which runs the command.
+// every instruction is charged to a budget, a script that runs out of it is
+// aborted, so a loop can't hold the event loop forever.
+
+// a string or an array element can't get longer than that
+const size_t k_script_max_str = 64 << 10;
+// the arrays of a run
+const size_t k_script_max_mem = 64 << 20;
+
+enum
+{
+    SV_NIL = 0,
+    SV_BOOL = 1,
+    SV_INT = 2,
+    SV_DBL = 3,
+    SV_STR = 4,
+    SV_ARR = 5,
+};
+
+struct SValue
+{
+    uint8_t type = SV_NIL;
+    union
+    {
+        bool b;
+        int64_t i;
+        double d;
+        // owned by the run, arrays are shared by reference like Lua tables
+        std::vector<SValue> *arr;
+    };
+    std::string s;
+
+    SValue() : i(0) {}
+};
+
+struct SInstr
+{
+    uint32_t op = 0;
+    int32_t a = 0;
+    int32_t b = 0;
+};
+
+struct Script
+{
+    std::vector<SInstr> code;
+    // the source line of each instruction, for the errors
+    std::vector<uint32_t> lines;
+    std::vector<SValue> consts;
+    uint32_t nlocals = 0;
+};
+
+// the state of one run
+struct ScriptRun
+{
+    std::vector<std::string> keys;
+    std::vector<std::string> argv;
+    // instructions left
+    uint64_t budget = 0;
+    // runs a command for call(), false to abort the script with `err`
+    bool (*call)(ScriptRun *run, std::vector<std::string> &cmd, SValue &ret, std::string &err) = NULL;
+    void *arg = NULL;
+    // the arrays, freed together at the end
+    std::vector<std::vector<SValue> *> arrays;
+    size_t mem = 0;
+    bool out_of_budget = false;
+};
+
+// NULL and the reason in `err` if it doesn't compile
+Script *script_compile(const std::string &src, std::string &err);
+void script_free(Script *script);
+// false and the reason in `err` if the script fails, `ret` is what it returned
+bool script_run(const Script *script, ScriptRun *run, SValue &ret, std::string &err);
+void script_run_dispose(ScriptRun *run);
+// an array owned by the run, NULL past k_script_max_mem
+std::vector<SValue> *script_new_arr(ScriptRun *run, size_t bytes);
+
+// the hex SHA-1 of the source, which names a cached script
+std::string script_sha1(const std::string &src);
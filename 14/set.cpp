@@ -0,0 +1,513 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <string>
+
+#include "set.h"
+#include "common.h"
+#include "slab.h"
+
+size_t set_node_size(SetNode *node)
+{
+    return sizeof(SetNode) + node->len;
+}
+
+static SetNode *snode_new(const char *name, size_t len)
+{
+    SetNode *node = new (slab_alloc(sizeof(SetNode) + len)) SetNode();
+    node->node.hcode = str_hash((uint8_t *)name, len);
+    node->len = (uint32_t)len;
+    memcpy(&node->name[0], name, len);
+    return node;
+}
+
+static void snode_del(SetNode *node)
+{
+    slab_free(node, set_node_size(node));
+}
+
+// only the canonical form, so the member reads back the same
+static bool str2int64(const char *s, size_t len, int64_t *out)
+{
+    if (len == 0 || len > 20)
+    {
+        return false;
+    }
+    char buf[24];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *end = NULL;
+    errno = 0;
+    long long val = strtoll(buf, &end, 10);
+    if (errno || end != buf + len)
+    {
+        return false;
+    }
+    char back[24];
+    int n = snprintf(back, sizeof(back), "%lld", val);
+    if ((size_t)n != len || 0 != memcmp(back, s, len))
+    {
+        return false;
+    }
+    *out = val;
+    return true;
+}
+
+// a helper structure for the hashtable lookup
+struct SKey
+{
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool scmp(HNode *node, HNode *key)
+{
+    if (node->hcode != key->hcode)
+    {
+        return false;
+    }
+    SetNode *snode = container_of(node, SetNode, node);
+    SKey *skey = container_of(key, SKey, node);
+    return snode->len == skey->len && 0 == memcmp(snode->name, skey->name, skey->len);
+}
+
+static void skey_init(SKey &key, const char *name, size_t len)
+{
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+}
+
+// move the integers into the HMap
+static void set_convert(Set *set)
+{
+    hm_reserve(&set->map, set->ints.size() + 1);
+    for (int64_t val : set->ints)
+    {
+        std::string name = std::to_string(val);
+        hm_insert(&set->map, &snode_new(name.data(), name.size())->node);
+    }
+    std::vector<int64_t>().swap(set->ints);
+    set->is_map = true;
+}
+
+bool set_add(Set *set, const char *name, size_t len)
+{
+    int64_t val = 0;
+    if (!set->is_map && str2int64(name, len, &val))
+    {
+        std::vector<int64_t> &ints = set->ints;
+        auto it = std::lower_bound(ints.begin(), ints.end(), val);
+        if (it != ints.end() && *it == val)
+        {
+            return false;
+        }
+        if (ints.size() < k_intset_max)
+        {
+            ints.insert(it, val);
+            return true;
+        }
+    }
+    if (!set->is_map)
+    {
+        set_convert(set);
+    }
+
+    SKey key;
+    skey_init(key, name, len);
+    if (hm_lookup(&set->map, &key.node, &scmp))
+    {
+        return false;
+    }
+    hm_insert(&set->map, &snode_new(name, len)->node);
+    return true;
+}
+
+bool set_del(Set *set, const char *name, size_t len)
+{
+    if (!set->is_map)
+    {
+        int64_t val = 0;
+        std::vector<int64_t> &ints = set->ints;
+        auto it = str2int64(name, len, &val) ? std::lower_bound(ints.begin(), ints.end(), val)
+                                              : ints.end();
+        if (it == ints.end() || *it != val)
+        {
+            return false;
+        }
+        ints.erase(it);
+        return true;
+    }
+    SKey key;
+    skey_init(key, name, len);
+    HNode *node = hm_pop(&set->map, &key.node, &scmp);
+    if (node)
+    {
+        snode_del(container_of(node, SetNode, node));
+    }
+    return node != NULL;
+}
+
+// read-only, the intersection workers share the sets
+bool set_has(Set *set, const char *name, size_t len)
+{
+    if (!set->is_map)
+    {
+        int64_t val = 0;
+        return str2int64(name, len, &val)
+               && std::binary_search(set->ints.begin(), set->ints.end(), val);
+    }
+    SKey key;
+    skey_init(key, name, len);
+    return hm_find(&set->map, &key.node, &scmp) != NULL;
+}
+
+size_t set_size(Set *set)
+{
+    return set->is_map ? hm_size(&set->map) : set->ints.size();
+}
+
+struct ScanCtx
+{
+    void (*f)(const char *, size_t, void *) = NULL;
+    void *arg = NULL;
+};
+
+static void cb_scan(HNode *node, void *arg)
+{
+    ScanCtx *ctx = (ScanCtx *)arg;
+    SetNode *snode = container_of(node, SetNode, node);
+    ctx->f(snode->name, snode->len, ctx->arg);
+}
+
+static void ints_out(const int64_t *vals, size_t n, void (*f)(const char *, size_t, void *), void *arg)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        char buf[24];
+        int len = snprintf(buf, sizeof(buf), "%lld", (long long)vals[i]);
+        f(buf, (size_t)len, arg);
+    }
+}
+
+uint64_t set_scan(Set *set, uint64_t cursor, size_t count,
+                  void (*f)(const char *, size_t, void *), void *arg)
+{
+    if (set->is_map)
+    {
+        ScanCtx ctx;
+        ctx.f = f;
+        ctx.arg = arg;
+        return hm_scan(&set->map, cursor, count, &cb_scan, &ctx);
+    }
+    // small enough to be returned at once
+    ints_out(set->ints.data(), set->ints.size(), f, arg);
+    return 0;
+}
+
+void set_dispose(Set *set)
+{
+    HTab *tabs[2] = {&set->map.ht1, &set->map.ht2};
+    for (HTab *tab : tabs)
+    {
+        for (size_t i = 0; tab->tab && i <= tab->mask; i++)
+        {
+            HNode *node = tab->tab[i];
+            while (node)
+            {
+                HNode *next = node->next;
+                snode_del(container_of(node, SetNode, node));
+                node = next;
+            }
+        }
+    }
+    hm_destroy(&set->map);
+    std::vector<int64_t>().swap(set->ints);
+}
+
+size_t intset_inter_scalar(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+    while (i < na && j < nb)
+    {
+        if (a[i] == b[j])
+        {
+            out[n++] = a[i];
+            i++;
+            j++;
+        }
+        else if (a[i] < b[j])
+        {
+            i++;
+        }
+        else
+        {
+            j++;
+        }
+    }
+    return n;
+}
+
+// compare a block of 4 from each side in all 4 rotations, keep the items of a
+// that matched, then advance the block with the smaller last item.
+__attribute__((target("avx2")))
+static size_t intset_inter_avx2(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    size_t i = 0;
+    size_t j = 0;
+    size_t n = 0;
+    while (i + 4 <= na && j + 4 <= nb)
+    {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[j]);
+        __m256i m = _mm256_cmpeq_epi64(va, vb);
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x39)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x4e)));
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi64(va, _mm256_permute4x64_epi64(vb, 0x93)));
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(m));
+        while (mask)
+        {
+            out[n++] = a[i + __builtin_ctz(mask)];
+            mask &= mask - 1;
+        }
+        int64_t amax = a[i + 3];
+        int64_t bmax = b[j + 3];
+        i += amax <= bmax ? 4 : 0;
+        j += bmax <= amax ? 4 : 0;
+    }
+    return n + intset_inter_scalar(a + i, na - i, b + j, nb - j, out + n);
+}
+
+static const bool g_has_avx2 = __builtin_cpu_supports("avx2");
+
+size_t intset_inter(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out)
+{
+    if (g_has_avx2)
+    {
+        return intset_inter_avx2(a, na, b, nb, out);
+    }
+    return intset_inter_scalar(a, na, b, nb, out);
+}
+
+// the members of base found in all of the others
+struct InterJob
+{
+    Set **others = NULL;
+    size_t nothers = 0;
+    HTab *tab = NULL;
+    size_t lo = 0;
+    size_t hi = 0;
+    std::vector<SetNode *> found;
+    WaitGroup *wg = NULL;
+};
+
+static bool in_all(Set **sets, size_t n, const char *name, size_t len)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!set_has(sets[i], name, len))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void inter_job(void *arg)
+{
+    InterJob &job = *(InterJob *)arg;
+    for (size_t pos = job.lo; pos < job.hi; pos++)
+    {
+        for (HNode *node = job.tab->tab[pos]; node; node = node->next)
+        {
+            SetNode *snode = container_of(node, SetNode, node);
+            if (in_all(job.others, job.nothers, snode->name, snode->len))
+            {
+                job.found.push_back(snode);
+            }
+        }
+    }
+    wait_group_done(job.wg);
+}
+
+// the event loop waits, so the sets stay unchanged while the workers read them
+static size_t set_inter_parallel(Set *base, Set **others, size_t nothers, size_t limit,
+                                 ThreadPool *tp, void (*f)(const char *, size_t, void *), void *arg)
+{
+    const size_t k_pieces = 2 * tp->threads.size();
+    std::vector<InterJob> jobs;
+    HTab *tabs[2] = {&base->map.ht1, &base->map.ht2};
+    for (HTab *tab : tabs)
+    {
+        size_t nslots = tab->tab ? tab->mask + 1 : 0;
+        for (size_t k = 0; nslots && k < k_pieces; k++)
+        {
+            InterJob job;
+            job.others = others;
+            job.nothers = nothers;
+            job.tab = tab;
+            job.lo = nslots * k / k_pieces;
+            job.hi = nslots * (k + 1) / k_pieces;
+            jobs.push_back(job);
+        }
+    }
+    WaitGroup wg;
+    wait_group_init(&wg, jobs.size());
+    for (InterJob &job : jobs)
+    {
+        job.wg = &wg;
+        thread_pool_queue(tp, &inter_job, &job);
+    }
+    wait_group_wait(&wg);
+
+    size_t n = 0;
+    for (InterJob &job : jobs)
+    {
+        for (SetNode *snode : job.found)
+        {
+            if (limit && n >= limit)
+            {
+                return n;
+            }
+            if (f)
+            {
+                f(snode->name, snode->len, arg);
+            }
+            n++;
+        }
+    }
+    return n;
+}
+
+size_t set_inter(Set **sets, size_t n, size_t limit, ThreadPool *tp,
+                 void (*f)(const char *, size_t, void *), void *arg)
+{
+    // the smallest set drives the probes
+    std::vector<Set *> sorted(sets, sets + n);
+    std::sort(sorted.begin(), sorted.end(),
+              [](Set *a, Set *b) { return set_size(a) < set_size(b); });
+    Set *base = sorted[0];
+    Set **others = sorted.data() + 1;
+    size_t nothers = n - 1;
+
+    bool all_ints = true;
+    for (Set *set : sorted)
+    {
+        all_ints = all_ints && !set->is_map;
+    }
+    if (all_ints)
+    {
+        std::vector<int64_t> cur = base->ints;
+        std::vector<int64_t> next(cur.size());
+        for (size_t i = 0; i < nothers && !cur.empty(); i++)
+        {
+            const std::vector<int64_t> &other = others[i]->ints;
+            next.resize(cur.size());
+            next.resize(intset_inter(cur.data(), cur.size(), other.data(), other.size(), next.data()));
+            cur.swap(next);
+        }
+        size_t count = limit ? std::min(limit, cur.size()) : cur.size();
+        if (f)
+        {
+            ints_out(cur.data(), count, f, arg);
+        }
+        return count;
+    }
+
+    if (base->is_map && set_size(base) >= k_set_parallel_min && tp && !tp->threads.empty())
+    {
+        return set_inter_parallel(base, others, nothers, limit, tp, f, arg);
+    }
+
+    size_t count = 0;
+    if (!base->is_map)
+    {
+        for (int64_t val : base->ints)
+        {
+            if (limit && count >= limit)
+            {
+                break;
+            }
+            char buf[24];
+            int len = snprintf(buf, sizeof(buf), "%lld", (long long)val);
+            if (in_all(others, nothers, buf, (size_t)len))
+            {
+                if (f)
+                {
+                    f(buf, (size_t)len, arg);
+                }
+                count++;
+            }
+        }
+        return count;
+    }
+    HTab *tabs[2] = {&base->map.ht1, &base->map.ht2};
+    for (HTab *tab : tabs)
+    {
+        for (size_t pos = 0; tab->tab && pos <= tab->mask; pos++)
+        {
+            for (HNode *node = tab->tab[pos]; node; node = node->next)
+            {
+                if (limit && count >= limit)
+                {
+                    return count;
+                }
+                SetNode *snode = container_of(node, SetNode, node);
+                if (in_all(others, nothers, snode->name, snode->len))
+                {
+                    if (f)
+                    {
+                        f(snode->name, snode->len, arg);
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+    return count;
+}
+
+static void cb_union_add(const char *name, size_t len, void *arg)
+{
+    set_add((Set *)arg, name, len);
+}
+
+void set_union(Set **sets, size_t n, Set *out)
+{
+    bool all_ints = true;
+    for (size_t i = 0; i < n; i++)
+    {
+        all_ints = all_ints && !sets[i]->is_map;
+    }
+    if (!all_ints)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            set_scan(sets[i], 0, (size_t)-1, &cb_union_add, out);
+        }
+        return;
+    }
+
+    // merge the sorted arrays
+    std::vector<int64_t> acc;
+    std::vector<int64_t> merged;
+    for (size_t i = 0; i < n; i++)
+    {
+        const std::vector<int64_t> &ints = sets[i]->ints;
+        merged.resize(acc.size() + ints.size());
+        auto end = std::set_union(acc.begin(), acc.end(), ints.begin(), ints.end(), merged.begin());
+        merged.resize(end - merged.begin());
+        acc.swap(merged);
+    }
+    out->ints.swap(acc);
+    if (out->ints.size() > k_intset_max)
+    {
+        set_convert(out);
+    }
+}
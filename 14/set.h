@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "hashtable.h"
+#include "thread_pool.h"
+
+// a set of canonical integers starts as a sorted int64 array, intersected with
+// SIMD where the CPU has it. it's converted to a HMap of SetNode, which holds
+// only the member, once a non-integer is added or it outgrows k_intset_max.
+const size_t k_intset_max = 512;
+// intersections whose smallest set is at least this large are split across the
+// thread pool
+const size_t k_set_parallel_min = 100000;
+
+struct Set
+{
+    std::vector<int64_t> ints;
+    bool is_map = false;
+    HMap map;
+};
+
+struct SetNode
+{
+    HNode node;
+    uint32_t len = 0;
+    char name[0];
+};
+
+bool set_add(Set *set, const char *name, size_t len);
+bool set_del(Set *set, const char *name, size_t len);
+bool set_has(Set *set, const char *name, size_t len);
+size_t set_size(Set *set);
+// calls f(name, len, arg) for about `count` members from the cursor, returns
+// the next cursor or 0 at the end. see hm_scan().
+uint64_t set_scan(Set *set, uint64_t cursor, size_t count,
+                  void (*f)(const char *, size_t, void *), void *arg);
+void set_dispose(Set *set);
+size_t set_node_size(SetNode *node);
+
+// the members of all the sets, stops at `limit` unless it's 0. f is called for
+// each member if given. returns the number of members.
+size_t set_inter(Set **sets, size_t n, size_t limit, ThreadPool *tp,
+                 void (*f)(const char *, size_t, void *), void *arg);
+// add the members of all the sets to `out`
+void set_union(Set **sets, size_t n, Set *out);
+
+// sorted arrays without duplicates, `out` has room for min(na, nb)
+size_t intset_inter(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out);
+size_t intset_inter_scalar(const int64_t *a, size_t na, const int64_t *b, size_t nb, int64_t *out);
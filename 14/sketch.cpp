@@ -0,0 +1,274 @@
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+
+#include "sketch.h"
+#include "common.h"
+#include "slab.h"
+
+static const bool g_has_avx2 = __builtin_cpu_supports("avx2");
+
+void cms_init(CMS *cms, uint32_t width, uint32_t depth)
+{
+    cms->width = width;
+    cms->depth = depth;
+    cms->total = 0;
+    cms->counters.assign((size_t)width * depth, 0);
+}
+
+uint64_t cms_hash(const char *data, size_t len)
+{
+    return str_hash64((const uint8_t *)data, len);
+}
+
+// the row hashes are a + row * b from the two halves of the item hash, mapped
+// to the width by a multiply and a shift
+void cms_cols_scalar(const uint64_t *hashes, size_t n, uint32_t row, uint32_t width, uint32_t *cols)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t a = (uint32_t)hashes[i];
+        uint32_t b = (uint32_t)(hashes[i] >> 32) | 1;
+        uint32_t x = a + row * b;
+        cols[i] = (uint32_t)(((uint64_t)x * width) >> 32);
+    }
+}
+
+void cms_min_scalar(const uint32_t *counters, const uint32_t *cols, size_t n, uint32_t *est)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        est[i] = std::min(est[i], counters[cols[i]]);
+    }
+}
+
+// 8 items at a time
+__attribute__((target("avx2")))
+static void cms_cols_avx2(const uint64_t *hashes, size_t n, uint32_t row, uint32_t width, uint32_t *cols)
+{
+    // the low halves to the low lane, the high halves to the high lane
+    const __m256i split = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    const __m256i vrow = _mm256_set1_epi32((int)row);
+    const __m256i vwidth = _mm256_set1_epi32((int)width);
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i h0 = _mm256_loadu_si256((const __m256i *)&hashes[i]);
+        __m256i h1 = _mm256_loadu_si256((const __m256i *)&hashes[i + 4]);
+        h0 = _mm256_permutevar8x32_epi32(h0, split);
+        h1 = _mm256_permutevar8x32_epi32(h1, split);
+        __m256i a = _mm256_permute2x128_si256(h0, h1, 0x20);
+        __m256i b = _mm256_or_si256(_mm256_permute2x128_si256(h0, h1, 0x31), one);
+        __m256i x = _mm256_add_epi32(a, _mm256_mullo_epi32(vrow, b));
+        // the high 32 bits of x * width, the even lanes, then the odd ones
+        __m256i even = _mm256_srli_epi64(_mm256_mul_epu32(x, vwidth), 32);
+        __m256i odd = _mm256_mul_epu32(_mm256_srli_epi64(x, 32), vwidth);
+        __m256i col = _mm256_blend_epi32(even, odd, 0xaa);
+        _mm256_storeu_si256((__m256i *)&cols[i], col);
+    }
+    cms_cols_scalar(&hashes[i], n - i, row, width, &cols[i]);
+}
+
+__attribute__((target("avx2")))
+static void cms_min_avx2(const uint32_t *counters, const uint32_t *cols, size_t n, uint32_t *est)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i idx = _mm256_loadu_si256((const __m256i *)&cols[i]);
+        __m256i val = _mm256_i32gather_epi32((const int *)counters, idx, 4);
+        __m256i cur = _mm256_loadu_si256((const __m256i *)&est[i]);
+        _mm256_storeu_si256((__m256i *)&est[i], _mm256_min_epu32(cur, val));
+    }
+    cms_min_scalar(counters, &cols[i], n - i, &est[i]);
+}
+
+void cms_cols(const uint64_t *hashes, size_t n, uint32_t row, uint32_t width, uint32_t *cols)
+{
+    return g_has_avx2 ? cms_cols_avx2(hashes, n, row, width, cols)
+                      : cms_cols_scalar(hashes, n, row, width, cols);
+}
+
+void cms_min(const uint32_t *counters, const uint32_t *cols, size_t n, uint32_t *est)
+{
+    return g_has_avx2 ? cms_min_avx2(counters, cols, n, est) : cms_min_scalar(counters, cols, n, est);
+}
+
+// row by row, so the columns of a row come out of one kernel call. the
+// estimates are taken after the whole batch is counted.
+void cms_incr_batch(CMS *cms, const uint64_t *hashes, const uint32_t *incrs, size_t n, uint32_t *est)
+{
+    std::vector<uint32_t> cols(n);
+    std::fill(est, est + n, UINT32_MAX);
+    for (size_t i = 0; i < n; i++)
+    {
+        cms->total += incrs[i];
+    }
+    for (uint32_t row = 0; row < cms->depth; row++)
+    {
+        uint32_t *counters = &cms->counters[(size_t)row * cms->width];
+        cms_cols(hashes, n, row, cms->width, cols.data());
+        for (size_t i = 0; i < n; i++)
+        {
+            uint64_t val = (uint64_t)counters[cols[i]] + incrs[i];
+            counters[cols[i]] = (uint32_t)std::min(val, (uint64_t)UINT32_MAX);
+        }
+        cms_min(counters, cols.data(), n, est);
+    }
+}
+
+void cms_query_batch(CMS *cms, const uint64_t *hashes, size_t n, uint32_t *est)
+{
+    std::vector<uint32_t> cols(n);
+    std::fill(est, est + n, UINT32_MAX);
+    for (uint32_t row = 0; row < cms->depth; row++)
+    {
+        cms_cols(hashes, n, row, cms->width, cols.data());
+        cms_min(&cms->counters[(size_t)row * cms->width], cols.data(), n, est);
+    }
+}
+
+void cms_dispose(CMS *cms)
+{
+    std::vector<uint32_t>().swap(cms->counters);
+}
+
+void topk_init(TopK *topk, uint32_t k, uint32_t width, uint32_t depth)
+{
+    topk->k = k;
+    cms_init(&topk->cms, width, depth);
+    topk->heap.reserve(k);
+}
+
+static size_t topk_node_size(TopKNode *node)
+{
+    return sizeof(TopKNode) + node->len;
+}
+
+// a helper structure for the hashtable lookup
+struct TopKKey
+{
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool tcmp(HNode *node, HNode *key)
+{
+    if (node->hcode != key->hcode)
+    {
+        return false;
+    }
+    TopKNode *tnode = container_of(node, TopKNode, node);
+    TopKKey *tkey = container_of(key, TopKKey, node);
+    return tnode->len == tkey->len && 0 == memcmp(tnode->name, tkey->name, tkey->len);
+}
+
+TopKNode *topk_lookup(TopK *topk, const char *name, size_t len)
+{
+    TopKKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_lookup(&topk->index, &key.node, &tcmp);
+    return found ? container_of(found, TopKNode, node) : NULL;
+}
+
+static TopKNode *node_new(TopK *topk, const char *name, size_t len)
+{
+    TopKNode *node = new (slab_alloc(sizeof(TopKNode) + len)) TopKNode();
+    node->node.hcode = str_hash((uint8_t *)name, len);
+    node->len = (uint32_t)len;
+    memcpy(&node->name[0], name, len);
+    hm_insert(&topk->index, &node->node);
+    return node;
+}
+
+static void node_del(TopK *topk, TopKNode *node)
+{
+    TopKKey key;
+    key.node.hcode = node->node.hcode;
+    key.name = node->name;
+    key.len = node->len;
+    hm_pop(&topk->index, &key.node, &tcmp);
+    slab_free(node, topk_node_size(node));
+}
+
+bool topk_offer(TopK *topk, const char *name, size_t len, uint64_t est, std::string &expelled)
+{
+    std::vector<HeapItem> &heap = topk->heap;
+    TopKNode *node = topk_lookup(topk, name, len);
+    if (node)
+    {
+        heap[node->heap_idx].val = est;
+        heap_update(heap.data(), node->heap_idx, heap.size());
+        return false;
+    }
+    if (heap.size() < topk->k)
+    {
+        node = node_new(topk, name, len);
+        HeapItem item;
+        item.val = est;
+        item.ref = &node->heap_idx;
+        heap.push_back(item);
+        heap_update(heap.data(), heap.size() - 1, heap.size());
+        return false;
+    }
+    if (est <= heap[0].val)
+    {
+        return false;
+    }
+    // replace the least frequent one
+    TopKNode *least = container_of(heap[0].ref, TopKNode, heap_idx);
+    expelled.assign(least->name, least->len);
+    node_del(topk, least);
+    node = node_new(topk, name, len);
+    heap[0].val = est;
+    heap[0].ref = &node->heap_idx;
+    heap_update(heap.data(), 0, heap.size());
+    return true;
+}
+
+void topk_load(TopK *topk, const char *name, size_t len, uint64_t count)
+{
+    if (topk->heap.size() < topk->k || topk_lookup(topk, name, len))
+    {
+        std::string unused;
+        topk_offer(topk, name, len, count, unused);
+    }
+}
+
+uint64_t topk_count(TopK *topk, TopKNode *node)
+{
+    return topk->heap[node->heap_idx].val;
+}
+
+void topk_list(TopK *topk, std::vector<TopKNode *> &out)
+{
+    out.clear();
+    for (const HeapItem &item : topk->heap)
+    {
+        out.push_back(container_of(item.ref, TopKNode, heap_idx));
+    }
+    std::sort(out.begin(), out.end(), [topk](TopKNode *a, TopKNode *b) {
+        uint64_t ca = topk_count(topk, a), cb = topk_count(topk, b);
+        if (ca != cb)
+        {
+            return ca > cb;
+        }
+        return std::string(a->name, a->len) < std::string(b->name, b->len);
+    });
+}
+
+void topk_dispose(TopK *topk)
+{
+    for (const HeapItem &item : topk->heap)
+    {
+        TopKNode *node = container_of(item.ref, TopKNode, heap_idx);
+        slab_free(node, topk_node_size(node));
+    }
+    std::vector<HeapItem>().swap(topk->heap);
+    hm_destroy(&topk->index);
+    cms_dispose(&topk->cms);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "hashtable.h"
+#include "heap.h"
+
+// a count-min sketch has `depth` rows of `width` counters. an item adds to one
+// counter per row and its estimate is the smallest of them, which is never
+// below the true count. the memory is fixed however many items are counted.
+//
+// the batch paths hash the items first, then go row by row: the columns of a
+// row are computed with SIMD where the CPU has it, and the estimates are
+// gathered from the row.
+const uint32_t k_cms_max_depth = 16;
+// 64MB of counters
+const uint64_t k_cms_max_cells = (uint64_t)1 << 24;
+
+struct CMS
+{
+    uint32_t width = 0;
+    uint32_t depth = 0;
+    // the sum of the increments
+    uint64_t total = 0;
+    // row after row, the counters saturate
+    std::vector<uint32_t> counters;
+};
+
+void cms_init(CMS *cms, uint32_t width, uint32_t depth);
+uint64_t cms_hash(const char *data, size_t len);
+// add incrs[i] to the item of hashes[i], then store the estimates
+void cms_incr_batch(CMS *cms, const uint64_t *hashes, const uint32_t *incrs, size_t n, uint32_t *est);
+void cms_query_batch(CMS *cms, const uint64_t *hashes, size_t n, uint32_t *est);
+void cms_dispose(CMS *cms);
+
+// the kernels, the columns of one row and the estimates taken from it
+void cms_cols(const uint64_t *hashes, size_t n, uint32_t row, uint32_t width, uint32_t *cols);
+void cms_cols_scalar(const uint64_t *hashes, size_t n, uint32_t row, uint32_t width, uint32_t *cols);
+void cms_min(const uint32_t *counters, const uint32_t *cols, size_t n, uint32_t *est);
+void cms_min_scalar(const uint32_t *counters, const uint32_t *cols, size_t n, uint32_t *est);
+
+// the k most frequent items, counted by a sketch. the candidates are in a
+// min-heap by their estimates, an item whose estimate passes the smallest one
+// takes its place.
+const uint32_t k_topk_max = 1000;
+
+struct TopK
+{
+    uint32_t k = 0;
+    CMS cms;
+    std::vector<HeapItem> heap;
+    HMap index;
+};
+
+struct TopKNode
+{
+    HNode node;
+    size_t heap_idx = -1;
+    uint32_t len = 0;
+    char name[0];
+};
+
+void topk_init(TopK *topk, uint32_t k, uint32_t width, uint32_t depth);
+// offer an item with its estimate after it was counted in the sketch. returns
+// true if this pushed another item out of the top, whose name is `expelled`.
+bool topk_offer(TopK *topk, const char *name, size_t len, uint64_t est, std::string &expelled);
+TopKNode *topk_lookup(TopK *topk, const char *name, size_t len);
+// restore a candidate from a dump
+void topk_load(TopK *topk, const char *name, size_t len, uint64_t count);
+// the candidates, the most frequent first
+void topk_list(TopK *topk, std::vector<TopKNode *> &out);
+uint64_t topk_count(TopK *topk, TopKNode *node);
+void topk_dispose(TopK *topk);
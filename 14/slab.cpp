@@ -0,0 +1,391 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <algorithm>
+
+#include "slab.h"
+
+// the header at the start of each page
+struct SlabPage
+{
+    uint32_t cls = 0;
+    uint32_t nobj = 0;
+    uint32_t nfree = 0;
+    void *free = NULL;
+    // in the list of the pages with free objects
+    SlabPage *prev = NULL;
+    SlabPage *next = NULL;
+};
+
+const size_t k_slab_hdr = (sizeof(SlabPage) + 15) & ~(size_t)15;
+
+// 16 byte steps, then 4 classes per power of 2
+static const uint32_t k_slab_sizes[] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024,
+};
+const size_t k_slab_nclasses = sizeof(k_slab_sizes) / sizeof(k_slab_sizes[0]);
+
+struct SlabClass
+{
+    pthread_mutex_t mu;
+    uint32_t size = 0;
+    // objects moved between a thread cache and the pages at a time
+    uint32_t batch = 0;
+    // the pages with free objects, the ones that were full recently go first
+    SlabPage partial;
+    size_t npages = 0;
+    // the free objects on the pages
+    size_t nfree = 0;
+    // an empty page is kept to avoid mmap() churn at the boundary
+    SlabPage *spare = NULL;
+    // the densest page with room, slab_move() fills it up
+    SlabPage *target = NULL;
+};
+
+struct SlabCache;
+
+static struct Slab
+{
+    SlabClass classes[k_slab_nclasses];
+    // size / 16 -> class
+    uint8_t class_of[k_slab_max / 16 + 1];
+    // for the stats
+    pthread_mutex_t mu;
+    std::vector<SlabCache *> caches;
+
+    Slab()
+    {
+        pthread_mutex_init(&mu, NULL);
+        size_t c = 0;
+        for (size_t i = 0; i <= k_slab_max / 16; i++)
+        {
+            while (k_slab_sizes[c] < i * 16)
+            {
+                c++;
+            }
+            class_of[i] = (uint8_t)c;
+        }
+        for (size_t i = 0; i < k_slab_nclasses; i++)
+        {
+            SlabClass &sc = classes[i];
+            pthread_mutex_init(&sc.mu, NULL);
+            sc.size = k_slab_sizes[i];
+            sc.batch = std::min<uint32_t>(64, std::max<uint32_t>(4, 4096 / sc.size));
+            sc.partial.prev = sc.partial.next = &sc.partial;
+        }
+    }
+} g_slab;
+
+static void cache_flush(size_t cls, uint32_t n);
+
+// the free objects owned by a thread, no lock is needed
+struct SlabCache
+{
+    void *free[k_slab_nclasses] = {};
+    // only written by the owner, read by slab_stats()
+    std::atomic<uint32_t> nfree[k_slab_nclasses] = {};
+
+    SlabCache()
+    {
+        pthread_mutex_lock(&g_slab.mu);
+        g_slab.caches.push_back(this);
+        pthread_mutex_unlock(&g_slab.mu);
+    }
+
+    ~SlabCache()
+    {
+        for (size_t i = 0; i < k_slab_nclasses; i++)
+        {
+            cache_flush(i, nfree[i].load(std::memory_order_relaxed));
+        }
+        pthread_mutex_lock(&g_slab.mu);
+        g_slab.caches.erase(std::find(g_slab.caches.begin(), g_slab.caches.end(), this));
+        pthread_mutex_unlock(&g_slab.mu);
+    }
+};
+
+static thread_local SlabCache t_cache;
+
+static void list_detach(SlabPage *page)
+{
+    page->prev->next = page->next;
+    page->next->prev = page->prev;
+    page->prev = page->next = NULL;
+}
+
+static void list_insert_after(SlabPage *target, SlabPage *page)
+{
+    page->prev = target;
+    page->next = target->next;
+    target->next->prev = page;
+    target->next = page;
+}
+
+// a page aligned to its size, so an object finds its page by masking
+static SlabPage *page_map()
+{
+    size_t len = 2 * k_slab_page;
+    char *p = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        fprintf(stderr, "slab: mmap() failed\n");
+        abort();
+    }
+    char *start = (char *)(((uintptr_t)p + k_slab_page - 1) & ~(uintptr_t)(k_slab_page - 1));
+    if (start > p)
+    {
+        munmap(p, start - p);
+    }
+    munmap(start + k_slab_page, p + len - (start + k_slab_page));
+    return (SlabPage *)start;
+}
+
+static SlabPage *page_of(void *ptr)
+{
+    return (SlabPage *)((uintptr_t)ptr & ~(uintptr_t)(k_slab_page - 1));
+}
+
+// a fresh page with all of its objects on the free list
+static SlabPage *page_new(size_t cls)
+{
+    SlabClass &sc = g_slab.classes[cls];
+    SlabPage *page = sc.spare;
+    sc.spare = NULL;
+    if (!page)
+    {
+        page = new (page_map()) SlabPage();
+        page->cls = (uint32_t)cls;
+        page->nobj = (uint32_t)((k_slab_page - k_slab_hdr) / sc.size);
+        char *base = (char *)page + k_slab_hdr;
+        for (uint32_t i = page->nobj; i-- > 0;)
+        {
+            void *obj = base + (size_t)i * sc.size;
+            *(void **)obj = page->free;
+            page->free = obj;
+        }
+        page->nfree = page->nobj;
+        sc.npages++;
+    }
+    sc.nfree += page->nfree;
+    list_insert_after(sc.partial.prev, page);
+    return page;
+}
+
+// take a batch of objects from the pages
+static void cache_refill(size_t cls)
+{
+    SlabClass &sc = g_slab.classes[cls];
+    void *head = NULL;
+    uint32_t n = 0;
+    pthread_mutex_lock(&sc.mu);
+    while (n < sc.batch)
+    {
+        SlabPage *page = sc.partial.next;
+        if (page == &sc.partial)
+        {
+            page = page_new(cls);
+        }
+        while (page->free && n < sc.batch)
+        {
+            void *obj = page->free;
+            page->free = *(void **)obj;
+            *(void **)obj = head;
+            head = obj;
+            page->nfree--;
+            sc.nfree--;
+            n++;
+        }
+        if (!page->free)
+        {
+            list_detach(page);
+        }
+    }
+    pthread_mutex_unlock(&sc.mu);
+
+    t_cache.free[cls] = head;
+    t_cache.nfree[cls].store(n, std::memory_order_relaxed);
+}
+
+// put an object back on its page, the class lock is held
+static void page_put(SlabClass &sc, void *obj)
+{
+    SlabPage *page = page_of(obj);
+    if (!page->free)
+    {
+        list_insert_after(&sc.partial, page);
+    }
+    *(void **)obj = page->free;
+    page->free = obj;
+    page->nfree++;
+    sc.nfree++;
+    if (page->nfree == page->nobj)
+    {
+        // unused, return it to the OS
+        list_detach(page);
+        sc.nfree -= page->nobj;
+        if (sc.target == page)
+        {
+            sc.target = NULL;
+        }
+        if (!sc.spare)
+        {
+            sc.spare = page;
+        }
+        else
+        {
+            munmap(page, k_slab_page);
+            sc.npages--;
+        }
+    }
+}
+
+// give n objects of the thread cache back to their pages
+static void cache_flush(size_t cls, uint32_t n)
+{
+    SlabClass &sc = g_slab.classes[cls];
+    SlabCache &cache = t_cache;
+    pthread_mutex_lock(&sc.mu);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        void *obj = cache.free[cls];
+        cache.free[cls] = *(void **)obj;
+        page_put(sc, obj);
+    }
+    pthread_mutex_unlock(&sc.mu);
+    cache.nfree[cls].store(cache.nfree[cls].load(std::memory_order_relaxed) - n,
+                           std::memory_order_relaxed);
+}
+
+void *slab_alloc(size_t size)
+{
+    if (size > k_slab_max)
+    {
+        void *ptr = malloc(size);
+        assert(ptr);
+        return ptr;
+    }
+    size_t cls = g_slab.class_of[(size + 15) / 16];
+    SlabCache &cache = t_cache;
+    if (!cache.free[cls])
+    {
+        cache_refill(cls);
+    }
+    void *obj = cache.free[cls];
+    cache.free[cls] = *(void **)obj;
+    cache.nfree[cls].store(cache.nfree[cls].load(std::memory_order_relaxed) - 1,
+                           std::memory_order_relaxed);
+    return obj;
+}
+
+void slab_free(void *ptr, size_t size)
+{
+    if (size > k_slab_max)
+    {
+        free(ptr);
+        return;
+    }
+    size_t cls = g_slab.class_of[(size + 15) / 16];
+    SlabCache &cache = t_cache;
+    *(void **)ptr = cache.free[cls];
+    cache.free[cls] = ptr;
+    uint32_t n = cache.nfree[cls].load(std::memory_order_relaxed) + 1;
+    cache.nfree[cls].store(n, std::memory_order_relaxed);
+    if (n >= 2 * g_slab.classes[cls].batch)
+    {
+        cache_flush(cls, g_slab.classes[cls].batch);
+    }
+}
+
+void slab_flush()
+{
+    SlabCache &cache = t_cache;
+    for (size_t i = 0; i < k_slab_nclasses; i++)
+    {
+        cache_flush(i, cache.nfree[i].load(std::memory_order_relaxed));
+    }
+}
+
+// the partial page with the fewest free objects
+static SlabPage *find_target(SlabClass &sc)
+{
+    SlabPage *target = NULL;
+    for (SlabPage *page = sc.partial.next; page != &sc.partial; page = page->next)
+    {
+        if (!target || page->nfree < target->nfree)
+        {
+            target = page;
+        }
+    }
+    return target;
+}
+
+void *slab_move(void *ptr, size_t size, void (*relocate)(void *dst, void *src, void *arg), void *arg)
+{
+    if (size > k_slab_max)
+    {
+        return NULL;
+    }
+    size_t cls = g_slab.class_of[(size + 15) / 16];
+    SlabClass &sc = g_slab.classes[cls];
+    SlabPage *src = page_of(ptr);
+    void *dst = NULL;
+
+    pthread_mutex_lock(&sc.mu);
+    // pages that are nearly full are left alone, the others are drained
+    // into the densest page until it's full, then into the next one
+    if (src->nfree * 8 >= src->nobj)
+    {
+        // the full scan is done once the last target is filled up
+        if (!sc.target || !sc.target->free)
+        {
+            sc.target = find_target(sc);
+        }
+        SlabPage *target = sc.target;
+        if (target && target != src && target->nfree < src->nfree)
+        {
+            dst = target->free;
+            target->free = *(void **)dst;
+            target->nfree--;
+            sc.nfree--;
+            if (!target->free)
+            {
+                list_detach(target);
+            }
+            relocate(dst, ptr, arg);
+            page_put(sc, ptr);
+        }
+    }
+    pthread_mutex_unlock(&sc.mu);
+    return dst;
+}
+
+void slab_stats(std::vector<SlabStat> &out)
+{
+    out.assign(k_slab_nclasses, SlabStat());
+    pthread_mutex_lock(&g_slab.mu);
+    for (SlabCache *cache : g_slab.caches)
+    {
+        for (size_t i = 0; i < k_slab_nclasses; i++)
+        {
+            out[i].cached += cache->nfree[i].load(std::memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&g_slab.mu);
+
+    for (size_t i = 0; i < k_slab_nclasses; i++)
+    {
+        SlabClass &sc = g_slab.classes[i];
+        pthread_mutex_lock(&sc.mu);
+        size_t nobj = (k_slab_page - k_slab_hdr) / sc.size;
+        size_t live = sc.npages - (sc.spare ? 1 : 0);
+        out[i].size = sc.size;
+        out[i].pages = sc.npages;
+        out[i].used = live * nobj - sc.nfree - std::min(out[i].cached, live * nobj - sc.nfree);
+        pthread_mutex_unlock(&sc.mu);
+    }
+}
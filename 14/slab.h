@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+
+// size-class allocator for the small fixed-layout objects of the key space.
+// objects are carved out of 64KB pages of the same class, each thread keeps a
+// small cache of free objects per class so the common path takes no lock.
+// the caller passes the size to both slab_alloc() and slab_free(), sizes above
+// k_slab_max go to malloc().
+const size_t k_slab_page = 64 << 10;
+const size_t k_slab_max = 1024;
+
+void *slab_alloc(size_t size);
+void slab_free(void *ptr, size_t size);
+
+template <class T>
+T *slab_new()
+{
+    return new (slab_alloc(sizeof(T))) T();
+}
+
+template <class T>
+void slab_delete(T *obj)
+{
+    obj->~T();
+    slab_free(obj, sizeof(T));
+}
+
+struct SlabStat
+{
+    size_t size = 0;    // object size of the class
+    size_t pages = 0;   // pages owned by the class
+    size_t used = 0;    // objects handed out
+    size_t cached = 0;  // free objects in the thread caches
+};
+
+void slab_stats(std::vector<SlabStat> &out);
+
+// return the free objects of the calling thread to their pages
+void slab_flush();
+
+// for the defragger: if the object sits on a sparse page and a denser page
+// has room, a slot there is taken and relocate(dst, src) is called to move
+// it, then the old slot is freed. returns the new
+// address, or NULL if the object is left alone.
+void *slab_move(void *ptr, size_t size, void (*relocate)(void *dst, void *src, void *arg), void *arg);
@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "stream.h"
+#include "common.h"
+#include "slab.h"
+
+// the ID and the field count
+const size_t k_sitem_hdr = 20;
+
+static bool str2u64(const char *s, size_t len, uint64_t &out)
+{
+    if (len == 0 || len > 20)
+    {
+        return false;
+    }
+    char buf[24];
+    memcpy(buf, s, len);
+    buf[len] = '\0';
+    char *end = NULL;
+    out = strtoull(buf, &end, 10);
+    return end == buf + len && buf[0] != '-' && buf[0] != '+';
+}
+
+bool sid_parse(const std::string &s, uint64_t seq, StreamID &id)
+{
+    size_t dash = s.find('-');
+    if (dash == std::string::npos)
+    {
+        id.seq = seq;
+        return str2u64(s.data(), s.size(), id.ms);
+    }
+    return str2u64(s.data(), dash, id.ms)
+           && str2u64(s.data() + dash + 1, s.size() - dash - 1, id.seq);
+}
+
+std::string sid_str(const StreamID &id)
+{
+    return std::to_string(id.ms) + "-" + std::to_string(id.seq);
+}
+
+bool stream_next_id(Stream *stream, uint64_t now_ms, StreamID &id)
+{
+    if (now_ms > stream->last.ms)
+    {
+        id = StreamID();
+        id.ms = now_ms;
+        return true;
+    }
+    // the clock went backwards, or many entries in the same ms
+    if (sid_max(stream->last))
+    {
+        return false;
+    }
+    id = sid_next(stream->last);
+    return true;
+}
+
+size_t stream_node_size(SNode *node)
+{
+    return sizeof(SNode) + node->cap;
+}
+
+static SNode *tree_first(AVLNode *tree)
+{
+    while (tree && tree->left)
+    {
+        tree = tree->left;
+    }
+    return container_of(tree, SNode, tree);
+}
+
+static SNode *tree_last(AVLNode *tree)
+{
+    while (tree && tree->right)
+    {
+        tree = tree->right;
+    }
+    return container_of(tree, SNode, tree);
+}
+
+SNode *stream_first(Stream *stream)
+{
+    return tree_first(stream->tree);
+}
+
+SNode *stream_next(SNode *node)
+{
+    return container_of(avl_offset(&node->tree, 1), SNode, tree);
+}
+
+static SNode *stream_prev(SNode *node)
+{
+    return container_of(avl_offset(&node->tree, -1), SNode, tree);
+}
+
+// the last node whose first ID <= id
+static SNode *node_floor(Stream *stream, const StreamID &id)
+{
+    SNode *found = NULL;
+    AVLNode *cur = stream->tree;
+    while (cur)
+    {
+        SNode *node = container_of(cur, SNode, tree);
+        if (sid_less(id, node->first))
+        {
+            cur = cur->left;
+        }
+        else
+        {
+            found = node;
+            cur = cur->right;
+        }
+    }
+    return found;
+}
+
+static void item_id(const char *p, StreamID &id)
+{
+    memcpy(&id.ms, p, 8);
+    memcpy(&id.seq, p + 8, 8);
+}
+
+// the byte offset of the next entry
+static uint32_t item_next(const SNode *node, uint32_t pos)
+{
+    uint32_t nfields = 0;
+    memcpy(&nfields, &node->data[pos + 16], 4);
+    pos += k_sitem_hdr;
+    for (uint32_t i = 0; i < 2 * nfields; i++)
+    {
+        uint32_t len = 0;
+        memcpy(&len, &node->data[pos], 4);
+        pos += 4 + len;
+    }
+    return pos;
+}
+
+static void node_del(Stream *stream, SNode *node)
+{
+    stream->tree = avl_del(&node->tree);
+    stream->nnodes--;
+    slab_free(node, stream_node_size(node));
+}
+
+void stream_append(Stream *stream, const StreamID &id, const std::string *fv, size_t n)
+{
+    size_t need = k_sitem_hdr;
+    for (size_t i = 0; i < n; i++)
+    {
+        need += 4 + fv[i].size();
+    }
+    SNode *node = stream->tree ? tree_last(stream->tree) : NULL;
+    if (!node || node->nitems >= k_snode_items || node->cap - node->end < need)
+    {
+        size_t cap = std::max(k_snode_bytes - sizeof(SNode), need);
+        node = new (slab_alloc(sizeof(SNode) + cap)) SNode();
+        node->cap = (uint32_t)cap;
+        node->first = id;
+        avl_init(&node->tree);
+        // the new node goes to the right end of the tree
+        SNode *last = stream->tree ? tree_last(stream->tree) : NULL;
+        if (last)
+        {
+            last->tree.right = &node->tree;
+            node->tree.parent = &last->tree;
+            stream->tree = avl_fix(&node->tree);
+        }
+        else
+        {
+            stream->tree = &node->tree;
+        }
+        stream->nnodes++;
+    }
+
+    char *p = &node->data[node->end];
+    uint32_t nfields = (uint32_t)(n / 2);
+    memcpy(p, &id.ms, 8);
+    memcpy(p + 8, &id.seq, 8);
+    memcpy(p + 16, &nfields, 4);
+    p += k_sitem_hdr;
+    for (size_t i = 0; i < n; i++)
+    {
+        uint32_t len = (uint32_t)fv[i].size();
+        memcpy(p, &len, 4);
+        memcpy(p + 4, fv[i].data(), len);
+        p += 4 + len;
+    }
+    node->end += (uint32_t)need;
+    node->nitems++;
+    stream->size++;
+    stream->last = id;
+}
+
+uint64_t stream_trim(Stream *stream, uint64_t maxlen, bool approx)
+{
+    uint64_t removed = 0;
+    while (stream->size > maxlen)
+    {
+        SNode *node = tree_first(stream->tree);
+        uint64_t excess = stream->size - maxlen;
+        if (node->nitems <= excess)
+        {
+            stream->size -= node->nitems;
+            removed += node->nitems;
+            node_del(stream, node);
+            continue;
+        }
+        if (approx)
+        {
+            break;
+        }
+        // drop from the front, the node keeps its place in the tree
+        for (uint64_t i = 0; i < excess; i++)
+        {
+            node->start = item_next(node, node->start);
+        }
+        node->nitems -= (uint32_t)excess;
+        item_id(&node->data[node->start], node->first);
+        stream->size -= excess;
+        removed += excess;
+    }
+    return removed;
+}
+
+// calls f for the entries of a node in the range, false if it's done
+static bool node_range(SNode *node, const StreamID &start, const StreamID &end, bool rev,
+                       size_t &left, bool (*f)(const StreamID &, const char *, uint32_t, void *),
+                       void *arg)
+{
+    // the offsets are only known forwards
+    uint32_t offs[k_snode_items];
+    uint32_t n = 0;
+    for (uint32_t pos = node->start; pos < node->end; pos = item_next(node, pos))
+    {
+        offs[n++] = pos;
+    }
+    for (uint32_t k = 0; k < n; k++)
+    {
+        const char *p = &node->data[offs[rev ? n - 1 - k : k]];
+        StreamID id;
+        item_id(p, id);
+        if (rev ? sid_less(end, id) : sid_less(id, start))
+        {
+            continue;
+        }
+        if (rev ? sid_less(id, start) : sid_less(end, id))
+        {
+            return false;
+        }
+        uint32_t nfields = 0;
+        memcpy(&nfields, p + 16, 4);
+        if (!f(id, p + k_sitem_hdr, nfields, arg) || (left && --left == 0))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void stream_range(Stream *stream, const StreamID &start, const StreamID &end, bool rev, size_t count,
+                  bool (*f)(const StreamID &, const char *, uint32_t, void *), void *arg)
+{
+    if (sid_less(end, start))
+    {
+        return;
+    }
+    size_t left = count;
+    SNode *node = node_floor(stream, rev ? end : start);
+    if (!node && !rev)
+    {
+        node = tree_first(stream->tree);
+    }
+    while (node && node_range(node, start, end, rev, left, f, arg))
+    {
+        node = rev ? stream_prev(node) : stream_next(node);
+    }
+}
+
+void stream_from(Stream *stream, uint64_t pos,
+                 bool (*f)(const StreamID &, const char *, uint32_t, void *), void *arg)
+{
+    SNode *node = tree_first(stream->tree);
+    while (node && pos >= node->nitems)
+    {
+        pos -= node->nitems;
+        node = stream_next(node);
+    }
+    StreamID start;
+    if (!node)
+    {
+        return;
+    }
+    // the id of the pos-th entry in the node
+    uint32_t off = node->start;
+    for (uint64_t i = 0; i < pos; i++)
+    {
+        off = item_next(node, off);
+    }
+    item_id(&node->data[off], start);
+    StreamID end;
+    end.ms = end.seq = UINT64_MAX;
+    stream_range(stream, start, end, false, 0, f, arg);
+}
+
+void stream_dispose(Stream *stream)
+{
+    while (stream->tree)
+    {
+        node_del(stream, tree_first(stream->tree));
+    }
+    stream->size = 0;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "avl.h"
+
+// a stream is an append-only log of entries with increasing IDs. the entries
+// are packed into nodes that are indexed by their first ID in an AVL tree,
+// the same tree the zset uses. each entry is
+//
+// | ms:u64 | seq:u64 | nfields:u32 | (len:u32 | bytes) * 2 * nfields |
+//
+// new entries go to the last node, trimming drops from the front of the
+// first node. like a QChunk, the entries of a node sit in [start, end).
+const size_t k_snode_bytes = 4096;
+const uint32_t k_snode_items = 128;
+
+struct StreamID
+{
+    uint64_t ms = 0;
+    uint64_t seq = 0;
+};
+
+inline bool sid_less(const StreamID &a, const StreamID &b)
+{
+    return a.ms < b.ms || (a.ms == b.ms && a.seq < b.seq);
+}
+
+inline bool sid_max(const StreamID &id)
+{
+    return id.ms == UINT64_MAX && id.seq == UINT64_MAX;
+}
+
+// the ID after `id`, which must be less than sid_max()
+inline StreamID sid_next(StreamID id)
+{
+    if (id.seq == UINT64_MAX)
+    {
+        id.ms++;
+        id.seq = 0;
+    }
+    else
+    {
+        id.seq++;
+    }
+    return id;
+}
+
+struct SNode
+{
+    AVLNode tree;
+    StreamID first;
+    uint32_t nitems = 0;
+    uint32_t cap = 0;
+    uint32_t start = 0;
+    uint32_t end = 0;
+    char data[0];
+};
+
+struct Stream
+{
+    AVLNode *tree = NULL;
+    uint64_t size = 0;
+    uint64_t nnodes = 0;
+    // the ID of the last entry
+    StreamID last;
+};
+
+// "ms-seq", or "ms" with `seq` as the sequence number
+bool sid_parse(const std::string &s, uint64_t seq, StreamID &id);
+std::string sid_str(const StreamID &id);
+// the ID for XADD *, after the last one. false if the last one is the max.
+bool stream_next_id(Stream *stream, uint64_t now_ms, StreamID &id);
+
+// the ID must be greater than stream->last, fv holds n fields and values
+void stream_append(Stream *stream, const StreamID &id, const std::string *fv, size_t n);
+// keep the last `maxlen` entries, only whole nodes are dropped if `approx`.
+// returns the number of entries removed.
+uint64_t stream_trim(Stream *stream, uint64_t maxlen, bool approx);
+// calls f(id, fields, nfields, arg) for at most `count` entries in [start, end],
+// from the end if `rev`, until f returns false. `count` 0 means no limit.
+void stream_range(Stream *stream, const StreamID &start, const StreamID &end, bool rev, size_t count,
+                  bool (*f)(const StreamID &, const char *, uint32_t, void *), void *arg);
+// the entries from the `pos`-th on, see stream_range()
+void stream_from(Stream *stream, uint64_t pos,
+                 bool (*f)(const StreamID &, const char *, uint32_t, void *), void *arg);
+void stream_dispose(Stream *stream);
+size_t stream_node_size(SNode *node);
+// the first node, and the one after it
+SNode *stream_first(Stream *stream);
+SNode *stream_next(SNode *node);
+
+// the next field or value of an entry, returns the position after it
+inline const char *sfield_next(const char *p, const char **str, uint32_t *len)
+{
+    __builtin_memcpy(len, p, 4);
+    *str = p + 4;
+    return p + 4 + *len;
+}
@@ -0,0 +1,864 @@
+#!/usr/bin/env python3
+
+import os
+import shlex
+import socket
+import struct
+import subprocess
+import tempfile
+import time
+
+PORT = 1235
+
+CASES = r'''
+$ ./client zscore asdf n1
+(nil)
+$ ./client zadd zset 1 n1 2 n2
+(int) 2
+$ ./client zadd zset 1.1 n1 3 n3
+(int) 1
+$ ./client zquery zset 1 "" 0 10
+(arr) len=6
+(str) n1
+(dbl) 1.1
+(str) n2
+(dbl) 2
+(str) n3
+(dbl) 3
+(arr) end
+$ ./client zadd zset x n4
+(err) 4 expect fp number
+$ ./client zrem zset n3
+(int) 1
+$ ./client set k1 v1
+(nil)
+$ ./client set k2 v2
+(nil)
+$ ./client del k2
+(int) 1
+$ ./client pexpire k1 100000
+(int) 1
+$ ./client hset h f1 1 f2 v2
+(int) 2
+$ ./client hincrby h f1 5
+(int) 6
+$ ./client hincrby h f2 1
+(err) 4 hash value is not an integer
+$ ./client hincrby h f1 ''
+(err) 4 expect int
+$ ./client hincrby h f1 ' 1'
+(err) 4 expect int
+$ ./client hincrby h f1 99999999999999999999
+(err) 4 expect int
+$ ./client hset h f2 ' 5'
+(int) 0
+$ ./client hincrby h f2 1
+(err) 4 hash value is not an integer
+$ ./client hdel h f2 f3
+(int) 1
+$ ./client hget zset n1
+(err) 3 expect hash
+$ ./client rpush list b c d
+(int) 3
+$ ./client lpush list a
+(int) 4
+$ ./client rpop list
+(str) d
+$ ./client lpush h x
+(err) 3 expect list
+$ ./client sadd ids 3 1 2 1
+(int) 3
+$ ./client sadd tags 2 3 x
+(int) 3
+$ ./client sintercard 2 ids tags
+(int) 2
+$ ./client srem tags x
+(int) 1
+$ ./client sadd list x
+(err) 3 expect set
+$ ./client pfadd visits a b c a
+(int) 1
+$ ./client pfadd visits b
+(int) 0
+$ ./client pfadd list x
+(err) 3 expect hyperloglog
+$ ./client setbit flags 9 1
+(int) 0
+$ ./client bitfield flags incrby u4 12 3 get u8 8
+(arr) len=2
+(int) 3
+(int) 67
+(arr) end
+$ ./client bitpos flags 1
+(int) 9
+$ ./client xadd events 1-1 kind click
+(str) 1-1
+$ ./client xadd events maxlen 2 2 kind view
+(str) 2-0
+$ ./client xadd events 2-0 kind view
+(err) 4 id not greater than the last one
+$ ./client xadd events 3-0 kind buy
+(str) 3-0
+$ ./client xlen events
+(int) 3
+$ ./client xadd maxid 18446744073709551615-18446744073709551615 f v
+(str) 18446744073709551615-18446744073709551615
+$ ./client xadd maxid * f v
+(err) 4 the stream has run out of IDs
+$ ./client del maxid
+(int) 1
+$ ./client geoadd places 13.361389 38.115556 Palermo 15.087269 37.502669 Catania
+(int) 2
+$ ./client geoadd places 200 0 nowhere
+(err) 4 invalid coordinates
+$ ./client geodist places Palermo Catania km
+(dbl) 166.274
+$ ./client vadd docs values 3 1 0 0 a
+(int) 1
+$ ./client vadd docs values 3 0 1 0 b q8
+(int) 1
+$ ./client vadd docs values 3 1 1 0 c
+(int) 1
+$ ./client vadd docs values 2 1 1 d
+(err) 4 dimension mismatch
+$ ./client vrem docs b
+(int) 1
+$ ./client bf.reserve seen 0.01 2 expansion 2
+(nil)
+$ ./client bf.reserve seen 0.01 2
+(err) 4 key exists
+$ ./client bf.madd seen a b c
+(arr) len=3
+(int) 1
+(int) 1
+(int) 1
+(arr) end
+$ ./client bf.add seen a
+(int) 0
+$ ./client bf.reserve full 0.01 1 nonscaling
+(nil)
+$ ./client bf.madd full x y
+(arr) len=2
+(int) 1
+(err) 4 filter is full
+(arr) end
+$ ./client del full
+(int) 1
+$ ./client cms.initbydim views 64 4
+(nil)
+$ ./client cms.incrby views home 3 about 1 home 2
+(arr) len=3
+(int) 5
+(int) 1
+(int) 5
+(arr) end
+$ ./client cms.incrby missing home 1
+(err) 4 no such sketch
+$ ./client topk.reserve trending 2 64 4
+(nil)
+$ ./client topk.add trending a b a c
+(arr) len=4
+(nil)
+(nil)
+(nil)
+(nil)
+(arr) end
+$ ./client topk.add trending c c
+(arr) len=2
+(str) b
+(nil)
+(arr) end
+$ ./client ts.add temps 1000 20.5
+(int) 1000
+$ ./client ts.add temps 2000 21
+(int) 2000
+$ ./client ts.add temps 61000 23
+(int) 61000
+$ ./client ts.add temps 61000 24
+(err) 4 timestamp not after the last sample
+$ ./client ts.range temps - + aggregation max 60000
+(arr) len=2
+(arr) len=2
+(int) 0
+(dbl) 21
+(arr) end
+(arr) len=2
+(int) 60000
+(dbl) 23
+(arr) end
+(arr) end
+$ ./client ts.range temps - + aggregation count 9223372036854775807
+(arr) len=1
+(arr) len=2
+(int) 0
+(dbl) 3
+(arr) end
+(arr) end
+$ ./client ts.range nothing - +
+(arr) len=0
+(arr) end
+'''
+
+# the AOF is replayed on restart
+RESTART_CASES = r'''
+$ ./client get k1
+(str) v1
+$ ./client get k2
+(nil)
+$ ./client zquery zset 1 "" 0 10
+(arr) len=4
+(str) n1
+(dbl) 1.1
+(str) n2
+(dbl) 2
+(arr) end
+$ ./client hmget h f1 f2
+(arr) len=2
+(str) 6
+(nil)
+(arr) end
+$ ./client lrange list 0 -1
+(arr) len=3
+(str) a
+(str) b
+(str) c
+(arr) end
+$ ./client smismember tags 1 2 x
+(arr) len=3
+(int) 0
+(int) 1
+(int) 0
+(arr) end
+$ ./client sinter ids
+(arr) len=3
+(str) 1
+(str) 2
+(str) 3
+(arr) end
+$ ./client sintercard 2 ids tags
+(int) 2
+$ ./client pfcount visits
+(int) 3
+$ ./client bitcount flags
+(int) 3
+$ ./client xrevrange events + 2 count 1
+(arr) len=1
+(arr) len=2
+(str) 3-0
+(arr) len=2
+(str) kind
+(str) buy
+(arr) end
+(arr) end
+(arr) end
+$ ./client geosearch places fromlonlat 15 37 byradius 200 km desc
+(arr) len=2
+(str) Palermo
+(str) Catania
+(arr) end
+$ ./client vsim docs values 3 1 0.1 0 count 2
+(arr) len=2
+(str) a
+(str) c
+(arr) end
+$ ./client bf.mexists seen a b c
+(arr) len=3
+(int) 1
+(int) 1
+(int) 1
+(arr) end
+$ ./client cms.query views home about nothing
+(arr) len=3
+(int) 5
+(int) 1
+(int) 0
+(arr) end
+$ ./client topk.list trending withcount
+(arr) len=4
+(str) c
+(int) 3
+(str) a
+(int) 2
+(arr) end
+$ ./client ts.range temps 1500 + count 1
+(arr) len=1
+(arr) len=2
+(int) 2000
+(dbl) 21
+(arr) end
+(arr) end
+$ ./client ts.get temps
+(arr) len=2
+(int) 61000
+(dbl) 23
+(arr) end
+$ ./client bf.info seen
+(arr) len=12
+(str) capacity
+(int) 6
+(str) size
+(int) 128
+(str) filters
+(int) 2
+(str) items
+(int) 3
+(str) expansion
+(int) 2
+(str) error
+(dbl) 0.01
+(arr) end
+$ ./client bgrewriteaof
+(nil)
+'''
+
+
+def start_server(*args, port=PORT):
+    proc = subprocess.Popen(['./server', '--port', str(port), *args])
+    for _ in range(100):
+        time.sleep(0.05)
+        if subprocess.run(['./client', '-p', str(port), 'keys'],
+                          stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL).returncode == 0:
+            break
+    return proc
+
+
+def run_cases(cases, port=PORT):
+    cmds = []
+    outputs = []
+    for x in cases.splitlines():
+        x = x.strip()
+        if not x:
+            continue
+        if x.startswith('$ '):
+            cmds.append(x[2:])
+            outputs.append('')
+        else:
+            outputs[-1] = outputs[-1] + x + '\n'
+
+    assert len(cmds) == len(outputs)
+    for cmd, expect in zip(cmds, outputs):
+        argv = shlex.split(cmd)
+        argv[1:1] = ['-p', str(port)]
+        out = subprocess.check_output(argv).decode('utf-8')
+        assert out == expect, f'cmd:{cmd} out:{out}'
+
+
+def request(*args):
+    body = struct.pack('<I', len(args))
+    for arg in args:
+        body += struct.pack('<I', len(arg)) + arg.encode()
+    return struct.pack('<I', len(body)) + body
+
+
+def response(sock):
+    def read(n):
+        data = b''
+        while len(data) < n:
+            data += sock.recv(n - len(data))
+        return data
+    return read(struct.unpack('<I', read(4))[0])
+
+
+def pttl(key):
+    out = subprocess.check_output(['./client', '-p', str(PORT), 'pttl', key]).decode('utf-8')
+    return int(out.split()[1])
+
+
+with tempfile.TemporaryDirectory() as tmp:
+    aof = os.path.join(tmp, 'test.aof')
+
+    server = start_server('--appendonly', aof)
+    try:
+        run_cases(CASES)
+        # the keys and the zset nodes are in the slab classes
+        out = subprocess.check_output(['./client', '-p', str(PORT), 'info']).decode('utf-8')
+        assert '(str) keys\n(int) 15\n' in out, out
+        assert '(str) slab_frag_ratio\n' in out, out
+        # a defrag cycle leaves the data intact
+        run_cases('''
+        $ ./client defrag
+        (nil)
+        ''')
+        time.sleep(0.2)
+        out = subprocess.check_output(['./client', '-p', str(PORT), 'info']).decode('utf-8')
+        assert '(str) defrag_cycles\n(int) 1\n' in out, out
+        run_cases(RESTART_CASES.split('$ ./client bgrewriteaof')[0])
+
+        # a parked BLPOP is served by the next push
+        waiter = subprocess.Popen(['./client', '-p', str(PORT), 'blpop', 'queue', '0'],
+                                  stdout=subprocess.PIPE)
+        time.sleep(0.2)
+        run_cases('''
+        $ ./client rpush queue job
+        (int) 1
+        ''')
+        out = waiter.communicate(timeout=5)[0].decode('utf-8')
+        assert out == '(arr) len=2\n(str) queue\n(str) job\n(arr) end\n', out
+
+        # so is a parked XREAD by the next entry
+        waiter = subprocess.Popen(['./client', '-p', str(PORT), 'xread', 'block', '0',
+                                   'streams', 'feed', '$'], stdout=subprocess.PIPE)
+        time.sleep(0.2)
+        run_cases('''
+        $ ./client xadd feed 1-0 n 1
+        (str) 1-0
+        ''')
+        out = waiter.communicate(timeout=5)[0].decode('utf-8')
+        assert out.startswith('(arr) len=1\n(arr) len=2\n(str) feed\n(arr) len=1\n'), out
+
+        # a script updates a key in one step, its writes are logged by themselves
+        script = ('local cur = tonumber(call("get", KEYS[1])) or 0 '
+                  'if cur < tonumber(ARGV[1]) then call("set", KEYS[1], ARGV[1]) return 1 end '
+                  'return 0')
+        run_cases(f'''
+        $ ./client eval '{script}' 1 best 7
+        (int) 1
+        $ ./client eval '{script}' 1 best 5
+        (int) 0
+        $ ./client script load '{script}'
+        (str) fb160e0769ff214c0533f8dd369061d03bfe5694
+        $ ./client evalsha fb160e0769ff214c0533f8dd369061d03bfe5694 1 best 3
+        (int) 0
+        $ ./client evalsha 0000000000000000000000000000000000000000 0
+        (err) 11 no such script, use EVAL
+        $ ./client eval 'local t = {{}} for i = 1, 3 do t[#t + 1] = i * 1.5 end return t' 0
+        (arr) len=3
+        (dbl) 1.5
+        (dbl) 3
+        (dbl) 4.5
+        (arr) end
+        $ ./client eval 'return call("zscore", KEYS[1], "x")' 1 best
+        (err) 3 expect zset
+        $ ./client eval 'return 1 +' 0
+        (err) 10 line 1: unexpected symbol
+        $ ./client eval 'while true do end' 0
+        (err) 10 the script ran out of its instruction budget
+        ''')
+        out = subprocess.check_output(['./client', '-p', str(PORT), 'info']).decode('utf-8')
+        assert '(str) scripts_killed\n(int) 1\n' in out, out
+
+        # a transaction runs at EXEC, unless a watched key was written since WATCH
+        with socket.create_connection(('127.0.0.1', PORT)) as txn:
+            def call(*args):
+                txn.sendall(request(*args))
+                return response(txn)
+            nil = b'\x00'
+            queued = b'\x02' + struct.pack('<I', 6) + b'queued'
+            assert call('watch', 'txn') == nil
+            assert call('multi') == nil
+            assert call('set', 'txn', '1') == queued
+            run_cases('''
+            $ ./client set txn 0
+            (nil)
+            ''')
+            assert call('exec') == nil
+            assert call('multi') == nil
+            assert call('set', 'txn', '2') == queued
+            assert call('get', 'txn') == queued
+            out = call('exec')
+            assert out == b'\x05' + struct.pack('<I', 2) + nil + b'\x02' + struct.pack('<I', 1) + b'2', out
+            assert call('exec')[0] == 1
+            # pfcount caches its estimate in the value, that's not a write
+            run_cases('''
+            $ ./client pfadd txn.h a b
+            (int) 1
+            ''')
+            assert call('watch', 'txn.h') == nil
+            run_cases('''
+            $ ./client pfcount txn.h
+            (int) 2
+            ''')
+            assert call('multi') == nil
+            assert call('get', 'txn') == queued
+            out = call('exec')
+            assert out == b'\x05' + struct.pack('<I', 1) + b'\x02' + struct.pack('<I', 1) + b'2', out
+            # a request without any arguments is an unknown command
+            out = call()
+            assert out == b'\x01' + struct.pack('<iI', 1, 11) + b'Unknown cmd', out
+            assert call('ping') == b'\x02' + struct.pack('<I', 4) + b'pong'
+            # a script run by EXEC is inside its transaction
+            assert call('multi') == nil
+            assert call('eval', 'return call("set", KEYS[1], "1")', '1', 'sc.c') == queued
+            assert call('exec') == b'\x05' + struct.pack('<I', 1) + nil
+        # the writes of a script are logged as a transaction
+        run_cases('''
+        $ ./client eval 'call("set", KEYS[1], "1") call("set", KEYS[2], "1") return 1' 2 sc.a sc.b
+        (int) 1
+        ''')
+    finally:
+        server.terminate()
+        server.wait()
+
+    # the writes of a transaction are logged between MULTI and EXEC, and a
+    # transaction cut short by a crash is dropped
+    with open(aof, 'rb') as fp:
+        log = fp.read()
+    assert request('multi') + request('set', 'txn', '2') + request('exec') in log
+    assert request('multi') + request('set', 'sc.c', '1') + request('exec') in log
+    script = request('multi') + request('set', 'sc.a', '1') + request('set', 'sc.b', '1') + request('exec')
+    assert log.endswith(script), log[-100:]
+    # cut in the middle of the script
+    with open(aof, 'r+b') as fp:
+        fp.truncate(len(log) - len(script) + len(request('multi') + request('set', 'sc.a', '1')))
+    with open(aof, 'ab') as fp:
+        fp.write(request('multi') + request('set', 'txn', '3'))
+
+    server = start_server('--appendonly', aof)
+    try:
+        run_cases(RESTART_CASES)
+        assert 0 < pttl('k1') <= 100000
+        run_cases('''
+        $ ./client get best
+        (str) 7
+        $ ./client get txn
+        (str) 2
+        $ ./client get sc.c
+        (str) 1
+        $ ./client get sc.a
+        (nil)
+        ''')
+        time.sleep(0.5)
+        assert not os.path.exists(aof + '.rewrite')
+    finally:
+        server.terminate()
+        server.wait()
+
+    # the rewritten log holds the minimal command set
+    server = start_server('--appendonly', aof)
+    try:
+        run_cases(RESTART_CASES)
+        assert 0 < pttl('k1') <= 100000
+    finally:
+        server.terminate()
+        server.wait()
+
+    # the snapshot is loaded on startup when the AOF is disabled
+    snap = os.path.join(tmp, 'test.snap')
+    server = start_server('--snapshot', snap)
+    try:
+        run_cases(CASES)
+        run_cases('''
+        $ ./client save
+        (nil)
+        ''')
+    finally:
+        server.terminate()
+        server.wait()
+
+    server = start_server('--snapshot', snap)
+    try:
+        run_cases(RESTART_CASES.split('$ ./client bgrewriteaof')[0])
+        assert 0 < pttl('k1') <= 100000
+    finally:
+        server.terminate()
+        server.wait()
+
+    # the fork-less snapshot captures the key space when it started
+    os.unlink(snap)
+    server = start_server('--snapshot', snap, '--snapshot-mode', 'incremental')
+    try:
+        run_cases(CASES)
+        run_cases('''
+        $ ./client bgsave
+        (nil)
+        $ ./client set k1 v2
+        (nil)
+        ''')
+        time.sleep(0.5)
+    finally:
+        server.terminate()
+        server.wait()
+
+    server = start_server('--snapshot', snap)
+    try:
+        run_cases(RESTART_CASES.split('$ ./client bgrewriteaof')[0])
+    finally:
+        server.terminate()
+        server.wait()
+
+    # cold values are moved to the tier file and loaded back on access
+    server = start_server('--tier', os.path.join(tmp, 'tier.dat'),
+                          '--tier-min-size', '1', '--tier-cold-ms', '100')
+    try:
+        run_cases(CASES)
+        time.sleep(0.5)
+        run_cases(RESTART_CASES.split('$ ./client bgrewriteaof')[0])
+        assert 0 < pttl('k1') <= 100000
+        out = subprocess.check_output(['./client', '-p', str(PORT), 'tier', 'stats'])
+        assert b'(str) faults\n(int) 15\n' in out, out
+    finally:
+        server.terminate()
+        server.wait()
+
+    # a replica gets a full sync, then the command stream
+    os.unlink(snap)
+    primary = start_server('--snapshot', snap)
+    replica = start_server('--snapshot', os.path.join(tmp, 'replica.snap'),
+                           '--replicaof', f'127.0.0.1:{PORT}', port=PORT + 1)
+    try:
+        run_cases(CASES)
+        time.sleep(1.5)
+        run_cases(RESTART_CASES.split('$ ./client bgrewriteaof')[0], port=PORT + 1)
+        run_cases('''
+        $ ./client set k3 v3
+        (err) 5 read-only replica
+        ''', port=PORT + 1)
+        run_cases('''
+        $ ./client set k3 v3
+        (nil)
+        ''')
+        with socket.create_connection(('127.0.0.1', PORT)) as txn:
+            for cmd in (['multi'], ['set', 'k4', 'v4'], ['pexpire', 'k4', '100000'], ['exec']):
+                txn.sendall(request(*cmd))
+                response(txn)
+        time.sleep(0.2)
+        run_cases('''
+        $ ./client get k3
+        (str) v3
+        $ ./client get k4
+        (str) v4
+        ''', port=PORT + 1)
+    finally:
+        replica.terminate()
+        replica.wait()
+        primary.terminate()
+        primary.wait()
+
+    # subscribers get the messages of their channels and patterns
+    server = start_server('--pubsub-output-limit', '100000')
+    try:
+        subs = [subprocess.Popen(['./client', '-p', str(PORT), *cmd], stdout=subprocess.PIPE)
+                for cmd in (['subscribe', 'news'], ['psubscribe', 'n*', 'x'])]
+        time.sleep(0.2)
+        run_cases('''
+        $ ./client publish news hello
+        (int) 2
+        $ ./client publish other hello
+        (int) 0
+        ''')
+        time.sleep(0.2)
+        outs = []
+        for sub in subs:
+            sub.terminate()
+            outs.append(sub.communicate(timeout=5)[0].decode('utf-8'))
+        assert outs[0] == '(int) 1\n(arr) len=3\n(str) message\n(str) news\n(str) hello\n(arr) end\n', outs
+        assert outs[1] == '(int) 2\n(arr) len=4\n(str) pmessage\n(str) n*\n(str) news\n(str) hello\n(arr) end\n', outs
+
+        # one that stops reading is cut off at the output limit
+        slow = socket.socket()
+        slow.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        slow.connect(('127.0.0.1', PORT))
+        slow.sendall(request('subscribe', 'firehose'))
+        time.sleep(0.2)
+        with socket.create_connection(('127.0.0.1', PORT)) as pub:
+            pub.sendall(b''.join(request('publish', 'firehose', 'x' * 3000) for _ in range(1000)))
+            time.sleep(0.5)
+        slow.close()
+        out = subprocess.check_output(['./client', '-p', str(PORT), 'info'])
+        assert b'(str) pubsub_disconnected\n(int) 1\n' in out, out
+        assert b'(str) pubsub_channels\n(int) 0\n' in out, out
+
+        # a tracking client is told about the writes to the keys it read
+        inv = socket.create_connection(('127.0.0.1', PORT))
+        inv.sendall(request('client', 'id'))
+        inv_id = struct.unpack('<q', response(inv)[1:])[0]
+        inv.sendall(request('subscribe', '__redis__:invalidate'))
+        response(inv)
+        with socket.create_connection(('127.0.0.1', PORT)) as trk:
+            trk.sendall(request('client', 'tracking', 'on', 'redirect', str(inv_id)))
+            response(trk)
+            trk.sendall(request('get', 'cached'))
+            response(trk)
+            trk.sendall(request('sintercard', '2', 'cached.a', 'cached.b'))
+            response(trk)
+            trk.sendall(request('xread', 'streams', 'cached.s', '0'))
+            response(trk)
+            run_cases('''
+            $ ./client pfadd cached.h a
+            (int) 1
+            $ ./client set cached 1
+            (nil)
+            $ ./client set cached 2
+            (nil)
+            $ ./client sadd cached.b x
+            (int) 1
+            $ ./client xadd cached.s 1-1 f v
+            (str) 1-1
+            ''')
+            # pfcount only caches its estimate in the value
+            trk.sendall(request('pfcount', 'cached.h'))
+            response(trk)
+            run_cases('''
+            $ ./client pfcount cached.h
+            (int) 1
+            ''')
+        for key in (b'cached', b'cached.b', b'cached.s'):
+            msg = response(inv)
+            assert b'__redis__:invalidate' in msg and msg.endswith(key), msg
+        inv.settimeout(0.2)
+        try:
+            msg = inv.recv(4096)
+        except socket.timeout:
+            msg = b''
+        assert msg == b'', msg
+        inv.close()
+    finally:
+        server.terminate()
+        server.wait()
+
+    # two servers splitting the slots, foo is in slot 12182 and bar in 5061
+    nodes = os.path.join(tmp, 'nodes.conf')
+    with open(nodes, 'w') as fp:
+        fp.write(f'0-8191 127.0.0.1:{PORT}\n8192-16383 127.0.0.1:{PORT + 1}\n')
+    servers = [start_server('--cluster', nodes, port=port) for port in (PORT, PORT + 1)]
+    try:
+        run_cases(f'''
+        $ ./client cluster keyslot {{bar}}.x
+        (int) 5061
+        $ ./client set foo 1
+        (err) 6 12182 127.0.0.1:{PORT + 1}
+        $ ./client set bar 1
+        (nil)
+        $ ./client set {{bar}}.x 2
+        (nil)
+        $ ./client cluster countkeysinslot 5061
+        (int) 2
+        $ ./client cluster getkeysinslot 5061 1
+        (arr) len=1
+        (str) bar
+        (arr) end
+        $ ./client sunionstore {{bar}}.u bar foo
+        (err) 12 the keys are in different slots
+        $ ./client bitop or {{bar}}.b bar {{bar}}.x
+        (int) 1
+        $ ./client eval 'return call("get", KEYS[1])' 1 bar
+        (str) 1
+        $ ./client eval 'return call("get", "{{bar}}.x")' 1 bar
+        (err) 10 the key {{bar}}.x is not in KEYS
+        $ ./client eval 'return call("get", KEYS[1])' 1 foo
+        (err) 6 12182 127.0.0.1:{PORT + 1}
+        ''')
+        run_cases('''
+        $ ./client set foo 1
+        (nil)
+        $ ./client cluster countkeysinslot 12182
+        (int) 1
+        ''', port=PORT + 1)
+
+        # the proxy routes by slot with the same config
+        proxy = subprocess.Popen(['./proxy', '--port', str(PORT + 2), '--cluster', nodes])
+        try:
+            time.sleep(0.2)
+            run_cases('''
+            $ ./client get foo
+            (str) 1
+            $ ./client get bar
+            (str) 1
+            $ ./client set baz 3
+            (nil)
+            ''', port=PORT + 2)
+            # routed by the keys, not by the first argument
+            run_cases('''
+            $ ./client bitop and {bar}.b {bar}.x
+            (int) 1
+            $ ./client get {bar}.b
+            (str) 2
+            $ ./client sadd {bar}.s1 a b
+            (int) 2
+            $ ./client sadd {bar}.s2 b
+            (int) 1
+            $ ./client sintercard 2 {bar}.s1 {bar}.s2
+            (int) 1
+            $ ./client xadd {bar}.st 1-1 f v
+            (str) 1-1
+            $ ./client xread count 1 streams {bar}.st 0
+            (arr) len=1
+            (arr) len=2
+            (str) {bar}.st
+            (arr) len=1
+            (arr) len=2
+            (str) 1-1
+            (arr) len=2
+            (str) f
+            (str) v
+            (arr) end
+            (arr) end
+            (arr) end
+            (arr) end
+            (arr) end
+            $ ./client eval 'return call("get", KEYS[1])' 1 foo
+            (str) 1
+            $ ./client sinter bar foo
+            (err) 12 proxy: the keys are on different servers
+            $ ./client del {bar}.s1
+            (int) 1
+            $ ./client del {bar}.s2
+            (int) 1
+            $ ./client del {bar}.st
+            (int) 1
+            ''', port=PORT + 2)
+            # the requests of a client reach a server in order
+            with socket.create_connection(('127.0.0.1', PORT + 2)) as pin:
+                pin.sendall(b''.join(request('set', 'baz', str(i)) for i in range(100)))
+                pin.sendall(request('get', 'baz'))
+                for i in range(100):
+                    response(pin)
+                out = response(pin)
+                assert out == b'\x02' + struct.pack('<I', 2) + b'99', out
+            # the upstream connections are shared, no connection state
+            run_cases('''
+            $ ./client blpop baz.l 0
+            (err) 1 proxy: blpop is not supported
+            $ ./client brpop baz.l 0
+            (err) 1 proxy: brpop is not supported
+            $ ./client xread block 0 streams baz.s $
+            (err) 1 proxy: xread is not supported
+            $ ./client xread count 1 streams baz.s 0
+            (nil)
+            $ ./client client tracking on
+            (err) 1 proxy: client is not supported
+            $ ./client multi
+            (err) 1 proxy: multi is not supported
+            $ ./client watch baz
+            (err) 1 proxy: watch is not supported
+            ''', port=PORT + 2)
+            with socket.create_connection(('127.0.0.1', PORT + 2)) as sub:
+                sub.sendall(request('subscribe', 'ch'))
+                out = response(sub)
+                assert out[0] == 1 and out.endswith(b'proxy: subscribe is not supported'), out
+        finally:
+            proxy.terminate()
+            proxy.wait()
+
+        # move the slot of bar, the keys go with it
+        run_cases(f'''
+        $ ./client zadd {{bar}}.z 1 a 2 b
+        (int) 2
+        $ ./client hset {{bar}}.h f v
+        (int) 1
+        $ ./client cluster setslot 5061 migrating 127.0.0.1:{PORT + 1}
+        (nil)
+        ''')
+        time.sleep(0.5)
+        run_cases(f'''
+        $ ./client get bar
+        (err) 6 5061 127.0.0.1:{PORT + 1}
+        $ ./client cluster countkeysinslot 5061
+        (int) 0
+        ''')
+        run_cases('''
+        $ ./client get {bar}.x
+        (str) 2
+        $ ./client zscore {bar}.z b
+        (dbl) 2
+        $ ./client hget {bar}.h f
+        (str) v
+        $ ./client cluster countkeysinslot 5061
+        (int) 5
+        ''', port=PORT + 1)
+    finally:
+        for server in servers:
+            server.terminate()
+            server.wait()
+
+print('OK')
@@ -50,4 +50,38 @@ void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg)
     tp->queue.push_back(w);
     pthread_cond_signal(&tp->not_empty);
     pthread_mutex_unlock(&tp->mu);
-}
\ No newline at end of file
+}
+
+void wait_group_init(WaitGroup *wg, size_t n)
+{
+    wg->pending = n;
+    int rv = pthread_mutex_init(&wg->mu, NULL);
+    assert(rv == 0);
+    rv = pthread_cond_init(&wg->done, NULL);
+    assert(rv == 0);
+}
+
+// called by each job when it finishes
+void wait_group_done(WaitGroup *wg)
+{
+    pthread_mutex_lock(&wg->mu);
+    assert(wg->pending > 0);
+    if (--wg->pending == 0)
+    {
+        pthread_cond_broadcast(&wg->done);
+    }
+    pthread_mutex_unlock(&wg->mu);
+}
+
+// block until all jobs are done, then release the resources
+void wait_group_wait(WaitGroup *wg)
+{
+    pthread_mutex_lock(&wg->mu);
+    while (wg->pending > 0)
+    {
+        pthread_cond_wait(&wg->done, &wg->mu);
+    }
+    pthread_mutex_unlock(&wg->mu);
+    pthread_cond_destroy(&wg->done);
+    pthread_mutex_destroy(&wg->mu);
+}
@@ -21,4 +21,16 @@ struct ThreadPool
 };
 
 void thread_pool_init(ThreadPool *tp, size_t num_threads);
-void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
\ No newline at end of file
+void thread_pool_queue(ThreadPool *tp, void (*f)(void *), void *arg);
+
+// waits for a batch of queued jobs to finish
+struct WaitGroup
+{
+    size_t pending = 0;
+    pthread_mutex_t mu;
+    pthread_cond_t done;
+};
+
+void wait_group_init(WaitGroup *wg, size_t n);
+void wait_group_done(WaitGroup *wg);
+void wait_group_wait(WaitGroup *wg);
@@ -0,0 +1,441 @@
+#include <string.h>
+#include <algorithm>
+
+#include "tseries.h"
+
+// the worst case of a sample: a 64-bit delta of delta and 64 new value bits
+const uint32_t k_tsample_max_bits = 4 + 64 + 2 + 5 + 6 + 64;
+
+// the bits go into the words from the most significant one down
+static void put_bits(TChunk &chunk, uint64_t v, uint32_t n)
+{
+    uint32_t off = chunk.nbits % 64;
+    if (off == 0)
+    {
+        chunk.words.push_back(0);
+    }
+    uint32_t room = 64 - off;
+    if (n <= room)
+    {
+        chunk.words.back() |= v << (room - n);
+    }
+    else
+    {
+        chunk.words.back() |= v >> (n - room);
+        chunk.words.push_back(v << (64 - (n - room)));
+    }
+    chunk.nbits += n;
+}
+
+struct BitReader
+{
+    const uint64_t *words = NULL;
+    uint32_t pos = 0;
+    uint32_t end = 0;
+};
+
+static bool get_bits(BitReader &r, uint32_t n, uint64_t &v)
+{
+    if (n > r.end - r.pos)
+    {
+        return false;
+    }
+    uint32_t off = r.pos % 64;
+    uint32_t room = 64 - off;
+    uint64_t hi = r.words[r.pos / 64] << off;
+    if (n <= room)
+    {
+        v = hi >> (64 - n);
+    }
+    else
+    {
+        v = (hi >> (64 - n)) | (r.words[r.pos / 64 + 1] >> (64 - (n - room)));
+    }
+    r.pos += n;
+    return true;
+}
+
+static uint64_t dbl_bits(double val)
+{
+    uint64_t bits = 0;
+    memcpy(&bits, &val, 8);
+    return bits;
+}
+
+static double bits_dbl(uint64_t bits)
+{
+    double val = 0;
+    memcpy(&val, &bits, 8);
+    return val;
+}
+
+// the delta of delta: '0' for none, then 7, 9 and 12 bits, or all 64
+static void put_dod(TChunk &chunk, int64_t dod)
+{
+    if (dod == 0)
+    {
+        put_bits(chunk, 0, 1);
+    }
+    else if (dod >= -63 && dod <= 64)
+    {
+        put_bits(chunk, 0x2, 2);
+        put_bits(chunk, (uint64_t)(dod + 63), 7);
+    }
+    else if (dod >= -255 && dod <= 256)
+    {
+        put_bits(chunk, 0x6, 3);
+        put_bits(chunk, (uint64_t)(dod + 255), 9);
+    }
+    else if (dod >= -2047 && dod <= 2048)
+    {
+        put_bits(chunk, 0xe, 4);
+        put_bits(chunk, (uint64_t)(dod + 2047), 12);
+    }
+    else
+    {
+        put_bits(chunk, 0xf, 4);
+        put_bits(chunk, (uint64_t)dod, 64);
+    }
+}
+
+// the XOR with the previous value: '0' if the same, '10' and the meaningful
+// bits if they fit in the previous window, or '11', the leading zeros, the
+// length and the bits for a new window
+static void put_xor(TChunk &chunk, uint64_t x)
+{
+    if (x == 0)
+    {
+        put_bits(chunk, 0, 1);
+        return;
+    }
+    uint8_t lead = (uint8_t)std::min(__builtin_clzll(x), 31);
+    uint8_t trail = (uint8_t)__builtin_ctzll(x);
+    if (chunk.lead != 0xff && lead >= chunk.lead && trail >= chunk.trail)
+    {
+        put_bits(chunk, 0x2, 2);
+        put_bits(chunk, x >> chunk.trail, 64 - chunk.lead - chunk.trail);
+        return;
+    }
+    uint32_t len = 64 - lead - trail;
+    put_bits(chunk, 0x3, 2);
+    put_bits(chunk, lead, 5);
+    put_bits(chunk, len - 1, 6);
+    put_bits(chunk, x >> trail, len);
+    chunk.lead = lead;
+    chunk.trail = trail;
+}
+
+static void chunk_append(TChunk &chunk, int64_t ts, double val)
+{
+    uint64_t bits = dbl_bits(val);
+    if (chunk.count == 0)
+    {
+        put_bits(chunk, (uint64_t)ts, 64);
+        put_bits(chunk, bits, 64);
+        chunk.first_ts = ts;
+    }
+    else
+    {
+        int64_t delta = ts - chunk.last_ts;
+        put_dod(chunk, delta - chunk.last_delta);
+        put_xor(chunk, bits ^ chunk.last_val);
+        chunk.last_delta = delta;
+    }
+    chunk.last_ts = ts;
+    chunk.last_val = bits;
+    chunk.count++;
+}
+
+// decodes a chunk sample by sample, with the same state as the encoder
+struct ChunkReader
+{
+    BitReader bits;
+    uint32_t left = 0;
+    bool first = true;
+    int64_t ts = 0;
+    int64_t delta = 0;
+    uint64_t val = 0;
+    uint8_t lead = 0xff;
+    uint8_t trail = 0;
+};
+
+static void reader_init(ChunkReader &r, const TChunk &chunk)
+{
+    r.bits.words = chunk.words.data();
+    r.bits.end = chunk.nbits;
+    r.left = chunk.count;
+}
+
+static bool get_dod(BitReader &r, int64_t &dod)
+{
+    // the number of leading ones picks the width
+    uint32_t ones = 0;
+    uint64_t bit = 1;
+    while (ones < 4 && get_bits(r, 1, bit) && bit)
+    {
+        ones++;
+    }
+    if (ones < 4 && bit)
+    {
+        return false;
+    }
+    static const uint32_t k_widths[] = {0, 7, 9, 12, 64};
+    static const int64_t k_bias[] = {0, 63, 255, 2047, 0};
+    uint64_t v = 0;
+    if (ones > 0 && !get_bits(r, k_widths[ones], v))
+    {
+        return false;
+    }
+    dod = (int64_t)v - k_bias[ones];
+    return true;
+}
+
+static bool get_xor(ChunkReader &r, uint64_t &x)
+{
+    uint64_t bit = 0, lead = 0, len = 0, v = 0;
+    if (!get_bits(r.bits, 1, bit))
+    {
+        return false;
+    }
+    if (!bit)
+    {
+        x = 0;
+        return true;
+    }
+    if (!get_bits(r.bits, 1, bit))
+    {
+        return false;
+    }
+    if (bit)
+    {
+        if (!get_bits(r.bits, 5, lead) || !get_bits(r.bits, 6, len) || lead + len + 1 > 64)
+        {
+            return false;
+        }
+        r.lead = (uint8_t)lead;
+        r.trail = (uint8_t)(64 - lead - len - 1);
+    }
+    else if (r.lead == 0xff)
+    {
+        return false;
+    }
+    if (!get_bits(r.bits, 64 - r.lead - r.trail, v))
+    {
+        return false;
+    }
+    x = v << r.trail;
+    return true;
+}
+
+static bool reader_next(ChunkReader &r, TSample &sample)
+{
+    if (r.left == 0)
+    {
+        return false;
+    }
+    if (r.first)
+    {
+        uint64_t ts = 0;
+        if (!get_bits(r.bits, 64, ts) || !get_bits(r.bits, 64, r.val))
+        {
+            return false;
+        }
+        r.ts = (int64_t)ts;
+        r.first = false;
+    }
+    else
+    {
+        int64_t dod = 0;
+        uint64_t x = 0;
+        if (!get_dod(r.bits, dod) || !get_xor(r, x))
+        {
+            return false;
+        }
+        r.delta += dod;
+        r.ts += r.delta;
+        r.val ^= x;
+    }
+    r.left--;
+    sample.ts = r.ts;
+    sample.val = bits_dbl(r.val);
+    return true;
+}
+
+int64_t ts_cutoff(TSeries *series)
+{
+    if (series->retention <= 0 || series->chunks.empty())
+    {
+        return INT64_MIN;
+    }
+    return series->chunks.back().last_ts - series->retention;
+}
+
+bool ts_add(TSeries *series, int64_t ts, double val)
+{
+    if (!series->chunks.empty() && ts <= series->chunks.back().last_ts)
+    {
+        return false;
+    }
+    if (series->chunks.empty()
+        || series->chunks.back().nbits + k_tsample_max_bits > k_tchunk_bytes * 8)
+    {
+        series->chunks.emplace_back();
+        series->chunks.back().words.reserve(16);
+    }
+    chunk_append(series->chunks.back(), ts, val);
+    series->size++;
+    // only the newest sample moves the cutoff
+    int64_t cutoff = ts_cutoff(series);
+    while (series->chunks.size() > 1 && series->chunks.front().last_ts < cutoff)
+    {
+        series->size -= series->chunks.front().count;
+        series->chunks.pop_front();
+    }
+    return true;
+}
+
+struct Bucket
+{
+    int64_t start = 0;
+    uint64_t n = 0;
+    double sum = 0;
+    double min = 0;
+    double max = 0;
+};
+
+static void bucket_add(Bucket &b, double val)
+{
+    b.sum += val;
+    b.min = b.n ? std::min(b.min, val) : val;
+    b.max = b.n ? std::max(b.max, val) : val;
+    b.n++;
+}
+
+static TSample bucket_result(const Bucket &b, uint32_t agg)
+{
+    TSample out;
+    out.ts = b.start;
+    switch (agg)
+    {
+    case TS_AVG:
+        out.val = b.sum / b.n;
+        break;
+    case TS_MIN:
+        out.val = b.min;
+        break;
+    case TS_MAX:
+        out.val = b.max;
+        break;
+    case TS_SUM:
+        out.val = b.sum;
+        break;
+    case TS_COUNT:
+        out.val = (double)b.n;
+        break;
+    }
+    return out;
+}
+
+void ts_range(TSeries *series, int64_t from, int64_t to, int64_t bucket, uint32_t agg,
+              size_t count, std::vector<TSample> &out)
+{
+    from = std::max(from, ts_cutoff(series));
+    // the first chunk that reaches `from`
+    auto it = std::partition_point(series->chunks.begin(), series->chunks.end(),
+                                   [from](const TChunk &c) { return c.last_ts < from; });
+    Bucket b;
+    for (; it != series->chunks.end() && it->first_ts <= to && out.size() < count; ++it)
+    {
+        ChunkReader r;
+        reader_init(r, *it);
+        TSample sample;
+        while (out.size() < count && reader_next(r, sample) && sample.ts <= to)
+        {
+            if (sample.ts < from)
+            {
+                continue;
+            }
+            if (bucket <= 0)
+            {
+                out.push_back(sample);
+                continue;
+            }
+            // the timestamps are never negative
+            int64_t start = sample.ts - sample.ts % bucket;
+            if (b.n && start != b.start)
+            {
+                out.push_back(bucket_result(b, agg));
+                b = Bucket();
+            }
+            b.start = start;
+            bucket_add(b, sample.val);
+        }
+    }
+    if (b.n && out.size() < count)
+    {
+        out.push_back(bucket_result(b, agg));
+    }
+}
+
+bool ts_load_chunk(TSeries *series, const char *data, size_t len, uint32_t nbits, uint32_t count)
+{
+    if (count == 0 || nbits > k_tchunk_bytes * 8 || len != (nbits + 63) / 64 * 8)
+    {
+        return false;
+    }
+    TChunk chunk;
+    chunk.words.resize(len / 8);
+    memcpy(chunk.words.data(), data, len);
+    if (nbits % 64)
+    {
+        // the next sample is ORed into the bits after the end
+        chunk.words.back() &= ~(uint64_t)0 << (64 - nbits % 64);
+    }
+    chunk.nbits = nbits;
+    chunk.count = count;
+    // decode it to check it and to get the encoder state
+    ChunkReader r;
+    reader_init(r, chunk);
+    TSample sample;
+    int64_t prev = series->chunks.empty() ? -1 : series->chunks.back().last_ts;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (!reader_next(r, sample) || sample.ts <= prev)
+        {
+            return false;
+        }
+        if (i == 0)
+        {
+            chunk.first_ts = sample.ts;
+        }
+        prev = sample.ts;
+    }
+    if (r.bits.pos != nbits)
+    {
+        return false;
+    }
+    chunk.last_ts = r.ts;
+    chunk.last_delta = r.delta;
+    chunk.last_val = r.val;
+    chunk.lead = r.lead;
+    chunk.trail = r.trail;
+    series->chunks.push_back(std::move(chunk));
+    series->size += count;
+    return true;
+}
+
+size_t ts_bytes(TSeries *series)
+{
+    size_t n = 0;
+    for (const TChunk &chunk : series->chunks)
+    {
+        n += sizeof(TChunk) + chunk.words.capacity() * 8;
+    }
+    return n;
+}
+
+void ts_dispose(TSeries *series)
+{
+    std::deque<TChunk>().swap(series->chunks);
+    series->size = 0;
+}
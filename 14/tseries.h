@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+// a time series is a list of chunks of (timestamp, value) samples with
+// increasing timestamps, compressed like Gorilla: each timestamp is stored as
+// the change of the delta to the previous one, each value as the XOR with the
+// previous one without its leading and trailing zero bits. samples at a
+// regular interval take a few bits for the timestamp, and the value takes
+// less the less it changes.
+//
+// with a retention, the samples older than the newest one minus the retention
+// are dropped. whole chunks are freed as they age out, reads skip the rest.
+
+// a chunk fits in a request, for the AOF rewrite
+const uint32_t k_tchunk_bytes = 2048;
+
+struct TChunk
+{
+    std::vector<uint64_t> words;
+    uint32_t nbits = 0;
+    uint32_t count = 0;
+    int64_t first_ts = 0;
+    int64_t last_ts = 0;
+    // the encoder state after the last sample
+    int64_t last_delta = 0;
+    uint64_t last_val = 0;
+    uint8_t lead = 0xff;
+    uint8_t trail = 0;
+};
+
+struct TSeries
+{
+    int64_t retention = 0;
+    uint64_t size = 0;
+    std::deque<TChunk> chunks;
+};
+
+enum
+{
+    TS_AVG = 0,
+    TS_MIN = 1,
+    TS_MAX = 2,
+    TS_SUM = 3,
+    TS_COUNT = 4,
+};
+
+struct TSample
+{
+    int64_t ts = 0;
+    double val = 0;
+};
+
+// returns false unless `ts` is after the last sample
+bool ts_add(TSeries *series, int64_t ts, double val);
+// the first timestamp still kept
+int64_t ts_cutoff(TSeries *series);
+// the samples in [from, to], or one per bucket of `bucket` ms with the
+// aggregate `agg` if bucket > 0. the aggregates are computed while the chunks
+// are decoded. at most `count` results.
+void ts_range(TSeries *series, int64_t from, int64_t to, int64_t bucket, uint32_t agg,
+              size_t count, std::vector<TSample> &out);
+// restore a chunk from a dump, false if the bits don't decode
+bool ts_load_chunk(TSeries *series, const char *data, size_t len, uint32_t nbits, uint32_t count);
+size_t ts_bytes(TSeries *series);
+void ts_dispose(TSeries *series);
@@ -0,0 +1,457 @@
+#include <math.h>
+#include <string.h>
+#include <immintrin.h>
+#include <algorithm>
+#include <string>
+
+#include "vset.h"
+#include "common.h"
+#include "slab.h"
+
+static const bool g_has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+
+float vec_dot_scalar(const float *a, const float *b, size_t n)
+{
+    float sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float vec_l2_scalar(const float *a, const float *b, size_t n)
+{
+    float sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        float d = a[i] - b[i];
+        sum += d * d;
+    }
+    return sum;
+}
+
+int32_t vec_dot_q8_scalar(const int8_t *a, const int8_t *b, size_t n)
+{
+    int32_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        sum += (int32_t)a[i] * b[i];
+    }
+    return sum;
+}
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v)
+{
+    __m128 lo = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    __m128 shuf = _mm_movehdup_ps(lo);
+    __m128 sums = _mm_add_ps(lo, shuf);
+    shuf = _mm_movehl_ps(shuf, sums);
+    return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+}
+
+// two accumulators hide the latency of the FMAs
+__attribute__((target("avx2,fma")))
+static float vec_dot_avx2(const float *a, const float *b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]), acc0);
+        acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i + 8]), _mm256_loadu_ps(&b[i + 8]), acc1);
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]), acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + vec_dot_scalar(&a[i], &b[i], n - i);
+}
+
+__attribute__((target("avx2,fma")))
+static float vec_l2_avx2(const float *a, const float *b, size_t n)
+{
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(&a[i + 8]), _mm256_loadu_ps(&b[i + 8]));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+        acc1 = _mm256_fmadd_ps(d1, d1, acc1);
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i]));
+        acc0 = _mm256_fmadd_ps(d0, d0, acc0);
+    }
+    return hsum_avx2(_mm256_add_ps(acc0, acc1)) + vec_l2_scalar(&a[i], &b[i], n - i);
+}
+
+// sign-extended to 16 bits, then multiplied and summed in pairs
+__attribute__((target("avx2,fma")))
+static int32_t vec_dot_q8_avx2(const int8_t *a, const int8_t *b, size_t n)
+{
+    __m256i acc = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&a[i]));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)&b[i]));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0x4e));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, 0xb1));
+    return _mm_cvtsi128_si32(s) + vec_dot_q8_scalar(&a[i], &b[i], n - i);
+}
+
+float vec_dot(const float *a, const float *b, size_t n)
+{
+    return g_has_avx2 ? vec_dot_avx2(a, b, n) : vec_dot_scalar(a, b, n);
+}
+
+float vec_l2(const float *a, const float *b, size_t n)
+{
+    return g_has_avx2 ? vec_l2_avx2(a, b, n) : vec_l2_scalar(a, b, n);
+}
+
+int32_t vec_dot_q8(const int8_t *a, const int8_t *b, size_t n)
+{
+    return g_has_avx2 ? vec_dot_q8_avx2(a, b, n) : vec_dot_q8_scalar(a, b, n);
+}
+
+float vec_quantize(const float *vec, size_t n, int8_t *out)
+{
+    float max = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        max = std::max(max, fabsf(vec[i]));
+    }
+    float scale = max / 127;
+    for (size_t i = 0; i < n; i++)
+    {
+        out[i] = scale > 0 ? (int8_t)lrintf(vec[i] / scale) : 0;
+    }
+    return scale;
+}
+
+size_t vset_node_size(VNode *node)
+{
+    return sizeof(VNode) + node->len;
+}
+
+// a helper structure for the hashtable lookup
+struct VKey
+{
+    HNode node;
+    const char *name = NULL;
+    size_t len = 0;
+};
+
+static bool vcmp(HNode *node, HNode *key)
+{
+    if (node->hcode != key->hcode)
+    {
+        return false;
+    }
+    VNode *vnode = container_of(node, VNode, node);
+    VKey *vkey = container_of(key, VKey, node);
+    return vnode->len == vkey->len && 0 == memcmp(vnode->name, vkey->name, vkey->len);
+}
+
+VNode *vset_lookup(VSet *vset, const char *name, size_t len)
+{
+    VKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_lookup(&vset->index, &key.node, &vcmp);
+    return found ? container_of(found, VNode, node) : NULL;
+}
+
+size_t vset_size(VSet *vset)
+{
+    return vset->nodes.size();
+}
+
+// store a vector at a position, which may be the end
+static void vset_store(VSet *vset, uint32_t pos, const float *vec)
+{
+    uint32_t dim = vset->dim;
+    std::vector<float> unit;
+    float norm = vset->metric == VSET_COSINE ? sqrtf(vec_dot(vec, vec, dim)) : 1;
+    // a stored vector read back stays the same
+    if (fabsf(norm - 1) > 1e-6f)
+    {
+        unit.assign(vec, vec + dim);
+        for (float &v : unit)
+        {
+            v = norm > 0 ? v / norm : 0;
+        }
+        vec = unit.data();
+    }
+    if (!vset->q8)
+    {
+        if (pos == vset->nodes.size())
+        {
+            vset->vecs.resize(vset->vecs.size() + dim);
+        }
+        memcpy(&vset->vecs[(size_t)pos * dim], vec, dim * sizeof(float));
+        return;
+    }
+    if (pos == vset->nodes.size())
+    {
+        vset->qvecs.resize(vset->qvecs.size() + dim);
+        vset->scales.push_back(0);
+        vset->norms.push_back(0);
+    }
+    int8_t *q = &vset->qvecs[(size_t)pos * dim];
+    float scale = vec_quantize(vec, dim, q);
+    int32_t dot = vec_dot_q8(q, q, dim);
+    // the dequantized vector is a unit vector too
+    if (vset->metric == VSET_COSINE && dot > 0)
+    {
+        scale = 1 / sqrtf((float)dot);
+    }
+    vset->scales[pos] = scale;
+    vset->norms[pos] = (float)dot * scale * scale;
+}
+
+bool vset_add(VSet *vset, const char *name, size_t len, const float *vec)
+{
+    VNode *node = vset_lookup(vset, name, len);
+    if (node)
+    {
+        vset_store(vset, node->pos, vec);
+        return false;
+    }
+    node = new (slab_alloc(sizeof(VNode) + len)) VNode();
+    node->node.hcode = str_hash((uint8_t *)name, len);
+    node->pos = (uint32_t)vset->nodes.size();
+    node->len = (uint32_t)len;
+    memcpy(&node->name[0], name, len);
+    vset_store(vset, node->pos, vec);
+    vset->nodes.push_back(node);
+    hm_insert(&vset->index, &node->node);
+    return true;
+}
+
+bool vset_del(VSet *vset, const char *name, size_t len)
+{
+    VKey key;
+    key.node.hcode = str_hash((uint8_t *)name, len);
+    key.name = name;
+    key.len = len;
+    HNode *found = hm_pop(&vset->index, &key.node, &vcmp);
+    if (!found)
+    {
+        return false;
+    }
+    VNode *node = container_of(found, VNode, node);
+    uint32_t pos = node->pos;
+    uint32_t last = (uint32_t)vset->nodes.size() - 1;
+    size_t dim = vset->dim;
+    // the last vector fills the hole
+    if (pos != last)
+    {
+        VNode *moved = vset->nodes[last];
+        moved->pos = pos;
+        vset->nodes[pos] = moved;
+        if (vset->q8)
+        {
+            memcpy(&vset->qvecs[pos * dim], &vset->qvecs[last * dim], dim);
+            vset->scales[pos] = vset->scales[last];
+            vset->norms[pos] = vset->norms[last];
+        }
+        else
+        {
+            memcpy(&vset->vecs[pos * dim], &vset->vecs[last * dim], dim * sizeof(float));
+        }
+    }
+    vset->nodes.pop_back();
+    if (vset->q8)
+    {
+        vset->qvecs.resize(last * dim);
+        vset->scales.pop_back();
+        vset->norms.pop_back();
+    }
+    else
+    {
+        vset->vecs.resize(last * dim);
+    }
+    slab_free(node, vset_node_size(node));
+    return true;
+}
+
+void vset_get(VSet *vset, uint32_t pos, float *out)
+{
+    size_t dim = vset->dim;
+    if (!vset->q8)
+    {
+        memcpy(out, &vset->vecs[pos * dim], dim * sizeof(float));
+        return;
+    }
+    for (size_t i = 0; i < dim; i++)
+    {
+        out[i] = vset->qvecs[pos * dim + i] * vset->scales[pos];
+    }
+}
+
+// the query in the form of the stored vectors
+struct VQuery
+{
+    std::vector<float> vec;
+    std::vector<int8_t> q;
+    float scale = 0;
+    float norm2 = 0;
+};
+
+// a lower key is a better match
+static float vset_key(VSet *vset, const VQuery &query, size_t pos)
+{
+    size_t dim = vset->dim;
+    if (!vset->q8)
+    {
+        const float *v = &vset->vecs[pos * dim];
+        return vset->metric == VSET_COSINE ? -vec_dot(v, query.vec.data(), dim)
+                                           : vec_l2(v, query.vec.data(), dim);
+    }
+    float dot = (float)vec_dot_q8(&vset->qvecs[pos * dim], query.q.data(), dim)
+                * vset->scales[pos] * query.scale;
+    return vset->metric == VSET_COSINE ? -dot : vset->norms[pos] + query.norm2 - 2 * dot;
+}
+
+static bool hit_less(const VHit &a, const VHit &b)
+{
+    return a.score < b.score;
+}
+
+// the k lowest keys of [lo, hi) in a max-heap
+static void vset_scan(VSet *vset, const VQuery &query, size_t lo, size_t hi, size_t k,
+                      std::vector<VHit> &heap)
+{
+    for (size_t pos = lo; pos < hi; pos++)
+    {
+        float key = vset_key(vset, query, pos);
+        if (heap.size() == k && !(key < heap[0].score))
+        {
+            continue;
+        }
+        VHit hit;
+        hit.pos = (uint32_t)pos;
+        hit.score = key;
+        if (heap.size() == k)
+        {
+            std::pop_heap(heap.begin(), heap.end(), &hit_less);
+            heap.back() = hit;
+        }
+        else
+        {
+            heap.push_back(hit);
+        }
+        std::push_heap(heap.begin(), heap.end(), &hit_less);
+    }
+}
+
+struct ScanJob
+{
+    VSet *vset = NULL;
+    const VQuery *query = NULL;
+    size_t lo = 0;
+    size_t hi = 0;
+    size_t k = 0;
+    std::vector<VHit> heap;
+    WaitGroup *wg = NULL;
+};
+
+static void scan_job(void *arg)
+{
+    ScanJob &job = *(ScanJob *)arg;
+    vset_scan(job.vset, *job.query, job.lo, job.hi, job.k, job.heap);
+    wait_group_done(job.wg);
+}
+
+void vset_search(VSet *vset, const float *query, size_t k, ThreadPool *tp, std::vector<VHit> &out)
+{
+    out.clear();
+    size_t n = vset_size(vset);
+    if (k == 0 || n == 0)
+    {
+        return;
+    }
+    size_t dim = vset->dim;
+    VQuery q;
+    q.vec.assign(query, query + dim);
+    if (vset->metric == VSET_COSINE)
+    {
+        float norm = sqrtf(vec_dot(query, query, dim));
+        for (float &v : q.vec)
+        {
+            v = norm > 0 ? v / norm : 0;
+        }
+    }
+    if (vset->q8)
+    {
+        q.q.resize(dim);
+        q.scale = vec_quantize(q.vec.data(), dim, q.q.data());
+        q.norm2 = vec_dot(q.vec.data(), q.vec.data(), dim);
+    }
+
+    if (!tp || tp->threads.empty() || n < k_vset_parallel_min)
+    {
+        vset_scan(vset, q, 0, n, k, out);
+    }
+    else
+    {
+        // each worker keeps its own top k, merged below
+        const size_t k_pieces = 2 * tp->threads.size();
+        std::vector<ScanJob> jobs(k_pieces);
+        WaitGroup wg;
+        wait_group_init(&wg, k_pieces);
+        for (size_t i = 0; i < k_pieces; i++)
+        {
+            ScanJob &job = jobs[i];
+            job.vset = vset;
+            job.query = &q;
+            job.lo = n * i / k_pieces;
+            job.hi = n * (i + 1) / k_pieces;
+            job.k = k;
+            job.wg = &wg;
+            thread_pool_queue(tp, &scan_job, &job);
+        }
+        wait_group_wait(&wg);
+        for (ScanJob &job : jobs)
+        {
+            out.insert(out.end(), job.heap.begin(), job.heap.end());
+        }
+    }
+
+    std::sort(out.begin(), out.end(), &hit_less);
+    if (out.size() > k)
+    {
+        out.resize(k);
+    }
+    // the keys become the scores
+    for (VHit &hit : out)
+    {
+        hit.score = vset->metric == VSET_COSINE ? -hit.score : sqrtf(std::max(hit.score, 0.0f));
+    }
+}
+
+void vset_dispose(VSet *vset)
+{
+    for (VNode *node : vset->nodes)
+    {
+        slab_free(node, vset_node_size(node));
+    }
+    std::vector<VNode *>().swap(vset->nodes);
+    std::vector<float>().swap(vset->vecs);
+    std::vector<int8_t>().swap(vset->qvecs);
+    std::vector<float>().swap(vset->scales);
+    std::vector<float>().swap(vset->norms);
+    hm_destroy(&vset->index);
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "hashtable.h"
+#include "thread_pool.h"
+
+// a vector set maps names to vectors of a fixed dimension. the vectors sit in
+// one dense array, so a k-nearest query is a brute-force scan with SIMD
+// kernels where the CPU has them. removal moves the last vector into the hole.
+//
+// cosine vectors are normalized on insert, the score is the dot product.
+// L2 scores are the distance. Q8 keeps each vector as int8 with a scale
+// (max abs / 127) instead of floats, a quarter of the memory, and compares
+// with integer dot products.
+// a VADD with the vector as a FP32 blob fits into a request
+const uint32_t k_vset_dim_max = 768;
+// searches over sets at least this large are split across the thread pool
+const size_t k_vset_parallel_min = 65536;
+
+enum
+{
+    VSET_COSINE = 0,
+    VSET_L2 = 1,
+};
+
+struct VSet
+{
+    uint32_t dim = 0;
+    uint8_t metric = VSET_COSINE;
+    bool q8 = false;
+    // dim floats per vector, or dim int8 and a scale for Q8
+    std::vector<float> vecs;
+    std::vector<int8_t> qvecs;
+    std::vector<float> scales;
+    // the squared norms for Q8 L2
+    std::vector<float> norms;
+    // the name of each vector, and the index by name
+    std::vector<struct VNode *> nodes;
+    HMap index;
+};
+
+struct VNode
+{
+    HNode node;
+    uint32_t pos = 0;
+    uint32_t len = 0;
+    char name[0];
+};
+
+struct VHit
+{
+    uint32_t pos = 0;
+    float score = 0;
+};
+
+// returns false if the name is updated
+bool vset_add(VSet *vset, const char *name, size_t len, const float *vec);
+bool vset_del(VSet *vset, const char *name, size_t len);
+VNode *vset_lookup(VSet *vset, const char *name, size_t len);
+size_t vset_size(VSet *vset);
+// the stored vector of a position, dequantized for Q8
+void vset_get(VSet *vset, uint32_t pos, float *out);
+// the k best matches for `query`, best first. the event loop waits for the
+// workers if the set is large.
+void vset_search(VSet *vset, const float *query, size_t k, ThreadPool *tp, std::vector<VHit> &out);
+void vset_dispose(VSet *vset);
+size_t vset_node_size(VNode *node);
+
+// the kernels
+float vec_dot(const float *a, const float *b, size_t n);
+float vec_dot_scalar(const float *a, const float *b, size_t n);
+float vec_l2(const float *a, const float *b, size_t n);
+float vec_l2_scalar(const float *a, const float *b, size_t n);
+int32_t vec_dot_q8(const int8_t *a, const int8_t *b, size_t n);
+int32_t vec_dot_q8_scalar(const int8_t *a, const int8_t *b, size_t n);
+// returns the scale
+float vec_quantize(const float *vec, size_t n, int8_t *out);
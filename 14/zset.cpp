@@ -5,11 +5,11 @@
 
 #include "zset.h"
 #include "common.h"
+#include "slab.h"
 
-static ZNode *znode_new(const char *name, size_t len, double score)
+ZNode *znode_new(const char *name, size_t len, double score)
 {
-    ZNode *node = (ZNode *)malloc(sizeof(ZNode) + len);
-    assert(node);
+    ZNode *node = (ZNode *)slab_alloc(sizeof(ZNode) + len);
     avl_init(&node->tree);
     node->hmap.next = NULL;
     node->hmap.hcode = str_hash((uint8_t *)name, len);
@@ -100,6 +100,25 @@ bool zset_add(ZSet *zset, const char *name, size_t len, double score)
     }
 }
 
+// build a perfectly balanced subtree from a sorted run of nodes
+static AVLNode *tree_build(ZNode **nodes, size_t n, AVLNode *parent)
+{
+    if (n == 0)
+    {
+        return NULL;
+    }
+    size_t mid = n / 2;
+    AVLNode *node = &nodes[mid]->tree;
+    node->parent = parent;
+    node->left = tree_build(nodes, mid, node);
+    node->right = tree_build(nodes + mid + 1, n - mid - 1, node);
+    uint32_t l = node->left ? node->left->depth : 0;
+    uint32_t r = node->right ? node->right->depth : 0;
+    node->depth = 1 + (l > r ? l : r);
+    node->cnt = (uint32_t)n;
+    return node;
+}
+
 // a helper structure for the hashtable lookup
 struct HKey
 {
@@ -145,6 +164,46 @@ ZNode *zset_lookup(ZSet *zset, const char *name, size_t len)
     return container_of(found, ZNode, hmap);
 }
 
+// bulk load an empty zset in O(n) from nodes sorted by (score, name),
+// unsorted input falls back to one-by-one tree insertion
+void zset_build(ZSet *zset, ZNode **nodes, size_t n)
+{
+    assert(!zset->tree && hm_size(&zset->hmap) == 0);
+    hm_reserve(&zset->hmap, n);
+
+    bool sorted = true;
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        ZNode *node = nodes[i];
+        HKey key;
+        key.node.hcode = node->hmap.hcode;
+        key.name = node->name;
+        key.len = node->len;
+        if (hm_lookup(&zset->hmap, &key.node, &hcmp))
+        {
+            znode_del(node); // duplicated name
+            continue;
+        }
+        hm_insert(&zset->hmap, &node->hmap);
+        if (m > 0 && !zless(&nodes[m - 1]->tree, &node->tree))
+        {
+            sorted = false;
+        }
+        nodes[m++] = node;
+    }
+
+    if (sorted)
+    {
+        zset->tree = tree_build(nodes, m, NULL);
+        return;
+    }
+    for (size_t i = 0; i < m; i++)
+    {
+        tree_add(zset, nodes[i]);
+    }
+}
+
 // deletion by name through hashtable
 ZNode *zset_pop(ZSet *zset, const char *name, size_t len)
 {
@@ -197,7 +256,7 @@ ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len, int64_
 
 void znode_del(ZNode *node)
 {
-    free(node);
+    slab_free(node, sizeof(ZNode) + node->len);
 }
 
 static void tree_dispose(AVLNode *node)
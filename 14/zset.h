@@ -18,7 +18,9 @@ struct ZNode
     char name[0];
 };
 
+ZNode *znode_new(const char *name, size_t len, double score);
 bool zset_add(ZSet *zset, const char *name, size_t len, double score);
+void zset_build(ZSet *zset, ZNode **nodes, size_t n);
 ZNode *zset_lookup(ZSet *zset, const char *name, size_t len);
 ZNode *zset_pop(ZSet *zset, const char *name, size_t len);
 ZNode *zset_query(ZSet *zset, double score, const char *name, size_t len, int64_t offset);